@@ -0,0 +1,97 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <string_view>
+#include <vector>
+
+// Just enough of a benchmark harness for the portable parts of netfork. Every `BENCHMARK`
+// registers itself under its suite, and `netfork-benchmarks <suite>` runs the benchmarks of
+// one suite. Results go to stdout, one line per measurement.
+namespace netfork::benchmarks
+{
+    struct benchmark
+    {
+        std::string_view suite;
+        std::string_view name;
+        void (*run)();
+    };
+
+    inline std::vector<benchmark>& registered()
+    {
+        static std::vector<benchmark> benchmarks;
+        return benchmarks;
+    }
+
+    struct registrar
+    {
+        registrar(const std::string_view suite, const std::string_view name, void (*run)())
+        {
+            registered().push_back({ suite, name, run });
+        }
+    };
+
+    // Keeps the compiler from dropping a computation whose result is otherwise unused.
+    template <typename T>
+    inline void keep(const T& value) noexcept
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        asm volatile("" : : "r,m"(value) : "memory");
+#else
+        static volatile const T* sink;
+        sink = &value;
+#endif
+    }
+
+    // Runs `body` `repetitions` times and returns the fastest run in seconds. The fastest
+    // run is the one least disturbed by everything else on the machine.
+    template <typename Body>
+    double best_of(const std::size_t repetitions, Body&& body)
+    {
+        double best = 0;
+        for (std::size_t i = 0; i < repetitions; i++)
+        {
+            const auto start = std::chrono::steady_clock::now();
+            body();
+            const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            best = i == 0 ? seconds : std::min(best, seconds);
+        }
+
+        return best;
+    }
+
+    // Prints how fast `bytes` went through in `seconds`.
+    inline void report(const std::string_view name, const std::uint64_t bytes, const double seconds)
+    {
+        std::cout << std::left << std::setw(48) << name << std::right << std::fixed << std::setprecision(2)
+            << std::setw(10) << static_cast<double>(bytes) / seconds / 1e9 << " GB/s"
+            << std::setw(12) << seconds * 1e3 << " ms" << std::endl;
+    }
+}
+
+#define BENCHMARK(suite, name) \
+    static void suite##_##name(); \
+    static const ::netfork::benchmarks::registrar suite##_##name##_registrar{ #suite, #name, &suite##_##name }; \
+    static void suite##_##name()
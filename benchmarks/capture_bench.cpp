@@ -0,0 +1,188 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <span>
+#include <string>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "bench.hpp"
+
+#include <netfork-lib/capture.hpp>
+#include <netfork-lib/clone_job.hpp>
+
+using namespace netfork;
+using namespace netfork::benchmarks;
+
+namespace
+{
+    constexpr std::size_t MAPPING_COUNT = 4096;
+    constexpr std::size_t MAPPING_SIZE = 16 * 1024;
+    constexpr std::size_t REPETITIONS = 3;
+    constexpr std::uint64_t BATCH_BYTES = 16 * 1024 * 1024;
+
+    // Many small mappings, as a process with lots of heaps, stacks and libraries has.
+    // Alternate ones are read-only, so the kernel can't merge them.
+    class fragmented_memory
+    {
+        std::byte* memory_;
+
+    public:
+        fragmented_memory()
+            : memory_{ static_cast<std::byte*>(::mmap(
+                nullptr, MAPPING_COUNT * MAPPING_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) }
+        {
+            if (memory_ == MAP_FAILED)
+            {
+                return;
+            }
+
+            for (std::size_t i = 0; i < MAPPING_COUNT; i++)
+            {
+                std::memset(memory_ + i * MAPPING_SIZE, static_cast<int>(i), MAPPING_SIZE);
+                if (i % 2 != 0)
+                {
+                    ::mprotect(memory_ + i * MAPPING_SIZE, MAPPING_SIZE, PROT_READ);
+                }
+            }
+        }
+
+        fragmented_memory(const fragmented_memory&) = delete;
+        fragmented_memory& operator=(const fragmented_memory&) = delete;
+
+        ~fragmented_memory()
+        {
+            if (memory_ != MAP_FAILED)
+            {
+                ::munmap(memory_, MAPPING_COUNT * MAPPING_SIZE);
+            }
+        }
+
+        bool valid() const noexcept
+        {
+            return memory_ != MAP_FAILED;
+        }
+
+        std::uint64_t address() const noexcept
+        {
+            return reinterpret_cast<std::uint64_t>(memory_);
+        }
+
+        // Only the mappings of the benchmark, as /proc/self/maps describes them.
+        net::address_space_manifest manifest() const
+        {
+            const auto maps = vm::read_maps(::getpid());
+            net::address_space_manifest all = vm::manifest_from_maps(maps.value_or(std::string{}));
+            net::address_space_manifest ours;
+            for (const auto& region : all.regions)
+            {
+                if (region.base_address >= address() && region.end_address() <= address() + MAPPING_COUNT * MAPPING_SIZE)
+                {
+                    ours.add_region(region.base_address, region.protect, region.type);
+                    for (const auto& subregion : all.subregions_of(region))
+                    {
+                        ours.add_subregion(subregion.base_address, subregion.region_size, subregion.protect);
+                    }
+                }
+            }
+
+            return ours;
+        }
+    };
+}
+
+// Capturing a fragmented address space. The old way reads every mapping of this process in
+// place after making it writable and restores it after, two system calls a mapping; reading
+// a clone takes one process_vm_readv a mapping, or one for a whole batch of them.
+BENCHMARK(capture, maps_and_process_vm_readv)
+{
+    fragmented_memory memory;
+    const auto manifest = memory.valid() ? memory.manifest() : net::address_space_manifest{};
+    if (manifest.subregions.size() != MAPPING_COUNT)
+    {
+        std::cout << "Couldn't lay out " << MAPPING_COUNT << " mappings; skipping" << std::endl;
+        return;
+    }
+
+    const double walk = best_of(REPETITIONS, [&] { keep(memory.manifest()); });
+    std::cout << "    walking /proc/self/maps for " << MAPPING_COUNT << " mappings: " << walk * 1e3 << " ms" << std::endl;
+
+    const std::uint64_t total = MAPPING_COUNT * MAPPING_SIZE;
+    std::vector<std::byte> out(total);
+    const double flipped = best_of(REPETITIONS, [&]
+    {
+        std::size_t offset = 0;
+        for (const auto& subregion : manifest.subregions)
+        {
+            auto* address = reinterpret_cast<std::byte*>(subregion.base_address);
+            ::mprotect(address, subregion.region_size, PROT_READ | PROT_WRITE);
+            std::memcpy(out.data() + offset, address, subregion.region_size);
+            ::mprotect(address, subregion.region_size, subregion.protect == vm::PROTECT_READ_ONLY ? PROT_READ : PROT_READ | PROT_WRITE);
+            offset += subregion.region_size;
+        }
+        keep(out);
+    });
+    report("flip, copy, restore per mapping", total, flipped);
+
+    auto clone = async_fork::fork_clone::capture();
+    if (!clone)
+    {
+        std::cout << "Couldn't fork a clone; skipping" << std::endl;
+        return;
+    }
+
+    const double per_mapping = best_of(REPETITIONS, [&]
+    {
+        std::size_t offset = 0;
+        for (const auto& subregion : manifest.subregions)
+        {
+            const iovec local{ out.data() + offset, subregion.region_size };
+            const iovec remote{ reinterpret_cast<void*>(subregion.base_address), subregion.region_size };
+            ::process_vm_readv(clone->pid(), &local, 1, &remote, 1, 0);
+            offset += subregion.region_size;
+        }
+        keep(out);
+    });
+    report("process_vm_readv per mapping", total, per_mapping);
+
+    std::uint64_t batch_read = 0;
+    const double batched = best_of(REPETITIONS, [&]
+    {
+        batch_read = 0;
+        std::size_t offset = 0;
+        vm::for_each_capture_batch(manifest, vm::is_readable, vm::MAX_RUNS_PER_READ, BATCH_BYTES,
+            [&](std::span<const vm::capture_run> runs, const std::uint64_t bytes)
+            {
+                batch_read += vm::read_batch(clone->pid(), runs, std::span{ out }.subspan(offset, bytes));
+                offset += bytes;
+                return true;
+            });
+        keep(out);
+    });
+    report("process_vm_readv, batched", total, batched);
+
+    if (batch_read != total)
+    {
+        std::cout << "    read 0x" << std::hex << batch_read << " of 0x" << total << std::dec << " bytes" << std::endl;
+    }
+}
@@ -0,0 +1,135 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <span>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Linux only: a stand-in for the forked process the server writes a payload into.
+namespace netfork::benchmarks
+{
+    // A child process whose memory at `address` the benchmarks write into, the way the
+    // server writes into a forked process. It's mapped before the fork, so the address is
+    // the same in both, and the child waits until the parent lets it go.
+    class child_process
+    {
+        pid_t pid_ = -1;
+        int release_ = -1;
+        std::size_t size_;
+        std::byte* memory_;
+
+    public:
+        explicit child_process(const std::size_t size)
+            : size_{ size },
+              memory_{ static_cast<std::byte*>(::mmap(
+                nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) }
+        {
+        }
+
+        child_process(const child_process&) = delete;
+        child_process& operator=(const child_process&) = delete;
+
+        ~child_process()
+        {
+            if (pid_ > 0)
+            {
+                ::close(release_);
+                ::waitpid(pid_, nullptr, 0);
+            }
+
+            if (memory_ != MAP_FAILED)
+            {
+                ::munmap(memory_, size_);
+            }
+        }
+
+        // Forks the child, which runs `in_child` (if any) before it waits. Returns false if
+        // it couldn't be started.
+        bool start(const std::function<bool()>& in_child = {})
+        {
+            int fds[2];
+            if (memory_ == MAP_FAILED || ::pipe(fds) != 0)
+            {
+                return false;
+            }
+
+            pid_ = ::fork();
+            if (pid_ == 0)
+            {
+                ::close(fds[1]);
+                if (in_child && !in_child())
+                {
+                    ::_exit(1);
+                }
+
+                char byte;
+                while (::read(fds[0], &byte, 1) > 0)
+                {
+                }
+                ::_exit(0);
+            }
+
+            ::close(fds[0]);
+            if (pid_ < 0)
+            {
+                ::close(fds[1]);
+                return false;
+            }
+
+            release_ = fds[1];
+            return true;
+        }
+
+        pid_t pid() const noexcept
+        {
+            return pid_;
+        }
+
+        std::uint64_t address() const noexcept
+        {
+            return reinterpret_cast<std::uint64_t>(memory_);
+        }
+
+        // Whether the child's memory holds `expected`.
+        bool holds(std::span<const std::byte> expected) const
+        {
+            std::vector<std::byte> actual(expected.size());
+            const iovec local{ actual.data(), actual.size() };
+            const iovec remote{ memory_, actual.size() };
+            return ::process_vm_readv(pid_, &local, 1, &remote, 1, 0) == static_cast<ssize_t>(actual.size())
+                && actual == std::vector<std::byte>(expected.begin(), expected.end());
+        }
+    };
+
+    // The Linux counterpart of `WriteProcessMemory`.
+    inline bool write_process_vm(const pid_t& pid, const std::uint64_t address, std::span<const std::byte> bytes)
+    {
+        const iovec local{ const_cast<std::byte*>(bytes.data()), bytes.size() };
+        const iovec remote{ reinterpret_cast<void*>(address), bytes.size() };
+        return ::process_vm_writev(pid, &local, 1, &remote, 1, 0) == static_cast<ssize_t>(bytes.size());
+    }
+}
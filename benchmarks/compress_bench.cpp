@@ -0,0 +1,231 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "bench.hpp"
+
+#include <netfork-shared/chunk_codec.hpp>
+#include <netfork-shared/pipeline.hpp>
+
+using namespace netfork;
+using namespace netfork::benchmarks;
+
+namespace
+{
+    constexpr std::size_t IMAGE_SIZE = 64 * 1024 * 1024;
+    constexpr std::size_t PAGE_SIZE = 4096;
+    constexpr std::size_t REPETITIONS = 3;
+    // As many chunks in flight as the senders allow.
+    constexpr std::size_t MAX_IN_FLIGHT = 16;
+
+    // A synthetic memory image with the mix of pages a service's heap tends to have: small
+    // integers and pointers, text, mostly-zero pages and already-compressed data. Zero pages
+    // are left out, since the capture path elides them before compression.
+    std::vector<std::byte> image()
+    {
+        std::vector<std::byte> bytes(IMAGE_SIZE);
+        std::mt19937_64 random{ 7 };
+        constexpr std::string_view words[] = { "fork ", "page ", "region ", "server ", "client ", "stream ", "chunk " };
+
+        for (std::size_t offset = 0; offset < bytes.size(); offset += PAGE_SIZE)
+        {
+            std::byte* page = bytes.data() + offset;
+            switch (random() % 10)
+            {
+            case 0: case 1: case 2: case 3:
+                // Structs of a pointer and a counter.
+                for (std::size_t i = 0; i < PAGE_SIZE; i += 16)
+                {
+                    const std::uint64_t pointer = 0x00007FF6'12340000 + (random() % 4096) * 16;
+                    const std::uint64_t counter = random() % 1000;
+                    std::memcpy(page + i, &pointer, sizeof(pointer));
+                    std::memcpy(page + i + 8, &counter, sizeof(counter));
+                }
+                break;
+            case 4: case 5:
+                for (std::size_t i = 0; i < PAGE_SIZE;)
+                {
+                    const auto word = words[random() % std::size(words)];
+                    const std::size_t length = std::min(word.size(), PAGE_SIZE - i);
+                    std::memcpy(page + i, word.data(), length);
+                    i += length;
+                }
+                break;
+            case 6: case 7:
+                for (std::size_t i = 0; i < 32; i++)
+                {
+                    page[random() % PAGE_SIZE] = static_cast<std::byte>(random());
+                }
+                break;
+            default:
+                for (std::size_t i = 0; i < PAGE_SIZE; i += sizeof(std::uint64_t))
+                {
+                    const std::uint64_t value = random();
+                    std::memcpy(page + i, &value, sizeof(value));
+                }
+                break;
+            }
+        }
+
+        return bytes;
+    }
+
+    std::vector<std::vector<std::byte>> chunks_of(std::span<const std::byte> bytes)
+    {
+        std::vector<std::vector<std::byte>> chunks;
+        for (std::size_t offset = 0; offset < bytes.size(); offset += compress::CHUNK_TARGET_SIZE)
+        {
+            const auto chunk = bytes.subspan(offset, std::min(compress::CHUNK_TARGET_SIZE, bytes.size() - offset));
+            chunks.emplace_back(chunk.begin(), chunk.end());
+        }
+
+        return chunks;
+    }
+
+    compress::deflate_backend& this_thread_backend()
+    {
+        thread_local compress::deflate_backend backend;
+        return backend;
+    }
+
+    // 1, 2, 4, ... up to one per core.
+    std::vector<unsigned int> worker_counts()
+    {
+        std::vector<unsigned int> counts;
+        for (unsigned int count = 1; count < default_worker_count(); count *= 2)
+        {
+            counts.push_back(count);
+        }
+
+        counts.push_back(default_worker_count());
+        return counts;
+    }
+
+    const char* name_of(const compress::codec method)
+    {
+        return method == compress::codec::fast ? "fast" : "dense";
+    }
+}
+
+// The sender's compression stage: chunks go through an `ordered_pipeline` of workers and
+// come back out in order, as they would on their way to the socket.
+BENCHMARK(compress, pipeline)
+{
+    const auto bytes = image();
+    const auto chunks = chunks_of(bytes);
+
+    for (const auto method : { compress::codec::fast, compress::codec::dense })
+    {
+        for (const unsigned int workers : worker_counts())
+        {
+            std::uint64_t sent = 0;
+            const double seconds = best_of(REPETITIONS, [&]
+            {
+                ordered_pipeline<std::vector<std::byte>, std::vector<std::byte>> pipeline{
+                    workers,
+                    MAX_IN_FLIGHT,
+                    [method](std::vector<std::byte>& frames)
+                    {
+                        return compress::compress_chunk(this_thread_backend(), method, frames);
+                    }
+                };
+
+                std::jthread producer{ [&]
+                {
+                    for (const auto& chunk : chunks)
+                    {
+                        pipeline.push(chunk);
+                    }
+
+                    pipeline.close();
+                } };
+
+                sent = 0;
+                while (const auto chunk = pipeline.pop())
+                {
+                    sent += chunk->size();
+                }
+            });
+
+            report(std::string(name_of(method)) + ", " + std::to_string(workers) + " workers", IMAGE_SIZE, seconds);
+            std::cout << "    " << sent << " bytes sent for " << IMAGE_SIZE << " bytes of memory ("
+                << 100.0 * static_cast<double>(sent) / IMAGE_SIZE << "%)" << std::endl;
+        }
+    }
+}
+
+// The receiver's stage in front of the rebuild: compressed chunks expanded in order.
+BENCHMARK(compress, receive_pipeline)
+{
+    const auto bytes = image();
+    for (const auto method : { compress::codec::fast, compress::codec::dense })
+    {
+        std::vector<std::vector<std::byte>> bodies;
+        for (const auto& chunk : chunks_of(bytes))
+        {
+            auto frame = compress::compress_chunk(this_thread_backend(), method, chunk);
+            frame.erase(frame.begin(), frame.begin() + net::codec::FRAME_HEADER_SIZE);
+            bodies.push_back(std::move(frame));
+        }
+
+        for (const unsigned int workers : worker_counts())
+        {
+            std::uint64_t received = 0;
+            const double seconds = best_of(REPETITIONS, [&]
+            {
+                ordered_pipeline<std::vector<std::byte>, std::vector<std::byte>> pipeline{
+                    workers,
+                    MAX_IN_FLIGHT,
+                    [](std::vector<std::byte>& body)
+                    {
+                        return compress::decompress_chunk(this_thread_backend(), body).value_or(std::vector<std::byte>{});
+                    }
+                };
+
+                std::jthread producer{ [&]
+                {
+                    for (const auto& body : bodies)
+                    {
+                        pipeline.push(body);
+                    }
+
+                    pipeline.close();
+                } };
+
+                received = 0;
+                while (const auto frames = pipeline.pop())
+                {
+                    received += frames->size();
+                }
+            });
+
+            report(std::string(name_of(method)) + ", " + std::to_string(workers) + " workers", received, seconds);
+        }
+    }
+}
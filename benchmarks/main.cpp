@@ -0,0 +1,52 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <cstddef>
+#include <iostream>
+#include <string_view>
+
+#include "bench.hpp"
+
+// Usage: netfork-benchmarks [suite]
+// Runs every benchmark, or only those of `suite`.
+int main(int argc, char* argv[])
+{
+    using namespace netfork::benchmarks;
+
+    const std::string_view suite = argc > 1 ? argv[1] : "";
+    std::size_t ran = 0;
+    for (const auto& benchmark : registered())
+    {
+        if (!suite.empty() && benchmark.suite != suite)
+        {
+            continue;
+        }
+
+        std::cout << "# " << benchmark.suite << "." << benchmark.name << std::endl;
+        benchmark.run();
+        ran++;
+    }
+
+    if (ran == 0)
+    {
+        std::cerr << "No benchmarks in suite " << suite << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,279 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <optional>
+#include <random>
+#include <span>
+#include <thread>
+#include <vector>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "bench.hpp"
+#include "child_process.hpp"
+
+#include <netfork-server/memfd_regions.hpp>
+#include <netfork-server/write_ring.hpp>
+#include <netfork-shared/net/codec.hpp>
+#include <netfork-shared/net/page_data.hpp>
+
+using namespace netfork;
+using namespace netfork::benchmarks;
+
+namespace
+{
+    constexpr std::size_t IMAGE_SIZE = 128 * 1024 * 1024;
+    constexpr std::size_t FRAME_SIZE = net::MAX_PAGES_PER_FRAME * net::MANIFEST_PAGE_SIZE;
+    constexpr std::size_t REPETITIONS = 3;
+
+    // The payload of an image of random pages at `address`, as the client sends it: one
+    // `page_data` frame per `FRAME_SIZE` bytes.
+    std::vector<std::byte> payload_stream(const std::uint64_t address, std::vector<std::byte>& pages)
+    {
+        pages.resize(IMAGE_SIZE);
+        std::mt19937_64 random{ 14 };
+        for (std::size_t offset = 0; offset < pages.size(); offset += sizeof(std::uint64_t))
+        {
+            const std::uint64_t value = random();
+            std::memcpy(pages.data() + offset, &value, sizeof(value));
+        }
+
+        net::codec::frame_writer writer{ IMAGE_SIZE + IMAGE_SIZE / FRAME_SIZE * 1024 };
+        for (std::size_t offset = 0; offset < IMAGE_SIZE; offset += FRAME_SIZE)
+        {
+            net::page_run run{ .address = address + offset, .page_count = net::MAX_PAGES_PER_FRAME };
+            for (std::uint32_t page = 0; page < run.page_count; page++)
+            {
+                run.set_present(page);
+            }
+
+            net::write_page_run(writer, run, std::span{ pages }.subspan(offset, FRAME_SIZE));
+        }
+
+        return writer.release();
+    }
+
+    bool recv_all(const int sock, std::span<std::byte> bytes)
+    {
+        while (!bytes.empty())
+        {
+            const ssize_t received = ::recv(sock, bytes.data(), bytes.size(), 0);
+            if (received <= 0)
+            {
+                return false;
+            }
+
+            bytes = bytes.subspan(static_cast<std::size_t>(received));
+        }
+
+        return true;
+    }
+
+    // A TCP connection over loopback whose far end sends `stream` and hangs up. `sock()` is
+    // the receiving end, or -1 if loopback isn't available.
+    class loopback
+    {
+        int sock_ = -1;
+        std::thread sender_;
+
+    public:
+        explicit loopback(std::span<const std::byte> stream)
+        {
+            const int listener = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            sockaddr_in address{};
+            address.sin_family = AF_INET;
+            address.sin_addr.s_addr = ::htonl(INADDR_LOOPBACK);
+            socklen_t length = sizeof(address);
+            if (listener == -1
+                || ::bind(listener, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0
+                || ::listen(listener, 1) != 0
+                || ::getsockname(listener, reinterpret_cast<sockaddr*>(&address), &length) != 0)
+            {
+                ::close(listener);
+                return;
+            }
+
+            const int sender = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (sender == -1 || ::connect(sender, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0)
+            {
+                ::close(sender);
+                ::close(listener);
+                return;
+            }
+
+            sock_ = ::accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+            ::close(listener);
+            sender_ = std::thread{ [sender, stream]
+            {
+                auto remaining = stream;
+                while (!remaining.empty())
+                {
+                    const ssize_t sent = ::send(sender, remaining.data(), remaining.size(), MSG_NOSIGNAL);
+                    if (sent <= 0)
+                    {
+                        break;
+                    }
+
+                    remaining = remaining.subspan(static_cast<std::size_t>(sent));
+                }
+
+                ::close(sender);
+            } };
+        }
+
+        loopback(const loopback&) = delete;
+        loopback& operator=(const loopback&) = delete;
+
+        ~loopback()
+        {
+            // Unblocks the sender if the receiver gave up early.
+            if (sock_ != -1)
+            {
+                ::shutdown(sock_, SHUT_RDWR);
+            }
+
+            if (sender_.joinable())
+            {
+                sender_.join();
+            }
+
+            ::close(sock_);
+        }
+
+        int sock() const noexcept
+        {
+            return sock_;
+        }
+    };
+
+    // Receives `page_data` frames until the sender hangs up. `place(run)` receives the
+    // present pages of each run itself.
+    template <typename Place>
+    bool receive_payload(const int sock, Place&& place)
+    {
+        std::array<std::byte, net::codec::FRAME_HEADER_SIZE> header;
+        std::array<std::byte, net::PAGE_RUN_FIXED_SIZE + net::PAGE_BITMAP_WORDS * sizeof(std::uint64_t)> prefix;
+        while (recv_all(sock, header))
+        {
+            if (net::codec::decode_header(header).type != net::codec::frame_type::page_data
+                || !recv_all(sock, std::span{ prefix }.first(net::PAGE_RUN_FIXED_SIZE)))
+            {
+                return false;
+            }
+
+            auto run = net::decode_page_run_fixed(std::span{ prefix }.first<net::PAGE_RUN_FIXED_SIZE>());
+            if (!run)
+            {
+                return false;
+            }
+
+            const auto bitmap = std::span{ prefix }.subspan(net::PAGE_RUN_FIXED_SIZE, run->bitmap_words() * sizeof(std::uint64_t));
+            if (!recv_all(sock, bitmap))
+            {
+                return false;
+            }
+
+            net::decode_page_run_bitmap(*run, bitmap);
+            if (!place(*run))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+}
+
+// Receiving a payload off a loopback connection into a forked process. Before, every frame
+// is received into a buffer and then written into the child; after, the child's memory is a
+// memfd the server has mapped too, and pages are received straight into it.
+BENCHMARK(receive, loopback)
+{
+    child_process child{ IMAGE_SIZE };
+    vm::memfd_regions regions;
+    if (!regions.map(child.address(), IMAGE_SIZE)
+        || !child.start([&] { return regions.map_fixed(); }))
+    {
+        std::cout << "Couldn't start a child process sharing a memfd; skipping" << std::endl;
+        return;
+    }
+
+    std::vector<std::byte> pages;
+    const auto stream = payload_stream(child.address(), pages);
+    std::vector<std::byte> frame(FRAME_SIZE);
+
+    const double discarded = best_of(REPETITIONS, [&]
+    {
+        loopback connection{ stream };
+        receive_payload(connection.sock(), [&](const net::page_run& run)
+        {
+            return recv_all(connection.sock(), std::span{ frame }.first(run.present_count() * net::MANIFEST_PAGE_SIZE));
+        });
+    });
+    report("receive only", IMAGE_SIZE, discarded);
+
+    // Into the child's private memory, the way the server writes without shared regions.
+    // The benchmark's child has the memfd at that address, which process_vm_writev
+    // writes through just the same.
+    const double copied = best_of(REPETITIONS, [&]
+    {
+        loopback connection{ stream };
+        receive_payload(connection.sock(), [&](const net::page_run& run)
+        {
+            if (!recv_all(connection.sock(), std::span{ frame }.first(run.present_count() * net::MANIFEST_PAGE_SIZE)))
+            {
+                return false;
+            }
+
+            vm::write_present_pages(child.pid(), run, frame, write_process_vm);
+            return true;
+        });
+    });
+    report("receive, then process_vm_writev", IMAGE_SIZE, copied);
+    const bool copy_holds = child.holds(pages);
+
+    std::memset(regions.find(child.address(), IMAGE_SIZE), 0, IMAGE_SIZE);
+    const double shared = best_of(REPETITIONS, [&]
+    {
+        loopback connection{ stream };
+        receive_payload(connection.sock(), [&](const net::page_run& run)
+        {
+            bool received = true;
+            run.for_each_present_run([&](const std::uint32_t first_page, const std::uint32_t page_count)
+            {
+                const std::uint64_t address = run.address + first_page * net::MANIFEST_PAGE_SIZE;
+                const std::uint64_t size = page_count * net::MANIFEST_PAGE_SIZE;
+                std::byte* view = regions.find(address, size);
+                received = received && view && recv_all(connection.sock(), { view, size });
+            });
+            return received;
+        });
+    });
+    report("receive into a memfd view", IMAGE_SIZE, shared);
+
+    if (!copy_holds || !child.holds(pages))
+    {
+        std::cout << "    the child's memory doesn't match the payload" << std::endl;
+    }
+}
@@ -0,0 +1,193 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <span>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "bench.hpp"
+
+#include <netfork-shared/net/chunk_log.hpp>
+
+using namespace netfork;
+using namespace netfork::benchmarks;
+
+namespace
+{
+    constexpr std::size_t PAYLOAD_SIZE = 64 * 1024 * 1024;
+    constexpr std::size_t CHUNK_SIZE = 256 * 1024;
+    // As `send_striped_payload` bounds the log.
+    constexpr std::size_t WINDOW_SIZE = 32 * 1024 * 1024;
+    // Each connection waits this long after every chunk, standing in for a link whose
+    // round trips, not its bandwidth, bound what one connection carries.
+    constexpr std::chrono::microseconds CHUNK_DELAY{ 1000 };
+    constexpr std::size_t REPETITIONS = 3;
+
+    // A connected pair of TCP sockets over loopback, sending end first, or -1s if loopback
+    // isn't available.
+    std::pair<int, int> loopback_pair()
+    {
+        const int listener = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = ::htonl(INADDR_LOOPBACK);
+        socklen_t length = sizeof(address);
+        if (listener == -1
+            || ::bind(listener, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0
+            || ::listen(listener, 1) != 0
+            || ::getsockname(listener, reinterpret_cast<sockaddr*>(&address), &length) != 0)
+        {
+            ::close(listener);
+            return { -1, -1 };
+        }
+
+        const int sender = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sender == -1 || ::connect(sender, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0)
+        {
+            ::close(sender);
+            ::close(listener);
+            return { -1, -1 };
+        }
+
+        const int receiver = ::accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        ::close(listener);
+        if (receiver == -1)
+        {
+            ::close(sender);
+            return { -1, -1 };
+        }
+
+        return { sender, receiver };
+    }
+
+    bool send_all(const int sock, std::span<const std::byte> bytes)
+    {
+        while (!bytes.empty())
+        {
+            const ssize_t sent = ::send(sock, bytes.data(), bytes.size(), MSG_NOSIGNAL);
+            if (sent <= 0)
+            {
+                return false;
+            }
+
+            bytes = bytes.subspan(static_cast<std::size_t>(sent));
+        }
+
+        return true;
+    }
+
+    // Sends the payload the way `send_striped_payload` does: one producer appends chunks to
+    // a windowed log, and every connection's sender takes the next chunk as it's ready for
+    // one. Returns the bytes the far ends received between them.
+    std::uint64_t send_striped(const std::size_t connections, const std::vector<std::byte>& chunk)
+    {
+        std::vector<std::pair<int, int>> pairs;
+        for (std::size_t index = 0; index < connections; index++)
+        {
+            pairs.push_back(loopback_pair());
+            if (pairs.back().first == -1)
+            {
+                break;
+            }
+        }
+
+        std::atomic<std::uint64_t> received = 0;
+        if (pairs.back().first != -1)
+        {
+            net::chunk_log log{ 1, WINDOW_SIZE };
+            std::vector<std::jthread> threads;
+            for (const auto& [sender, receiver] : pairs)
+            {
+                threads.emplace_back([&log, sender]
+                {
+                    while (const auto next = log.next(0))
+                    {
+                        if (!send_all(sender, *next))
+                        {
+                            log.abandon(0);
+                            break;
+                        }
+
+                        std::this_thread::sleep_for(CHUNK_DELAY);
+                    }
+
+                    ::shutdown(sender, SHUT_WR);
+                });
+                threads.emplace_back([&received, receiver]
+                {
+                    std::array<std::byte, 64 * 1024> buf;
+                    ssize_t count;
+                    while ((count = ::recv(receiver, buf.data(), buf.size(), 0)) > 0)
+                    {
+                        received += static_cast<std::uint64_t>(count);
+                    }
+                });
+            }
+
+            for (std::size_t offset = 0; offset < PAYLOAD_SIZE; offset += CHUNK_SIZE)
+            {
+                log.append(chunk);
+            }
+
+            log.close();
+        }
+
+        for (const auto& [sender, receiver] : pairs)
+        {
+            ::close(sender);
+            ::close(receiver);
+        }
+
+        return received;
+    }
+}
+
+// Striping a payload over more connections, each of which can only carry so much by itself.
+// Before, the fork sent over one connection; after, the payload spreads over however many
+// the client opens, and the windowed log keeps the reader no further ahead than they drain.
+BENCHMARK(stripes, delayed_loopback)
+{
+    const std::vector<std::byte> chunk(CHUNK_SIZE, std::byte{ 0x5A });
+
+    for (const std::size_t connections : { 1, 2, 4, 8 })
+    {
+        std::uint64_t received = 0;
+        const double seconds = best_of(REPETITIONS, [&]
+        {
+            received = send_striped(connections, chunk);
+        });
+        if (received != PAYLOAD_SIZE)
+        {
+            std::cout << "Couldn't send the payload over loopback; skipping" << std::endl;
+            return;
+        }
+
+        report(std::to_string(connections) + " connections", PAYLOAD_SIZE, seconds);
+    }
+}
@@ -0,0 +1,142 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <optional>
+#include <random>
+#include <span>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+#include "bench.hpp"
+#include "child_process.hpp"
+
+#include <netfork-server/write_ring.hpp>
+#include <netfork-shared/pipeline.hpp>
+
+using namespace netfork;
+using namespace netfork::benchmarks;
+
+namespace
+{
+    constexpr std::size_t IMAGE_SIZE = 128 * 1024 * 1024;
+    constexpr std::size_t FRAME_SIZE = net::MAX_PAGES_PER_FRAME * net::MANIFEST_PAGE_SIZE;
+    constexpr std::size_t REPETITIONS = 3;
+    // As the server has it.
+    constexpr std::size_t WRITE_BUFFERS_PER_WRITER = 4;
+
+    net::page_run full_run(const std::uint64_t address, const std::size_t size)
+    {
+        net::page_run run{ .address = address, .page_count = static_cast<std::uint32_t>(size / net::MANIFEST_PAGE_SIZE) };
+        for (std::uint32_t page = 0; page < run.page_count; page++)
+        {
+            run.set_present(page);
+        }
+
+        return run;
+    }
+
+    // What came off the network, as incompressible as a payload gets.
+    std::vector<std::byte> payload()
+    {
+        std::vector<std::byte> bytes(IMAGE_SIZE);
+        std::mt19937_64 random{ 13 };
+        for (std::size_t offset = 0; offset < bytes.size(); offset += sizeof(std::uint64_t))
+        {
+            const std::uint64_t value = random();
+            std::memcpy(bytes.data() + offset, &value, sizeof(value));
+        }
+
+        return bytes;
+    }
+
+    // 1, 2, 4, ... up to one per core.
+    std::vector<unsigned int> writer_counts()
+    {
+        std::vector<unsigned int> counts;
+        for (unsigned int count = 1; count < default_worker_count(); count *= 2)
+        {
+            counts.push_back(count);
+        }
+
+        counts.push_back(default_worker_count());
+        return counts;
+    }
+}
+
+// Receiving a payload into a forked process, frame by frame. The receive is stood in for by
+// a copy out of `payload`. Without the ring every frame is received and then written before
+// the next; with it, frames are received straight into its buffers and written behind.
+BENCHMARK(writer, process_vm_writev)
+{
+    const auto bytes = payload();
+    child_process child{ IMAGE_SIZE };
+    if (!child.start())
+    {
+        std::cout << "Couldn't start a child process to write into; skipping" << std::endl;
+        return;
+    }
+
+    std::vector<std::byte> frame(FRAME_SIZE);
+    const double serial = best_of(REPETITIONS, [&]
+    {
+        for (std::size_t offset = 0; offset < IMAGE_SIZE; offset += FRAME_SIZE)
+        {
+            std::memcpy(frame.data(), bytes.data() + offset, FRAME_SIZE);
+            vm::write_present_pages(child.pid(), full_run(child.address() + offset, FRAME_SIZE), frame, write_process_vm);
+        }
+    });
+    report("receive, then write", IMAGE_SIZE, serial);
+
+    for (const unsigned int writers : writer_counts())
+    {
+        vm::write_ring<pid_t> ring{ writers, WRITE_BUFFERS_PER_WRITER * writers, write_process_vm };
+        const double seconds = best_of(REPETITIONS, [&]
+        {
+            vm::write_ring<pid_t>::batch writes{ ring, child.pid() };
+            for (std::size_t offset = 0; offset < IMAGE_SIZE; offset += FRAME_SIZE)
+            {
+                const auto run = full_run(child.address() + offset, FRAME_SIZE);
+                if (auto lease = writes.try_acquire())
+                {
+                    std::memcpy(lease->bytes().data(), bytes.data() + offset, FRAME_SIZE);
+                    writes.submit(run, std::move(lease).value(), FRAME_SIZE);
+                }
+                else
+                {
+                    std::memcpy(frame.data(), bytes.data() + offset, FRAME_SIZE);
+                    writes.submit(run, frame);
+                }
+            }
+
+            writes.drain();
+        });
+
+        report("writer ring, " + std::to_string(writers) + " writers", IMAGE_SIZE, seconds);
+    }
+
+    if (!child.holds(bytes))
+    {
+        std::cout << "    the child's memory doesn't match the payload" << std::endl;
+    }
+}
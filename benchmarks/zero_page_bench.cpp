@@ -0,0 +1,150 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "bench.hpp"
+
+#include <netfork-shared/net/page_data.hpp>
+#include <netfork-shared/zero_page.hpp>
+
+using namespace netfork;
+using namespace netfork::benchmarks;
+
+namespace
+{
+    constexpr std::size_t IMAGE_SIZE = 256 * 1024 * 1024;
+    constexpr std::size_t PAGE_COUNT = IMAGE_SIZE / simd::ZERO_PAGE_SIZE;
+    constexpr std::size_t REPETITIONS = 5;
+
+    // A synthetic memory image in which `zero_percent` of the pages are all zeros. The others
+    // have one non-zero byte at a random offset.
+    std::vector<std::byte> image(const unsigned zero_percent)
+    {
+        std::vector<std::byte> bytes(IMAGE_SIZE);
+        std::mt19937_64 random{ zero_percent };
+        std::uniform_int_distribution<unsigned> percent{ 0, 99 };
+        std::uniform_int_distribution<std::size_t> offset{ 0, simd::ZERO_PAGE_SIZE - 1 };
+        for (std::size_t page = 0; page < PAGE_COUNT; page++)
+        {
+            if (percent(random) >= zero_percent)
+            {
+                bytes[page * simd::ZERO_PAGE_SIZE + offset(random)] = std::byte{ 0x5A };
+            }
+        }
+
+        return bytes;
+    }
+
+    std::vector<std::pair<const char*, simd::zero_page_kernel>> kernels()
+    {
+        std::vector<std::pair<const char*, simd::zero_page_kernel>> all{ { "scalar", &simd::is_zero_page_scalar } };
+#ifdef NETFORK_X64_KERNELS
+        all.emplace_back("sse2", &simd::is_zero_page_sse2);
+        if (simd::cpu_supports_avx2())
+        {
+            all.emplace_back("avx2", &simd::is_zero_page_avx2);
+        }
+#endif
+        return all;
+    }
+}
+
+// Each kernel over pages that stay in L1, where it's bound by its own loop, and over the
+// whole image, where it's bound by memory bandwidth. The kernels never stop early, so the
+// share of zero pages doesn't change how fast they go.
+BENCHMARK(zero_page, kernels)
+{
+    constexpr std::size_t cached_pages = 4;
+    const auto bytes = image(50);
+    for (const auto& [name, kernel] : kernels())
+    {
+        std::size_t zero_pages = 0;
+        const double cached = best_of(REPETITIONS, [&]
+        {
+            zero_pages = 0;
+            for (std::size_t page = 0; page < PAGE_COUNT; page++)
+            {
+                zero_pages += kernel(bytes.data() + page % cached_pages * simd::ZERO_PAGE_SIZE);
+            }
+
+            keep(zero_pages);
+        });
+        report(std::string(name) + ", in L1", IMAGE_SIZE, cached);
+
+        const double streamed = best_of(REPETITIONS, [&]
+        {
+            zero_pages = 0;
+            for (std::size_t page = 0; page < PAGE_COUNT; page++)
+            {
+                zero_pages += kernel(bytes.data() + page * simd::ZERO_PAGE_SIZE);
+            }
+
+            keep(zero_pages);
+        });
+        report(std::string(name) + ", from memory", IMAGE_SIZE, streamed);
+    }
+}
+
+// What the capture path does per frame: one kernel call per page into the `page_run`
+// bitmap. The bytes that no longer go over the wire are what elision buys.
+BENCHMARK(zero_page, capture_bitmaps)
+{
+    constexpr std::size_t frame_span = net::MAX_PAGES_PER_FRAME * net::MANIFEST_PAGE_SIZE;
+
+    for (const unsigned zero_percent : { 100u, 75u, 0u })
+    {
+        const auto bytes = image(zero_percent);
+        std::uint64_t sent = 0;
+        const double seconds = best_of(REPETITIONS, [&]
+        {
+            sent = 0;
+            for (std::size_t offset = 0; offset < bytes.size(); offset += frame_span)
+            {
+                net::page_run run{
+                    .address = offset,
+                    .page_count = static_cast<std::uint32_t>(std::min(frame_span, bytes.size() - offset) / net::MANIFEST_PAGE_SIZE)
+                };
+                for (std::uint32_t page = 0; page < run.page_count; page++)
+                {
+                    if (!simd::is_zero_page(bytes.data() + offset + page * net::MANIFEST_PAGE_SIZE))
+                    {
+                        run.set_present(page);
+                    }
+                }
+
+                if (run.present_count() != 0)
+                {
+                    sent += run.body_size();
+                }
+            }
+
+            keep(sent);
+        });
+
+        report(std::to_string(zero_percent) + "% zero pages", IMAGE_SIZE, seconds);
+        std::cout << "    " << sent << " bytes sent for " << IMAGE_SIZE << " bytes of memory ("
+            << 100.0 * static_cast<double>(sent) / IMAGE_SIZE << "%)" << std::endl;
+    }
+}
@@ -60,7 +60,9 @@ int main()
         return 1;
     }
 
-    const auto ctx = netfork::fork(netfork_server_sock, nullptr);
+    fork_stats stats{};
+    const fork_options options{ .compression = compression_codec::fast };
+    const auto ctx = netfork::fork(netfork_server_sock, nullptr, options, &stats);
     if (ctx == fork_context::child)
     {
         LOG_DEBUG() << "netfork succeeded" << std::endl;
@@ -69,7 +71,10 @@ int main()
     {
         if (ctx == fork_context::parent)
         {
-            LOG_DEBUG() << "netfork succeeded" << std::endl;
+            LOG_DEBUG() << "netfork succeeded; sent " << stats.bytes_sent << " bytes, skipped "
+                << stats.zero_pages_skipped << " zero pages and "
+                << stats.demand_zero_bytes_avoided << " demand-zero bytes; "
+                << stats.compressed_bytes_sent << " bytes after compression" << std::endl;
         }
         else
         {
@@ -0,0 +1,230 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <shared_mutex>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include "netfork.hpp"
+
+#include <netfork-shared/log.hpp>
+#include <netfork-shared/net/manifest.hpp>
+
+namespace netfork::annotations
+{
+    struct annotation
+    {
+        std::uint64_t base_address;
+        std::uint64_t end_address;
+        region_policy policy;
+    };
+
+    // The first annotation in `ranges` which ends after `address`.
+    inline std::span<const annotation>::iterator first_ending_after(
+        std::span<const annotation> ranges,
+        const std::uint64_t address)
+    {
+        return std::upper_bound(
+            ranges.begin(),
+            ranges.end(),
+            address,
+            [](const std::uint64_t addr, const annotation& a)
+            {
+                return addr < a.end_address;
+            });
+    }
+
+    // Every range of memory `annotate` has been told about. The ranges are page-aligned,
+    // don't overlap and are kept in address order, so looking one up is a binary search
+    // however many there are.
+    class registry
+    {
+        mutable std::shared_mutex mutex_;
+        std::vector<annotation> ranges_;
+
+        registry() = default;
+
+    public:
+        registry(const registry&) = delete;
+        registry& operator=(const registry&) = delete;
+
+        static registry& instance()
+        {
+            static registry r;
+            return r;
+        }
+
+        // Gives `[base_address, end_address)` `policy`, overriding whatever was annotated
+        // there before.
+        void annotate(const std::uint64_t base_address, const std::uint64_t end_address, const region_policy policy)
+        {
+            std::unique_lock lock{ mutex_ };
+
+            std::vector<annotation> next;
+            next.reserve(ranges_.size() + 2);
+            for (const auto& a : ranges_)
+            {
+                if (a.end_address <= base_address || a.base_address >= end_address)
+                {
+                    next.push_back(a);
+                    continue;
+                }
+
+                if (a.base_address < base_address)
+                {
+                    next.push_back({ a.base_address, base_address, a.policy });
+                }
+
+                if (a.end_address > end_address)
+                {
+                    next.push_back({ end_address, a.end_address, a.policy });
+                }
+            }
+
+            if (policy != region_policy::send)
+            {
+                next.push_back({ base_address, end_address, policy });
+            }
+
+            std::ranges::sort(next, {}, &annotation::base_address);
+            ranges_ = std::move(next);
+        }
+
+        region_policy policy_of(const std::uint64_t address) const
+        {
+            std::shared_lock lock{ mutex_ };
+            const std::span<const annotation> ranges{ ranges_ };
+            const auto it = first_ending_after(ranges, address);
+            return it != ranges.end() && it->base_address <= address
+                ? it->policy
+                : region_policy::send;
+        }
+
+        std::vector<annotation> ranges() const
+        {
+            std::shared_lock lock{ mutex_ };
+            return ranges_;
+        }
+    };
+
+    // Whether annotations with `policy` cover all of `[base_address, end_address)`.
+    inline bool is_covered(
+        std::span<const annotation> ranges,
+        std::uint64_t base_address,
+        const std::uint64_t end_address,
+        const region_policy policy)
+    {
+        for (auto it = first_ending_after(ranges, base_address); it != ranges.end(); ++it)
+        {
+            if (it->base_address > base_address || it->policy != policy)
+            {
+                return false;
+            }
+
+            base_address = it->end_address;
+            if (base_address >= end_address)
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // Whether the pages of `subregion` are to be left zero in the child. A manifest which
+    // went through `apply` has a subregion boundary wherever an annotation starts or ends,
+    // so its base address speaks for the whole of it.
+    inline bool is_zeroed(const net::manifest_subregion& subregion)
+    {
+        return registry::instance().policy_of(subregion.base_address) == region_policy::commit_zeroed;
+    }
+
+    // Reshapes `manifest` as the registry's annotations say. Subregions are split wherever
+    // an annotation starts or ends; the parts to skip or keep reserved lose their protection,
+    // so the child only reserves them; and regions skipped from end to end are left out.
+    // Parts to commit zeroed keep their protection: the readers leave them out instead, as
+    // the child's freshly committed memory is zero already.
+    inline net::address_space_manifest apply(net::address_space_manifest manifest)
+    {
+        const auto annotated = registry::instance().ranges();
+        const std::span<const annotation> ranges{ annotated };
+        if (ranges.empty())
+        {
+            return manifest;
+        }
+
+        std::uint64_t skipped_bytes = 0;
+        std::uint64_t reserved_bytes = 0;
+        net::address_space_manifest shaped;
+        for (const auto& region : manifest.regions)
+        {
+            if (is_covered(ranges, region.base_address, region.end_address(), region_policy::skip))
+            {
+                skipped_bytes += region.allocation_size;
+                continue;
+            }
+
+            shaped.add_region(region.base_address, region.protect, region.type);
+            for (const auto& subregion : manifest.subregions_of(region))
+            {
+                auto it = first_ending_after(ranges, subregion.base_address);
+                std::uint64_t address = subregion.base_address;
+                while (address < subregion.end_address())
+                {
+                    std::uint64_t end_address = subregion.end_address();
+                    region_policy policy = region_policy::send;
+                    if (it != ranges.end())
+                    {
+                        if (it->base_address <= address)
+                        {
+                            policy = it->policy;
+                            end_address = std::min(end_address, it->end_address);
+                        }
+                        else
+                        {
+                            end_address = std::min(end_address, it->base_address);
+                        }
+                    }
+
+                    const bool reserve_only = policy == region_policy::skip || policy == region_policy::reserve_only;
+                    if (reserve_only && subregion.protect != 0)
+                    {
+                        reserved_bytes += end_address - address;
+                    }
+
+                    shaped.add_subregion(address, end_address - address, reserve_only ? 0 : subregion.protect);
+                    address = end_address;
+                    if (it != ranges.end() && address >= it->end_address)
+                    {
+                        ++it;
+                    }
+                }
+            }
+        }
+
+        LOG_DEBUG() << "Annotations left out 0x" << std::hex << skipped_bytes << " bytes and left 0x"
+            << reserved_bytes << std::dec << " bytes reserved only" << std::endl;
+
+        return shaped;
+    }
+}
@@ -0,0 +1,75 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+#include "clone_job.hpp"
+#include "netfork.hpp"
+#include "post_copy.hpp"
+
+#include <netfork-shared/phnt_stub.hpp>
+
+namespace netfork::async_fork
+{
+    // What `wait_for_fork` returns for a fork given up on with `cancel_fork`.
+    constexpr const HRESULT FORK_CANCELLED = 0xA0000008;
+
+    // A fork being sent from a `va_clone` over `socket()`. Cancelling it shuts the socket, so
+    // the server drops the fork.
+    class job : public clone_job<post_copy::va_clone, HRESULT, fork_stats>
+    {
+        SOCKET sock_;
+
+    public:
+        job(SOCKET sock, std::unique_ptr<post_copy::va_clone> clone, fork_progress_callback on_progress)
+            : clone_job{
+                std::move(clone),
+                [on_progress = std::move(on_progress)](const std::uint64_t bytes_done, const std::uint64_t bytes_total)
+                {
+                    if (on_progress)
+                    {
+                        on_progress(fork_progress{ .bytes_done = bytes_done, .bytes_total = bytes_total });
+                    }
+                },
+                [sock] { ::shutdown(sock, SD_BOTH); }
+            }
+            , sock_{ sock }
+        {
+        }
+
+        // Runs `send(job, stats)` on the job's thread. Must only be called once.
+        template <typename Send>
+        void start(Send send)
+        {
+            clone_job::start([this, send = std::move(send)](fork_stats& stats) mutable
+            {
+                const HRESULT result = send(*this, stats);
+                // Whatever the send failed with, it's down to the socket being shut.
+                return FAILED(result) && cancelled() ? FORK_CANCELLED : result;
+            });
+        }
+
+        SOCKET socket() const noexcept
+        {
+            return sock_;
+        }
+    };
+}
@@ -0,0 +1,315 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+// How the capture path walks an address space in bulk and reads it in batches. Free of
+// Windows dependencies; the Windows client walks the VADs with VirtualQueryEx and reads its
+// own memory in place (see vm.hpp), and Linux builds walk /proc/<pid>/maps and read a
+// process, such as a `fork_clone`, with one process_vm_readv per batch.
+
+#include <algorithm>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <vector>
+
+#include <netfork-shared/net/manifest.hpp>
+
+#ifdef __linux__
+#	include <fcntl.h>
+#	include <string>
+#	include <sys/types.h>
+#	include <sys/uio.h>
+#	include <unistd.h>
+#endif
+
+namespace netfork::vm
+{
+    // The Windows protection and allocation type values a manifest is described in, named
+    // so as not to clash with the macros of the Windows headers.
+    constexpr const std::uint32_t PROTECT_NO_ACCESS = 0x01;
+    constexpr const std::uint32_t PROTECT_READ_ONLY = 0x02;
+    constexpr const std::uint32_t PROTECT_READ_WRITE = 0x04;
+    constexpr const std::uint32_t PROTECT_EXECUTE = 0x10;
+    constexpr const std::uint32_t PROTECT_EXECUTE_READ = 0x20;
+    constexpr const std::uint32_t PROTECT_EXECUTE_READ_WRITE = 0x40;
+    constexpr const std::uint32_t TYPE_PRIVATE = 0x20000;
+    constexpr const std::uint32_t TYPE_MAPPED = 0x40000;
+
+    // Addresses from here up belong to the kernel (e.g. [vsyscall]).
+    constexpr const std::uint64_t USER_ADDRESS_LIMIT = std::uint64_t{ 1 } << 47;
+
+    // A stretch of memory read in one go.
+    struct capture_run
+    {
+        std::uint64_t address;
+        std::uint64_t size;
+    };
+
+    // Hands the subregions of `manifest` which `has_payload(protect)` to `on_batch(runs,
+    // bytes)` in batches of at most `max_runs` runs and `max_bytes` bytes, so that a reader
+    // can take each batch with one system call. Adjacent subregions are merged into one run,
+    // and a subregion larger than `max_bytes` is split. Returns false as soon as `on_batch`
+    // does.
+    template <typename HasPayload, typename OnBatch>
+    bool for_each_capture_batch(
+        const net::address_space_manifest& manifest,
+        HasPayload&& has_payload,
+        const std::size_t max_runs,
+        const std::uint64_t max_bytes,
+        OnBatch&& on_batch)
+    {
+        std::vector<capture_run> batch;
+        batch.reserve(max_runs);
+        std::uint64_t bytes = 0;
+        const auto flush = [&]
+        {
+            if (batch.empty())
+            {
+                return true;
+            }
+
+            const bool carry_on = on_batch(std::span<const capture_run>{ batch }, bytes);
+            batch.clear();
+            bytes = 0;
+            return carry_on;
+        };
+
+        for (const auto& subregion : manifest.subregions)
+        {
+            if (!has_payload(subregion.protect))
+            {
+                continue;
+            }
+
+            std::uint64_t address = subregion.base_address;
+            std::uint64_t remaining = subregion.region_size;
+            while (remaining != 0)
+            {
+                const bool extends = !batch.empty() && batch.back().address + batch.back().size == address;
+                if (bytes == max_bytes || (!extends && batch.size() == max_runs))
+                {
+                    if (!flush())
+                    {
+                        return false;
+                    }
+
+                    continue;
+                }
+
+                const std::uint64_t size = std::min(remaining, max_bytes - bytes);
+                if (extends)
+                {
+                    batch.back().size += size;
+                }
+                else
+                {
+                    batch.push_back({ address, size });
+                }
+
+                bytes += size;
+                address += size;
+                remaining -= size;
+            }
+        }
+
+        return flush();
+    }
+
+    // One line of /proc/<pid>/maps:
+    //
+    //   start-end perms offset major:minor inode [path]
+    struct maps_entry
+    {
+        std::uint64_t start;
+        std::uint64_t end;
+        bool read;
+        bool write;
+        bool execute;
+        bool shared;
+        std::string_view path;
+    };
+
+    inline std::optional<maps_entry> parse_maps_line(std::string_view line) noexcept
+    {
+        const auto hex = [&](std::uint64_t& value, const char terminator)
+        {
+            const auto [end, error] = std::from_chars(line.data(), line.data() + line.size(), value, 16);
+            if (error != std::errc{} || end == line.data() + line.size() || *end != terminator)
+            {
+                return false;
+            }
+
+            line.remove_prefix(static_cast<std::size_t>(end - line.data()) + 1);
+            return true;
+        };
+
+        maps_entry entry{};
+        if (!hex(entry.start, '-') || !hex(entry.end, ' ') || entry.end <= entry.start || line.size() < 5 || line[4] != ' ')
+        {
+            return std::nullopt;
+        }
+
+        entry.read = line[0] == 'r';
+        entry.write = line[1] == 'w';
+        entry.execute = line[2] == 'x';
+        entry.shared = line[3] == 's';
+        line.remove_prefix(5);
+
+        // The offset, device and inode, then the path if there is one.
+        for (int field = 0; field < 3; field++)
+        {
+            const auto space = line.find(' ');
+            if (space == std::string_view::npos)
+            {
+                return field == 2 ? std::optional{ entry } : std::nullopt;
+            }
+
+            line.remove_prefix(space + 1);
+        }
+
+        const auto path_start = line.find_first_not_of(' ');
+        entry.path = path_start == std::string_view::npos ? std::string_view{} : line.substr(path_start);
+        return entry;
+    }
+
+    // The closest Windows protection to a mapping's permissions. The kernel's own mappings
+    // can't be read through process_vm_readv, so they count as no access.
+    constexpr std::uint32_t protect_of(const maps_entry& entry) noexcept
+    {
+        if (entry.path == "[vvar]" || entry.path == "[vvar_vclock]")
+        {
+            return PROTECT_NO_ACCESS;
+        }
+
+        if (entry.execute)
+        {
+            return entry.write ? PROTECT_EXECUTE_READ_WRITE : entry.read ? PROTECT_EXECUTE_READ : PROTECT_EXECUTE;
+        }
+
+        return entry.write ? PROTECT_READ_WRITE : entry.read ? PROTECT_READ_ONLY : PROTECT_NO_ACCESS;
+    }
+
+    // Whether the bytes of memory with `protect` can be read in place.
+    constexpr bool is_readable(const std::uint32_t protect) noexcept
+    {
+        return protect == PROTECT_READ_ONLY
+            || protect == PROTECT_READ_WRITE
+            || protect == PROTECT_EXECUTE_READ
+            || protect == PROTECT_EXECUTE_READ_WRITE;
+    }
+
+    // The manifest of the address space `maps` describes, one region per mapping. Shared
+    // and file-backed mappings are `TYPE_MAPPED` and everything else `TYPE_PRIVATE`.
+    inline net::address_space_manifest manifest_from_maps(std::string_view maps)
+    {
+        net::address_space_manifest manifest;
+        while (!maps.empty())
+        {
+            const auto newline = maps.find('\n');
+            const auto line = maps.substr(0, newline);
+            maps.remove_prefix(newline == std::string_view::npos ? maps.size() : newline + 1);
+
+            const auto entry = parse_maps_line(line);
+            if (!entry || entry->start >= USER_ADDRESS_LIMIT)
+            {
+                continue;
+            }
+
+            const bool mapped = entry->shared || (!entry->path.empty() && entry->path.front() == '/');
+            manifest.add_region(entry->start, protect_of(*entry), mapped ? TYPE_MAPPED : TYPE_PRIVATE);
+            manifest.add_subregion(entry->start, entry->end - entry->start, protect_of(*entry));
+        }
+
+        return manifest;
+    }
+
+#ifdef __linux__
+    // Reads the whole of /proc/<pid>/maps in as few reads as it takes. Returns nothing if it
+    // can't be opened.
+    inline std::optional<std::string> read_maps(const pid_t pid)
+    {
+        const int fd = ::open(("/proc/" + std::to_string(pid) + "/maps").c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+        {
+            return std::nullopt;
+        }
+
+        std::string maps;
+        std::size_t size = 0;
+        for (;;)
+        {
+            maps.resize(size + 64 * 1024);
+            const ssize_t bytes_read = ::read(fd, maps.data() + size, maps.size() - size);
+            if (bytes_read <= 0)
+            {
+                break;
+            }
+
+            size += static_cast<std::size_t>(bytes_read);
+        }
+
+        ::close(fd);
+        maps.resize(size);
+        return maps;
+    }
+
+    // The most runs one process_vm_readv takes (IOV_MAX).
+    constexpr const std::size_t MAX_RUNS_PER_READ = 1024;
+
+    // Reads `runs` of process `pid` into `out` back to back with one process_vm_readv.
+    // `out` must hold every run. The kernel stops at the first page it can't read (e.g. a
+    // file mapping past the end of its file), so each run it didn't finish is read on its
+    // own, and is left zero from its first unreadable page. Returns how many bytes were read.
+    inline std::uint64_t read_batch(const pid_t pid, std::span<const capture_run> runs, std::span<std::byte> out)
+    {
+        std::vector<iovec> remote(runs.size());
+        for (std::size_t i = 0; i < runs.size(); i++)
+        {
+            remote[i] = { reinterpret_cast<void*>(runs[i].address), runs[i].size };
+        }
+
+        const iovec local{ out.data(), out.size() };
+        const ssize_t batch_read = ::process_vm_readv(pid, &local, 1, remote.data(), remote.size(), 0);
+        const std::uint64_t batched = batch_read > 0 ? static_cast<std::uint64_t>(batch_read) : 0;
+
+        std::uint64_t bytes_read = batched;
+        std::uint64_t offset = 0;
+        for (const auto& run : runs)
+        {
+            const std::uint64_t end = offset + run.size;
+            if (end > batched)
+            {
+                const std::uint64_t done = batched > offset ? batched - offset : 0;
+                const iovec rest_local{ out.data() + offset + done, run.size - done };
+                const iovec rest_remote{ reinterpret_cast<void*>(run.address + done), run.size - done };
+                const ssize_t rest_read = ::process_vm_readv(pid, &rest_local, 1, &rest_remote, 1, 0);
+                const std::uint64_t rest = rest_read > 0 ? static_cast<std::uint64_t>(rest_read) : 0;
+                std::fill(out.data() + offset + done + rest, out.data() + end, std::byte{});
+                bytes_read += rest;
+            }
+
+            offset = end;
+        }
+
+        return bytes_read;
+    }
+#endif
+}
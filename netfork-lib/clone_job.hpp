@@ -0,0 +1,232 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+// How `fork_async` sends from a copy-on-write clone of the address space on a thread of its
+// own. Free of Windows dependencies; the Windows client clones with PSS_CAPTURE_VA_CLONE
+// (`post_copy::va_clone`) and wraps the job in `async_fork::job`, and Linux builds clone
+// with the `fork_clone` below.
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <utility>
+
+#ifdef __linux__
+#	include <cerrno>
+#	include <csignal>
+#	include <cstddef>
+#	include <span>
+#	include <fcntl.h>
+#	include <sys/prctl.h>
+#	include <sys/types.h>
+#	include <sys/uio.h>
+#	include <sys/wait.h>
+#	include <unistd.h>
+#endif
+
+namespace netfork::async_fork
+{
+    // A send from a `Clone` on a thread of its own, so the thread which forked can carry on
+    // as soon as the clone has been taken. `Clone` only has to outlive the send; the send
+    // itself returns a `Result` and fills in `Stats`.
+    template <typename Clone, typename Result, typename Stats>
+    class clone_job
+    {
+    public:
+        using progress_callback = std::function<void(std::uint64_t bytes_done, std::uint64_t bytes_total)>;
+
+    private:
+        std::unique_ptr<Clone> clone_;
+        progress_callback on_progress_;
+        // Unblocks a send waiting on its peer, e.g. by shutting the socket.
+        std::function<void()> on_cancel_;
+
+        std::atomic<std::uint64_t> bytes_done_ = 0;
+        std::atomic<std::uint64_t> bytes_total_ = 0;
+        std::atomic<bool> cancelled_ = false;
+        Result result_{};
+        Stats stats_{};
+        std::jthread sender_;
+
+    public:
+        clone_job(std::unique_ptr<Clone> clone, progress_callback on_progress, std::function<void()> on_cancel)
+            : clone_{ std::move(clone) }
+            , on_progress_{ std::move(on_progress) }
+            , on_cancel_{ std::move(on_cancel) }
+        {
+        }
+
+        clone_job(const clone_job&) = delete;
+        clone_job& operator=(const clone_job&) = delete;
+
+        // Runs `send(stats)` on the job's thread. Must only be called once.
+        template <typename Send>
+        void start(Send send)
+        {
+            sender_ = std::jthread{ [this, send = std::move(send)]() mutable
+            {
+                result_ = send(stats_);
+            } };
+        }
+
+        const Clone& clone() const noexcept
+        {
+            return *clone_;
+        }
+
+        bool cancelled() const noexcept
+        {
+            return cancelled_.load(std::memory_order_relaxed);
+        }
+
+        // Called by the sender once it knows how much of the clone it's going to read.
+        void set_total(const std::uint64_t bytes)
+        {
+            bytes_total_ = bytes;
+            advance(0);
+        }
+
+        // Called by the sender as it gets through the clone.
+        void advance(const std::uint64_t bytes)
+        {
+            const std::uint64_t done = bytes_done_ += bytes;
+            if (on_progress_)
+            {
+                on_progress_(done, bytes_total_);
+            }
+        }
+
+        // Stops the sender as soon as it next checks, and runs the cancel hook so it isn't
+        // left waiting on its peer either.
+        void cancel()
+        {
+            if (!cancelled_.exchange(true) && on_cancel_)
+            {
+                on_cancel_();
+            }
+        }
+
+        // Blocks until the sender is done.
+        Result wait(Stats* stats)
+        {
+            if (sender_.joinable())
+            {
+                sender_.join();
+            }
+
+            if (stats)
+            {
+                *stats = stats_;
+            }
+
+            return result_;
+        }
+    };
+
+#ifdef __linux__
+    // A copy-on-write clone of this process's address space, the Linux counterpart of
+    // `post_copy::va_clone`: a child `fork`ed for the purpose, which does nothing but wait
+    // until the clone is let go. Reads go through `process_vm_readv` and see memory as it was
+    // at the fork, whatever this process has done since.
+    //
+    // Only the forking thread exists in the child, and it only ever calls `read` and `_exit`,
+    // so the fork is safe however many threads this process has. The child inherits every
+    // descriptor, so a socket closed here stays open until the clone is let go.
+    class fork_clone
+    {
+        pid_t pid_;
+        int release_;
+
+        fork_clone(const pid_t pid, const int release)
+            : pid_{ pid }
+            , release_{ release }
+        {
+        }
+
+    public:
+        fork_clone(const fork_clone&) = delete;
+        fork_clone& operator=(const fork_clone&) = delete;
+
+        ~fork_clone()
+        {
+            ::close(release_);
+            ::waitpid(pid_, nullptr, 0);
+        }
+
+        // Returns null if the process couldn't be forked.
+        static std::unique_ptr<fork_clone> capture()
+        {
+            int fds[2];
+            if (::pipe2(fds, O_CLOEXEC) != 0)
+            {
+                return nullptr;
+            }
+
+            const pid_t pid = ::fork();
+            if (pid == 0)
+            {
+                // Gone with this process, should it never let the clone go.
+                ::prctl(PR_SET_PDEATHSIG, SIGKILL);
+                ::close(fds[1]);
+                char byte;
+                ssize_t result;
+                do
+                {
+                    result = ::read(fds[0], &byte, 1);
+                } while (result > 0 || (result < 0 && errno == EINTR));
+                ::_exit(0);
+            }
+
+            ::close(fds[0]);
+            if (pid < 0)
+            {
+                ::close(fds[1]);
+                return nullptr;
+            }
+
+            return std::unique_ptr<fork_clone>{ new fork_clone{ pid, fds[1] } };
+        }
+
+        pid_t pid() const noexcept
+        {
+            return pid_;
+        }
+
+        bool read(const std::uint64_t address, std::span<std::byte> out) const
+        {
+            std::size_t offset = 0;
+            while (offset < out.size())
+            {
+                const iovec local{ out.data() + offset, out.size() - offset };
+                const iovec remote{ reinterpret_cast<void*>(address + offset), out.size() - offset };
+                const ssize_t bytes_read = ::process_vm_readv(pid_, &local, 1, &remote, 1, 0);
+                if (bytes_read <= 0)
+                {
+                    return false;
+                }
+
+                offset += static_cast<std::size_t>(bytes_read);
+            }
+
+            return true;
+        }
+    };
+#endif
+}
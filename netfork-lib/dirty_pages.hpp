@@ -0,0 +1,280 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+// How a pre-copy fork decides which pages are dirty and when to stop going round. Free of
+// Windows dependencies; the Windows client finds written pages with write watching and
+// reads them with ReadProcessMemory (see pre_copy.hpp), and Linux builds find them with the
+// soft-dirty bits below.
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+#include <netfork-shared/net/manifest.hpp>
+#include <netfork-shared/net/page_data.hpp>
+#include <netfork-shared/page_hash.hpp>
+#include <netfork-shared/zero_page.hpp>
+
+#ifdef __linux__
+#	include <fcntl.h>
+#	include <sys/mman.h>
+#	include <unistd.h>
+#	include <vector>
+#endif
+
+namespace netfork::pre_copy
+{
+    // Matches no page the server could have, so the page is always sent.
+    constexpr const page_hash UNKNOWN_HASH{ .low = ~std::uint64_t{ 0 }, .high = ~std::uint64_t{ 0 } };
+
+    struct run_diff
+    {
+        // The candidates whose bytes differ from what the server has.
+        net::page_run dirty;
+        // How many of those the server had something other than a zero page for, so
+        // sending them sends bytes a second time.
+        std::uint32_t resent_pages = 0;
+    };
+
+    // Hashes the `candidates` of a run, whose bytes are at `pages` in page order, and
+    // compares them with `hashes`, what the server has for each page of the run. With
+    // `update` set the dirty pages' hashes are replaced, as they're about to be sent.
+    inline run_diff diff_run(
+        const net::page_run& candidates,
+        std::span<const std::byte> pages,
+        std::span<page_hash> hashes,
+        const page_hash& zero_hash,
+        const bool update)
+    {
+        run_diff diff{ .dirty = { .address = candidates.address, .page_count = candidates.page_count } };
+        candidates.for_each_present_run([&](const std::uint32_t first, const std::uint32_t count)
+        {
+            for (std::uint32_t page = first; page < first + count; page++)
+            {
+                const std::byte* const bytes = pages.data() + page * net::MANIFEST_PAGE_SIZE;
+                const page_hash hash = simd::is_zero_page(bytes) ? zero_hash : hash_page(bytes);
+
+                page_hash& sent_hash = hashes[page];
+                if (hash == sent_hash)
+                {
+                    continue;
+                }
+
+                diff.dirty.set_present(page);
+                if (sent_hash != zero_hash && sent_hash != UNKNOWN_HASH)
+                {
+                    diff.resent_pages++;
+                }
+
+                if (update)
+                {
+                    sent_hash = hash;
+                }
+            }
+        });
+
+        return diff;
+    }
+
+    // When to stop sending rounds while the other threads keep running: once the dirty set
+    // looks like it can go out within `max_pause`, once a round stops shrinking it, or after
+    // `max_rounds`.
+    //
+    // The estimate for a round is the time the last scan took plus the dirty bytes at the
+    // throughput the last round managed.
+    class round_schedule
+    {
+        std::chrono::microseconds max_pause_;
+        unsigned int max_rounds_;
+        unsigned int rounds_ = 0;
+        // Bytes per second, scanning included.
+        double throughput_ = 0.0;
+        std::uint64_t last_dirty_bytes_ = 0;
+
+    public:
+        round_schedule(const std::chrono::microseconds max_pause, const unsigned int max_rounds) noexcept
+            : max_pause_{ max_pause }
+            , max_rounds_{ max_rounds }
+        {
+        }
+
+        unsigned int rounds() const noexcept
+        {
+            return rounds_;
+        }
+
+        // A round sent `bytes_sent` bytes in `elapsed`. The first round sends everything,
+        // which is what later rounds have to beat.
+        void record_round(const std::uint64_t bytes_sent, const std::chrono::duration<double> elapsed) noexcept
+        {
+            if (bytes_sent != 0 && elapsed.count() > 0.0)
+            {
+                throughput_ = bytes_sent / elapsed.count();
+            }
+
+            if (rounds_++ == 0)
+            {
+                last_dirty_bytes_ = bytes_sent;
+            }
+        }
+
+        std::chrono::microseconds estimate_pause(
+            const std::uint64_t dirty_bytes,
+            const std::chrono::duration<double> scan_time) const noexcept
+        {
+            const std::chrono::duration<double> send_time{ throughput_ > 0.0 ? dirty_bytes / throughput_ : 0.0 };
+            return std::chrono::duration_cast<std::chrono::microseconds>(scan_time + send_time);
+        }
+
+        // Whether to send another round with `dirty_bytes` dirty, counting which took
+        // `scan_time`.
+        bool another_round(const std::uint64_t dirty_bytes, const std::chrono::duration<double> scan_time) noexcept
+        {
+            if (rounds_ >= max_rounds_)
+            {
+                return false;
+            }
+
+            // Past the point where another round helps, the pause won't get any shorter.
+            if (estimate_pause(dirty_bytes, scan_time) <= max_pause_ || dirty_bytes >= last_dirty_bytes_)
+            {
+                return false;
+            }
+
+            last_dirty_bytes_ = dirty_bytes;
+            return true;
+        }
+    };
+
+#ifdef __linux__
+    // Bit of a /proc/self/pagemap entry set once the page is written after the process's
+    // soft-dirty bits were last cleared (see Documentation/admin-guide/mm/soft-dirty.rst).
+    constexpr const std::uint64_t PAGEMAP_SOFT_DIRTY = std::uint64_t{ 1 } << 55;
+
+    // The Linux counterpart of write watching. Unlike `MEM_WRITE_WATCH` it covers every
+    // mapping, those which existed before the fork included, but clearing resets the whole
+    // process at once: read the bits of everything a round sends, then `clear`, then read
+    // the pages, so what's written meanwhile shows up in the next round.
+    //
+    // A kernel built without CONFIG_MEM_SOFT_DIRTY accepts the clear and never sets a bit;
+    // `is_supported` finds that out, and callers then hash every page like the Windows
+    // client does for memory without write watching.
+    class soft_dirty
+    {
+        int pagemap_;
+        int clear_refs_;
+        std::size_t system_page_size_;
+        std::vector<std::uint64_t> entries_;
+
+    public:
+        soft_dirty() noexcept
+            : pagemap_(::open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC))
+            , clear_refs_(::open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC))
+            , system_page_size_(static_cast<std::size_t>(::sysconf(_SC_PAGESIZE)))
+        {
+        }
+
+        soft_dirty(const soft_dirty&) = delete;
+        soft_dirty& operator=(const soft_dirty&) = delete;
+
+        ~soft_dirty()
+        {
+            if (pagemap_ != -1)
+            {
+                ::close(pagemap_);
+            }
+
+            if (clear_refs_ != -1)
+            {
+                ::close(clear_refs_);
+            }
+        }
+
+        // Clears the soft-dirty bit of every page of the process.
+        bool clear() noexcept
+        {
+            return clear_refs_ != -1 && ::pwrite(clear_refs_, "4", 1, 0) == 1;
+        }
+
+        // Marks every page of `candidates` written since the last `clear`. Returns false if
+        // pagemap couldn't be read, in which case nothing is marked.
+        bool written(net::page_run& candidates)
+        {
+            if (pagemap_ == -1 || candidates.page_count == 0)
+            {
+                return false;
+            }
+
+            const std::uint64_t end = candidates.address + candidates.page_count * net::MANIFEST_PAGE_SIZE;
+            const std::uint64_t first_system_page = candidates.address / system_page_size_;
+            const std::size_t system_pages = static_cast<std::size_t>(
+                (end + system_page_size_ - 1) / system_page_size_ - first_system_page);
+
+            entries_.resize(system_pages);
+            const auto bytes = static_cast<ssize_t>(system_pages * sizeof(std::uint64_t));
+            if (::pread(
+                pagemap_,
+                entries_.data(),
+                static_cast<std::size_t>(bytes),
+                static_cast<off_t>(first_system_page * sizeof(std::uint64_t))) != bytes)
+            {
+                return false;
+            }
+
+            for (std::uint32_t page = 0; page < candidates.page_count; page++)
+            {
+                const std::size_t system_page = static_cast<std::size_t>(
+                    (candidates.address + page * net::MANIFEST_PAGE_SIZE) / system_page_size_ - first_system_page);
+                if (entries_[system_page] & PAGEMAP_SOFT_DIRTY)
+                {
+                    candidates.set_present(page);
+                }
+            }
+
+            return true;
+        }
+
+        // Whether the kernel tracks soft-dirty bits: a page written after a clear has to
+        // come back dirty.
+        bool is_supported()
+        {
+            void* page = ::mmap(nullptr, system_page_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (page == MAP_FAILED)
+            {
+                return false;
+            }
+
+            auto* bytes = static_cast<volatile std::byte*>(page);
+            bytes[0] = std::byte{ 1 };
+            net::page_run probe{ .address = reinterpret_cast<std::uint64_t>(page), .page_count = 1 };
+            bool supported = clear();
+            if (supported)
+            {
+                bytes[0] = std::byte{ 2 };
+                supported = written(probe) && probe.is_present(0);
+            }
+
+            ::munmap(page, system_page_size_);
+            return supported;
+        }
+    };
+#endif
+}
@@ -0,0 +1,133 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <netfork-shared/compress.hpp>
+#include <netfork-shared/net/chunk_log.hpp>
+#include <netfork-shared/net/codec.hpp>
+#include <netfork-shared/pipeline.hpp>
+
+namespace netfork::fan_out
+{
+    // How far behind the encoder any server of `fork_many` may fall. The encoder waits for
+    // a server that far behind, and gives up on it once it's been waiting `MAX_STALL`.
+    constexpr const std::size_t WINDOW_SIZE = 64 * 1024 * 1024;
+    constexpr const std::chrono::milliseconds MAX_STALL{ 10'000 };
+    // What `fork_many` reports for a server given up on that way.
+    constexpr const HRESULT DESTINATION_TOO_SLOW = 0xA000000A;
+
+    // Cuts frames written into `writer()` into chunks of about `CHUNK_TARGET_SIZE` bytes and
+    // appends them to a `net::chunk_log`. With a compression codec the chunks are compressed
+    // on a pool of workers first, once for every destination, and appended in order.
+    class encoder
+    {
+        using pipeline_type = ordered_pipeline<std::vector<std::byte>, std::vector<std::byte>>;
+
+        net::chunk_log& log_;
+        net::codec::frame_writer chunk_;
+        std::optional<pipeline_type> pipeline_;
+        std::jthread collector_;
+
+        void push(std::vector<std::byte> frames)
+        {
+            if (pipeline_)
+            {
+                pipeline_->push(std::move(frames));
+            }
+            else
+            {
+                log_.append(std::move(frames));
+            }
+        }
+
+    public:
+        encoder(net::chunk_log& log, std::optional<compress::codec> method, const unsigned int worker_count)
+            : log_{ log }
+            , chunk_{ compress::CHUNK_TARGET_SIZE + net::codec::MAX_BYTES_FRAME_LENGTH }
+        {
+            if (method)
+            {
+                pipeline_.emplace(
+                    worker_count,
+                    2 * static_cast<std::size_t>(worker_count),
+                    [method = method.value()](std::vector<std::byte>& frames)
+                    {
+                        return compress::compress_chunk(method, frames);
+                    }
+                );
+                collector_ = std::jthread{ [this]
+                {
+                    while (auto compressed = pipeline_->pop())
+                    {
+                        log_.append(std::move(compressed).value());
+                    }
+                } };
+            }
+        }
+
+        encoder(const encoder&) = delete;
+        encoder& operator=(const encoder&) = delete;
+
+        ~encoder()
+        {
+            if (pipeline_)
+            {
+                pipeline_->cancel();
+            }
+        }
+
+        // Frames written here go out with the next chunk; call `commit` after every frame.
+        net::codec::frame_writer& writer() noexcept
+        {
+            return chunk_;
+        }
+
+        // Hands the current chunk on once it's large enough.
+        void commit()
+        {
+            if (chunk_.size() >= compress::CHUNK_TARGET_SIZE)
+            {
+                push(chunk_.release());
+                chunk_ = net::codec::frame_writer{ compress::CHUNK_TARGET_SIZE + net::codec::MAX_BYTES_FRAME_LENGTH };
+            }
+        }
+
+        // Flushes whatever is left and waits until every chunk is in the log. Doesn't close
+        // the log.
+        void finish()
+        {
+            if (!chunk_.empty())
+            {
+                push(chunk_.release());
+            }
+
+            if (pipeline_)
+            {
+                pipeline_->close();
+                collector_.join();
+            }
+        }
+    };
+}
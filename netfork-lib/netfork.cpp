@@ -19,18 +19,43 @@
 
 #include <psapi.h>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <expected>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <span>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <utility>
-#include <variant>
+#include <vector>
 
+#include "annotations.hpp"
+#include "async_fork.hpp"
+#include "fan_out.hpp"
+#include "post_copy.hpp"
+#include "pre_copy.hpp"
+#include "replication.hpp"
 #include "vm.hpp"
 
 #include <netfork-shared/auto.hpp>
+#include <netfork-shared/compress.hpp>
 #include <netfork-shared/log.hpp>
+#include <netfork-shared/net/manifest.hpp>
 #include <netfork-shared/net/msg.hpp>
+#include <netfork-shared/net/page_data.hpp>
 #include <netfork-shared/net/sock.hpp>
+#include <netfork-shared/net/stream.hpp>
+#include <netfork-shared/page_hash.hpp>
 #include <netfork-shared/phnt_stub.hpp>
+#include <netfork-shared/pipeline.hpp>
+#include <netfork-shared/zero_page.hpp>
 
 namespace
 {
@@ -56,36 +81,1186 @@ namespace
         return { .base_address = mi.lpBaseOfDll, .size = mi.SizeOfImage };
     }
 
-    struct message_transporter
+    // Sends what the server needs before anything else: the context the new thread starts
+    // from, copies of the PEB and TEB, and how the memory is going to be sent. Then waits
+    // for the server to admit the fork, which may take a while on a busy server.
+    // `stripe_token`, if given, gets the token a striped fork's other connections attach with.
+    HRESULT send_process_info(
+        SOCKET sock,
+        const CONTEXT& context,
+        const PEB& peb,
+        const TEB& teb,
+        const netfork::net::msg::fork_mode mode,
+        std::uint64_t* stripe_token = nullptr)
     {
-        SOCKET socket;
+        using namespace netfork;
 
-        message_transporter(SOCKET s)
-            : socket{ s }
+        if (const auto result = net::send_msg(sock, context); FAILED(result))
         {
+            return result;
         }
 
-        HRESULT operator()(const netfork::net::msg::region_info& msg) const
+        if (const auto result = net::send_msg(sock, peb); FAILED(result))
         {
-            return netfork::net::send_as(socket, msg);
+            return result;
         }
 
-        HRESULT operator()(const netfork::net::msg::subregion_info& msg) const
+        if (const auto result = net::send_msg(sock, teb); FAILED(result))
         {
-            return netfork::net::send_as(socket, msg);
+            return result;
         }
 
-        HRESULT operator()(std::span<const char> msg) const
+        if (const auto result = net::send_msg(sock, mode); FAILED(result))
         {
-            return netfork::net::send_bytes(socket, std::as_bytes(msg));
+            return result;
         }
+
+        const auto admission = net::recv_msg<net::msg::admission>(sock);
+        if (!admission)
+        {
+            return admission.error();
+        }
+
+        if (!admission->admitted)
+        {
+            LOG_DEBUG_ERR() << "Server turned down a fork committing 0x" << std::hex
+                << mode.committed_size << std::dec << " bytes" << std::endl;
+            return net::FORK_REJECTED;
+        }
+
+        if (stripe_token)
+        {
+            *stripe_token = admission->stripe_token;
+        }
+
+        return ERROR_SUCCESS;
+    }
+
+    // `send_process_info` with the PEB and TEB of the calling thread as they are now.
+    // `mode.committed_size` is left to the caller, which may need it for more than this.
+    HRESULT send_process_info(
+        SOCKET sock,
+        const CONTEXT& context,
+        const netfork::net::msg::fork_mode mode,
+        std::uint64_t* stripe_token = nullptr)
+    {
+        PEB peb{};
+        ::RtlAcquirePebLock();
+        std::memcpy(&peb, ::NtCurrentTeb()->ProcessEnvironmentBlock, sizeof(PEB));
+        ::RtlReleasePebLock();
+
+        TEB teb{};
+        std::memcpy(&teb, ::NtCurrentTeb(), sizeof(TEB));
+
+        return send_process_info(sock, context, peb, teb, mode, stripe_token);
+    }
+
+    // Splits the pages at `base_address`, read into `bytes`, into page runs and hands every
+    // run with at least one non-zero page to `sink(run, pages)`. Entirely zero pages are
+    // left out since the server's freshly committed memory already is.
+    template <typename Sink>
+    HRESULT for_each_nonzero_run(
+        const std::uint64_t base_address,
+        std::span<const std::byte> bytes,
+        netfork::fork_stats& stats,
+        Sink&& sink)
+    {
+        constexpr std::size_t frame_span = netfork::net::MAX_PAGES_PER_FRAME * netfork::net::MANIFEST_PAGE_SIZE;
+
+        for (std::size_t offset = 0; offset < bytes.size(); offset += frame_span)
+        {
+            const auto chunk = bytes.subspan(offset, std::min(frame_span, bytes.size() - offset));
+
+            netfork::net::page_run run{
+                .address = base_address + offset,
+                .page_count = static_cast<std::uint32_t>(chunk.size() / netfork::net::MANIFEST_PAGE_SIZE)
+            };
+            for (std::uint32_t page = 0; page < run.page_count; page++)
+            {
+                if (netfork::simd::is_zero_page(chunk.data() + page * netfork::net::MANIFEST_PAGE_SIZE))
+                {
+                    stats.zero_pages_skipped++;
+                }
+                else
+                {
+                    run.set_present(page);
+                }
+            }
+
+            if (run.present_count() == 0)
+            {
+                continue;
+            }
+
+            if (const auto result = sink(run, chunk); FAILED(result))
+            {
+                return result;
+            }
+        }
+
+        return ERROR_SUCCESS;
+    }
+
+    // `for_each_nonzero_run` for memory of this process, read where it is.
+    template <typename Sink>
+    HRESULT for_each_nonzero_run(std::span<const std::byte> bytes, netfork::fork_stats& stats, Sink&& sink)
+    {
+        return for_each_nonzero_run(
+            reinterpret_cast<std::uint64_t>(bytes.data()),
+            bytes,
+            stats,
+            std::forward<Sink>(sink)
+        );
+    }
+
+    // Hash-first exchange with the server's page store: sends the hash of every non-zero
+    // page, waits for the bitmap of pages the server doesn't have and sends only those
+    // through `send_run`. The pages are read again for the second pass, so anything written
+    // in between goes out as it is now.
+    template <typename SendRun>
+    HRESULT send_deduplicated_pages(
+        SOCKET sock,
+        const netfork::net::address_space_manifest& manifest,
+        netfork::fork_stats& stats,
+        netfork::vm::capture_stats& capture_stats,
+        SendRun&& send_run)
+    {
+        using namespace netfork;
+
+        std::vector<net::page_run> hashed_runs;
+        std::uint64_t hashed_pages = 0;
+        {
+            net::codec::frame_writer batch{ 2 * net::codec::MAX_BYTES_FRAME_LENGTH };
+            std::array<page_hash, net::MAX_PAGES_PER_FRAME> hashes;
+
+            const auto send_hashes = [&](const net::page_run& run, std::span<const std::byte> pages) -> HRESULT
+            {
+                std::size_t hash_count = 0;
+                run.for_each_present_run([&](const std::uint32_t first_page, const std::uint32_t page_count)
+                {
+                    for (std::uint32_t page = first_page; page < first_page + page_count; page++)
+                    {
+                        hashes[hash_count++] = hash_page(pages.data() + page * net::MANIFEST_PAGE_SIZE);
+                    }
+                });
+
+                net::write_page_hashes(batch, run, std::span{ hashes }.first(hash_count));
+                hashed_runs.push_back(run);
+                hashed_pages += hash_count;
+
+                if (batch.size() < net::codec::MAX_BYTES_FRAME_LENGTH)
+                {
+                    return ERROR_SUCCESS;
+                }
+
+                const auto result = net::send_batch(sock, batch);
+                batch.clear();
+                return result;
+            };
+
+            auto payload = vm::read_resident_payload(manifest, capture_stats);
+            while (payload)
+            {
+                const auto buf = payload();
+                if (const auto result = ::for_each_nonzero_run(std::as_bytes(buf), stats, send_hashes);
+                    FAILED(result))
+                {
+                    return result;
+                }
+            }
+
+            // Nothing hashed means nothing to ask about; the caller's `end_of_stream`
+            // ends the payload as usual.
+            if (hashed_pages == 0)
+            {
+                return ERROR_SUCCESS;
+            }
+
+            if (const auto result = net::send_batch(sock, batch); FAILED(result))
+            {
+                return result;
+            }
+
+            if (const auto result = net::send_frames(sock, net::codec::frame_type::end_of_stream, {});
+                FAILED(result))
+            {
+                return result;
+            }
+        }
+
+        std::vector<std::byte> encoded_missing(((hashed_pages + 63) / 64) * sizeof(std::uint64_t));
+        if (const auto result = net::recv_frames(sock, net::codec::frame_type::missing_pages, encoded_missing);
+            FAILED(result))
+        {
+            return result;
+        }
+
+        const auto missing = net::decode_bitmap(encoded_missing);
+        LOG_DEBUG() << "Sent " << hashed_pages << " page hashes" << std::endl;
+
+        std::uint64_t hash_index = 0;
+        for (const auto& hashed : hashed_runs)
+        {
+            net::page_run missing_run{ .address = hashed.address, .page_count = hashed.page_count };
+            hashed.for_each_present_run([&](const std::uint32_t first_page, const std::uint32_t page_count)
+            {
+                for (std::uint32_t page = first_page; page < first_page + page_count; page++, hash_index++)
+                {
+                    if ((missing[hash_index / 64] >> (hash_index % 64)) & 1)
+                    {
+                        missing_run.set_present(page);
+                    }
+                    else
+                    {
+                        stats.deduplicated_bytes += net::MANIFEST_PAGE_SIZE;
+                    }
+                }
+            });
+
+            if (missing_run.present_count() == 0)
+            {
+                continue;
+            }
+
+            const std::uint64_t run_size = hashed.page_count * net::MANIFEST_PAGE_SIZE;
+            const vm::readable_range readable{
+                hashed.address,
+                run_size,
+                manifest.find_subregion(hashed.address)->protect
+            };
+
+            const auto result = send_run(missing_run, std::span<const std::byte>{
+                reinterpret_cast<const std::byte*>(hashed.address),
+                run_size
+            });
+            if (FAILED(result))
+            {
+                return result;
+            }
+        }
+
+        return ERROR_SUCCESS;
+    }
+
+    // Hands every page of the image's writable subregions to `sink(run, pages)`, a frame's
+    // worth at a time. Zero pages are included: the server's cached copy may hold something
+    // else there. The pages are read from `clone` if there is one.
+    template <typename Sink>
+    HRESULT for_each_overlay_run(
+        const netfork::net::address_space_manifest& image_manifest,
+        const netfork::post_copy::va_clone* clone,
+        Sink&& sink)
+    {
+        using namespace netfork;
+
+        std::vector<std::byte> buffer;
+        for (const auto& subregion : image_manifest.subregions)
+        {
+            if (!net::msg::has_payload(subregion.protect) || !net::msg::is_writable(subregion.protect))
+            {
+                continue;
+            }
+
+            for (std::uint64_t offset = 0; offset < subregion.region_size;)
+            {
+                const std::uint64_t size = std::min<std::uint64_t>(
+                    subregion.region_size - offset,
+                    net::MAX_PAGES_PER_FRAME * net::MANIFEST_PAGE_SIZE);
+
+                net::page_run run{
+                    .address = subregion.base_address + offset,
+                    .page_count = static_cast<std::uint32_t>(size / net::MANIFEST_PAGE_SIZE)
+                };
+                for (std::uint32_t page = 0; page < run.page_count; page++)
+                {
+                    run.set_present(page);
+                }
+
+                std::span<const std::byte> pages{ reinterpret_cast<const std::byte*>(run.address), size };
+                if (clone)
+                {
+                    buffer.resize(size);
+                    if (const auto result = clone->read(run.address, buffer); FAILED(result))
+                    {
+                        return result;
+                    }
+
+                    pages = buffer;
+                }
+
+                if (const auto result = sink(run, pages); FAILED(result))
+                {
+                    return result;
+                }
+
+                offset += size;
+            }
+        }
+
+        return ERROR_SUCCESS;
+    }
+
+    // Sends every page of the image's writable subregions as `page_data` frames, followed
+    // by `end_of_stream`.
+    HRESULT send_image_overlay(
+        SOCKET sock,
+        const netfork::net::address_space_manifest& image_manifest,
+        const netfork::post_copy::va_clone* clone)
+    {
+        using namespace netfork;
+
+        std::uint64_t overlay_size = 0;
+        const auto result = ::for_each_overlay_run(image_manifest, clone,
+            [&](const net::page_run& run, std::span<const std::byte> pages)
+            {
+                overlay_size += pages.size();
+                return net::send_page_run(sock, run, pages);
+            });
+        if (FAILED(result))
+        {
+            return result;
+        }
+
+        LOG_DEBUG() << "Image is cached on the server; sent 0x" << std::hex << overlay_size
+            << std::dec << " writable image bytes" << std::endl;
+
+        return net::send_frames(sock, net::codec::frame_type::end_of_stream, {});
+    }
+
+    // Sends the image bytes of `image_manifest` as read from `clone`, a buffer at a time.
+    HRESULT send_cloned_image(
+        SOCKET sock,
+        const netfork::net::address_space_manifest& image_manifest,
+        const netfork::post_copy::va_clone& clone)
+    {
+        using namespace netfork;
+
+        constexpr std::uint64_t buffer_size = net::MAX_PAGES_PER_FRAME * net::MANIFEST_PAGE_SIZE;
+
+        std::vector<std::byte> buffer;
+        for (const auto& subregion : image_manifest.subregions)
+        {
+            if (!net::msg::has_payload(subregion.protect))
+            {
+                continue;
+            }
+
+            for (std::uint64_t offset = 0; offset < subregion.region_size; offset += buffer_size)
+            {
+                buffer.resize(std::min(buffer_size, subregion.region_size - offset));
+                if (const auto result = clone.read(subregion.base_address + offset, buffer); FAILED(result))
+                {
+                    return result;
+                }
+
+                const auto result = net::send_frames(sock, net::codec::frame_type::image_bytes, buffer);
+                if (FAILED(result))
+                {
+                    return result;
+                }
+            }
+
+            LOG_DEBUG() << "Sent 0x" << std::hex << subregion.region_size
+                << std::dec << " image bytes" << std::endl;
+        }
+
+        return ERROR_SUCCESS;
+    }
+
+    // The main image's manifest, and the `image_info` which identifies it to a server. The
+    // image is read from `clone`'s process if there is one.
+    std::pair<netfork::net::address_space_manifest, netfork::net::msg::image_info> capture_image(
+        const netfork::post_copy::va_clone* clone)
+    {
+        using namespace netfork;
+
+        const auto [image_allocation_base, image_size] = get_image_info();
+        auto image_manifest = vm::capture_manifest_if(
+            [image_allocation_base](const MEMORY_BASIC_INFORMATION& mbi)
+            {
+                return mbi.Type == MEM_IMAGE
+                    && mbi.AllocationBase == image_allocation_base;
+            },
+            clone ? clone->process() : ::GetCurrentProcess());
+
+        const auto image_hash = vm::hash_read_only_image(image_manifest);
+        const net::msg::image_info image_info{
+            .size_of_image = image_size,
+            .read_only_hash_low = image_hash.low,
+            .read_only_hash_high = image_hash.high
+        };
+        return { std::move(image_manifest), image_info };
+    }
+
+    // Tells the server about the main image and sends either all of it or, if the server
+    // has it cached, only the pages which may have changed since. Everything is read from
+    // `clone` if there is one. Returns the image's manifest.
+    std::expected<netfork::net::address_space_manifest, HRESULT> send_image(
+        SOCKET sock,
+        const netfork::post_copy::va_clone* clone = nullptr)
+    {
+        using namespace netfork;
+
+        auto [image_manifest, image_info] = ::capture_image(clone);
+        if (const auto result = net::send_msg(sock, image_info); FAILED(result))
+        {
+            return std::unexpected{ result };
+        }
+
+        const auto cache_status = net::recv_msg<net::msg::image_cache_status>(sock);
+        if (!cache_status)
+        {
+            LOG_DEBUG_ERR() << "Failed to receive image cache status; error: "
+                << cache_status.error() << std::endl;
+            return std::unexpected{ cache_status.error() };
+        }
+
+        if (cache_status->hit)
+        {
+            if (const auto result = ::send_image_overlay(sock, image_manifest, clone); FAILED(result))
+            {
+                return std::unexpected{ result };
+            }
+
+            return std::move(image_manifest);
+        }
+
+        // The server checks the image against `image_hash` before caching it, for which it
+        // needs the layout the hash was taken over.
+        if (const auto result = net::send_manifest(sock, image_manifest); FAILED(result))
+        {
+            return std::unexpected{ result };
+        }
+
+        if (clone)
+        {
+            if (const auto result = ::send_cloned_image(sock, image_manifest, *clone); FAILED(result))
+            {
+                return std::unexpected{ result };
+            }
+
+            return std::move(image_manifest);
+        }
+
+        // We only want to send the image itself
+        // (no sub/region info since we don't need it).
+        auto image_payload = vm::read_manifest_payload(image_manifest);
+        while (image_payload)
+        {
+            const auto buf = image_payload();
+            const auto result = net::send_frames(
+                sock,
+                net::codec::frame_type::image_bytes,
+                std::as_bytes(buf)
+            );
+            if (FAILED(result))
+            {
+                return std::unexpected{ result };
+            }
+
+            LOG_DEBUG() << "Sent 0x" << std::hex << buf.size()
+                << std::dec << " image bytes" << std::endl;
+        }
+
+        return std::move(image_manifest);
+    }
+
+    netfork::compress::codec to_chunk_codec(const netfork::compression_codec compression)
+    {
+        return compression == netfork::compression_codec::dense
+            ? netfork::compress::codec::dense
+            : netfork::compress::codec::fast;
+    }
+
+    // The whole shape of the address space goes first so the server can plan every
+    // allocation before any payload arrives.
+    HRESULT send_manifest(SOCKET sock, const netfork::net::address_space_manifest& manifest)
+    {
+        const auto result = netfork::net::send_manifest(sock, manifest);
+        if (SUCCEEDED(result))
+        {
+            LOG_DEBUG() << "Sent manifest of " << manifest.regions.size() << " regions and "
+                << manifest.subregions.size() << " subregions" << std::endl;
+        }
+
+        return result;
+    }
+
+    // Post-copy forks still serving pages, by socket.
+    std::mutex post_copy_mutex;
+    std::unordered_map<SOCKET, std::unique_ptr<netfork::post_copy::page_server>> post_copy_servers;
+
+    // Sends the manifest and the hot set of a post-copy fork, then leaves a `page_server`
+    // running for the rest. Everything is read from a clone taken up front, so the caller
+    // is free to carry on as soon as this returns.
+    HRESULT start_post_copy(SOCKET sock, const std::uint64_t stack_pointer, netfork::fork_stats& stats)
+    {
+        using namespace netfork;
+
+        auto clone = post_copy::va_clone::capture();
+        if (!clone)
+        {
+            LOG_DEBUG_ERR() << "Failed to clone the address space; error: " << clone.error() << std::endl;
+            return clone.error();
+        }
+
+        auto manifest = vm::capture_process_manifest(clone.value()->process());
+        if (const auto result = ::send_manifest(sock, manifest); FAILED(result))
+        {
+            return result;
+        }
+
+        // The child runs on this thread's stack straight away and the loader state hangs
+        // off the PEB, so those are sent before it starts.
+        const auto peb_address = reinterpret_cast<std::uint64_t>(::NtCurrentTeb()->ProcessEnvironmentBlock);
+        std::vector<bool> hot_regions(manifest.regions.size());
+        for (std::size_t i = 0; i < manifest.regions.size(); i++)
+        {
+            const auto& region = manifest.regions[i];
+            const auto contains = [&region](const std::uint64_t address)
+            {
+                return address >= region.base_address && address < region.end_address();
+            };
+            hot_regions[i] = contains(stack_pointer) || contains(peb_address);
+        }
+
+        auto server = std::make_unique<post_copy::page_server>(
+            sock,
+            std::move(clone).value(),
+            std::move(manifest),
+            std::move(hot_regions)
+        );
+        if (const auto result = server->send_hot_set(); FAILED(result))
+        {
+            return result;
+        }
+
+        stats.bytes_sent = server->bytes_sent();
+        LOG_DEBUG() << "Sent 0x" << std::hex << stats.bytes_sent << std::dec
+            << " hot bytes; serving the rest in the background" << std::endl;
+
+        server->start();
+        std::lock_guard lock{ post_copy_mutex };
+        post_copy_servers.insert_or_assign(sock, std::move(server));
+        return ERROR_SUCCESS;
+    }
+
+    // Replications in progress, by socket.
+    std::mutex replication_mutex;
+    std::unordered_map<SOCKET, std::unique_ptr<netfork::replication::replicator>> replicators;
+
+    // Tries the final stop-and-copy of a pre-copy fork this many times before giving up on
+    // an address space which keeps changing underneath it.
+    constexpr const unsigned int MAX_FINAL_STOP_ATTEMPTS = 4;
+
+    // Sends the manifest and every page while the other threads keep running, then resends
+    // whatever they dirty in rounds until `pre_copy::round_schedule` says to stop. Only the
+    // last round runs with them suspended. Without write watching every scan hashes every
+    // page, so the pause can't shrink below that however little is dirty.
+    HRESULT send_pre_copy(
+        SOCKET sock,
+        const netfork::net::address_space_manifest& image_manifest,
+        const netfork::fork_options& options,
+        netfork::fork_stats& stats)
+    {
+        using namespace netfork;
+        using clock = std::chrono::steady_clock;
+
+        pre_copy::dirty_tracker tracker{ sock };
+        if (const auto result = tracker.rebase(vm::capture_process_manifest()); FAILED(result))
+        {
+            return result;
+        }
+
+        // Globals live in the image and change like anything else.
+        tracker.track_image(image_manifest);
+
+        pre_copy::round_schedule schedule{ options.max_pause, options.max_pre_copy_rounds };
+        const auto send_round = [&]() -> HRESULT
+        {
+            const auto start = clock::now();
+            const auto sent = tracker.send_dirty();
+            if (!sent)
+            {
+                return sent.error();
+            }
+
+            schedule.record_round(sent.value(), clock::now() - start);
+            stats.pre_copy_rounds = schedule.rounds();
+            LOG_DEBUG() << "Pre-copy round " << stats.pre_copy_rounds << " sent 0x" << std::hex
+                << sent.value() << std::dec << " bytes" << std::endl;
+
+            // The other threads may have allocated or freed memory in the meantime.
+            return tracker.rebase(vm::capture_process_manifest());
+        };
+
+        if (const auto result = send_round(); FAILED(result))
+        {
+            return result;
+        }
+
+        while (schedule.rounds() < options.max_pre_copy_rounds)
+        {
+            const auto start = clock::now();
+            const auto dirty_bytes = tracker.count_dirty();
+            if (!dirty_bytes)
+            {
+                return dirty_bytes.error();
+            }
+
+            const std::chrono::duration<double> scan_time = clock::now() - start;
+            LOG_DEBUG() << "0x" << std::hex << dirty_bytes.value() << std::dec
+                << " bytes dirty; estimated pause " << schedule.estimate_pause(dirty_bytes.value(), scan_time).count()
+                << "us" << std::endl;
+
+            if (!schedule.another_round(dirty_bytes.value(), scan_time))
+            {
+                break;
+            }
+
+            if (const auto result = send_round(); FAILED(result))
+            {
+                return result;
+            }
+        }
+
+        std::vector<HANDLE> threads;
+        for (unsigned int attempt = 1;; attempt++)
+        {
+            pre_copy::thread_freezer::reserve(threads);
+
+            bool stable = false;
+            std::expected<std::uint64_t, HRESULT> sent{ 0 };
+            const auto start = clock::now();
+            {
+                pre_copy::thread_freezer freezer{ threads };
+                stable = freezer.is_complete() && tracker.matches_address_space();
+                if (stable)
+                {
+                    sent = tracker.send_dirty();
+                }
+            }
+
+            if (stable)
+            {
+                stats.pause = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - start);
+                if (!sent)
+                {
+                    return sent.error();
+                }
+
+                break;
+            }
+
+            if (attempt == MAX_FINAL_STOP_ATTEMPTS)
+            {
+                LOG_DEBUG_ERR() << "Address space kept changing; giving up on the final stop-and-copy." << std::endl;
+                return pre_copy::ADDRESS_SPACE_UNSTABLE;
+            }
+
+            LOG_DEBUG() << "Address space changed before the final stop-and-copy; going another round" << std::endl;
+            if (const auto result = send_round(); FAILED(result))
+            {
+                return result;
+            }
+        }
+
+        stats.bytes_sent = tracker.bytes_sent();
+        stats.bytes_resent = tracker.bytes_resent();
+        LOG_DEBUG() << "Pre-copy sent 0x" << std::hex << stats.bytes_sent << " bytes, 0x"
+            << stats.bytes_resent << std::dec << " of them again, in " << stats.pre_copy_rounds
+            << " rounds; paused for " << stats.pause.count() << "us" << std::endl;
+
+        return net::send_frames(sock, net::codec::frame_type::end_of_stream, {});
+    }
+
+    // How much of a striped payload may be encoded ahead of the connections sending it.
+    constexpr const std::size_t STRIPE_WINDOW_SIZE = 32 * 1024 * 1024;
+
+    // How many connections `fork` opens besides `nf_server_sock` to stripe the payload over,
+    // for a fork committing `committed_size` bytes.
+    std::size_t extra_stripes(const netfork::fork_options& options, const std::uint64_t committed_size)
+    {
+        using namespace netfork;
+
+        if (options.post_copy || options.pre_copy || options.deduplicate_pages || options.relay)
+        {
+            return 0;
+        }
+
+        constexpr std::size_t MAX_CONNECTIONS = net::msg::MAX_STRIPES + 1;
+        std::size_t connections = options.stripes;
+        if (connections == AUTO_STRIPES)
+        {
+            // Roughly one per 128 MiB, so a small fork doesn't wait on connections it
+            // barely uses, and no more than there are cores to send them.
+            constexpr std::uint64_t BYTES_PER_STRIPE = 128ull << 20;
+            connections = static_cast<std::size_t>(std::min<std::uint64_t>(
+                committed_size / BYTES_PER_STRIPE + 1,
+                default_worker_count()
+            ));
+        }
+
+        return std::clamp<std::size_t>(connections, 1, MAX_CONNECTIONS) - 1;
+    }
+
+    // Opens `count` more connections to the server `sock` is connected to and attaches each
+    // to the fork the server gave `token`.
+    std::expected<std::vector<SOCKET>, HRESULT> open_stripes(
+        SOCKET sock,
+        const std::uint64_t token,
+        const std::size_t count)
+    {
+        using namespace netfork;
+
+        std::vector<SOCKET> stripe_socks;
+        bool opened = false;
+        AT_SCOPE_EXIT(if (!opened) for (const SOCKET stripe_sock : stripe_socks) ::closesocket(stripe_sock));
+
+        for (std::size_t index = 0; index < count; index++)
+        {
+            const SOCKET stripe_sock = net::connect_to_peer(sock);
+            if (stripe_sock == INVALID_SOCKET)
+            {
+                return std::unexpected{ HRESULT_FROM_WIN32(::WSAGetLastError()) };
+            }
+
+            stripe_socks.push_back(stripe_sock);
+            const net::msg::stripe_attach attach{
+                .token = token,
+                .index = static_cast<std::uint8_t>(index)
+            };
+            if (const auto result = net::send_msg(stripe_sock, attach); FAILED(result))
+            {
+                return std::unexpected{ result };
+            }
+        }
+
+        opened = true;
+        return stripe_socks;
+    }
+
+    // Sends the payload of a plain fork over `sock` and `stripe_socks` at once. The payload is
+    // encoded once into a log, and every connection's sender takes the next chunk of it as
+    // soon as it has sent its last, so a faster connection carries more of them. Chunks hold
+    // whole frames and the server writes each page run wherever it arrives, so nothing has to
+    // be put back in order. Every stripe ends with an `end_of_stream` of its own; `sock`'s is
+    // left to the caller.
+    HRESULT send_striped_payload(
+        SOCKET sock,
+        std::span<const SOCKET> stripe_socks,
+        const netfork::net::address_space_manifest& manifest,
+        const netfork::fork_options& options,
+        netfork::fork_stats& stats,
+        netfork::vm::capture_stats& capture_stats)
+    {
+        using namespace netfork;
+
+        // Every connection reads the log as the same destination. Reading the payload waits
+        // while the log is full, so it goes no faster than the stripes drain it.
+        net::chunk_log log{ 1, STRIPE_WINDOW_SIZE };
+        std::atomic<HRESULT> failure = ERROR_SUCCESS;
+        const auto send_chunks = [&](SOCKET stripe_sock, const bool end_stream)
+        {
+            HRESULT result = ERROR_SUCCESS;
+            while (const auto chunk = log.next(0))
+            {
+                result = net::send_bytes(stripe_sock, std::span<const std::byte>{ *chunk });
+                if (FAILED(result))
+                {
+                    break;
+                }
+            }
+
+            if (SUCCEEDED(result) && end_stream)
+            {
+                result = net::send_frames(stripe_sock, net::codec::frame_type::end_of_stream, {});
+            }
+
+            if (FAILED(result))
+            {
+                // The fork is lost with any one stripe, so the log stops keeping chunks for
+                // any of them.
+                HRESULT no_failure = ERROR_SUCCESS;
+                failure.compare_exchange_strong(no_failure, result);
+                log.abandon(0);
+            }
+        };
+
+        std::vector<std::jthread> senders;
+        senders.reserve(stripe_socks.size() + 1);
+        senders.emplace_back(send_chunks, sock, false);
+        for (const SOCKET stripe_sock : stripe_socks)
+        {
+            senders.emplace_back(send_chunks, stripe_sock, true);
+        }
+
+        HRESULT result = ERROR_SUCCESS;
+        {
+            std::optional<compress::codec> method;
+            if (options.compression != compression_codec::none)
+            {
+                method = ::to_chunk_codec(options.compression);
+            }
+
+            fan_out::encoder encoder{
+                log,
+                method,
+                options.compression_threads != 0 ? options.compression_threads : default_worker_count()
+            };
+            const auto encode_run = [&](const net::page_run& run, std::span<const std::byte> pages) -> HRESULT
+            {
+                if (const HRESULT failed = failure.load(); FAILED(failed))
+                {
+                    return failed;
+                }
+
+                net::write_page_run(encoder.writer(), run, pages);
+                encoder.commit();
+                stats.bytes_sent += run.present_count() * net::MANIFEST_PAGE_SIZE;
+                return ERROR_SUCCESS;
+            };
+
+            auto payload = vm::read_resident_payload(manifest, capture_stats);
+            while (payload && SUCCEEDED(result))
+            {
+                const auto buf = payload();
+                result = ::for_each_nonzero_run(std::as_bytes(buf), stats, encode_run);
+            }
+
+            encoder.finish();
+        }
+
+        log.close();
+        // Joins every sender.
+        senders.clear();
+
+        if (const HRESULT failed = failure.load(); FAILED(failed))
+        {
+            return failed;
+        }
+
+        if (options.compression != compression_codec::none)
+        {
+            stats.compressed_bytes_sent = log.bytes();
+        }
+
+        LOG_DEBUG() << "Striped 0x" << std::hex << log.bytes() << std::dec << " payload bytes over "
+            << stripe_socks.size() + 1 << " connections" << std::endl;
+        return result;
+    }
+
+    // The main image as every server of `fork_many` may be sent it, read, hashed and encoded
+    // once on the calling thread so the senders only ever send bytes. Which of `overlay` and
+    // `full` a server gets depends on whether it has the image cached.
+    struct encoded_image
+    {
+        netfork::net::msg::image_info info;
+        // The image's writable pages as `page_data` frames, ending with `end_of_stream`.
+        std::vector<std::byte> overlay;
+        // The image's manifest followed by all of its bytes.
+        std::vector<std::byte> full;
     };
+
+    std::expected<encoded_image, HRESULT> encode_image()
+    {
+        using namespace netfork;
+
+        auto [image_manifest, image_info] = ::capture_image(nullptr);
+        encoded_image image{ .info = image_info };
+
+        net::codec::frame_writer overlay;
+        const auto result = ::for_each_overlay_run(image_manifest, nullptr,
+            [&](const net::page_run& run, std::span<const std::byte> pages) -> HRESULT
+            {
+                net::write_page_run(overlay, run, pages);
+                return ERROR_SUCCESS;
+            });
+        if (FAILED(result))
+        {
+            return std::unexpected{ result };
+        }
+
+        overlay.write_bytes(net::codec::frame_type::end_of_stream, {});
+        image.overlay = overlay.release();
+
+        net::codec::frame_writer full;
+        if (!net::write_manifest(full, image_manifest))
+        {
+            LOG_DEBUG_ERR() << "Image manifest is too large to send" << std::endl;
+            return std::unexpected{ net::MALFORMED_MANIFEST };
+        }
+
+        auto image_payload = vm::read_manifest_payload(image_manifest);
+        while (image_payload)
+        {
+            const auto buf = image_payload();
+            full.write_bytes_chunked(net::codec::frame_type::image_bytes, std::as_bytes(buf));
+        }
+
+        image.full = full.release();
+        LOG_DEBUG() << "Encoded 0x" << std::hex << image.full.size() << " image bytes and 0x"
+            << image.overlay.size() << std::dec << " overlay bytes once" << std::endl;
+        return image;
+    }
+
+    // `send_image` for an image already encoded.
+    HRESULT send_encoded_image(SOCKET sock, const encoded_image& image)
+    {
+        using namespace netfork;
+
+        if (const auto result = net::send_msg(sock, image.info); FAILED(result))
+        {
+            return result;
+        }
+
+        const auto cache_status = net::recv_msg<net::msg::image_cache_status>(sock);
+        if (!cache_status)
+        {
+            LOG_DEBUG_ERR() << "Failed to receive image cache status; error: "
+                << cache_status.error() << std::endl;
+            return cache_status.error();
+        }
+
+        return net::send_bytes(sock, std::span<const std::byte>{ cache_status->hit ? image.overlay : image.full });
+    }
+
+    // Forks to one server of `fork_many`: the handshake and image go to it alone, then the
+    // shared payload as fast as the server takes it. `encoded`, whether the whole payload
+    // made it into the log, is only read once the log is closed.
+    HRESULT send_to_destination(
+        SOCKET sock,
+        const CONTEXT& context,
+        netfork::net::msg::fork_mode mode,
+        const encoded_image& image,
+        netfork::net::chunk_log& log,
+        const std::size_t destination,
+        const HRESULT& encoded)
+    {
+        using namespace netfork;
+
+        // Nothing more is read for this server however it ends.
+        AT_SCOPE_EXIT(log.abandon(destination));
+
+        mode.rank = destination;
+        if (const auto result = ::send_process_info(sock, context, mode); FAILED(result))
+        {
+            return result;
+        }
+
+        if (const auto result = ::send_encoded_image(sock, image); FAILED(result))
+        {
+            return result;
+        }
+
+        while (const auto chunk = log.next(destination))
+        {
+            if (const auto result = net::send_bytes(sock, std::span<const std::byte>{ *chunk }); FAILED(result))
+            {
+                return result;
+            }
+        }
+
+        if (log.dropped(destination))
+        {
+            return fan_out::DESTINATION_TOO_SLOW;
+        }
+
+        // Without the rest of the payload the server never gets an `end_of_stream`, and so
+        // never starts a child.
+        if (FAILED(encoded))
+        {
+            return encoded;
+        }
+
+        return net::send_frames(sock, net::codec::frame_type::end_of_stream, {});
+    }
+
+    // Forks started by `fork_async` which haven't been waited for, by socket.
+    std::mutex async_fork_mutex;
+    std::unordered_map<SOCKET, std::unique_ptr<netfork::async_fork::job>> async_forks;
+
+    // Sends a fork of this process as `job`'s clone has it: the handshake with the PEB and
+    // TEB as the clone has them, the image, the manifest and every non-zero payload page.
+    // Residency isn't checked, as with post-copy; pages which were never touched read as
+    // zero from the clone and so stay off the wire anyway.
+    HRESULT send_from_clone(
+        netfork::async_fork::job& job,
+        const CONTEXT& context,
+        const std::uint64_t peb_address,
+        const std::uint64_t teb_address,
+        netfork::net::msg::fork_mode mode,
+        const netfork::fork_options& options,
+        netfork::fork_stats& stats)
+    {
+        using namespace netfork;
+
+        const SOCKET sock = job.socket();
+        const auto& clone = job.clone();
+
+        PEB peb{};
+        if (const auto result = clone.read(peb_address, std::as_writable_bytes(std::span{ &peb, 1 })); FAILED(result))
+        {
+            return result;
+        }
+
+        TEB teb{};
+        if (const auto result = clone.read(teb_address, std::as_writable_bytes(std::span{ &teb, 1 })); FAILED(result))
+        {
+            return result;
+        }
+
+        mode.committed_size = vm::committed_size(clone.process());
+        if (const auto result = ::send_process_info(sock, context, peb, teb, mode); FAILED(result))
+        {
+            return result;
+        }
+
+        if (const auto image_manifest = ::send_image(sock, &clone); !image_manifest)
+        {
+            return image_manifest.error();
+        }
+
+        const auto manifest = vm::capture_process_manifest(clone.process());
+        if (const auto result = ::send_manifest(sock, manifest); FAILED(result))
+        {
+            return result;
+        }
+
+        std::uint64_t payload_size = 0;
+        for (const auto& subregion : manifest.subregions)
+        {
+            if (net::msg::has_payload(subregion.protect) && !annotations::is_zeroed(subregion))
+            {
+                payload_size += subregion.region_size;
+            }
+        }
+
+        job.set_total(payload_size);
+
+        std::optional<net::compressing_sender> compressor;
+        if (options.compression != compression_codec::none)
+        {
+            compressor.emplace(
+                sock,
+                ::to_chunk_codec(options.compression),
+                options.compression_threads != 0 ? options.compression_threads : default_worker_count()
+            );
+        }
+
+        const auto send_run = [&](const net::page_run& run, std::span<const std::byte> pages)
+        {
+            HRESULT result;
+            if (compressor)
+            {
+                net::write_page_run(compressor->writer(), run, pages);
+                result = compressor->commit();
+            }
+            else
+            {
+                result = net::send_page_run(sock, run, pages);
+            }
+
+            if (SUCCEEDED(result))
+            {
+                stats.bytes_sent += run.present_count() * net::MANIFEST_PAGE_SIZE;
+            }
+
+            return result;
+        };
+
+        constexpr std::uint64_t buffer_size = net::MAX_PAGES_PER_FRAME * net::MANIFEST_PAGE_SIZE;
+
+        std::vector<std::byte> buffer;
+        for (const auto& subregion : manifest.subregions)
+        {
+            if (!net::msg::has_payload(subregion.protect) || annotations::is_zeroed(subregion))
+            {
+                continue;
+            }
+
+            for (std::uint64_t offset = 0; offset < subregion.region_size; offset += buffer_size)
+            {
+                if (job.cancelled())
+                {
+                    return async_fork::FORK_CANCELLED;
+                }
+
+                const std::uint64_t address = subregion.base_address + offset;
+                buffer.resize(std::min(buffer_size, subregion.region_size - offset));
+                if (const auto result = clone.read(address, buffer); FAILED(result))
+                {
+                    LOG_DEBUG_ERR() << "Failed to read clone at 0x" << std::hex << address << std::dec
+                        << "; error: " << result << std::endl;
+                    return result;
+                }
+
+                if (const auto result = ::for_each_nonzero_run(address, buffer, stats, send_run); FAILED(result))
+                {
+                    return result;
+                }
+
+                job.advance(buffer.size());
+            }
+        }
+
+        if (compressor)
+        {
+            if (const auto result = compressor->finish(); FAILED(result))
+            {
+                return result;
+            }
+
+            stats.compressed_bytes_sent = compressor->bytes_sent();
+        }
+
+        LOG_DEBUG() << "Sent 0x" << std::hex << stats.bytes_sent << std::dec << " bytes from the clone; skipped "
+            << stats.zero_pages_skipped << " zero pages" << std::endl;
+
+        return net::send_frames(sock, net::codec::frame_type::end_of_stream, {});
+    }
 }
 
 namespace netfork
 {
-    fork_context fork(_In_ SOCKET nf_server_sock, _In_opt_ PCONTEXT restore_context)
+    HRESULT annotate(_In_ const void* ptr, _In_ std::size_t size, _In_ region_policy policy)
+    {
+        const auto address = reinterpret_cast<std::uint64_t>(ptr);
+        if (size == 0 || address + size < address || std::to_underlying(policy) > std::to_underlying(region_policy::commit_zeroed))
+        {
+            return E_INVALIDARG;
+        }
+
+        // Only the pages entirely inside the range; the rest of a page it shares with other
+        // memory still has to reach the child.
+        const std::uint64_t base_address = (address + net::MANIFEST_PAGE_SIZE - 1) & ~(net::MANIFEST_PAGE_SIZE - 1);
+        const std::uint64_t end_address = (address + size) & ~(net::MANIFEST_PAGE_SIZE - 1);
+        if (base_address < end_address)
+        {
+            annotations::registry::instance().annotate(base_address, end_address, policy);
+        }
+
+        return ERROR_SUCCESS;
+    }
+
+    fork_context fork(
+        _In_ SOCKET nf_server_sock,
+        _In_opt_ PCONTEXT restore_context,
+        _Out_opt_ fork_stats* stats)
+    {
+        return fork(nf_server_sock, restore_context, fork_options{}, stats);
+    }
+
+    fork_context fork(
+        _In_ SOCKET nf_server_sock,
+        _In_opt_ PCONTEXT restore_context,
+        _In_ const fork_options& options,
+        _Out_opt_ fork_stats* stats)
     {
+        std::uint64_t stack_pointer = 0;
+        const std::uint64_t committed_size = vm::committed_size();
+        const std::size_t stripe_count = ::extra_stripes(options, committed_size);
+        std::uint64_t stripe_token = 0;
         {
             CONTEXT current_context{ .ContextFlags = CONTEXT_ALL };
             ::RtlCaptureContext(&current_context);
@@ -103,105 +1278,574 @@ namespace netfork
                 context_to_restore = restore_context;
             }
 
-            if (const auto result = net::send_as(nf_server_sock, *context_to_restore);
+            stack_pointer = context_to_restore->Rsp;
+            if (const auto result = ::send_process_info(
+                    nf_server_sock,
+                    *context_to_restore,
+                    net::msg::fork_mode{
+                        .post_copy = options.post_copy,
+                        .committed_size = committed_size,
+                        .priority = static_cast<std::uint8_t>(std::to_underlying(options.priority)),
+                        .snapshot = options.snapshot && !options.post_copy,
+                        .relay = options.relay && !options.post_copy,
+                        .stripes = static_cast<std::uint8_t>(stripe_count)
+                    },
+                    &stripe_token);
                 FAILED(result))
             {
-                LOG_DEBUG_ERR() << "send_as failed with error: " << result << std::endl;
+                LOG_DEBUG_ERR() << "Failed to send process information; error: " << result << std::endl;
                 return fork_context::error;
             }
         }
 
+        // The other connections are opened on a thread of their own while the image goes out
+        // over this one, so their handshakes overlap it. A server which doesn't stripe hands
+        // out no token. The opener is done with `stripe_socks` before they're closed, however
+        // the fork ends.
+        std::vector<SOCKET> stripe_socks;
+        HRESULT stripes_opened = ERROR_SUCCESS;
+        std::jthread opener;
+        AT_SCOPE_EXIT(
+            if (opener.joinable()) opener.join();
+            for (const SOCKET stripe_sock : stripe_socks) ::closesocket(stripe_sock));
+        if (stripe_token != 0)
         {
-            PEB peb{};
+            opener = std::jthread{ [&]
+            {
+                auto opened = ::open_stripes(nf_server_sock, stripe_token, stripe_count);
+                if (opened)
+                {
+                    stripe_socks = std::move(opened).value();
+                }
+                else
+                {
+                    stripes_opened = opened.error();
+                }
+            } };
+        }
+
+        fork_stats local_stats{};
+
+        const auto image_manifest = ::send_image(nf_server_sock);
+        if (!image_manifest)
+        {
+            LOG_DEBUG_ERR() << "Failed to send image; error: " << image_manifest.error() << std::endl;
+            return fork_context::error;
+        }
+
+        if (opener.joinable())
+        {
+            opener.join();
+        }
 
-            ::RtlAcquirePebLock();
-            std::memcpy(&peb, ::NtCurrentTeb()->ProcessEnvironmentBlock, sizeof(PEB));
-            ::RtlReleasePebLock();
+        if (FAILED(stripes_opened))
+        {
+            LOG_DEBUG_ERR() << "Failed to open stripes; error: " << stripes_opened << std::endl;
+            return fork_context::error;
+        }
 
-            if (const auto result = net::send_as(nf_server_sock, peb); FAILED(result))
+        if (options.post_copy)
+        {
+            if (const auto result = ::start_post_copy(nf_server_sock, stack_pointer, local_stats);
+                FAILED(result))
             {
-                LOG_DEBUG_ERR() << "send_as failed with error: " << result << std::endl;
+                LOG_DEBUG_ERR() << "Failed to start post-copy fork; error: " << result << std::endl;
                 return fork_context::error;
             }
+
+            if (stats)
+            {
+                *stats = local_stats;
+            }
+
+            return fork_context::parent;
         }
 
+        if (options.pre_copy)
         {
-            TEB teb{};
-            std::memcpy(&teb, ::NtCurrentTeb(), sizeof(TEB));
-
-            if (const auto result = net::send_as(nf_server_sock, teb); FAILED(result))
+            const auto result = ::send_pre_copy(nf_server_sock, image_manifest.value(), options, local_stats);
+            if (FAILED(result))
             {
-                LOG_DEBUG_ERR() << "send_as failed with error: " << result << std::endl;
+                LOG_DEBUG_ERR() << "Failed to send pre-copy fork; error: " << result << std::endl;
                 return fork_context::error;
             }
-        }
 
-        const auto [image_allocation_base, image_size] = get_image_info();
+            if (stats)
+            {
+                *stats = local_stats;
+            }
 
-        if (const auto result = net::send_as(nf_server_sock, image_size); FAILED(result))
-        {
-            LOG_DEBUG_ERR() << "send_as failed with error: " << result << std::endl;
-            return fork_context::error;
+            return fork_context::parent;
         }
 
         {
-            auto vm_image_results = vm::query_virtual_memory_if(
-                [image_allocation_base](const MEMORY_BASIC_INFORMATION& mbi)
+            const auto manifest = vm::capture_process_manifest();
+
+            if (const auto result = ::send_manifest(nf_server_sock, manifest); FAILED(result))
+            {
+                LOG_DEBUG_ERR() << "Failed to send manifest; error: "
+                    << result << std::endl;
+                return fork_context::error;
+            }
+
+            // With compression on, page runs are batched into chunks which a pool of workers
+            // compresses while the next regions are still being read. A striped payload is
+            // chunked by `send_striped_payload` instead.
+            std::optional<net::compressing_sender> compressor;
+            if (options.compression != compression_codec::none && stripe_socks.empty())
+            {
+                compressor.emplace(
+                    nf_server_sock,
+                    ::to_chunk_codec(options.compression),
+                    options.compression_threads != 0 ? options.compression_threads : default_worker_count()
+                );
+            }
+
+            const auto send_run = [&](const net::page_run& run, std::span<const std::byte> pages)
+            {
+                HRESULT result;
+                if (compressor)
                 {
-                    return mbi.Type == MEM_IMAGE
-                        && mbi.AllocationBase == image_allocation_base;
-                });
+                    net::write_page_run(compressor->writer(), run, pages);
+                    result = compressor->commit();
+                }
+                else
+                {
+                    result = net::send_page_run(nf_server_sock, run, pages);
+                }
+
+                if (SUCCEEDED(result))
+                {
+                    local_stats.bytes_sent += run.present_count() * net::MANIFEST_PAGE_SIZE;
+                }
+
+                return result;
+            };
 
-            while (vm_image_results)
+            vm::capture_stats capture_stats{};
+            if (!stripe_socks.empty())
             {
-                message_transporter encoder{ nf_server_sock };
+                const auto result = ::send_striped_payload(
+                    nf_server_sock,
+                    stripe_socks,
+                    manifest,
+                    options,
+                    local_stats,
+                    capture_stats
+                );
+                if (FAILED(result))
+                {
+                    LOG_DEBUG_ERR() << "Failed to send striped region data; error: "
+                        << result << std::endl;
+                    return fork_context::error;
+                }
+            }
+            else if (options.deduplicate_pages && !options.relay)
+            {
+                const auto result = ::send_deduplicated_pages(
+                    nf_server_sock,
+                    manifest,
+                    local_stats,
+                    capture_stats,
+                    send_run
+                );
+                if (FAILED(result))
+                {
+                    LOG_DEBUG_ERR() << "Failed to send deduplicated region data; error: "
+                        << result << std::endl;
+                    return fork_context::error;
+                }
 
-                const auto msg = vm_image_results();
-                // We only want to send the image itself
-                // (no sub/region info since we don't need it).
-                if (std::holds_alternative<std::span<char>>(msg))
+                LOG_DEBUG() << "Server already had 0x" << std::hex << local_stats.deduplicated_bytes
+                    << std::dec << " bytes" << std::endl;
+            }
+            else
+            {
+                auto payload = vm::read_resident_payload(manifest, capture_stats);
+                while (payload)
                 {
-                    const auto buf = std::get<std::span<char>>(msg);
-                    const auto result = encoder(buf);
+                    const auto buf = payload();
+                    const auto result = ::for_each_nonzero_run(std::as_bytes(buf), local_stats, send_run);
                     if (FAILED(result))
                     {
-                        LOG_DEBUG_ERR() << "Failed to send image bytes; error: "
+                        LOG_DEBUG_ERR() << "Failed to send region data; error: "
                             << result << std::endl;
                         return fork_context::error;
                     }
 
                     LOG_DEBUG() << "Sent 0x" << std::hex << buf.size()
-                        << std::dec << " image bytes" << std::endl;
+                        << std::dec << " bytes" << std::endl;
                 }
             }
-        }
-
-        {
-            auto vm_committed_results = vm::query_virtual_memory_if(
-                [](const MEMORY_BASIC_INFORMATION& mbi)
-                {
-                    return mbi.Type != MEM_IMAGE;
-                });
 
-            while (vm_committed_results)
+            if (compressor)
             {
-                const auto msg = vm_committed_results();
-                const auto result = std::visit(
-                    message_transporter{ nf_server_sock },
-                    msg
-                );
-                if (FAILED(result))
+                if (const auto result = compressor->finish(); FAILED(result))
                 {
-                    LOG_DEBUG_ERR() << "Failed to send region data; error: "
+                    LOG_DEBUG_ERR() << "Failed to send compressed region data; error: "
                         << result << std::endl;
                     return fork_context::error;
                 }
 
-                LOG_DEBUG() << "Sent 0x" << std::hex << sizeof(msg)
-                    << std::dec << " bytes" << std::endl;
+                local_stats.compressed_bytes_sent = compressor->bytes_sent();
+                LOG_DEBUG() << "Compressed 0x" << std::hex << local_stats.bytes_sent << " bytes to 0x"
+                    << local_stats.compressed_bytes_sent << std::dec << std::endl;
+            }
+
+            local_stats.demand_zero_bytes_avoided = capture_stats.demand_zero_bytes;
+            local_stats.paged_out_bytes_deferred = capture_stats.deferred_bytes;
+
+            LOG_DEBUG() << "Skipped " << local_stats.zero_pages_skipped << " zero pages" << std::endl;
+        }
+
+        // Tell the server there are no more regions so it doesn't have to infer the end of
+        // the stream from the connection closing.
+        if (const auto result = net::send_frames(
+                nf_server_sock,
+                net::codec::frame_type::end_of_stream,
+                {});
+            FAILED(result))
+        {
+            LOG_DEBUG_ERR() << "Failed to send end of stream; error: " << result << std::endl;
+            return fork_context::error;
+        }
+
+        if (stats)
+        {
+            *stats = local_stats;
+        }
+
+        return fork_context::parent;
+    }
+
+    fork_many_result fork_many(
+        _In_ std::span<const SOCKET> nf_server_socks,
+        _In_ const fork_options& options,
+        _Out_opt_ fork_stats* stats)
+    {
+        // Each server writes its child's rank here (see `fork_mode::rank_address`). Volatile
+        // so the child reads it back from memory rather than from a register.
+        volatile std::size_t rank = 0;
+        CONTEXT current_context{ .ContextFlags = CONTEXT_ALL };
+        ::RtlCaptureContext(&current_context);
+
+        if (current_context.Rax == std::to_underlying(fork_context::child))
+        {
+            return fork_many_result{ .context = fork_context::child, .rank = rank };
+        }
+
+        current_context.Rax = std::to_underlying(fork_context::child);
+
+        fork_many_result outcome{ .results = std::vector<HRESULT>(nf_server_socks.size(), E_FAIL) };
+        // Each of these needs exchanges with one server alone while the payload is sent.
+        if (options.post_copy || options.pre_copy || options.deduplicate_pages)
+        {
+            LOG_DEBUG_ERR() << "fork_many supports neither post-copy, pre-copy nor deduplication" << std::endl;
+            std::ranges::fill(outcome.results, E_INVALIDARG);
+            return outcome;
+        }
+
+        net::chunk_log log{ nf_server_socks.size(), fan_out::WINDOW_SIZE, fan_out::MAX_STALL };
+
+        // The manifest goes out as it is, like in `fork`; the server reads it before the
+        // payload stream. It's encoded before any server is contacted so that one too large
+        // to send fails the fork up front.
+        const auto manifest = vm::capture_process_manifest();
+        {
+            net::codec::frame_writer manifest_frames;
+            if (!net::write_manifest(manifest_frames, manifest))
+            {
+                LOG_DEBUG_ERR() << "Manifest is too large to send" << std::endl;
+                std::ranges::fill(outcome.results, net::MALFORMED_MANIFEST);
+                return outcome;
+            }
+
+            log.append(manifest_frames.release());
+        }
+
+        // Likewise the image, which would otherwise be read by every sender at once.
+        const auto image = ::encode_image();
+        if (!image)
+        {
+            std::ranges::fill(outcome.results, image.error());
+            return outcome;
+        }
+
+        const net::msg::fork_mode mode{
+            .committed_size = vm::committed_size(),
+            .priority = static_cast<std::uint8_t>(std::to_underlying(options.priority)),
+            .snapshot = options.snapshot,
+            .relay = options.relay,
+            .rank_address = reinterpret_cast<std::uint64_t>(&rank)
+        };
+        HRESULT encoded = ERROR_SUCCESS;
+        std::vector<std::jthread> senders;
+        senders.reserve(nf_server_socks.size());
+        for (std::size_t destination = 0; destination < nf_server_socks.size(); destination++)
+        {
+            senders.emplace_back([&, destination]
+            {
+                outcome.results[destination] = ::send_to_destination(
+                    nf_server_socks[destination],
+                    current_context,
+                    mode,
+                    image.value(),
+                    log,
+                    destination,
+                    encoded
+                );
+            });
+        }
+
+        fork_stats local_stats{};
+        {
+            std::optional<compress::codec> method;
+            if (options.compression != compression_codec::none)
+            {
+                method = ::to_chunk_codec(options.compression);
+            }
+
+            fan_out::encoder encoder{
+                log,
+                method,
+                options.compression_threads != 0 ? options.compression_threads : default_worker_count()
+            };
+            const auto encode_run = [&](const net::page_run& run, std::span<const std::byte> pages) -> HRESULT
+            {
+                net::write_page_run(encoder.writer(), run, pages);
+                encoder.commit();
+                local_stats.bytes_sent += run.present_count() * net::MANIFEST_PAGE_SIZE;
+                return ERROR_SUCCESS;
+            };
+
+            vm::capture_stats capture_stats{};
+            auto payload = vm::read_resident_payload(manifest, capture_stats);
+            while (payload && SUCCEEDED(encoded))
+            {
+                const auto buf = payload();
+                encoded = ::for_each_nonzero_run(std::as_bytes(buf), local_stats, encode_run);
+            }
+
+            encoder.finish();
+            local_stats.demand_zero_bytes_avoided = capture_stats.demand_zero_bytes;
+            local_stats.paged_out_bytes_deferred = capture_stats.deferred_bytes;
+        }
+
+        if (options.compression != compression_codec::none)
+        {
+            local_stats.compressed_bytes_sent = log.bytes();
+        }
+
+        log.close();
+
+        // Joins every sender.
+        senders.clear();
+
+        std::size_t forked = 0;
+        for (std::size_t destination = 0; destination < outcome.results.size(); destination++)
+        {
+            if (SUCCEEDED(outcome.results[destination]))
+            {
+                forked++;
+            }
+            else
+            {
+                LOG_DEBUG_ERR() << "Failed to fork to server " << destination << "; error: "
+                    << outcome.results[destination] << std::endl;
             }
         }
 
+        LOG_DEBUG() << "Encoded 0x" << std::hex << log.bytes() << std::dec << " payload bytes once and forked to "
+            << forked << " of " << nf_server_socks.size() << " servers" << std::endl;
+
+        outcome.context = forked != 0 ? fork_context::parent : fork_context::error;
+        if (stats)
+        {
+            *stats = local_stats;
+        }
+
+        return outcome;
+    }
+
+    fork_context fork_async(
+        _In_ SOCKET nf_server_sock,
+        _In_ const fork_options& options,
+        _In_opt_ fork_progress_callback on_progress)
+    {
+        CONTEXT current_context{ .ContextFlags = CONTEXT_ALL };
+        ::RtlCaptureContext(&current_context);
+
+        if (current_context.Rax == std::to_underlying(fork_context::child))
+        {
+            return fork_context::child;
+        }
+
+        current_context.Rax = std::to_underlying(fork_context::child);
+
+        // The child gets memory as it is at this point; nothing after it reaches the server.
+        const auto start = std::chrono::steady_clock::now();
+        auto clone = post_copy::va_clone::capture();
+        if (!clone)
+        {
+            LOG_DEBUG_ERR() << "Failed to clone the address space; error: " << clone.error() << std::endl;
+            return fork_context::error;
+        }
+
+        const auto clone_time = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start);
+        LOG_DEBUG() << "Cloned the address space in " << clone_time.count() << "us" << std::endl;
+
+        const auto peb_address = reinterpret_cast<std::uint64_t>(::NtCurrentTeb()->ProcessEnvironmentBlock);
+        const auto teb_address = reinterpret_cast<std::uint64_t>(::NtCurrentTeb());
+        const net::msg::fork_mode mode{
+            .priority = static_cast<std::uint8_t>(std::to_underlying(options.priority)),
+            .snapshot = options.snapshot,
+            .relay = options.relay
+        };
+
+        auto job = std::make_unique<async_fork::job>(nf_server_sock, std::move(clone).value(), std::move(on_progress));
+        job->start([=](async_fork::job& job, fork_stats& stats)
+        {
+            const auto result = ::send_from_clone(job, current_context, peb_address, teb_address, mode, options, stats);
+            if (FAILED(result))
+            {
+                LOG_DEBUG_ERR() << "Failed to send fork from the clone; error: " << result << std::endl;
+            }
+
+            return result;
+        });
+
+        std::lock_guard lock{ ::async_fork_mutex };
+        ::async_forks.insert_or_assign(nf_server_sock, std::move(job));
         return fork_context::parent;
     }
+
+    HRESULT wait_for_fork(_In_ SOCKET nf_server_sock, _Out_opt_ fork_stats* stats)
+    {
+        std::unique_ptr<async_fork::job> job;
+        {
+            std::lock_guard lock{ ::async_fork_mutex };
+            const auto it = ::async_forks.find(nf_server_sock);
+            if (it == ::async_forks.end())
+            {
+                return HRESULT_FROM_WIN32(ERROR_NOT_FOUND);
+            }
+
+            job = std::move(it->second);
+            ::async_forks.erase(it);
+        }
+
+        return job->wait(stats);
+    }
+
+    HRESULT cancel_fork(_In_ SOCKET nf_server_sock)
+    {
+        std::lock_guard lock{ ::async_fork_mutex };
+        const auto it = ::async_forks.find(nf_server_sock);
+        if (it == ::async_forks.end())
+        {
+            return HRESULT_FROM_WIN32(ERROR_NOT_FOUND);
+        }
+
+        it->second->cancel();
+        return ERROR_SUCCESS;
+    }
+
+    HRESULT wait_for_post_copy(_In_ SOCKET nf_server_sock)
+    {
+        std::unique_ptr<post_copy::page_server> server;
+        {
+            std::lock_guard lock{ ::post_copy_mutex };
+            const auto it = ::post_copy_servers.find(nf_server_sock);
+            if (it == ::post_copy_servers.end())
+            {
+                return ERROR_SUCCESS;
+            }
+
+            server = std::move(it->second);
+            ::post_copy_servers.erase(it);
+        }
+
+        return server->wait();
+    }
+
+    HRESULT start_replication(_In_ SOCKET nf_server_sock, _In_ const replication_options& options)
+    {
+        HANDLE thread = nullptr;
+        if (!::DuplicateHandle(
+            ::GetCurrentProcess(),
+            ::GetCurrentThread(),
+            ::GetCurrentProcess(),
+            &thread,
+            0,
+            FALSE,
+            DUPLICATE_SAME_ACCESS))
+        {
+            return HRESULT_FROM_WIN32(::GetLastError());
+        }
+
+        auto session = std::make_unique<replication::replicator>(nf_server_sock, unique_handle<>{ thread }, options.interval);
+
+        // The server only uses this if no epoch is ever committed, in which case it never
+        // starts the standby anyway. A standby keeps its memory for as long as replication
+        // runs, so it queues behind interactive forks.
+        CONTEXT current_context{ .ContextFlags = CONTEXT_ALL };
+        ::RtlCaptureContext(&current_context);
+        if (const auto result = ::send_process_info(
+                nf_server_sock,
+                current_context,
+                net::msg::fork_mode{
+                    .replicate = true,
+                    .committed_size = vm::committed_size(),
+                    .priority = std::to_underlying(net::msg::fork_priority::bulk)
+                });
+            FAILED(result))
+        {
+            LOG_DEBUG_ERR() << "Failed to send process information; error: " << result << std::endl;
+            return result;
+        }
+
+        const auto image_manifest = ::send_image(nf_server_sock);
+        if (!image_manifest)
+        {
+            LOG_DEBUG_ERR() << "Failed to send image; error: " << image_manifest.error() << std::endl;
+            return image_manifest.error();
+        }
+
+        session->start(image_manifest.value());
+        std::lock_guard lock{ ::replication_mutex };
+        ::replicators.insert_or_assign(nf_server_sock, std::move(session));
+        return ERROR_SUCCESS;
+    }
+
+    HRESULT get_replication_stats(_In_ SOCKET nf_server_sock, _Out_ replication_stats* stats)
+    {
+        std::lock_guard lock{ ::replication_mutex };
+        const auto it = ::replicators.find(nf_server_sock);
+        if (it == ::replicators.end())
+        {
+            return HRESULT_FROM_WIN32(ERROR_NOT_FOUND);
+        }
+
+        *stats = it->second->stats();
+        return ERROR_SUCCESS;
+    }
+
+    HRESULT stop_replication(_In_ SOCKET nf_server_sock)
+    {
+        std::unique_ptr<replication::replicator> session;
+        {
+            std::lock_guard lock{ ::replication_mutex };
+            const auto it = ::replicators.find(nf_server_sock);
+            if (it == ::replicators.end())
+            {
+                return HRESULT_FROM_WIN32(ERROR_NOT_FOUND);
+            }
+
+            session = std::move(it->second);
+            ::replicators.erase(it);
+        }
+
+        return session->stop();
+    }
 }
@@ -17,6 +17,13 @@
 
 #pragma once
 
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <span>
+#include <vector>
+
 #include <winsock2.h>
 #include <netfork-shared/phnt_stub.hpp>
 
@@ -27,5 +34,231 @@ namespace netfork
 		error = 0, parent, child
 	};
 
-	fork_context fork(_In_ SOCKET nf_server_sock, _In_opt_ PCONTEXT restore_context);
+	struct fork_stats
+	{
+		// Bytes of private memory put on the wire (excluding framing).
+		std::uint64_t bytes_sent = 0;
+		// Pages left out of the stream because they were entirely zero.
+		std::uint64_t zero_pages_skipped = 0;
+		// Bytes never read because the pages had never been touched.
+		std::uint64_t demand_zero_bytes_avoided = 0;
+		// Bytes of paged out memory which were streamed after everything resident.
+		std::uint64_t paged_out_bytes_deferred = 0;
+		// Bytes the region data took on the wire after compression, including framing.
+		// Zero when compression is off.
+		std::uint64_t compressed_bytes_sent = 0;
+		// Bytes the server already had in its page store and so weren't sent.
+		std::uint64_t deduplicated_bytes = 0;
+		// Pre-copy only: rounds sent while the other threads kept running, not counting
+		// the final stop-and-copy.
+		unsigned int pre_copy_rounds = 0;
+		// Pre-copy only: bytes sent again because they changed after they first went out.
+		// Included in `bytes_sent`.
+		std::uint64_t bytes_resent = 0;
+		// Pre-copy only: how long the other threads were actually suspended for.
+		std::chrono::microseconds pause{};
+	};
+
+	enum class compression_codec
+	{
+		// Region data goes out as it is.
+		none = 0,
+		// Cheap enough to keep up with a gigabit link on a few cores.
+		fast,
+		// Smaller output for roughly twice the CPU of `fast`.
+		dense
+	};
+
+	enum class fork_priority
+	{
+		// Small forks which should start as soon as possible. The server lets them ahead of
+		// bulk forks waiting for memory.
+		interactive = 0,
+		// Large forks which may wait for memory on a busy server.
+		bulk
+	};
+
+	// For `fork_options::stripes`: as many connections as the fork is worth.
+	constexpr const unsigned int AUTO_STRIPES = 0xFFFFFFFF;
+
+	struct fork_options
+	{
+		compression_codec compression = compression_codec::none;
+		// Threads compressing region data; 0 uses one per core.
+		unsigned int compression_threads = 0;
+		// Send a hash of every page first and then only the pages the server's page store
+		// doesn't have. Costs a round trip and a hash per page; pays off when the same
+		// program is forked to the same servers again and again.
+		bool deduplicate_pages = false;
+		// Post-copy fork: send only the stack, PEB and TEB before the child starts, and
+		// serve every other page from a copy-on-write clone of this process, either when
+		// the child touches it or as the rest is pushed in the background. `fork` returns
+		// as soon as the child can start; `nf_server_sock` must then stay open until
+		// `wait_for_post_copy` returns. Compression and deduplication don't apply.
+		bool post_copy = false;
+		// Pre-copy fork: send every page while the other threads keep running, then keep
+		// resending the pages they dirty in rounds until what's left can be sent within
+		// `max_pause`. Only then are they suspended for a final stop-and-copy. Gives up
+		// shrinking after `max_pre_copy_rounds` or once a round stops helping, so a busy
+		// process can still pause for longer. Ignored with `post_copy`; compression and
+		// deduplication don't apply.
+		bool pre_copy = false;
+		std::chrono::microseconds max_pause = std::chrono::milliseconds{ 10 };
+		unsigned int max_pre_copy_rounds = 8;
+		// How the server schedules the fork against others waiting for memory. A fork the
+		// server can't fit within its memory budget fails.
+		fork_priority priority = fork_priority::interactive;
+		// Have the server keep a snapshot of the child as it was about to start, so more
+		// children can be spawned from it on the server later with `netfork-server spawn`.
+		// Ignored with `post_copy`.
+		bool snapshot = false;
+		// Have the server pass the fork on to the servers it's configured to relay to while it
+		// receives it, and those to theirs, so one upload reaches a whole tree of servers.
+		// Ignored with `post_copy`; turns `deduplicate_pages` off, since each server would
+		// have different pages missing.
+		bool relay = false;
+		// How many connections to the server to send the payload over at once, counting
+		// `nf_server_sock`: the others are opened to the same address for the fork and
+		// closed again once it's sent, and each takes the next part of the payload as soon as
+		// it's done with its last, so faster connections carry more. 0 or 1 sends over
+		// `nf_server_sock` alone; `AUTO_STRIPES` picks a count from how much memory is
+		// committed and how many cores there are. At most 16. Only `fork` stripes, and not
+		// with `post_copy`, `pre_copy`, `deduplicate_pages` or `relay`.
+		unsigned int stripes = 0;
+	};
+
+	enum class region_policy
+	{
+		// Sent like any other memory.
+		send = 0,
+		// Left out of the child entirely. Only whole allocations can be; the covered part of
+		// an allocation which isn't covered in full is reserved only.
+		skip,
+		// Reserved at the same address in the child, but nothing is committed there.
+		reserve_only,
+		// Committed in the child with the same protection, but left zero.
+		commit_zeroed
+	};
+
+	struct fork_many_result
+	{
+		fork_context context = fork_context::error;
+		// Child only: the index in `nf_server_socks` of the server it was forked to.
+		std::size_t rank = 0;
+		// Parent only: how the fork went on each server, in the order of `nf_server_socks`.
+		std::vector<HRESULT> results;
+	};
+
+	struct fork_progress
+	{
+		// Bytes of memory `fork_async` has got through so far, out of `bytes_total`. Zero
+		// pages count once they've been read, although they never go on the wire.
+		std::uint64_t bytes_done = 0;
+		std::uint64_t bytes_total = 0;
+	};
+
+	using fork_progress_callback = std::function<void(const fork_progress&)>;
+
+	struct replication_options
+	{
+		// How often an epoch is captured and shipped; roughly the worst the standby can
+		// fall behind by.
+		std::chrono::milliseconds interval = std::chrono::milliseconds{ 200 };
+	};
+
+	struct replication_stats
+	{
+		// Epochs the server has committed to the standby.
+		std::uint64_t epochs = 0;
+		// Epochs given up on because the address space kept changing while it was being
+		// captured. Their pages go out with the next epoch.
+		std::uint64_t skipped_epochs = 0;
+		// Bytes of memory put on the wire since replication started (excluding framing).
+		std::uint64_t bytes_sent = 0;
+		// Bytes the last committed epoch took.
+		std::uint64_t last_epoch_bytes = 0;
+		// `bytes_sent` over the time replication has been running.
+		double bytes_per_second = 0.0;
+		// How far behind the standby is: the time since the state it holds was captured.
+		std::chrono::microseconds lag{};
+		// How long the other threads were suspended to capture the last committed epoch.
+		std::chrono::microseconds last_pause{};
+	};
+
+	// Tells every fork from now on what to do with the memory in `[ptr, ptr + size)`, such as
+	// caches and scratch buffers the child has no use for; they then cost a manifest entry at
+	// most, however large. Only whole pages are annotated. A later annotation overrides an
+	// earlier one where they overlap, and `region_policy::send` clears them. Images are always
+	// sent as they are.
+	HRESULT annotate(_In_ const void* ptr, _In_ std::size_t size, _In_ region_policy policy);
+
+	fork_context fork(
+		_In_ SOCKET nf_server_sock,
+		_In_opt_ PCONTEXT restore_context,
+		_Out_opt_ fork_stats* stats = nullptr
+	);
+
+	fork_context fork(
+		_In_ SOCKET nf_server_sock,
+		_In_opt_ PCONTEXT restore_context,
+		_In_ const fork_options& options,
+		_Out_opt_ fork_stats* stats = nullptr
+	);
+
+	// Forks to every server in `nf_server_socks` at once. The image and address space are read
+	// and encoded once and the same chunks are streamed to every server from a thread per
+	// server, so a slow server only falls behind on its own, by up to 64 MiB. Reading waits
+	// for a server that far behind, and gives up on it with `fan_out::DESTINATION_TOO_SLOW`
+	// if it takes nothing for 10 seconds. Each child learns its rank from the result; the
+	// parent gets `parent` if at least one fork went through, and the outcome of each in
+	// `results`. Post-copy, pre-copy and deduplication fail every fork with `E_INVALIDARG`.
+	// `stats` describes the one encoded payload.
+	fork_many_result fork_many(
+		_In_ std::span<const SOCKET> nf_server_socks,
+		_In_ const fork_options& options,
+		_Out_opt_ fork_stats* stats = nullptr
+	);
+
+	// Forks without holding up the calling thread for the transfer. A copy-on-write clone of
+	// the address space is taken, which costs about as much as copying the page tables, and
+	// `parent` is returned as soon as it exists; everything is then sent from the clone on a
+	// thread of its own, so the child sees memory as it was when `fork_async` was called
+	// whatever the parent does meanwhile. `on_progress` is called on that thread as memory
+	// is read. `nf_server_sock` belongs to the fork until `wait_for_fork` returns, and
+	// `parent` only means the clone was taken; the outcome comes from `wait_for_fork`.
+	// Post-copy, pre-copy and deduplication don't apply and are ignored.
+	fork_context fork_async(
+		_In_ SOCKET nf_server_sock,
+		_In_ const fork_options& options,
+		_In_opt_ fork_progress_callback on_progress = nullptr
+	);
+
+	// Blocks until the fork `fork_async` started on `nf_server_sock` has been sent, and
+	// returns how it went. `stats` describes what was sent.
+	HRESULT wait_for_fork(_In_ SOCKET nf_server_sock, _Out_opt_ fork_stats* stats = nullptr);
+
+	// Gives up on the fork `fork_async` started on `nf_server_sock`. Shuts the socket down, so
+	// the server discards the fork; `wait_for_fork` must still be called and then returns
+	// that the fork was cancelled, unless it had already been sent.
+	HRESULT cancel_fork(_In_ SOCKET nf_server_sock);
+
+	// Blocks until the child of a post-copy fork on `nf_server_sock` has every page, and
+	// returns whether all of them were served. Returns immediately if there's no
+	// post-copy fork in progress on the socket.
+	HRESULT wait_for_post_copy(_In_ SOCKET nf_server_sock);
+
+	// Keeps a standby copy of this process on the server behind `nf_server_sock`, nearly
+	// current, for failover. Every `interval` the pages dirtied since the last epoch are
+	// sent, then the other threads are briefly suspended to send what changed meanwhile
+	// along with the calling thread's context. If the connection drops without
+	// `stop_replication`, the server starts the last committed epoch with the calling
+	// thread resuming wherever that epoch caught it. Only the calling thread is replicated,
+	// as with `fork`.
+	HRESULT start_replication(_In_ SOCKET nf_server_sock, _In_ const replication_options& options);
+
+	HRESULT get_replication_stats(_In_ SOCKET nf_server_sock, _Out_ replication_stats* stats);
+
+	// Stops replicating and tells the server the standby isn't needed. Returns the first
+	// error replication ran into, if any.
+	HRESULT stop_replication(_In_ SOCKET nf_server_sock);
 }
@@ -0,0 +1,350 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <processsnapshot.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <expected>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "vm.hpp"
+
+#include <netfork-shared/log.hpp>
+#include <netfork-shared/net/manifest.hpp>
+#include <netfork-shared/net/msg.hpp>
+#include <netfork-shared/net/page_data.hpp>
+#include <netfork-shared/net/sock.hpp>
+#include <netfork-shared/phnt_stub.hpp>
+#include <netfork-shared/post_copy.hpp>
+#include <netfork-shared/zero_page.hpp>
+
+namespace netfork::post_copy
+{
+    // A copy-on-write clone of this process's address space (`PSS_CAPTURE_VA_CLONE`).
+    // Reads see memory as it was when the clone was taken, whatever this process has done
+    // since, so pages can be served long after `fork` has returned.
+    class va_clone
+    {
+        HPSS snapshot_;
+        HANDLE process_;
+
+        va_clone(HPSS snapshot, HANDLE process)
+            : snapshot_{ snapshot }
+            , process_{ process }
+        {
+        }
+
+    public:
+        va_clone(const va_clone&) = delete;
+        va_clone& operator=(const va_clone&) = delete;
+
+        ~va_clone()
+        {
+            // Also terminates the clone.
+            ::PssFreeSnapshot(::GetCurrentProcess(), snapshot_);
+        }
+
+        static std::expected<std::unique_ptr<va_clone>, HRESULT> capture()
+        {
+            HPSS snapshot = nullptr;
+            if (const DWORD error = ::PssCaptureSnapshot(::GetCurrentProcess(), PSS_CAPTURE_VA_CLONE, 0, &snapshot);
+                error != ERROR_SUCCESS)
+            {
+                return std::unexpected{ HRESULT_FROM_WIN32(error) };
+            }
+
+            PSS_VA_CLONE_INFORMATION clone_info{};
+            if (const DWORD error = ::PssQuerySnapshot(
+                    snapshot,
+                    PSS_QUERY_VA_CLONE_INFORMATION,
+                    &clone_info,
+                    sizeof(clone_info));
+                error != ERROR_SUCCESS)
+            {
+                ::PssFreeSnapshot(::GetCurrentProcess(), snapshot);
+                return std::unexpected{ HRESULT_FROM_WIN32(error) };
+            }
+
+            return std::unique_ptr<va_clone>{ new va_clone{ snapshot, clone_info.VaCloneHandle } };
+        }
+
+        HANDLE process() const noexcept
+        {
+            return process_;
+        }
+
+        HRESULT read(const std::uint64_t address, std::span<std::byte> out) const
+        {
+            SIZE_T bytes_read = 0;
+            if (!::ReadProcessMemory(process_, reinterpret_cast<LPCVOID>(address), out.data(), out.size(), &bytes_read)
+                || bytes_read != out.size())
+            {
+                return HRESULT_FROM_WIN32(::GetLastError());
+            }
+
+            return ERROR_SUCCESS;
+        }
+    };
+
+    // Serves the pages of a post-copy fork from a `va_clone`. The hot regions go out first,
+    // before the child starts. Afterwards one thread answers the server's `page_request`s
+    // while another pushes every other page, so the child only waits on pages it touches
+    // before the push gets to them.
+    class page_server
+    {
+        SOCKET sock_;
+        std::unique_ptr<va_clone> clone_;
+        net::address_space_manifest manifest_;
+        // Indexed like `manifest_.regions`.
+        std::vector<bool> hot_regions_;
+
+        std::mutex send_mutex_;
+        std::atomic<HRESULT> result_ = ERROR_SUCCESS;
+        std::atomic<std::uint64_t> bytes_sent_ = 0;
+        std::atomic<std::uint64_t> pages_requested_ = 0;
+        std::jthread responder_;
+        std::jthread pusher_;
+
+        void fail(const HRESULT result)
+        {
+            HRESULT expected = ERROR_SUCCESS;
+            if (result_.compare_exchange_strong(expected, result))
+            {
+                // Unblocks whichever thread is still waiting on the socket.
+                ::shutdown(sock_, SD_BOTH);
+            }
+        }
+
+        // Reads a run of pages from the clone and sends it as one `page_data` frame, leaving
+        // out zero pages. An entirely zero run is only sent if `send_empty` is set. A run
+        // annotated to be left zero isn't read at all and goes out as zero pages.
+        HRESULT send_pages(
+            const std::uint64_t address,
+            const std::uint32_t page_count,
+            std::vector<std::byte>& buffer,
+            const bool send_empty)
+        {
+            net::page_run run{ .address = address, .page_count = page_count };
+            if (annotations::registry::instance().policy_of(address) != region_policy::commit_zeroed)
+            {
+                buffer.resize(page_count * net::MANIFEST_PAGE_SIZE);
+                if (const auto result = clone_->read(address, buffer); FAILED(result))
+                {
+                    LOG_DEBUG_ERR() << "Failed to read clone at 0x" << std::hex << address << std::dec
+                        << "; error: " << result << std::endl;
+                    return result;
+                }
+
+                for (std::uint32_t page = 0; page < page_count; page++)
+                {
+                    if (!simd::is_zero_page(buffer.data() + page * net::MANIFEST_PAGE_SIZE))
+                    {
+                        run.set_present(page);
+                    }
+                }
+            }
+
+            if (run.present_count() == 0 && !send_empty)
+            {
+                return ERROR_SUCCESS;
+            }
+
+            std::lock_guard lock{ send_mutex_ };
+            const auto result = net::send_page_run(sock_, run, buffer);
+            if (SUCCEEDED(result))
+            {
+                bytes_sent_ += run.present_count() * net::MANIFEST_PAGE_SIZE;
+            }
+
+            return result;
+        }
+
+        // Sends every payload page of the regions for which `hot_regions_[i] == hot`.
+        //
+        // Residency can't be used to skip untouched pages here: the clone's own working set
+        // says nothing about them, and this process's may have changed since the clone was
+        // taken. Untouched pages read as zero and so still stay off the wire.
+        HRESULT send_regions(const bool hot)
+        {
+            std::vector<std::byte> buffer;
+            for (std::size_t i = 0; i < manifest_.regions.size(); i++)
+            {
+                if (hot_regions_[i] != hot)
+                {
+                    continue;
+                }
+
+                for (const auto& subregion : manifest_.subregions_of(manifest_.regions[i]))
+                {
+                    // The child's fresh commit is already what these are annotated to be.
+                    if (!net::msg::has_payload(subregion.protect) || annotations::is_zeroed(subregion))
+                    {
+                        continue;
+                    }
+
+                    const std::uint64_t page_count = subregion.region_size / net::MANIFEST_PAGE_SIZE;
+                    for (std::uint64_t first = 0; first < page_count; first += net::MAX_PAGES_PER_FRAME)
+                    {
+                        const auto result = send_pages(
+                            subregion.base_address + first * net::MANIFEST_PAGE_SIZE,
+                            static_cast<std::uint32_t>(std::min<std::uint64_t>(net::MAX_PAGES_PER_FRAME, page_count - first)),
+                            buffer,
+                            false
+                        );
+                        if (FAILED(result))
+                        {
+                            return result;
+                        }
+                    }
+                }
+            }
+
+            return ERROR_SUCCESS;
+        }
+
+        // Answers `page_request`s until the server sends `end_of_stream`.
+        void respond()
+        {
+            std::vector<std::byte> buffer;
+            while (true)
+            {
+                const auto header = net::recv_header(sock_);
+                if (!header)
+                {
+                    fail(header.error());
+                    return;
+                }
+
+                if (header->type == net::codec::frame_type::end_of_stream)
+                {
+                    return;
+                }
+
+                if (header->type != net::codec::frame_type::page_request)
+                {
+                    LOG_DEBUG() << "Skipping unexpected frame of type "
+                        << std::to_underlying(header->type) << std::endl;
+                    if (const auto result = net::skip_frame(sock_, header.value()); FAILED(result))
+                    {
+                        fail(result);
+                        return;
+                    }
+
+                    continue;
+                }
+
+                const auto request = net::recv_body<net::msg::page_request>(sock_, header.value());
+                if (!request
+                    || !is_valid_request(manifest_, { request->address, request->page_count }, net::msg::has_payload))
+                {
+                    LOG_DEBUG_ERR() << "Malformed page request." << std::endl;
+                    fail(request ? net::UNEXPECTED_FRAME : request.error());
+                    return;
+                }
+
+                pages_requested_ += request->page_count;
+                if (const auto result = send_pages(request->address, request->page_count, buffer, true);
+                    FAILED(result))
+                {
+                    fail(result);
+                    return;
+                }
+            }
+        }
+
+        void push()
+        {
+            HRESULT result = send_regions(false);
+            if (SUCCEEDED(result))
+            {
+                std::lock_guard lock{ send_mutex_ };
+                result = net::send_frames(sock_, net::codec::frame_type::end_of_stream, {});
+            }
+
+            if (FAILED(result))
+            {
+                fail(result);
+            }
+        }
+
+    public:
+        page_server(
+            SOCKET sock,
+            std::unique_ptr<va_clone> clone,
+            net::address_space_manifest manifest,
+            std::vector<bool> hot_regions)
+            : sock_{ sock }
+            , clone_{ std::move(clone) }
+            , manifest_{ std::move(manifest) }
+            , hot_regions_{ std::move(hot_regions) }
+        {
+        }
+
+        page_server(const page_server&) = delete;
+        page_server& operator=(const page_server&) = delete;
+
+        // Sends the hot regions followed by `end_of_stream`. Must be called before `start`.
+        HRESULT send_hot_set()
+        {
+            if (const auto result = send_regions(true); FAILED(result))
+            {
+                return result;
+            }
+
+            return net::send_frames(sock_, net::codec::frame_type::end_of_stream, {});
+        }
+
+        void start()
+        {
+            responder_ = std::jthread{ [this] { respond(); } };
+            pusher_ = std::jthread{ [this] { push(); } };
+        }
+
+        // Waits until the server has every page.
+        HRESULT wait()
+        {
+            if (pusher_.joinable())
+            {
+                pusher_.join();
+            }
+
+            if (responder_.joinable())
+            {
+                responder_.join();
+            }
+
+            LOG_DEBUG() << "Post-copy sent 0x" << std::hex << bytes_sent_ << std::dec << " bytes; "
+                << pages_requested_ << " pages were requested on demand" << std::endl;
+            return result_;
+        }
+
+        std::uint64_t bytes_sent() const noexcept
+        {
+            return bytes_sent_;
+        }
+    };
+}
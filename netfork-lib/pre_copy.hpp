@@ -0,0 +1,597 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <psapi.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <expected>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include "dirty_pages.hpp"
+#include "vm.hpp"
+
+#include <netfork-shared/net/manifest.hpp>
+#include <netfork-shared/net/msg.hpp>
+#include <netfork-shared/net/page_data.hpp>
+#include <netfork-shared/net/sock.hpp>
+#include <netfork-shared/page_hash.hpp>
+#include <netfork-shared/phnt_stub.hpp>
+
+namespace netfork::pre_copy
+{
+    // The address space kept changing under every attempt at the final stop-and-copy.
+    constexpr const HRESULT ADDRESS_SPACE_UNSTABLE = 0xA0000005;
+
+    // Suspends every other thread of this process for as long as it lives.
+    //
+    // Nothing here allocates: a suspended thread may well be holding the heap lock. The
+    // handles go into `threads`, whose capacity must be set up front with `reserve`; if
+    // more threads turn up than fit, the freeze is left incomplete.
+    class thread_freezer
+    {
+        std::vector<HANDLE>& threads_;
+        bool complete_ = true;
+
+    public:
+        explicit thread_freezer(std::vector<HANDLE>& threads)
+            : threads_{ threads }
+        {
+            const DWORD current_thread_id = ::GetCurrentThreadId();
+
+            HANDLE cursor = nullptr;
+            bool owns_cursor = false;
+            HANDLE thread = nullptr;
+            while (NT_SUCCESS(::NtGetNextThread(
+                ::GetCurrentProcess(),
+                cursor,
+                THREAD_SUSPEND_RESUME | THREAD_GET_CONTEXT | THREAD_QUERY_LIMITED_INFORMATION,
+                0,
+                0,
+                &thread)))
+            {
+                if (owns_cursor)
+                {
+                    ::CloseHandle(cursor);
+                }
+
+                cursor = thread;
+                owns_cursor = true;
+                if (::GetThreadId(thread) == current_thread_id)
+                {
+                    continue;
+                }
+
+                if (threads_.size() == threads_.capacity())
+                {
+                    complete_ = false;
+                    break;
+                }
+
+                // Fails for a thread which is already exiting; it can be left alone.
+                if (::SuspendThread(thread) == static_cast<DWORD>(-1))
+                {
+                    continue;
+                }
+
+                // Suspension is asynchronous. Asking for the context waits until the
+                // thread has really stopped.
+                CONTEXT context{ .ContextFlags = CONTEXT_INTEGER };
+                ::GetThreadContext(thread, &context);
+
+                threads_.push_back(thread);
+                owns_cursor = false;
+            }
+
+            if (owns_cursor)
+            {
+                ::CloseHandle(cursor);
+            }
+        }
+
+        thread_freezer(const thread_freezer&) = delete;
+        thread_freezer& operator=(const thread_freezer&) = delete;
+
+        ~thread_freezer()
+        {
+            for (const HANDLE thread : threads_)
+            {
+                ::ResumeThread(thread);
+                ::CloseHandle(thread);
+            }
+
+            threads_.clear();
+        }
+
+        bool is_complete() const noexcept
+        {
+            return complete_;
+        }
+
+        // Makes room in `threads` for every thread running now, with some to spare for
+        // any started before the freeze.
+        static void reserve(std::vector<HANDLE>& threads)
+        {
+            std::size_t thread_count = 0;
+            HANDLE cursor = nullptr;
+            HANDLE thread = nullptr;
+            while (NT_SUCCESS(::NtGetNextThread(
+                ::GetCurrentProcess(),
+                cursor,
+                THREAD_QUERY_LIMITED_INFORMATION,
+                0,
+                0,
+                &thread)))
+            {
+                if (cursor)
+                {
+                    ::CloseHandle(cursor);
+                }
+
+                cursor = thread;
+                thread_count++;
+            }
+
+            if (cursor)
+            {
+                ::CloseHandle(cursor);
+            }
+
+            threads.reserve(2 * thread_count + 16);
+        }
+    };
+
+    // Keeps track of what the server has for every payload page of the manifest, as the
+    // hash of the bytes it was last sent (initially the zero page, which is what a fresh
+    // commit on the server holds). A page is dirty when its hash no longer matches. The
+    // writable pages of the image can be tracked too; they aren't part of any manifest.
+    //
+    // Subregions allocated with `MEM_WRITE_WATCH` only have the pages the system saw
+    // written hashed again; every other page has to be hashed on every scan.
+    //
+    // Pages are read with `ReadProcessMemory` rather than in place, so memory freed or
+    // reprotected by another thread mid-scan fails the read instead of faulting. Scanning
+    // doesn't allocate either, so it's safe while the other threads are frozen.
+    class dirty_tracker
+    {
+        struct tracked_subregion
+        {
+            std::uint64_t base_address;
+            std::uint64_t page_count;
+            DWORD protect;
+            bool is_private;
+            bool write_watched;
+            // Every page has to be read on the next scan, whatever write watching says.
+            bool full_scan;
+            // Index of the first page's hash in `hashes_` (or `image_hashes_`).
+            std::size_t first_hash;
+        };
+
+        SOCKET sock_;
+        net::address_space_manifest manifest_;
+        std::vector<tracked_subregion> subregions_;
+        // `region_subregions_[i]` is the index of the first tracked subregion of
+        // `manifest_.regions[i]`, with one extra entry at the end.
+        std::vector<std::size_t> region_subregions_;
+        std::vector<page_hash> hashes_;
+        std::vector<tracked_subregion> image_subregions_;
+        std::vector<page_hash> image_hashes_;
+        page_hash zero_hash_;
+
+        // Scan buffers, sized once so scanning never allocates.
+        std::vector<std::byte> buffer_;
+        std::vector<PSAPI_WORKING_SET_EX_INFORMATION> residency_scratch_;
+        std::vector<vm::page_residency> residency_;
+        std::vector<PVOID> written_;
+
+        // Kept across `rebase` so the storage can be reused rather than reallocated, which
+        // would itself change the address space being tracked.
+        std::vector<tracked_subregion> next_subregions_;
+        std::vector<std::size_t> next_region_subregions_;
+        std::vector<page_hash> next_hashes_;
+
+        std::uint64_t bytes_sent_ = 0;
+        std::uint64_t bytes_resent_ = 0;
+        bool shape_changed_ = false;
+
+        bool is_write_watched(const net::manifest_subregion& subregion)
+        {
+            ULONG_PTR written_count = written_.size();
+            ULONG granularity = 0;
+            return ::GetWriteWatch(
+                0,
+                reinterpret_cast<PVOID>(subregion.base_address),
+                subregion.region_size,
+                written_.data(),
+                &written_count,
+                &granularity) == 0;
+        }
+
+        // Scans up to `MAX_PAGES_PER_FRAME` pages of `subregion` from `first_page` and, if
+        // `send` is set, sends the dirty ones as one `page_data` frame. `hashes` are those
+        // of the subregion's pages. Returns the bytes found dirty.
+        std::expected<std::uint64_t, HRESULT> scan_run(
+            tracked_subregion& subregion,
+            std::span<page_hash> hashes,
+            const std::uint64_t first_page,
+            const std::uint32_t page_count,
+            const bool send)
+        {
+            const std::uint64_t address = subregion.base_address + first_page * net::MANIFEST_PAGE_SIZE;
+            const std::uint64_t size = page_count * net::MANIFEST_PAGE_SIZE;
+
+            // Pages which may have changed since they were last sent.
+            net::page_run candidates{ .address = address, .page_count = page_count };
+            if (subregion.write_watched && !subregion.full_scan)
+            {
+                ULONG_PTR written_count = written_.size();
+                ULONG granularity = 0;
+                // Reset only when sending, so that what's counted is still there to send.
+                if (::GetWriteWatch(
+                    send ? WRITE_WATCH_FLAG_RESET : 0,
+                    reinterpret_cast<PVOID>(address),
+                    size,
+                    written_.data(),
+                    &written_count,
+                    &granularity) != 0)
+                {
+                    shape_changed_ = true;
+                    return 0;
+                }
+
+                for (ULONG_PTR i = 0; i < written_count; i++)
+                {
+                    candidates.set_present(static_cast<std::uint32_t>(
+                        (reinterpret_cast<std::uint64_t>(written_[i]) - address) / net::MANIFEST_PAGE_SIZE));
+                }
+            }
+            else
+            {
+                // Whatever is written after this gets picked up by the next scan.
+                if (subregion.write_watched && send)
+                {
+                    ::ResetWriteWatch(reinterpret_cast<PVOID>(address), size);
+                }
+
+                for (std::uint32_t page = 0; page < page_count; page++)
+                {
+                    candidates.set_present(page);
+                }
+            }
+
+            if (candidates.present_count() == 0)
+            {
+                return 0;
+            }
+
+            // Untouched private pages are zero; reading them would only fault them in.
+            vm::query_residency(
+                net::manifest_subregion{ .base_address = address, .region_size = size, .protect = subregion.protect },
+                subregion.is_private,
+                residency_scratch_,
+                residency_
+            );
+
+            net::page_run readable{ .address = address, .page_count = page_count };
+            candidates.for_each_present_run([&](const std::uint32_t first, const std::uint32_t count)
+            {
+                for (std::uint32_t page = first; page < first + count; page++)
+                {
+                    if (residency_[page] == vm::page_residency::demand_zero)
+                    {
+                        std::memset(buffer_.data() + page * net::MANIFEST_PAGE_SIZE, 0, net::MANIFEST_PAGE_SIZE);
+                    }
+                    else
+                    {
+                        readable.set_present(page);
+                    }
+                }
+            });
+
+            bool read_failed = false;
+            readable.for_each_present_run([&](const std::uint32_t first, const std::uint32_t count)
+            {
+                const std::size_t bytes_to_read = count * net::MANIFEST_PAGE_SIZE;
+                SIZE_T bytes_read = 0;
+                if (!read_failed
+                    && (!::ReadProcessMemory(
+                            ::GetCurrentProcess(),
+                            reinterpret_cast<LPCVOID>(address + first * net::MANIFEST_PAGE_SIZE),
+                            buffer_.data() + first * net::MANIFEST_PAGE_SIZE,
+                            bytes_to_read,
+                            &bytes_read)
+                        || bytes_read != bytes_to_read))
+                {
+                    read_failed = true;
+                }
+            });
+
+            if (read_failed)
+            {
+                // Freed or reprotected under us. The next manifest capture will see how,
+                // and until then the whole subregion has to be looked at again.
+                subregion.full_scan = true;
+                shape_changed_ = true;
+                return 0;
+            }
+
+            const auto diff = diff_run(candidates, buffer_, hashes.subspan(first_page, page_count), zero_hash_, send);
+            const net::page_run& dirty = diff.dirty;
+            const std::uint64_t dirty_bytes = dirty.present_count() * net::MANIFEST_PAGE_SIZE;
+            if (!send || dirty_bytes == 0)
+            {
+                return dirty_bytes;
+            }
+
+            // A dirty zero page is sent like any other; the server still has the old bytes.
+            if (const auto result = net::send_page_run(sock_, dirty, std::span{ buffer_ }.first(size));
+                FAILED(result))
+            {
+                return std::unexpected{ result };
+            }
+
+            bytes_sent_ += dirty_bytes;
+            bytes_resent_ += diff.resent_pages * net::MANIFEST_PAGE_SIZE;
+            return dirty_bytes;
+        }
+
+        std::expected<std::uint64_t, HRESULT> scan(
+            std::span<tracked_subregion> subregions,
+            std::span<page_hash> hashes,
+            const bool send)
+        {
+            std::uint64_t dirty_bytes = 0;
+            for (auto& subregion : subregions)
+            {
+                const auto subregion_hashes = hashes.subspan(subregion.first_hash, subregion.page_count);
+                for (std::uint64_t first = 0; first < subregion.page_count; first += net::MAX_PAGES_PER_FRAME)
+                {
+                    const auto result = scan_run(
+                        subregion,
+                        subregion_hashes,
+                        first,
+                        static_cast<std::uint32_t>(std::min<std::uint64_t>(net::MAX_PAGES_PER_FRAME, subregion.page_count - first)),
+                        send
+                    );
+                    if (!result)
+                    {
+                        return result;
+                    }
+
+                    dirty_bytes += result.value();
+                }
+
+                if (send && !shape_changed_)
+                {
+                    subregion.full_scan = false;
+                }
+            }
+
+            return dirty_bytes;
+        }
+
+        std::expected<std::uint64_t, HRESULT> scan(const bool send)
+        {
+            const auto dirty_bytes = scan(subregions_, hashes_, send);
+            if (!dirty_bytes)
+            {
+                return dirty_bytes;
+            }
+
+            const auto dirty_image_bytes = scan(image_subregions_, image_hashes_, send);
+            if (!dirty_image_bytes)
+            {
+                return dirty_image_bytes;
+            }
+
+            return dirty_bytes.value() + dirty_image_bytes.value();
+        }
+
+    public:
+        explicit dirty_tracker(SOCKET sock)
+            : sock_{ sock }
+            , buffer_(net::MAX_PAGES_PER_FRAME * net::MANIFEST_PAGE_SIZE)
+            , residency_scratch_(vm::RESIDENCY_QUERY_BATCH)
+            , written_(net::MAX_PAGES_PER_FRAME)
+        {
+            std::memset(buffer_.data(), 0, net::MANIFEST_PAGE_SIZE);
+            zero_hash_ = hash_page(buffer_.data());
+            residency_.reserve(net::MAX_PAGES_PER_FRAME);
+        }
+
+        dirty_tracker(const dirty_tracker&) = delete;
+        dirty_tracker& operator=(const dirty_tracker&) = delete;
+
+        // Starts tracking `manifest` instead. Regions laid out the same as before keep what
+        // the server is known to have; every other region starts over from zero pages, as
+        // the server replans them the same way. If anything changed, `manifest` is sent.
+        HRESULT rebase(net::address_space_manifest manifest)
+        {
+            next_subregions_.clear();
+            next_region_subregions_.clear();
+            next_hashes_.clear();
+
+            bool changed = manifest.regions.size() != manifest_.regions.size();
+            for (const auto& region : manifest.regions)
+            {
+                next_region_subregions_.push_back(next_subregions_.size());
+
+                const auto* old_region = manifest_.find_same_region(manifest, region);
+                if (old_region)
+                {
+                    const std::size_t old_index = old_region - manifest_.regions.data();
+                    for (std::size_t i = region_subregions_[old_index]; i < region_subregions_[old_index + 1]; i++)
+                    {
+                        auto subregion = subregions_[i];
+                        const auto hashes = std::span{ hashes_ }.subspan(subregion.first_hash, subregion.page_count);
+                        subregion.first_hash = next_hashes_.size();
+                        next_hashes_.insert(next_hashes_.end(), hashes.begin(), hashes.end());
+                        next_subregions_.push_back(subregion);
+                    }
+
+                    continue;
+                }
+
+                changed = true;
+                for (const auto& subregion : manifest.subregions_of(region))
+                {
+                    // Subregions annotated to be left zero are already zero on the server.
+                    if (!net::msg::has_payload(subregion.protect) || annotations::is_zeroed(subregion))
+                    {
+                        continue;
+                    }
+
+                    next_subregions_.push_back({
+                        .base_address = subregion.base_address,
+                        .page_count = subregion.region_size / net::MANIFEST_PAGE_SIZE,
+                        .protect = subregion.protect,
+                        .is_private = region.type == MEM_PRIVATE,
+                        .write_watched = is_write_watched(subregion),
+                        .full_scan = true,
+                        .first_hash = next_hashes_.size()
+                    });
+                    next_hashes_.resize(next_hashes_.size() + next_subregions_.back().page_count, zero_hash_);
+                }
+            }
+
+            next_region_subregions_.push_back(next_subregions_.size());
+
+            std::swap(subregions_, next_subregions_);
+            std::swap(region_subregions_, next_region_subregions_);
+            std::swap(hashes_, next_hashes_);
+            manifest_ = std::move(manifest);
+            shape_changed_ = false;
+
+            if (!changed)
+            {
+                return ERROR_SUCCESS;
+            }
+
+            LOG_DEBUG() << "Tracking " << subregions_.size() << " subregions; sending manifest" << std::endl;
+            return net::send_manifest(sock_, manifest_);
+        }
+
+        // Also tracks the writable subregions of `image_manifest`. What the server has there
+        // isn't known, so every one of their pages counts as dirty until it's been sent.
+        void track_image(const net::address_space_manifest& image_manifest)
+        {
+            image_subregions_.clear();
+            image_hashes_.clear();
+            for (const auto& subregion : image_manifest.subregions)
+            {
+                if (!net::msg::has_payload(subregion.protect) || !net::msg::is_writable(subregion.protect))
+                {
+                    continue;
+                }
+
+                image_subregions_.push_back({
+                    .base_address = subregion.base_address,
+                    .page_count = subregion.region_size / net::MANIFEST_PAGE_SIZE,
+                    .protect = subregion.protect,
+                    .is_private = false,
+                    .write_watched = false,
+                    .full_scan = true,
+                    .first_hash = image_hashes_.size()
+                });
+                image_hashes_.resize(image_hashes_.size() + image_subregions_.back().page_count, UNKNOWN_HASH);
+            }
+        }
+
+        // Counts the dirty bytes without sending or forgetting any of them.
+        std::expected<std::uint64_t, HRESULT> count_dirty()
+        {
+            return scan(false);
+        }
+
+        // Sends every dirty page and returns how many bytes that was.
+        std::expected<std::uint64_t, HRESULT> send_dirty()
+        {
+            return scan(true);
+        }
+
+        // Whether a scan since the last `rebase` ran into memory which has gone or changed.
+        bool shape_changed() const noexcept
+        {
+            return shape_changed_;
+        }
+
+        // Walks the address space without allocating and checks it's still exactly what's
+        // being tracked, as it has to be for the final stop-and-copy.
+        bool matches_address_space() const
+        {
+            std::size_t next_region = 0;
+            std::size_t next_subregion = 0;
+            std::uint64_t region_base = 0;
+
+            MEMORY_BASIC_INFORMATION mbi{};
+            ULONG_PTR address = 0;
+            while (::VirtualQuery(reinterpret_cast<LPCVOID>(address), &mbi, sizeof(mbi)))
+            {
+                address += mbi.RegionSize;
+
+                if (mbi.State == MEM_FREE || mbi.Type == MEM_IMAGE)
+                {
+                    continue;
+                }
+
+                if (next_subregion == manifest_.subregions.size())
+                {
+                    return false;
+                }
+
+                if (next_region < manifest_.regions.size()
+                    && manifest_.regions[next_region].first_subregion == next_subregion)
+                {
+                    const auto& region = manifest_.regions[next_region++];
+                    if (region.protect != mbi.AllocationProtect || region.type != mbi.Type)
+                    {
+                        return false;
+                    }
+
+                    region_base = region.base_address;
+                }
+
+                const auto& subregion = manifest_.subregions[next_subregion++];
+                if (region_base != reinterpret_cast<std::uint64_t>(mbi.AllocationBase)
+                    || subregion.base_address != reinterpret_cast<std::uint64_t>(mbi.BaseAddress)
+                    || subregion.region_size != mbi.RegionSize
+                    || subregion.protect != mbi.Protect)
+                {
+                    return false;
+                }
+            }
+
+            return next_subregion == manifest_.subregions.size();
+        }
+
+        std::uint64_t bytes_sent() const noexcept
+        {
+            return bytes_sent_;
+        }
+
+        std::uint64_t bytes_resent() const noexcept
+        {
+            return bytes_resent_;
+        }
+    };
+}
@@ -0,0 +1,212 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <expected>
+#include <mutex>
+#include <stop_token>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "netfork.hpp"
+#include "pre_copy.hpp"
+#include "vm.hpp"
+
+#include <netfork-shared/log.hpp>
+#include <netfork-shared/net/manifest.hpp>
+#include <netfork-shared/net/msg.hpp>
+#include <netfork-shared/net/sock.hpp>
+#include <netfork-shared/phnt_stub.hpp>
+#include <netfork-shared/utils.hpp>
+
+namespace netfork::replication
+{
+    // Ships an epoch to the server every `interval` from a thread of its own. Each epoch
+    // is sent like a pre-copy fork in miniature: the dirty pages go out while everything
+    // runs, then the other threads are suspended for whatever changed meanwhile and the
+    // replicated thread's context, which commits the epoch on the server.
+    class replicator
+    {
+        using clock = std::chrono::steady_clock;
+
+        SOCKET sock_;
+        unique_handle<> thread_;
+        std::chrono::milliseconds interval_;
+        pre_copy::dirty_tracker tracker_;
+        std::vector<HANDLE> frozen_threads_;
+
+        mutable std::mutex stats_mutex_;
+        replication_stats stats_{};
+        clock::time_point started_;
+        clock::time_point committed_at_;
+
+        std::atomic<HRESULT> result_ = ERROR_SUCCESS;
+        std::mutex wait_mutex_;
+        std::condition_variable_any wait_;
+        std::jthread worker_;
+
+        HRESULT send_epoch()
+        {
+            const std::uint64_t sent_before = tracker_.bytes_sent();
+
+            // The other threads may have allocated or freed memory since the last epoch.
+            if (const auto result = tracker_.rebase(vm::capture_process_manifest()); FAILED(result))
+            {
+                return result;
+            }
+
+            if (const auto sent = tracker_.send_dirty(); !sent)
+            {
+                return sent.error();
+            }
+
+            pre_copy::thread_freezer::reserve(frozen_threads_);
+
+            CONTEXT context{ .ContextFlags = CONTEXT_ALL };
+            bool stable = false;
+            std::expected<std::uint64_t, HRESULT> sent{ 0 };
+            const auto captured_at = clock::now();
+            {
+                pre_copy::thread_freezer freezer{ frozen_threads_ };
+                stable = freezer.is_complete()
+                    && !tracker_.shape_changed()
+                    && tracker_.matches_address_space();
+                if (stable)
+                {
+                    sent = tracker_.send_dirty();
+                    if (sent && !::GetThreadContext(thread_.get(), &context))
+                    {
+                        sent = std::unexpected{ HRESULT_FROM_WIN32(::GetLastError()) };
+                    }
+                }
+            }
+
+            const auto pause = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - captured_at);
+            if (!stable)
+            {
+                // What was sent stays staged on the server and goes in with the next epoch.
+                std::lock_guard lock{ stats_mutex_ };
+                stats_.skipped_epochs++;
+                return ERROR_SUCCESS;
+            }
+
+            if (!sent)
+            {
+                return sent.error();
+            }
+
+            if (const auto result = net::send_msg(sock_, context); FAILED(result))
+            {
+                return result;
+            }
+
+            const auto ack = net::recv_msg<net::msg::replication_ack>(sock_);
+            if (!ack)
+            {
+                return ack.error();
+            }
+
+            std::lock_guard lock{ stats_mutex_ };
+            stats_.epochs = ack->epoch;
+            stats_.bytes_sent = tracker_.bytes_sent();
+            stats_.last_epoch_bytes = tracker_.bytes_sent() - sent_before;
+            stats_.last_pause = pause;
+            committed_at_ = captured_at;
+            return ERROR_SUCCESS;
+        }
+
+        void run(std::stop_token stop)
+        {
+            while (!stop.stop_requested())
+            {
+                const auto next_epoch = clock::now() + interval_;
+                if (const auto result = send_epoch(); FAILED(result))
+                {
+                    LOG_DEBUG_ERR() << "Replication failed; error: " << result << std::endl;
+                    result_ = result;
+                    return;
+                }
+
+                std::unique_lock lock{ wait_mutex_ };
+                wait_.wait_until(lock, stop, next_epoch, [] { return false; });
+            }
+        }
+
+    public:
+        replicator(SOCKET sock, unique_handle<> thread, const std::chrono::milliseconds interval)
+            : sock_{ sock }
+            , thread_{ std::move(thread) }
+            , interval_{ interval }
+            , tracker_{ sock }
+            , started_{ clock::now() }
+            , committed_at_{ started_ }
+        {
+        }
+
+        replicator(const replicator&) = delete;
+        replicator& operator=(const replicator&) = delete;
+
+        // The image's writable pages have to be kept current too; the server already has
+        // them as they were when `image_manifest` was sent.
+        void start(const net::address_space_manifest& image_manifest)
+        {
+            tracker_.track_image(image_manifest);
+            worker_ = std::jthread{ [this](std::stop_token stop) { run(stop); } };
+        }
+
+        replication_stats stats() const
+        {
+            const auto now = clock::now();
+            std::lock_guard lock{ stats_mutex_ };
+            replication_stats stats = stats_;
+            stats.lag = std::chrono::duration_cast<std::chrono::microseconds>(now - committed_at_);
+
+            const std::chrono::duration<double> running = now - started_;
+            if (running.count() > 0.0)
+            {
+                stats.bytes_per_second = stats.bytes_sent / running.count();
+            }
+
+            return stats;
+        }
+
+        // Waits out the epoch in progress, if any, and ends the replication.
+        HRESULT stop()
+        {
+            worker_.request_stop();
+            if (worker_.joinable())
+            {
+                worker_.join();
+            }
+
+            if (FAILED(result_))
+            {
+                return result_;
+            }
+
+            LOG_DEBUG() << "Replicated " << stats_.epochs << " epochs in 0x" << std::hex
+                << stats_.bytes_sent << std::dec << " bytes" << std::endl;
+            return net::send_frames(sock_, net::codec::frame_type::end_of_stream, {});
+        }
+    };
+}
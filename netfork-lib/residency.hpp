@@ -0,0 +1,198 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+// Page residency as the capture path sees it, and how runs of it are walked. Free of Windows
+// dependencies; Windows builds query it with `QueryWorkingSetEx` (see vm.hpp), and Linux
+// builds with the /proc/self/pagemap and mincore backend below.
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#ifdef __linux__
+#	include <fcntl.h>
+#	include <sys/mman.h>
+#	include <unistd.h>
+#endif
+
+namespace netfork::vm
+{
+    enum class page_residency : std::uint8_t
+    {
+        // In the working set, or on the standby/modified lists; reading it is cheap.
+        resident,
+        // Private memory which has never been touched. It's known to read as zeros, so it
+        // isn't faulted in just to find that out.
+        demand_zero,
+        // Paged out to the pagefile or, for mapped memory, not read from its backing file
+        // yet. Reading it means disk I/O.
+        paged_out,
+    };
+
+    struct capture_stats
+    {
+        std::uint64_t demand_zero_bytes = 0;
+        std::uint64_t deferred_bytes = 0;
+    };
+
+    constexpr const std::size_t RESIDENCY_QUERY_BATCH = 1024;
+
+    struct residency_run
+    {
+        page_residency state;
+        std::size_t first;
+        std::size_t count;
+    };
+
+    // The run of pages with the same residency that starts at `first`, which must be a page
+    // of `residency`.
+    inline residency_run residency_run_at(std::span<const page_residency> residency, const std::size_t first) noexcept
+    {
+        std::size_t page = first;
+        while (page < residency.size() && residency[page] == residency[first])
+        {
+            page++;
+        }
+
+        return { residency[first], first, page - first };
+    }
+
+#ifdef __linux__
+    // Bits of a /proc/self/pagemap entry (see Documentation/admin-guide/mm/pagemap.rst).
+    constexpr const std::uint64_t PAGEMAP_PRESENT = std::uint64_t{ 1 } << 63;
+    constexpr const std::uint64_t PAGEMAP_SWAPPED = std::uint64_t{ 1 } << 62;
+
+    // What a page's pagemap entry and mincore bit say about it. A page that is neither
+    // mapped nor swapped has never been touched: anonymous memory then reads as zeros, and
+    // file-backed memory is cheap to read only if the file's page is in the page cache.
+    constexpr page_residency classify_page(
+        const std::uint64_t pagemap_entry,
+        const bool is_anonymous,
+        const bool in_page_cache) noexcept
+    {
+        if (pagemap_entry & PAGEMAP_PRESENT)
+        {
+            return page_residency::resident;
+        }
+
+        if (pagemap_entry & PAGEMAP_SWAPPED)
+        {
+            return page_residency::paged_out;
+        }
+
+        if (is_anonymous)
+        {
+            return page_residency::demand_zero;
+        }
+
+        return in_page_cache ? page_residency::resident : page_residency::paged_out;
+    }
+
+    // The Linux counterpart of `query_residency`: pagemap says whether each page is mapped
+    // or swapped, and mincore whether a file-backed one is in the page cache. Neither faults
+    // anything in. Without pagemap (e.g. it's masked in a container) an untouched page can't
+    // be told from a swapped one, so only mincore is used and anything not in core counts as
+    // paged out; it still gets read.
+    class residency_query
+    {
+    public:
+        residency_query() noexcept
+            : pagemap_(::open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC))
+            , system_page_size_(static_cast<std::size_t>(::sysconf(_SC_PAGESIZE)))
+        {
+        }
+
+        residency_query(const residency_query&) = delete;
+        residency_query& operator=(const residency_query&) = delete;
+
+        ~residency_query()
+        {
+            if (pagemap_ != -1)
+            {
+                ::close(pagemap_);
+            }
+        }
+
+        bool has_pagemap() const noexcept
+        {
+            return pagemap_ != -1;
+        }
+
+        // Fills `residency` with the state of every `page_size` page from `address`, which
+        // must be aligned to the system page size.
+        void query(
+            const std::uint64_t address,
+            const std::size_t page_count,
+            const std::size_t page_size,
+            const bool is_anonymous,
+            std::vector<page_residency>& residency)
+        {
+            residency.assign(page_count, page_residency::resident);
+            if (page_count == 0)
+            {
+                return;
+            }
+
+            const std::uint64_t end = address + page_count * page_size;
+            const std::uint64_t first_system_page = address / system_page_size_;
+            const std::size_t system_pages = static_cast<std::size_t>(
+                (end + system_page_size_ - 1) / system_page_size_ - first_system_page);
+
+            in_core_.assign(system_pages, 0);
+            if (::mincore(reinterpret_cast<void*>(address), end - address, in_core_.data()) != 0)
+            {
+                // Unmapped under us, or not something mincore understands; read everything.
+                return;
+            }
+
+            entries_.assign(system_pages, 0);
+            bool have_entries = has_pagemap();
+            for (std::size_t first = 0; have_entries && first < system_pages; first += RESIDENCY_QUERY_BATCH)
+            {
+                const std::size_t batch = std::min(RESIDENCY_QUERY_BATCH, system_pages - first);
+                const auto bytes = static_cast<ssize_t>(batch * sizeof(std::uint64_t));
+                have_entries = ::pread(
+                    pagemap_,
+                    entries_.data() + first,
+                    static_cast<std::size_t>(bytes),
+                    static_cast<off_t>((first_system_page + first) * sizeof(std::uint64_t))) == bytes;
+            }
+
+            for (std::size_t page = 0; page < page_count; page++)
+            {
+                const std::size_t system_page = static_cast<std::size_t>(
+                    (address + page * page_size) / system_page_size_ - first_system_page);
+                const bool in_core = (in_core_[system_page] & 1) != 0;
+                residency[page] = have_entries
+                    ? classify_page(entries_[system_page], is_anonymous, in_core)
+                    : in_core ? page_residency::resident : page_residency::paged_out;
+            }
+        }
+
+    private:
+        int pagemap_;
+        std::size_t system_page_size_;
+        std::vector<std::uint64_t> entries_;
+        std::vector<unsigned char> in_core_;
+    };
+#endif
+}
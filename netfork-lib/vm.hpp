@@ -17,99 +17,354 @@
 
 #pragma once
 
-#include <expected>
-#include <vector>
+#include <psapi.h>
+
+#include <algorithm>
+#include <cstdint>
 #include <span>
+#include <vector>
+
+#include "annotations.hpp"
+#include "residency.hpp"
 
-#include <netfork-shared/auto.hpp>
+#include <netfork-shared/image_hash.hpp>
 #include <netfork-shared/log.hpp>
+#include <netfork-shared/net/manifest.hpp>
 #include <netfork-shared/net/msg.hpp>
+#include <netfork-shared/page_hash.hpp>
 #include <netfork-shared/phnt_stub.hpp>
 #include <netfork-shared/utils.hpp>
 
 namespace netfork::vm
 {
+    // Walks the address space of `process` and describes every allocation matching `pred`
+    // without reading any of it.
     template <typename QueryPredicate>
-    generator<net::msg::message_type> query_virtual_memory_if(QueryPredicate pred)
+    net::address_space_manifest capture_manifest_if(QueryPredicate pred, HANDLE process = ::GetCurrentProcess())
     {
+        net::address_space_manifest manifest;
+
         MEMORY_BASIC_INFORMATION mbi{};
         ULONG_PTR address = 0;
-        while (::VirtualQuery(reinterpret_cast<LPCVOID>(address), &mbi, sizeof(mbi)))
+        while (::VirtualQueryEx(process, reinterpret_cast<LPCVOID>(address), &mbi, sizeof(mbi)))
         {
             address += mbi.RegionSize;
 
             if (mbi.State == MEM_FREE) continue;
             if (!pred(mbi)) continue;
 
-            net::msg::region_info region_info{
-                .base_address = mbi.AllocationBase,
-                .protect = mbi.AllocationProtect,
-                .allocation_size = 0,
-                .subregion_info_size = 0
-            };
-            std::vector<net::msg::subregion_info> subregions;
-            subregions.emplace_back(mbi.BaseAddress, mbi.RegionSize, mbi.Protect);
-            region_info.allocation_size += mbi.RegionSize;
+            const auto allocation_base = reinterpret_cast<std::uint64_t>(mbi.AllocationBase);
+            // The walk is in ascending order, so a new allocation starts whenever the
+            // allocation base changes.
+            if (manifest.regions.empty() || manifest.regions.back().base_address != allocation_base)
+            {
+                manifest.add_region(allocation_base, mbi.AllocationProtect, mbi.Type);
+            }
+
+            manifest.add_subregion(
+                reinterpret_cast<std::uint64_t>(mbi.BaseAddress),
+                mbi.RegionSize,
+                mbi.Protect
+            );
+        }
+
+        LOG_DEBUG() << "Captured " << manifest.regions.size() << " regions and "
+            << manifest.subregions.size() << " subregions" << std::endl;
 
-            PVOID current_allocation_base = mbi.AllocationBase;
-            while (::VirtualQuery(reinterpret_cast<LPCVOID>(address), &mbi, sizeof(mbi)))
+        return manifest;
+    }
+
+    // Everything but images, which are sent separately, shaped by whatever has been
+    // annotated. `process` is this process or a clone of it.
+    inline net::address_space_manifest capture_process_manifest(HANDLE process = ::GetCurrentProcess())
+    {
+        return annotations::apply(capture_manifest_if(
+            [](const MEMORY_BASIC_INFORMATION& mbi)
             {
-                if (current_allocation_base != mbi.AllocationBase)
+                return mbi.Type != MEM_IMAGE;
+            },
+            process));
+    }
+
+    // Bytes committed outside of images, which is about what a fork of `process` commits
+    // on the server.
+    inline std::uint64_t committed_size(HANDLE process = ::GetCurrentProcess())
+    {
+        std::uint64_t size = 0;
+        MEMORY_BASIC_INFORMATION mbi{};
+        ULONG_PTR address = 0;
+        while (::VirtualQueryEx(process, reinterpret_cast<LPCVOID>(address), &mbi, sizeof(mbi)))
+        {
+            address += mbi.RegionSize;
+            if (mbi.State == MEM_COMMIT && mbi.Type != MEM_IMAGE)
+            {
+                size += mbi.RegionSize;
+            }
+        }
+
+        return size;
+    }
+
+    // For an invalid working set block, bits 22-23 say where the page currently lives
+    // (see `MEMORY_WORKING_SET_EX_BLOCK::Invalid::Location` in phnt).
+    constexpr const ULONG_PTR WORKING_SET_LOCATION_SHIFT = 22;
+    constexpr const ULONG_PTR WORKING_SET_LOCATION_MASK = 0x3;
+    constexpr const ULONG_PTR WORKING_SET_LOCATION_INVALID = 0;
+    constexpr const ULONG_PTR WORKING_SET_LOCATION_PAGEFILE = 2;
+
+    // Fills `residency` with the state of every page of the subregion using batched
+    // `QueryWorkingSetEx` calls, which don't fault anything in. If the query fails, every
+    // page is assumed resident so it still gets read.
+    inline void query_residency(
+        const net::manifest_subregion& subregion,
+        const bool is_private,
+        std::vector<PSAPI_WORKING_SET_EX_INFORMATION>& scratch,
+        std::vector<page_residency>& residency)
+    {
+        const std::size_t page_count = subregion.region_size / net::MANIFEST_PAGE_SIZE;
+        residency.assign(page_count, page_residency::resident);
+        scratch.resize(RESIDENCY_QUERY_BATCH);
+
+        for (std::size_t first = 0; first < page_count; first += RESIDENCY_QUERY_BATCH)
+        {
+            const std::size_t batch = std::min(RESIDENCY_QUERY_BATCH, page_count - first);
+            for (std::size_t i = 0; i < batch; i++)
+            {
+                scratch[i].VirtualAddress = reinterpret_cast<PVOID>(
+                    subregion.base_address + (first + i) * net::MANIFEST_PAGE_SIZE);
+            }
+
+            if (!::QueryWorkingSetEx(
+                ::GetCurrentProcess(),
+                scratch.data(),
+                static_cast<DWORD>(batch * sizeof(PSAPI_WORKING_SET_EX_INFORMATION))))
+            {
+                LOG_DEBUG_ERR() << "QueryWorkingSetEx failed; GetLastError: "
+                    << ::GetLastError() << std::endl;
+                continue;
+            }
+
+            for (std::size_t i = 0; i < batch; i++)
+            {
+                const auto& attributes = scratch[i].VirtualAttributes;
+                if (attributes.Valid)
                 {
-                    break;
+                    continue;
                 }
 
-                subregions.emplace_back(mbi.BaseAddress, mbi.RegionSize, mbi.Protect);
-                region_info.allocation_size += mbi.RegionSize;
-                current_allocation_base = mbi.AllocationBase;
-                address += mbi.RegionSize;
+                const ULONG_PTR location = (attributes.Flags >> WORKING_SET_LOCATION_SHIFT)
+                    & WORKING_SET_LOCATION_MASK;
+                if (location == WORKING_SET_LOCATION_PAGEFILE)
+                {
+                    residency[first + i] = page_residency::paged_out;
+                }
+                else if (location == WORKING_SET_LOCATION_INVALID)
+                {
+                    // A private page with no backing anywhere has never been touched. A
+                    // mapped one still has to come from its file.
+                    residency[first + i] = is_private
+                        ? page_residency::demand_zero
+                        : page_residency::paged_out;
+                }
             }
+        }
+    }
 
-            region_info.subregion_info_size = subregions.size();
+    // Makes the range readable. The caller restores `protect` once it's done reading.
+    inline void relax_protection(const std::uint64_t address, const std::uint64_t size)
+    {
+        [[maybe_unused]] DWORD old_protect;
+        if (!::VirtualProtectEx(
+            ::GetCurrentProcess(),
+            reinterpret_cast<LPVOID>(address),
+            size,
+            PAGE_EXECUTE_READWRITE,
+            &old_protect))
+        {
+            LOG_DEBUG_ERR() << "Failed to change memory protection to allow RWX at: 0x"
+                << std::hex << address << std::dec
+                << " GetLastError: " << ::GetLastError() << std::endl;
+        }
+    }
 
-            LOG_DEBUG() << "Region\n" << region_info << std::endl;
+    inline void restore_protection(const std::uint64_t address, const std::uint64_t size, const DWORD protect)
+    {
+        [[maybe_unused]] DWORD old_protect;
+        ::VirtualProtectEx(
+            ::GetCurrentProcess(),
+            reinterpret_cast<LPVOID>(address),
+            size,
+            protect,
+            &old_protect
+        );
+    }
 
-            co_yield region_info;
+    // Whether memory with protection `protect` can be read in place. No-access and guard
+    // pages carry no payload, so of the rest only execute-only memory can't be.
+    constexpr bool is_readable(const DWORD protect) noexcept
+    {
+        return net::msg::has_payload(protect) && (protect & 0xFF) != PAGE_EXECUTE;
+    }
 
-            for (const auto& subregion : subregions)
+    // Keeps a range of payload pages readable for as long as it lives. Nearly all memory
+    // already is, and is left alone; only execute-only ranges are relaxed and restored, so
+    // reading a process costs no protection changes beyond those.
+    class readable_range
+    {
+        std::uint64_t address_;
+        std::uint64_t size_;
+        DWORD protect_;
+        bool relaxed_;
+
+    public:
+        readable_range(const std::uint64_t address, const std::uint64_t size, const DWORD protect)
+            : address_{ address }
+            , size_{ size }
+            , protect_{ protect }
+            , relaxed_{ !is_readable(protect) }
+        {
+            if (relaxed_)
+            {
+                relax_protection(address_, size_);
+            }
+        }
+
+        readable_range(const readable_range&) = delete;
+        readable_range& operator=(const readable_range&) = delete;
+
+        ~readable_range()
+        {
+            if (relaxed_)
+            {
+                restore_protection(address_, size_, protect_);
+            }
+        }
+    };
+
+    // Hashes every read-only page of an image in address order; see `image_hash.hpp`.
+    inline page_hash hash_read_only_image(const net::address_space_manifest& image_manifest)
+    {
+        page_hash hash{};
+        if (image_manifest.regions.empty())
+        {
+            return hash;
+        }
+
+        const std::uint64_t image_base = image_manifest.regions.front().base_address;
+        for (const auto& subregion : image_manifest.subregions)
+        {
+            if (!is_hashed_image_subregion(subregion))
+            {
+                continue;
+            }
+
+            const readable_range readable{ subregion.base_address, subregion.region_size, subregion.protect };
+            hash = hash_image_subregion(hash, image_base, subregion, reinterpret_cast<const std::byte*>(subregion.base_address));
+        }
+
+        return hash;
+    }
+
+    // Yields the bytes of every subregion in `manifest` that carries a payload, in
+    // manifest order. A subregion which can't be read as it is is made readable only for
+    // as long as its span is being consumed.
+    inline generator<std::span<char>> read_manifest_payload(const net::address_space_manifest& manifest)
+    {
+        for (const auto& subregion : manifest.subregions)
+        {
+            if (!net::msg::has_payload(subregion.protect))
             {
-                LOG_DEBUG() << "Subregion\n" << subregion << std::endl;
+                continue;
+            }
+
+            const readable_range readable{ subregion.base_address, subregion.region_size, subregion.protect };
+
+            co_yield std::span<char>{
+                reinterpret_cast<char*>(subregion.base_address),
+                subregion.region_size
+            };
+        }
+
+        co_return;
+    }
+
+    // Like `read_manifest_payload`, but yields runs of pages with the same residency and
+    // so doesn't preserve manifest order; only use it where every span carries its own
+    // address.
+    //
+    // Residency is checked before reading anything: demand-zero pages are never touched
+    // (the receiver's fresh commit is already zero), and paged-out pages are deferred until
+    // everything resident has been yielded.
+    inline generator<std::span<char>> read_resident_payload(
+        const net::address_space_manifest& manifest,
+        capture_stats& stats)
+    {
+        struct deferred_range
+        {
+            std::uint64_t address;
+            std::uint64_t size;
+            DWORD protect;
+        };
+
+        std::vector<deferred_range> deferred;
+        std::vector<PSAPI_WORKING_SET_EX_INFORMATION> scratch;
+        std::vector<page_residency> residency;
 
-                co_yield subregion;
+        for (const auto& region : manifest.regions)
+        {
+            for (const auto& subregion : manifest.subregions_of(region))
+            {
+                if (!net::msg::has_payload(subregion.protect))
+                {
+                    continue;
+                }
 
-                if (subregion.protect == 0 ||
-                    subregion.protect & (PAGE_NOACCESS | PAGE_GUARD))
+                // Annotated to be left zero, which the receiver's fresh commit already is.
+                if (annotations::is_zeroed(subregion))
                 {
+                    stats.demand_zero_bytes += subregion.region_size;
                     continue;
                 }
 
-                [[maybe_unused]] DWORD old_protect;
-                if (!::VirtualProtectEx(
-                    ::GetCurrentProcess(),
-                    subregion.base_address,
-                    subregion.region_size,
-                    PAGE_EXECUTE_READWRITE,
-                    &old_protect))
+                query_residency(subregion, region.type == MEM_PRIVATE, scratch, residency);
+
+                const readable_range readable{ subregion.base_address, subregion.region_size, subregion.protect };
+
+                for (std::size_t page = 0; page < residency.size();)
                 {
-                    LOG_DEBUG_ERR() << "Failed to change memory protection to allow RWX at: 0x"
-                        << std::hex << subregion.base_address << std::dec
-                        << " GetLastError: " << ::GetLastError() << std::endl;
+                    const residency_run run = residency_run_at(residency, page);
+                    page += run.count;
+
+                    const std::uint64_t address = subregion.base_address + run.first * net::MANIFEST_PAGE_SIZE;
+                    const std::uint64_t size = run.count * net::MANIFEST_PAGE_SIZE;
+                    switch (run.state)
+                    {
+                    case page_residency::resident:
+                        co_yield std::span<char>{ reinterpret_cast<char*>(address), size };
+                        break;
+                    case page_residency::demand_zero:
+                        stats.demand_zero_bytes += size;
+                        break;
+                    case page_residency::paged_out:
+                        deferred.push_back({ address, size, subregion.protect });
+                        stats.deferred_bytes += size;
+                        break;
+                    }
                 }
-                AT_SCOPE_EXIT(::VirtualProtectEx(
-                    ::GetCurrentProcess(),
-                    subregion.base_address,
-                    subregion.region_size,
-                    subregion.protect,
-                    &old_protect
-                ));
-
-                co_yield std::span<char>{
-                    reinterpret_cast<char*>(subregion.base_address),
-                    subregion.region_size
-                };
             }
         }
 
+        LOG_DEBUG() << "Skipped 0x" << std::hex << stats.demand_zero_bytes
+            << " demand-zero bytes; deferred 0x" << stats.deferred_bytes
+            << std::dec << " paged out bytes" << std::endl;
+
+        for (const auto& range : deferred)
+        {
+            const readable_range readable{ range.address, range.size, range.protect };
+
+            co_yield std::span<char>{ reinterpret_cast<char*>(range.address), range.size };
+        }
+
         co_return;
     }
 }
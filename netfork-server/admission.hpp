@@ -0,0 +1,85 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <coroutine>
+#include <cstdint>
+#include <optional>
+#include <utility>
+
+#include "admission_scheduler.hpp"
+
+#include <netfork-shared/net/async.hpp>
+#include <netfork-shared/net/msg.hpp>
+
+namespace netfork::admission
+{
+    static_assert(std::to_underlying(priority::interactive) == std::to_underlying(net::msg::fork_priority::interactive));
+    static_assert(std::to_underlying(priority::bulk) == std::to_underlying(net::msg::fork_priority::bulk));
+
+    // Waits until `scheduler` admits `size` bytes of priority `p`, without holding up a
+    // thread of `context` while queued; the session carries on on one of them. Resumes with
+    // the session's ticket, or with nothing if it was rejected.
+    inline auto admit(scheduler& scheduler, net::io_context& context, const std::uint64_t size, const priority p)
+    {
+        struct awaiter : net::io_context::operation
+        {
+            admission::scheduler* scheduler;
+            net::io_context* context;
+            std::uint64_t size;
+            priority p;
+            decision result = decision::rejected;
+
+            bool await_ready() const noexcept
+            {
+                return false;
+            }
+
+            bool await_suspend(std::coroutine_handle<> awaiting)
+            {
+                waiter = awaiting;
+                // Once queued, the session may be admitted and resumed before `request` even
+                // returns, so only the callback touches the awaiter from then on.
+                const decision requested = scheduler->request(size, p, [this]
+                {
+                    result = decision::admitted;
+                    context->post(*this);
+                });
+                if (requested == decision::queued)
+                {
+                    return true;
+                }
+
+                result = requested;
+                return false;
+            }
+
+            std::optional<ticket> await_resume() const
+            {
+                if (result != decision::admitted)
+                {
+                    return std::nullopt;
+                }
+
+                return std::optional<ticket>{ std::in_place, *scheduler, size, p };
+            }
+        };
+
+        return awaiter{ net::io_context::operation{}, &scheduler, &context, size, p };
+    }
+}
@@ -0,0 +1,241 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace netfork::admission
+{
+    // The same values as `net::msg::fork_priority`, which a session's priority comes from.
+    enum class priority : std::uint8_t
+    {
+        interactive = 0,
+        bulk = 1
+    };
+
+    struct options
+    {
+        // Bytes every session being served may commit between them.
+        std::uint64_t budget;
+        // The part of `budget` bulk sessions may take between them, so interactive ones
+        // always find room without waiting for a bulk one to finish.
+        double bulk_share = 0.75;
+        // Sessions which may wait for memory at once, per priority. Any more are rejected.
+        std::size_t max_queued = 64;
+    };
+
+    enum class decision
+    {
+        admitted,
+        queued,
+        rejected
+    };
+
+    // Keeps the memory the sessions being served commit within a budget. A session which
+    // doesn't fit waits behind every session of its priority which came before it, and
+    // behind every interactive session, until enough memory has been released.
+    //
+    // Knows nothing of sockets or threads: a queued session is told it's admitted through
+    // the callback it queued with.
+    class scheduler
+    {
+        struct waiter
+        {
+            std::uint64_t size;
+            std::function<void()> admit;
+        };
+
+        options options_;
+        std::mutex mutex_;
+        std::uint64_t in_use_ = 0;
+        std::uint64_t bulk_in_use_ = 0;
+        // Indexed by priority, interactive first.
+        std::array<std::deque<waiter>, 2> queues_;
+
+        static std::size_t index(const priority p) noexcept
+        {
+            return p == priority::bulk ? 1 : 0;
+        }
+
+        std::uint64_t limit(const priority p) const noexcept
+        {
+            return p == priority::bulk
+                ? static_cast<std::uint64_t>(options_.budget * options_.bulk_share)
+                : options_.budget;
+        }
+
+        bool fits(const std::uint64_t size, const priority p) const noexcept
+        {
+            if (in_use_ + size > options_.budget)
+            {
+                return false;
+            }
+
+            return p != priority::bulk || bulk_in_use_ + size <= limit(p);
+        }
+
+        void take(const std::uint64_t size, const priority p) noexcept
+        {
+            in_use_ += size;
+            if (p == priority::bulk)
+            {
+                bulk_in_use_ += size;
+            }
+        }
+
+        // Admits waiting sessions in order for as long as they fit. A bulk session is never
+        // let ahead of an interactive one which doesn't fit yet.
+        std::vector<std::function<void()>> admit_waiters()
+        {
+            std::vector<std::function<void()>> admitted;
+            for (const priority p : { priority::interactive, priority::bulk })
+            {
+                auto& queue = queues_[index(p)];
+                while (!queue.empty() && fits(queue.front().size, p))
+                {
+                    take(queue.front().size, p);
+                    admitted.push_back(std::move(queue.front().admit));
+                    queue.pop_front();
+                }
+
+                if (!queue.empty())
+                {
+                    break;
+                }
+            }
+
+            return admitted;
+        }
+
+    public:
+        explicit scheduler(const options& options)
+            : options_{ options }
+        {
+        }
+
+        scheduler(const scheduler&) = delete;
+        scheduler& operator=(const scheduler&) = delete;
+
+        // Admits `size` bytes of priority `p` straight away if they fit and nobody is ahead
+        // of them. Otherwise queues them and calls `admit` once they're admitted, on
+        // whichever thread releases the memory they needed.
+        decision request(const std::uint64_t size, const priority p, std::function<void()> admit)
+        {
+            std::lock_guard lock{ mutex_ };
+            if (size > limit(p))
+            {
+                return decision::rejected;
+            }
+
+            bool ahead = !queues_[index(p)].empty();
+            if (p == priority::bulk)
+            {
+                ahead = ahead || !queues_[index(priority::interactive)].empty();
+            }
+
+            if (!ahead && fits(size, p))
+            {
+                take(size, p);
+                return decision::admitted;
+            }
+
+            if (queues_[index(p)].size() >= options_.max_queued)
+            {
+                return decision::rejected;
+            }
+
+            queues_[index(p)].push_back(waiter{ .size = size, .admit = std::move(admit) });
+            return decision::queued;
+        }
+
+        // Gives back what an admitted session took and admits whoever fits now.
+        void release(const std::uint64_t size, const priority p)
+        {
+            std::vector<std::function<void()>> admitted;
+            {
+                std::lock_guard lock{ mutex_ };
+                in_use_ -= size;
+                if (p == priority::bulk)
+                {
+                    bulk_in_use_ -= size;
+                }
+
+                admitted = admit_waiters();
+            }
+
+            for (auto& admit : admitted)
+            {
+                admit();
+            }
+        }
+
+        std::uint64_t in_use()
+        {
+            std::lock_guard lock{ mutex_ };
+            return in_use_;
+        }
+
+        std::size_t queued()
+        {
+            std::lock_guard lock{ mutex_ };
+            return queues_[0].size() + queues_[1].size();
+        }
+    };
+
+    // The memory an admitted session holds until it's done.
+    class ticket
+    {
+        scheduler* scheduler_;
+        std::uint64_t size_;
+        priority priority_;
+
+    public:
+        ticket(scheduler& scheduler, const std::uint64_t size, const priority p)
+            : scheduler_{ &scheduler }
+            , size_{ size }
+            , priority_{ p }
+        {
+        }
+
+        ticket(ticket&& other) noexcept
+            : scheduler_{ std::exchange(other.scheduler_, nullptr) }
+            , size_{ other.size_ }
+            , priority_{ other.priority_ }
+        {
+        }
+
+        ticket(const ticket&) = delete;
+        ticket& operator=(const ticket&) = delete;
+        ticket& operator=(ticket&&) = delete;
+
+        ~ticket()
+        {
+            if (scheduler_)
+            {
+                scheduler_->release(size_, priority_);
+            }
+        }
+    };
+}
@@ -25,9 +25,18 @@
 
 namespace netfork::io
 {
-    std::expected<unique_nt_handle<default_nt_handle_deleter>, NTSTATUS> create_temporary_image(
+    enum class image_lifetime
+    {
+        // Deleted as soon as the last handle to it is closed.
+        temporary,
+        // Kept on disk, e.g. for the image cache.
+        persistent
+    };
+
+    std::expected<unique_nt_handle<default_nt_handle_deleter>, NTSTATUS> create_image_file(
         const DWORD image_size_in_bytes,
-        UNICODE_STRING& image_path)
+        UNICODE_STRING& image_path,
+        const image_lifetime lifetime = image_lifetime::temporary)
     {
         unique_nt_handle image_handle{};
 
@@ -40,16 +49,17 @@ namespace netfork::io
         file_size.LowPart = image_size_in_bytes;
         file_size.HighPart = 0;
 
+        const bool temporary = lifetime == image_lifetime::temporary;
         NTSTATUS status = ::NtCreateFile(
             &image_handle.get(),
             DELETE | FILE_GENERIC_READ | FILE_GENERIC_WRITE,
             &obj_attr,
             &isb,
             &file_size,
-            FILE_ATTRIBUTE_TEMPORARY,
+            temporary ? FILE_ATTRIBUTE_TEMPORARY : FILE_ATTRIBUTE_NORMAL,
             FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
             FILE_OVERWRITE_IF,
-            FILE_SYNCHRONOUS_IO_NONALERT | FILE_DELETE_ON_CLOSE,
+            FILE_SYNCHRONOUS_IO_NONALERT | (temporary ? FILE_DELETE_ON_CLOSE : 0),
             nullptr,
             0
         );
@@ -58,19 +68,22 @@ namespace netfork::io
             return std::unexpected{ status };
         }
 
-        // Mark the temporary file for deletion.
-        FILE_DISPOSITION_INFORMATION disposition;
-        disposition.DeleteFile = true;
-        status = ::NtSetInformationFile(
-            image_handle.get(),
-            &isb,
-            &disposition,
-            sizeof(disposition),
-            ::FileDispositionInformation
-        );
-        if (NT_ERROR(status))
+        if (temporary)
         {
-            return std::unexpected{ status };
+            // Mark the temporary file for deletion.
+            FILE_DISPOSITION_INFORMATION disposition;
+            disposition.DeleteFile = true;
+            status = ::NtSetInformationFile(
+                image_handle.get(),
+                &isb,
+                &disposition,
+                sizeof(disposition),
+                ::FileDispositionInformation
+            );
+            if (NT_ERROR(status))
+            {
+                return std::unexpected{ status };
+            }
         }
 
         // Give the file a size so that a file mapping view can be created.
@@ -0,0 +1,247 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <expected>
+#include <format>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include "proc.hpp"
+
+#include <netfork-shared/log.hpp>
+#include <netfork-shared/page_hash.hpp>
+#include <netfork-shared/phnt_stub.hpp>
+#include <netfork-shared/utils.hpp>
+
+namespace netfork::io
+{
+    // Images kept open at once. Evicted images are deleted from disk unless a forked process
+    // still has them mapped.
+    constexpr const std::size_t MAX_CACHED_IMAGES = 16;
+
+    struct image_key
+    {
+        page_hash read_only_hash;
+        std::uint64_t image_base = 0;
+        DWORD size_of_image = 0;
+
+        friend bool operator==(const image_key&, const image_key&) = default;
+    };
+
+    struct image_key_hasher
+    {
+        std::size_t operator()(const image_key& key) const noexcept
+        {
+            return page_hash_hasher{}(key.read_only_hash)
+                ^ static_cast<std::size_t>(key.image_base)
+                ^ key.size_of_image;
+        }
+    };
+
+    // An image file patched by `pe::modify_pe_image_for_execution`, and the image section
+    // created from it.
+    struct prepared_image
+    {
+        unique_nt_handle<default_nt_handle_deleter> file;
+        unique_nt_handle<default_nt_handle_deleter> section;
+    };
+
+    // Prepared images keyed by `image_key`, so a repeat fork of the same executable skips
+    // receiving, writing and patching the image.
+    //
+    // The key is part of the file name, which lets images prepared by an earlier run of the
+    // server be picked up again. Images are staged under a separate name until they're fully
+    // prepared, so a crash can't leave a half-written image behind under a valid key.
+    class image_cache
+    {
+        std::wstring directory_;
+
+        std::mutex mutex_;
+        // Most recently used first.
+        std::list<image_key> lru_;
+        std::unordered_map<
+            image_key,
+            std::pair<std::shared_ptr<const prepared_image>, std::list<image_key>::iterator>,
+            image_key_hasher
+        > images_;
+
+        explicit image_cache(std::wstring directory)
+            : directory_{ std::move(directory) }
+        {
+        }
+
+        std::wstring file_name_of(const image_key& key) const
+        {
+            return std::format(
+                L"{}\\{:016x}{:016x}-{:x}-{:x}",
+                directory_,
+                key.read_only_hash.high,
+                key.read_only_hash.low,
+                key.image_base,
+                key.size_of_image
+            );
+        }
+
+        std::wstring path_of(const image_key& key) const
+        {
+            return file_name_of(key) + L".exe";
+        }
+
+        std::wstring staging_path_of(const image_key& key, const std::uint64_t session_id) const
+        {
+            return std::format(L"{}-{:x}.partial", file_name_of(key), session_id);
+        }
+
+        static std::shared_ptr<const prepared_image> open_prepared_image(const std::wstring& path)
+        {
+            unique_nt_handle<> file{ ::CreateFileW(
+                path.c_str(),
+                GENERIC_READ | GENERIC_EXECUTE,
+                FILE_SHARE_READ | FILE_SHARE_DELETE,
+                nullptr,
+                OPEN_EXISTING,
+                FILE_ATTRIBUTE_NORMAL,
+                nullptr
+            ) };
+            if (!file)
+            {
+                return nullptr;
+            }
+
+            auto section = proc::create_image_section(file.get());
+            if (!section)
+            {
+                LOG_DEBUG_ERR() << "Failed to create section for cached image; status: "
+                    << section.error() << std::endl;
+                return nullptr;
+            }
+
+            return std::make_shared<const prepared_image>(prepared_image{
+                .file = std::move(file),
+                .section = std::move(section).value()
+            });
+        }
+
+        // Must be called with `mutex_` held.
+        std::shared_ptr<const prepared_image> remember(const image_key& key, std::shared_ptr<const prepared_image> image)
+        {
+            lru_.push_front(key);
+            images_.insert_or_assign(key, std::make_pair(image, lru_.begin()));
+
+            while (images_.size() > MAX_CACHED_IMAGES)
+            {
+                const image_key evicted = lru_.back();
+                lru_.pop_back();
+                images_.erase(evicted);
+                // Fails while a forked process still maps the image; it's then left for a
+                // later run of the server to reuse.
+                ::DeleteFileW(path_of(evicted).c_str());
+            }
+
+            return image;
+        }
+
+    public:
+        image_cache(const image_cache&) = delete;
+        image_cache& operator=(const image_cache&) = delete;
+
+        // `directory` is a DOS path, created if it doesn't exist yet.
+        static std::expected<std::unique_ptr<image_cache>, HRESULT> open(std::wstring directory)
+        {
+            if (!::CreateDirectoryW(directory.c_str(), nullptr)
+                && ::GetLastError() != ERROR_ALREADY_EXISTS)
+            {
+                return std::unexpected{ HRESULT_FROM_WIN32(::GetLastError()) };
+            }
+
+            return std::unique_ptr<image_cache>{ new image_cache{ std::move(directory) } };
+        }
+
+        std::shared_ptr<const prepared_image> find(const image_key& key)
+        {
+            std::lock_guard lock{ mutex_ };
+            if (const auto it = images_.find(key); it != images_.end())
+            {
+                lru_.splice(lru_.begin(), lru_, it->second.second);
+                return it->second.first;
+            }
+
+            auto image = open_prepared_image(path_of(key));
+            if (!image)
+            {
+                return nullptr;
+            }
+
+            LOG_DEBUG() << "Reusing image prepared by an earlier run" << std::endl;
+            return remember(key, std::move(image));
+        }
+
+        // NT path of the file an image is written and patched in before `insert` is called.
+        // Sessions forking the same image at once each stage their own copy.
+        std::wstring staging_nt_path(const image_key& key, const std::uint64_t session_id) const
+        {
+            return L"\\??\\" + staging_path_of(key, session_id);
+        }
+
+        // Deletes an image staged under `key` which won't be inserted. Every handle to the
+        // staged file must have been closed.
+        void discard(const image_key& key, const std::uint64_t session_id) const
+        {
+            ::DeleteFileW(staging_path_of(key, session_id).c_str());
+        }
+
+        // Moves a fully prepared image from its staging path into the cache. Every handle to
+        // the staged file must have been closed. If another session got there first, its
+        // image is used and the staged copy is thrown away.
+        std::expected<std::shared_ptr<const prepared_image>, HRESULT> insert(const image_key& key, const std::uint64_t session_id)
+        {
+            const std::wstring staged_path = staging_path_of(key, session_id);
+            const std::wstring path = path_of(key);
+
+            std::lock_guard lock{ mutex_ };
+            if (const auto it = images_.find(key); it != images_.end())
+            {
+                ::DeleteFileW(staged_path.c_str());
+                lru_.splice(lru_.begin(), lru_, it->second.second);
+                return it->second.first;
+            }
+
+            if (!::MoveFileExW(staged_path.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING))
+            {
+                const HRESULT result = HRESULT_FROM_WIN32(::GetLastError());
+                ::DeleteFileW(staged_path.c_str());
+                return std::unexpected{ result };
+            }
+
+            auto image = open_prepared_image(path);
+            if (!image)
+            {
+                return std::unexpected{ INTERNAL_NETFORK_ERROR };
+            }
+
+            return remember(key, std::move(image));
+        }
+    };
+}
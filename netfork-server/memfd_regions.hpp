@@ -0,0 +1,189 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// The Linux backend of shared regions (see shared_memory.hpp for the Windows one). Each
+// region is a memfd the server maps anywhere, so its payload is received straight into
+// memory the child sees, with no copy into the child afterwards.
+//
+// Linux can't map into another process, so the child maps the regions itself: it inherits
+// the descriptors across the fork (or is passed them over a Unix socket) and calls
+// `map_fixed` before it runs, which maps each memfd over its base with MAP_FIXED. The tests
+// and benchmarks fork such a child from their own process.
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <netfork-shared/log.hpp>
+
+namespace netfork::vm
+{
+    struct memfd_region
+    {
+        std::uint64_t base_address;
+        std::uint64_t size;
+        int fd;
+        std::byte* view;
+    };
+
+    // The shared regions of one forked process, in ascending address order.
+    class memfd_regions
+    {
+        std::vector<memfd_region> regions_;
+
+        std::vector<memfd_region>::iterator find_region(const std::uint64_t address)
+        {
+            auto it = std::upper_bound(regions_.begin(), regions_.end(), address, [](const std::uint64_t address, const memfd_region& region)
+            {
+                return address < region.base_address;
+            });
+            if (it == regions_.begin())
+            {
+                return regions_.end();
+            }
+
+            --it;
+            return address - it->base_address < it->size ? it : regions_.end();
+        }
+
+        static void release(const memfd_region& region) noexcept
+        {
+            ::munmap(region.view, region.size);
+            ::close(region.fd);
+        }
+
+    public:
+        memfd_regions() = default;
+        memfd_regions(const memfd_regions&) = delete;
+        memfd_regions& operator=(const memfd_regions&) = delete;
+
+        ~memfd_regions()
+        {
+            release_views();
+        }
+
+        // Creates a memfd of `size` bytes for the region at `base_address` and maps it
+        // anywhere in the server. It's zero-filled and writable. Returns false if the region
+        // should be planned as private memory instead.
+        bool map(const std::uint64_t base_address, const std::uint64_t size)
+        {
+            const int fd = ::memfd_create("netfork-region", MFD_CLOEXEC);
+            if (fd == -1)
+            {
+                LOG_DEBUG_ERR() << "Failed to create memfd for region at 0x" << std::hex
+                    << base_address << std::dec << " errno: " << errno << std::endl;
+                return false;
+            }
+
+            if (::ftruncate(fd, static_cast<off_t>(size)) != 0)
+            {
+                LOG_DEBUG_ERR() << "Failed to size memfd of region at 0x" << std::hex
+                    << base_address << std::dec << " errno: " << errno << std::endl;
+                ::close(fd);
+                return false;
+            }
+
+            void* view = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (view == MAP_FAILED)
+            {
+                LOG_DEBUG_ERR() << "Failed to map memfd of region at 0x" << std::hex
+                    << base_address << std::dec << " errno: " << errno << std::endl;
+                ::close(fd);
+                return false;
+            }
+
+            const auto it = std::upper_bound(regions_.begin(), regions_.end(), base_address, [](const std::uint64_t address, const memfd_region& shared)
+            {
+                return address < shared.base_address;
+            });
+            regions_.insert(it, memfd_region{
+                .base_address = base_address,
+                .size = size,
+                .fd = fd,
+                .view = static_cast<std::byte*>(view)
+            });
+            return true;
+        }
+
+        // Run in the forked process: maps every region over its base with MAP_FIXED,
+        // replacing whatever was reserved there. Returns false if any of them failed.
+        bool map_fixed(const int prot = PROT_READ | PROT_WRITE) const noexcept
+        {
+            for (const auto& region : regions_)
+            {
+                void* mapped = ::mmap(reinterpret_cast<void*>(region.base_address), region.size, prot, MAP_SHARED | MAP_FIXED, region.fd, 0);
+                if (mapped == MAP_FAILED)
+                {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+        // Unmaps the server's view of the region at `base_address` and closes its memfd; the
+        // forked process keeps its own mapping. Returns false if it isn't shared.
+        bool unmap(const std::uint64_t base_address)
+        {
+            const auto it = find_region(base_address);
+            if (it == regions_.end() || it->base_address != base_address)
+            {
+                return false;
+            }
+
+            release(*it);
+            regions_.erase(it);
+            return true;
+        }
+
+        // The server's view of `[address, address + size)`, or null if that isn't entirely
+        // inside one shared region.
+        std::byte* find(const std::uint64_t address, const std::uint64_t size)
+        {
+            const auto it = find_region(address);
+            if (it == regions_.end() || size > it->size - (address - it->base_address))
+            {
+                return nullptr;
+            }
+
+            return it->view + (address - it->base_address);
+        }
+
+        // Unmaps every view of the server; the forked process keeps its own.
+        void release_views()
+        {
+            for (const auto& region : regions_)
+            {
+                release(region);
+            }
+
+            regions_.clear();
+        }
+
+        std::size_t size() const noexcept
+        {
+            return regions_.size();
+        }
+    };
+}
@@ -0,0 +1,380 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <format>
+#include <iterator>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <netfork-shared/log.hpp>
+#include <netfork-shared/net/sock.hpp>
+#include <netfork-shared/phnt_stub.hpp>
+
+namespace netfork::metrics
+{
+    enum class counter : std::size_t
+    {
+        sessions_started,
+        sessions_served,
+        // Turned down by admission control.
+        sessions_rejected,
+        // Image, overlay and payload bytes, after decompression.
+        received_bytes,
+        // Bytes written into forked processes, by a writer or straight into shared memory.
+        written_bytes,
+        // Bytes passed on to downstream servers, every hop counted.
+        relayed_bytes,
+        count
+    };
+
+    // The phases of a session whose latency is tracked, and to which a failed session is
+    // attributed.
+    enum class phase : std::size_t
+    {
+        handshake,
+        image,
+        process_create,
+        vm_rebuild,
+        thread_start,
+        // One downstream hop of a relayed fork, from connecting to the last byte sent.
+        relay,
+        count
+    };
+
+    constexpr const std::array<std::string_view, std::to_underlying(phase::count)> PHASE_NAMES{
+        "handshake",
+        "image",
+        "process_create",
+        "vm_rebuild",
+        "thread_start",
+        "relay"
+    };
+
+    // Upper bounds of the latency buckets, in seconds; every phase also has a +Inf bucket.
+    constexpr const std::array<double, 14> LATENCY_BUCKETS{
+        0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0
+    };
+
+    constexpr const std::size_t COUNTER_COUNT = std::to_underlying(counter::count);
+    constexpr const std::size_t PHASE_COUNT = std::to_underlying(phase::count);
+
+    // The metrics recorded by one thread. Only that thread writes them, so a write is a
+    // plain load and store rather than a locked read-modify-write; a scrape may read them at
+    // any time and sees each value either before or after a write.
+    struct shard
+    {
+        std::array<std::atomic<std::uint64_t>, COUNTER_COUNT> counters{};
+        std::array<std::atomic<std::uint64_t>, PHASE_COUNT> failures{};
+        std::array<std::array<std::atomic<std::uint64_t>, LATENCY_BUCKETS.size() + 1>, PHASE_COUNT> latency_buckets{};
+        std::array<std::atomic<std::uint64_t>, PHASE_COUNT> latency_sum_us{};
+    };
+
+    // Every metric summed over every thread.
+    struct snapshot
+    {
+        std::int64_t sessions_in_flight = 0;
+        std::array<std::uint64_t, COUNTER_COUNT> counters{};
+        std::array<std::uint64_t, PHASE_COUNT> failures{};
+        std::array<std::array<std::uint64_t, LATENCY_BUCKETS.size() + 1>, PHASE_COUNT> latency_buckets{};
+        std::array<std::uint64_t, PHASE_COUNT> latency_sum_us{};
+    };
+
+    class registry
+    {
+        std::mutex mutex_;
+        std::vector<shard*> shards_;
+        // What the threads which have exited recorded.
+        shard retired_;
+        std::atomic<std::int64_t> sessions_in_flight_ = 0;
+
+        template <std::size_t N>
+        static void add(std::array<std::uint64_t, N>& to, const std::array<std::atomic<std::uint64_t>, N>& from)
+        {
+            for (std::size_t i = 0; i < N; i++)
+            {
+                to[i] += from[i].load(std::memory_order_relaxed);
+            }
+        }
+
+        template <std::size_t N>
+        static void retire(std::array<std::atomic<std::uint64_t>, N>& to, const std::array<std::atomic<std::uint64_t>, N>& from)
+        {
+            for (std::size_t i = 0; i < N; i++)
+            {
+                to[i].fetch_add(from[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+            }
+        }
+
+        static void add(snapshot& to, const shard& from)
+        {
+            add(to.counters, from.counters);
+            add(to.failures, from.failures);
+            add(to.latency_sum_us, from.latency_sum_us);
+            for (std::size_t i = 0; i < PHASE_COUNT; i++)
+            {
+                add(to.latency_buckets[i], from.latency_buckets[i]);
+            }
+        }
+
+    public:
+        static registry& instance()
+        {
+            static registry global;
+            return global;
+        }
+
+        void attach(shard& local)
+        {
+            std::lock_guard lock{ mutex_ };
+            shards_.push_back(&local);
+        }
+
+        // Folds what an exiting thread recorded into the totals, so its shard can go away.
+        void detach(shard& local)
+        {
+            std::lock_guard lock{ mutex_ };
+            retire(retired_.counters, local.counters);
+            retire(retired_.failures, local.failures);
+            retire(retired_.latency_sum_us, local.latency_sum_us);
+            for (std::size_t i = 0; i < PHASE_COUNT; i++)
+            {
+                retire(retired_.latency_buckets[i], local.latency_buckets[i]);
+            }
+
+            shards_.erase(std::find(shards_.begin(), shards_.end(), &local));
+        }
+
+        std::atomic<std::int64_t>& sessions_in_flight() noexcept
+        {
+            return sessions_in_flight_;
+        }
+
+        snapshot collect()
+        {
+            snapshot total{ .sessions_in_flight = sessions_in_flight_.load(std::memory_order_relaxed) };
+            std::lock_guard lock{ mutex_ };
+            add(total, retired_);
+            for (const shard* local : shards_)
+            {
+                add(total, *local);
+            }
+
+            return total;
+        }
+    };
+
+    // The shard of the calling thread, attached on first use and detached when it exits.
+    shard& local_shard()
+    {
+        struct attachment
+        {
+            shard local;
+
+            attachment()
+            {
+                registry::instance().attach(local);
+            }
+
+            ~attachment()
+            {
+                registry::instance().detach(local);
+            }
+        };
+
+        thread_local attachment attached;
+        return attached.local;
+    }
+
+    void bump(std::atomic<std::uint64_t>& value, const std::uint64_t amount)
+    {
+        value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    void add(const counter which, const std::uint64_t amount = 1)
+    {
+        bump(local_shard().counters[std::to_underlying(which)], amount);
+    }
+
+    void record_failure(const phase which)
+    {
+        bump(local_shard().failures[std::to_underlying(which)], 1);
+    }
+
+    void record_latency(const phase which, const std::chrono::steady_clock::duration latency)
+    {
+        const double seconds = std::chrono::duration<double>(latency).count();
+        const auto bucket = std::distance(
+            LATENCY_BUCKETS.begin(),
+            std::lower_bound(LATENCY_BUCKETS.begin(), LATENCY_BUCKETS.end(), seconds)
+        );
+
+        shard& local = local_shard();
+        bump(local.latency_buckets[std::to_underlying(which)][bucket], 1);
+        bump(
+            local.latency_sum_us[std::to_underlying(which)],
+            std::chrono::duration_cast<std::chrono::microseconds>(latency).count()
+        );
+    }
+
+    // Counts a session as in flight for as long as it's alive.
+    class in_flight
+    {
+    public:
+        in_flight()
+        {
+            registry::instance().sessions_in_flight().fetch_add(1, std::memory_order_relaxed);
+        }
+
+        in_flight(const in_flight&) = delete;
+        in_flight& operator=(const in_flight&) = delete;
+
+        ~in_flight()
+        {
+            registry::instance().sessions_in_flight().fetch_sub(1, std::memory_order_relaxed);
+        }
+    };
+
+    // Every metric in the Prometheus text exposition format.
+    std::string render(const snapshot& metrics)
+    {
+        std::string text;
+        auto out = std::back_inserter(text);
+        const auto counter_value = [&](const counter which)
+        {
+            return metrics.counters[std::to_underlying(which)];
+        };
+
+        std::format_to(out,
+            "# HELP netfork_sessions_in_flight Fork sessions being served.\n"
+            "# TYPE netfork_sessions_in_flight gauge\n"
+            "netfork_sessions_in_flight {}\n"
+            "# HELP netfork_sessions_started_total Fork sessions accepted.\n"
+            "# TYPE netfork_sessions_started_total counter\n"
+            "netfork_sessions_started_total {}\n"
+            "# HELP netfork_sessions_served_total Fork sessions which served their fork.\n"
+            "# TYPE netfork_sessions_served_total counter\n"
+            "netfork_sessions_served_total {}\n"
+            "# HELP netfork_sessions_rejected_total Fork sessions turned down for lack of memory.\n"
+            "# TYPE netfork_sessions_rejected_total counter\n"
+            "netfork_sessions_rejected_total {}\n"
+            "# HELP netfork_received_bytes_total Image, overlay and payload bytes received.\n"
+            "# TYPE netfork_received_bytes_total counter\n"
+            "netfork_received_bytes_total {}\n"
+            "# HELP netfork_written_bytes_total Bytes written into forked processes.\n"
+            "# TYPE netfork_written_bytes_total counter\n"
+            "netfork_written_bytes_total {}\n"
+            "# HELP netfork_relayed_bytes_total Bytes passed on to downstream servers.\n"
+            "# TYPE netfork_relayed_bytes_total counter\n"
+            "netfork_relayed_bytes_total {}\n",
+            metrics.sessions_in_flight,
+            counter_value(counter::sessions_started),
+            counter_value(counter::sessions_served),
+            counter_value(counter::sessions_rejected),
+            counter_value(counter::received_bytes),
+            counter_value(counter::written_bytes),
+            counter_value(counter::relayed_bytes)
+        );
+
+        std::format_to(out,
+            "# HELP netfork_session_failures_total Failed fork sessions by the phase they failed in.\n"
+            "# TYPE netfork_session_failures_total counter\n");
+        for (std::size_t i = 0; i < PHASE_COUNT; i++)
+        {
+            std::format_to(out, "netfork_session_failures_total{{phase=\"{}\"}} {}\n", PHASE_NAMES[i], metrics.failures[i]);
+        }
+
+        std::format_to(out,
+            "# HELP netfork_phase_duration_seconds How long each phase of a session took.\n"
+            "# TYPE netfork_phase_duration_seconds histogram\n");
+        for (std::size_t i = 0; i < PHASE_COUNT; i++)
+        {
+            std::uint64_t cumulative = 0;
+            for (std::size_t bucket = 0; bucket < LATENCY_BUCKETS.size(); bucket++)
+            {
+                cumulative += metrics.latency_buckets[i][bucket];
+                std::format_to(out, "netfork_phase_duration_seconds_bucket{{phase=\"{}\",le=\"{}\"}} {}\n",
+                    PHASE_NAMES[i], LATENCY_BUCKETS[bucket], cumulative);
+            }
+
+            cumulative += metrics.latency_buckets[i].back();
+            std::format_to(out,
+                "netfork_phase_duration_seconds_bucket{{phase=\"{0}\",le=\"+Inf\"}} {1}\n"
+                "netfork_phase_duration_seconds_sum{{phase=\"{0}\"}} {2}\n"
+                "netfork_phase_duration_seconds_count{{phase=\"{0}\"}} {1}\n",
+                PHASE_NAMES[i], cumulative, metrics.latency_sum_us[i] / 1e6);
+        }
+
+        return text;
+    }
+
+    // Answers every HTTP request on `listen_sock` with the current metrics, whatever its
+    // path, until the socket is closed. Requests are served one at a time.
+    void serve(SOCKET listen_sock)
+    {
+        while (true)
+        {
+            SOCKET client_sock = ::accept(listen_sock, nullptr, nullptr);
+            if (client_sock == INVALID_SOCKET)
+            {
+                LOG_DEBUG_ERR() << "Metrics endpoint stopped; WSAGetLastError: " << ::WSAGetLastError() << std::endl;
+                return;
+            }
+
+            // Only the end of the request headers matters.
+            std::array<char, 4096> request{};
+            std::size_t request_size = 0;
+            while (request_size < request.size()
+                && std::string_view{ request.data(), request_size }.find("\r\n\r\n") == std::string_view::npos)
+            {
+                const int rc = ::recv(client_sock, request.data() + request_size, static_cast<int>(request.size() - request_size), 0);
+                if (rc <= 0)
+                {
+                    break;
+                }
+
+                request_size += rc;
+            }
+
+            const std::string body = render(registry::instance().collect());
+            const std::string response = std::format(
+                "HTTP/1.1 200 OK\r\n"
+                "Content-Type: text/plain; version=0.0.4\r\n"
+                "Content-Length: {}\r\n"
+                "Connection: close\r\n"
+                "\r\n"
+                "{}",
+                body.size(),
+                body
+            );
+            net::send_bytes(client_sock, std::as_bytes(std::span{ response }));
+            ::shutdown(client_sock, SD_BOTH);
+            ::closesocket(client_sock);
+        }
+    }
+}
@@ -0,0 +1,468 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <expected>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <netfork-shared/auto.hpp>
+#include <netfork-shared/log.hpp>
+#include <netfork-shared/page_hash.hpp>
+#include <netfork-shared/phnt_stub.hpp>
+#include <netfork-shared/utils.hpp>
+
+namespace netfork::store
+{
+    // 256 MiB of pages in memory and 4 GiB on disk.
+    constexpr const std::size_t DEFAULT_MEMORY_PAGES = 64 * 1024;
+    constexpr const std::size_t DEFAULT_DISK_PAGES = 1024 * 1024;
+    // Every log record is the page's hash followed by its bytes.
+    constexpr const std::size_t LOG_RECORD_SIZE = PAGE_HASH_SIZE + HASHED_PAGE_SIZE;
+    // Compacting a small log isn't worth the I/O.
+    constexpr const std::uint64_t MIN_DEAD_RECORDS_TO_COMPACT = 4096;
+
+    struct page_store_counters
+    {
+        std::uint64_t lookups = 0;
+        std::uint64_t hits = 0;
+        // Page bytes which clients didn't have to send thanks to hits.
+        std::uint64_t bytes_saved = 0;
+        std::uint64_t pages_stored = 0;
+        std::uint64_t pages_evicted = 0;
+
+        double hit_rate() const noexcept
+        {
+            return lookups != 0 ? static_cast<double>(hits) / static_cast<double>(lookups) : 0.0;
+        }
+    };
+
+    // Content-addressed store of pages, shared by every fork the server rebuilds.
+    //
+    // Every page is appended to a log file as a (hash, bytes) record so the store survives
+    // restarts; opening the store scans the log to rebuild the index. The most recently used
+    // pages are also kept in memory. Both tiers evict the least recently used pages first,
+    // and the log is compacted once more of it is dead records than live ones.
+    //
+    // Hashes from clients are only used as lookup keys: the hash a page is stored under is
+    // always computed here from its bytes.
+    class page_store
+    {
+        struct entry
+        {
+            std::uint64_t log_offset = 0;
+            std::list<page_hash>::iterator lru_position;
+            // Only meaningful while `page` is set.
+            std::list<page_hash>::iterator cached_position;
+            std::unique_ptr<std::byte[]> page;
+        };
+
+        std::wstring path_;
+        unique_handle<> log_;
+        std::uint64_t log_size_ = 0;
+        std::uint64_t dead_records_ = 0;
+        std::size_t memory_capacity_;
+        std::size_t disk_capacity_;
+
+        std::unordered_map<page_hash, entry, page_hash_hasher> index_;
+        // Most recently used first.
+        std::list<page_hash> lru_;
+        // Entries holding their page in memory, most recently used first.
+        std::list<page_hash> cached_;
+        page_store_counters counters_;
+        mutable std::mutex mutex_;
+
+        page_store(std::wstring path, unique_handle<> log, const std::size_t memory_pages, const std::size_t disk_pages)
+            : path_{ std::move(path) }
+            , log_{ std::move(log) }
+            , memory_capacity_{ memory_pages }
+            , disk_capacity_{ disk_pages }
+        {
+        }
+
+        static BOOL read_at(HANDLE file, const std::uint64_t offset, void* buffer, const DWORD size)
+        {
+            OVERLAPPED overlapped{};
+            overlapped.Offset = static_cast<DWORD>(offset);
+            overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+            DWORD bytes_read = 0;
+            return ::ReadFile(file, buffer, size, &bytes_read, &overlapped) && bytes_read == size;
+        }
+
+        static BOOL write_at(HANDLE file, const std::uint64_t offset, const void* buffer, const DWORD size)
+        {
+            OVERLAPPED overlapped{};
+            overlapped.Offset = static_cast<DWORD>(offset);
+            overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+            DWORD bytes_written = 0;
+            return ::WriteFile(file, buffer, size, &bytes_written, &overlapped) && bytes_written == size;
+        }
+
+        static std::array<std::byte, PAGE_HASH_SIZE> encode_hash(const page_hash& hash) noexcept
+        {
+            std::array<std::byte, PAGE_HASH_SIZE> out{};
+            std::memcpy(out.data(), &hash.low, sizeof(hash.low));
+            std::memcpy(out.data() + sizeof(hash.low), &hash.high, sizeof(hash.high));
+            return out;
+        }
+
+        static page_hash decode_hash(const std::byte* in) noexcept
+        {
+            page_hash hash;
+            std::memcpy(&hash.low, in, sizeof(hash.low));
+            std::memcpy(&hash.high, in + sizeof(hash.low), sizeof(hash.high));
+            return hash;
+        }
+
+        void touch(entry& e)
+        {
+            lru_.splice(lru_.begin(), lru_, e.lru_position);
+            if (e.page)
+            {
+                cached_.splice(cached_.begin(), cached_, e.cached_position);
+            }
+        }
+
+        void cache(const page_hash& hash, entry& e, const std::byte* page)
+        {
+            if (!e.page)
+            {
+                e.page = std::make_unique_for_overwrite<std::byte[]>(HASHED_PAGE_SIZE);
+                cached_.push_front(hash);
+                e.cached_position = cached_.begin();
+            }
+
+            std::memcpy(e.page.get(), page, HASHED_PAGE_SIZE);
+
+            while (cached_.size() > memory_capacity_)
+            {
+                index_.at(cached_.back()).page.reset();
+                cached_.pop_back();
+            }
+        }
+
+        void erase(const page_hash& hash)
+        {
+            const auto it = index_.find(hash);
+            if (it == index_.end())
+            {
+                return;
+            }
+
+            if (it->second.page)
+            {
+                cached_.erase(it->second.cached_position);
+            }
+
+            lru_.erase(it->second.lru_position);
+            index_.erase(it);
+            dead_records_++;
+        }
+
+        void evict()
+        {
+            while (index_.size() > disk_capacity_)
+            {
+                erase(lru_.back());
+                counters_.pages_evicted++;
+            }
+
+            if (dead_records_ >= MIN_DEAD_RECORDS_TO_COMPACT && dead_records_ > index_.size())
+            {
+                compact();
+            }
+        }
+
+        // Rewrites the log with only the live records, least recently used first so that
+        // reopening the store restores the same recency order.
+        void compact()
+        {
+            const std::wstring compact_path = path_ + L".compact";
+            unique_handle<> compacted{ ::CreateFileW(
+                compact_path.c_str(),
+                GENERIC_READ | GENERIC_WRITE,
+                0,
+                nullptr,
+                CREATE_ALWAYS,
+                FILE_ATTRIBUTE_NORMAL,
+                nullptr
+            ) };
+            if (!compacted)
+            {
+                LOG_DEBUG_ERR() << "Failed to create compacted page log; GetLastError: "
+                    << ::GetLastError() << std::endl;
+                return;
+            }
+
+            std::vector<std::pair<page_hash, std::uint64_t>> new_offsets;
+            new_offsets.reserve(index_.size());
+            std::vector<std::byte> record(LOG_RECORD_SIZE);
+            std::uint64_t offset = 0;
+            for (auto it = lru_.rbegin(); it != lru_.rend(); ++it)
+            {
+                const auto& e = index_.at(*it);
+                if (e.page)
+                {
+                    const auto hash = encode_hash(*it);
+                    std::memcpy(record.data(), hash.data(), hash.size());
+                    std::memcpy(record.data() + PAGE_HASH_SIZE, e.page.get(), HASHED_PAGE_SIZE);
+                }
+                else if (!read_at(log_.get(), e.log_offset, record.data(), LOG_RECORD_SIZE))
+                {
+                    LOG_DEBUG_ERR() << "Failed to read page log while compacting; GetLastError: "
+                        << ::GetLastError() << std::endl;
+                    compacted.reset(nullptr);
+                    ::DeleteFileW(compact_path.c_str());
+                    return;
+                }
+
+                if (!write_at(compacted.get(), offset, record.data(), LOG_RECORD_SIZE))
+                {
+                    LOG_DEBUG_ERR() << "Failed to write compacted page log; GetLastError: "
+                        << ::GetLastError() << std::endl;
+                    compacted.reset(nullptr);
+                    ::DeleteFileW(compact_path.c_str());
+                    return;
+                }
+
+                new_offsets.emplace_back(*it, offset);
+                offset += LOG_RECORD_SIZE;
+            }
+
+            ::FlushFileBuffers(compacted.get());
+            compacted.reset(nullptr);
+            log_.reset(nullptr);
+            if (!::MoveFileExW(compact_path.c_str(), path_.c_str(), MOVEFILE_REPLACE_EXISTING))
+            {
+                LOG_DEBUG_ERR() << "Failed to replace page log; GetLastError: "
+                    << ::GetLastError() << std::endl;
+                ::DeleteFileW(compact_path.c_str());
+            }
+            else
+            {
+                for (const auto& [hash, new_offset] : new_offsets)
+                {
+                    index_.at(hash).log_offset = new_offset;
+                }
+
+                log_size_ = offset;
+                dead_records_ = 0;
+            }
+
+            log_.reset(::CreateFileW(
+                path_.c_str(),
+                GENERIC_READ | GENERIC_WRITE,
+                FILE_SHARE_READ,
+                nullptr,
+                OPEN_ALWAYS,
+                FILE_ATTRIBUTE_NORMAL,
+                nullptr
+            ));
+            if (!log_)
+            {
+                // Without the log nothing can be read back from disk; start over empty.
+                LOG_DEBUG_ERR() << "Failed to reopen page log; GetLastError: "
+                    << ::GetLastError() << std::endl;
+                index_.clear();
+                lru_.clear();
+                cached_.clear();
+                log_size_ = 0;
+            }
+        }
+
+        // Rebuilds the index from an existing log. A torn record at the end (e.g. from a
+        // crash mid-write) is ignored and overwritten by the next insert.
+        HRESULT load()
+        {
+            LARGE_INTEGER file_size{};
+            if (!::GetFileSizeEx(log_.get(), &file_size))
+            {
+                return HRESULT_FROM_WIN32(::GetLastError());
+            }
+
+            const std::uint64_t records = static_cast<std::uint64_t>(file_size.QuadPart) / LOG_RECORD_SIZE;
+            constexpr std::uint64_t records_per_read = 256;
+            std::vector<std::byte> buffer(records_per_read * LOG_RECORD_SIZE);
+            for (std::uint64_t first = 0; first < records; first += records_per_read)
+            {
+                const std::uint64_t batch = std::min(records_per_read, records - first);
+                if (!read_at(
+                    log_.get(),
+                    first * LOG_RECORD_SIZE,
+                    buffer.data(),
+                    static_cast<DWORD>(batch * LOG_RECORD_SIZE)))
+                {
+                    return HRESULT_FROM_WIN32(::GetLastError());
+                }
+
+                for (std::uint64_t i = 0; i < batch; i++)
+                {
+                    const auto hash = decode_hash(buffer.data() + i * LOG_RECORD_SIZE);
+                    // A later record for the same page supersedes an earlier one.
+                    erase(hash);
+
+                    lru_.push_front(hash);
+                    index_.emplace(hash, entry{
+                        .log_offset = (first + i) * LOG_RECORD_SIZE,
+                        .lru_position = lru_.begin()
+                    });
+                }
+            }
+
+            log_size_ = records * LOG_RECORD_SIZE;
+            evict();
+
+            LOG_DEBUG() << "Loaded " << index_.size() << " pages from the page store" << std::endl;
+            return ERROR_SUCCESS;
+        }
+
+    public:
+        page_store(const page_store&) = delete;
+        page_store& operator=(const page_store&) = delete;
+
+        static std::expected<std::unique_ptr<page_store>, HRESULT> open(
+            std::wstring path,
+            const std::size_t memory_pages = DEFAULT_MEMORY_PAGES,
+            const std::size_t disk_pages = DEFAULT_DISK_PAGES)
+        {
+            unique_handle<> log{ ::CreateFileW(
+                path.c_str(),
+                GENERIC_READ | GENERIC_WRITE,
+                FILE_SHARE_READ,
+                nullptr,
+                OPEN_ALWAYS,
+                FILE_ATTRIBUTE_NORMAL,
+                nullptr
+            ) };
+            if (!log)
+            {
+                return std::unexpected{ HRESULT_FROM_WIN32(::GetLastError()) };
+            }
+
+            std::unique_ptr<page_store> store{
+                new page_store{ std::move(path), std::move(log), memory_pages, disk_pages }
+            };
+            if (const auto result = store->load(); FAILED(result))
+            {
+                return std::unexpected{ result };
+            }
+
+            return store;
+        }
+
+        // Copies the page with `hash` into `out` (`HASHED_PAGE_SIZE` bytes) if it's stored.
+        bool lookup(const page_hash& hash, std::byte* out)
+        {
+            std::lock_guard lock{ mutex_ };
+            counters_.lookups++;
+
+            const auto it = index_.find(hash);
+            if (it == index_.end())
+            {
+                return false;
+            }
+
+            auto& e = it->second;
+            if (e.page)
+            {
+                std::memcpy(out, e.page.get(), HASHED_PAGE_SIZE);
+            }
+            else
+            {
+                std::array<std::byte, LOG_RECORD_SIZE> record;
+                // Check the bytes as well as the recorded hash so a damaged log can only
+                // cost a miss.
+                if (!read_at(log_.get(), e.log_offset, record.data(), LOG_RECORD_SIZE)
+                    || decode_hash(record.data()) != hash
+                    || hash_page(record.data() + PAGE_HASH_SIZE) != hash)
+                {
+                    LOG_DEBUG_ERR() << "Dropping unreadable page at log offset 0x"
+                        << std::hex << e.log_offset << std::dec << std::endl;
+                    erase(hash);
+                    return false;
+                }
+
+                std::memcpy(out, record.data() + PAGE_HASH_SIZE, HASHED_PAGE_SIZE);
+                cache(hash, e, out);
+            }
+
+            touch(e);
+            counters_.hits++;
+            counters_.bytes_saved += HASHED_PAGE_SIZE;
+            return true;
+        }
+
+        // Adds `page` (`HASHED_PAGE_SIZE` bytes) to the store, or marks it as recently used
+        // if it's already there.
+        void insert(const std::byte* page)
+        {
+            const auto hash = hash_page(page);
+
+            std::lock_guard lock{ mutex_ };
+            if (const auto it = index_.find(hash); it != index_.end())
+            {
+                touch(it->second);
+                return;
+            }
+
+            std::array<std::byte, LOG_RECORD_SIZE> record;
+            const auto encoded_hash = encode_hash(hash);
+            std::memcpy(record.data(), encoded_hash.data(), encoded_hash.size());
+            std::memcpy(record.data() + PAGE_HASH_SIZE, page, HASHED_PAGE_SIZE);
+            if (!write_at(log_.get(), log_size_, record.data(), LOG_RECORD_SIZE))
+            {
+                LOG_DEBUG_ERR() << "Failed to append to page log; GetLastError: "
+                    << ::GetLastError() << std::endl;
+                return;
+            }
+
+            lru_.push_front(hash);
+            auto& e = index_.emplace(hash, entry{
+                .log_offset = log_size_,
+                .lru_position = lru_.begin()
+            }).first->second;
+            log_size_ += LOG_RECORD_SIZE;
+            counters_.pages_stored++;
+
+            cache(hash, e, page);
+            evict();
+        }
+
+        page_store_counters counters() const
+        {
+            std::lock_guard lock{ mutex_ };
+            return counters_;
+        }
+
+        std::size_t size() const
+        {
+            std::lock_guard lock{ mutex_ };
+            return index_.size();
+        }
+    };
+}
@@ -0,0 +1,171 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+#include "metrics.hpp"
+#include "write_ring.hpp"
+
+#include <netfork-shared/log.hpp>
+#include <netfork-shared/net/async.hpp>
+#include <netfork-shared/net/manifest.hpp>
+#include <netfork-shared/net/page_data.hpp>
+#include <netfork-shared/phnt_stub.hpp>
+
+namespace netfork::vm
+{
+    BOOL write_process_memory(HANDLE process, const std::uint64_t address, std::span<const std::byte> bytes)
+    {
+        SIZE_T bytes_written = 0;
+        const BOOL write_successful = ::WriteProcessMemory(
+            process,
+            reinterpret_cast<LPVOID>(address),
+            bytes.data(),
+            bytes.size(),
+            &bytes_written
+        );
+        if (!write_successful || bytes_written != bytes.size())
+        {
+            LOG_DEBUG_ERR() << "Failed to write memory at 0x"
+                << std::hex << address << std::dec
+                << " GetLastError: " << ::GetLastError() << std::endl;
+            return FALSE;
+        }
+
+        return TRUE;
+    }
+
+    // The page writer's backend: writes into a forked process and counts what it wrote.
+    bool write_forked_pages(const HANDLE& process, const std::uint64_t address, std::span<const std::byte> bytes)
+    {
+        if (!write_process_memory(process, address, bytes))
+        {
+            return false;
+        }
+
+        metrics::add(metrics::counter::written_bytes, bytes.size());
+        return true;
+    }
+
+    // The write stage of the payload receive, shared by every session. See `write_ring`.
+    using page_writer = write_ring<HANDLE>;
+
+    // Copies the present pages of `run` into a buffer of the ring and queues them to be
+    // written. While every buffer is in flight the session waits for one without holding up
+    // a thread of `context`, and carries on on one of them once a writer frees a buffer.
+    inline auto submit(page_writer::batch& writes, net::io_context& context, const net::page_run& run, std::span<const std::byte> pages)
+    {
+        struct awaiter : net::io_context::operation, page_writer::ring_wait
+        {
+            page_writer::batch* writes;
+            net::io_context* context;
+            net::page_run run;
+            std::span<const std::byte> pages;
+            bool waited = false;
+
+            awaiter(page_writer::batch& writes, net::io_context& context, const net::page_run& run, std::span<const std::byte> pages)
+                : net::io_context::operation{}
+                , writes{ &writes }
+                , context{ &context }
+                , run{ run }
+                , pages{ pages }
+            {
+            }
+
+            bool await_ready() const noexcept
+            {
+                return false;
+            }
+
+            bool await_suspend(std::coroutine_handle<> awaiting)
+            {
+                waiter = awaiting;
+                // Once queued, a writer may hand over a buffer and resume the session before
+                // `submit_or_wait` even returns, so nothing here touches the awaiter after.
+                waited = true;
+                if (writes->submit_or_wait(run, pages, *this))
+                {
+                    waited = false;
+                    return false;
+                }
+
+                return true;
+            }
+
+            void await_resume()
+            {
+                if (waited)
+                {
+                    writes->submit_into(buffer, run, pages);
+                }
+            }
+
+            void ready() override
+            {
+                context->post(*this);
+            }
+        };
+
+        return awaiter{ writes, context, run, pages };
+    }
+
+    // Waits until every run `writes` was given so far has been written, without holding up a
+    // thread of `context`.
+    inline auto drain(page_writer::batch& writes, net::io_context& context)
+    {
+        struct awaiter : net::io_context::operation, page_writer::ring_wait
+        {
+            page_writer::batch* writes;
+            net::io_context* context;
+
+            awaiter(page_writer::batch& writes, net::io_context& context)
+                : net::io_context::operation{}
+                , writes{ &writes }
+                , context{ &context }
+            {
+            }
+
+            bool await_ready() const noexcept
+            {
+                return false;
+            }
+
+            bool await_suspend(std::coroutine_handle<> awaiting)
+            {
+                waiter = awaiting;
+                return !writes->drained_or_wait(*this);
+            }
+
+            void await_resume() const noexcept
+            {
+            }
+
+            void ready() override
+            {
+                context->post(*this);
+            }
+        };
+
+        return awaiter{ writes, context };
+    }
+}
@@ -0,0 +1,263 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <format>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "metrics.hpp"
+
+#include <netfork-shared/log.hpp>
+#include <netfork-shared/net/async.hpp>
+#include <netfork-shared/pipeline.hpp>
+
+namespace netfork::phases
+{
+    // When each phase of a session started and ended, relative to the start of the session.
+    // Phases may run on any thread and overlap; the log shows by how much. How long each
+    // one took is recorded in the metrics of the phase it belongs to.
+    class timeline
+    {
+        struct entry
+        {
+            std::string_view name;
+            metrics::phase metric;
+            std::chrono::steady_clock::duration start;
+            std::optional<std::chrono::steady_clock::duration> end;
+        };
+
+        const std::chrono::steady_clock::time_point origin_ = std::chrono::steady_clock::now();
+        std::mutex mutex_;
+        std::vector<entry> entries_;
+        std::optional<metrics::phase> failed_;
+        bool rejected_ = false;
+
+        std::chrono::steady_clock::duration elapsed() const
+        {
+            return std::chrono::steady_clock::now() - origin_;
+        }
+
+    public:
+        // Ends its phase when it goes out of scope, unless ended earlier.
+        class phase
+        {
+            timeline* timeline_;
+            std::size_t index_;
+
+            friend class timeline;
+
+            phase(timeline& timeline, const std::size_t index)
+                : timeline_{ &timeline }
+                , index_{ index }
+            {
+            }
+
+        public:
+            phase(phase&& other) noexcept
+                : timeline_{ std::exchange(other.timeline_, nullptr) }
+                , index_{ other.index_ }
+            {
+            }
+
+            phase(const phase&) = delete;
+            phase& operator=(const phase&) = delete;
+            phase& operator=(phase&&) = delete;
+
+            ~phase()
+            {
+                end();
+            }
+
+            void end()
+            {
+                if (timeline_)
+                {
+                    std::lock_guard lock{ timeline_->mutex_ };
+                    auto& e = timeline_->entries_[index_];
+                    e.end = timeline_->elapsed();
+                    metrics::record_latency(e.metric, e.end.value() - e.start);
+                    timeline_ = nullptr;
+                }
+            }
+        };
+
+        timeline() = default;
+        timeline(const timeline&) = delete;
+        timeline& operator=(const timeline&) = delete;
+
+        // `name` must outlive the timeline.
+        phase begin(const std::string_view name, const metrics::phase metric)
+        {
+            std::lock_guard lock{ mutex_ };
+            entries_.push_back(entry{ .name = name, .metric = metric, .start = elapsed(), .end = std::nullopt });
+            return phase{ *this, entries_.size() - 1 };
+        }
+
+        // Blames a failed session on `metric`, for a phase whose failure only shows once a
+        // later phase has begun.
+        void fail(const metrics::phase metric)
+        {
+            std::lock_guard lock{ mutex_ };
+            failed_ = metric;
+        }
+
+        // The session was turned away before any of its phases could fail, and is counted as
+        // rejected rather than failed.
+        void reject()
+        {
+            std::lock_guard lock{ mutex_ };
+            rejected_ = true;
+        }
+
+        // The phase a failed session is blamed on: the one given to `fail`, if any, or else
+        // the last phase to begin. None for a rejected session.
+        std::optional<metrics::phase> failed_phase()
+        {
+            std::lock_guard lock{ mutex_ };
+            if (rejected_)
+            {
+                return std::nullopt;
+            }
+
+            if (failed_)
+            {
+                return failed_.value();
+            }
+
+            return entries_.empty() ? metrics::phase::handshake : entries_.back().metric;
+        }
+
+        void log(const std::uint64_t session_id)
+        {
+            using std::chrono::duration_cast;
+            using std::chrono::microseconds;
+
+            std::lock_guard lock{ mutex_ };
+            LOG_DEBUG() << "Timeline of session " << session_id << ":" << std::endl;
+            for (const auto& e : entries_)
+            {
+                const auto start = duration_cast<microseconds>(e.start).count();
+                const std::string end = e.end
+                    ? std::format("{}us ({}us)",
+                        duration_cast<microseconds>(e.end.value()).count(),
+                        duration_cast<microseconds>(e.end.value() - e.start).count())
+                    : std::string{ "unfinished" };
+                LOG_DEBUG() << "  " << e.name << ": " << start << "us -> " << end << std::endl;
+            }
+        }
+    };
+
+    // Runs `work` on `pool` as soon as it's constructed, so a session can go on receiving
+    // while it runs. Awaiting it resumes the session with the result on a thread of `context`
+    // once `work` is done, leaving the pool's threads to other sessions' phases.
+    //
+    // `work` may refer to the session's locals, so the session awaits it on every path out,
+    // failed ones included. Destroying it unawaited blocks until `work` is done.
+    template <typename T>
+    class concurrent_phase
+    {
+        enum status : int
+        {
+            running,
+            awaited,
+            done
+        };
+
+        struct state
+        {
+            net::io_context& context;
+            std::function<T()> work;
+            std::optional<T> result;
+            std::atomic<int> status{ running };
+            net::io_context::operation resume{};
+
+            state(net::io_context& context, std::function<T()> work)
+                : context{ context }
+                , work{ std::move(work) }
+            {
+            }
+        };
+
+        std::shared_ptr<state> state_;
+
+    public:
+        concurrent_phase(
+            net::io_context& context,
+            work_pool& pool,
+            timeline& timeline,
+            const std::string_view name,
+            const metrics::phase metric,
+            std::function<T()> work
+        )
+            : state_{ std::make_shared<state>(context, std::move(work)) }
+        {
+            pool.submit([state = state_, phase = timeline.begin(name, metric)]() mutable
+            {
+                state->result.emplace(state->work());
+                phase.end();
+
+                const int previous = state->status.exchange(done);
+                state->status.notify_all();
+                if (previous == awaited)
+                {
+                    state->context.post(state->resume);
+                }
+            });
+        }
+
+        concurrent_phase(const concurrent_phase&) = delete;
+        concurrent_phase& operator=(const concurrent_phase&) = delete;
+
+        ~concurrent_phase()
+        {
+            for (int status = state_->status.load(); status != done; status = state_->status.load())
+            {
+                state_->status.wait(status);
+            }
+        }
+
+        bool await_ready() const noexcept
+        {
+            return state_->status.load() == done;
+        }
+
+        bool await_suspend(std::coroutine_handle<> awaiting) noexcept
+        {
+            state_->resume.waiter = awaiting;
+            int expected = running;
+            return state_->status.compare_exchange_strong(expected, awaited);
+        }
+
+        T await_resume()
+        {
+            return std::move(state_->result).value();
+        }
+    };
+}
@@ -0,0 +1,445 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <expected>
+#include <memory>
+#include <span>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "vm.hpp"
+
+#include <netfork-shared/log.hpp>
+#include <netfork-shared/net/codec.hpp>
+#include <netfork-shared/net/manifest.hpp>
+#include <netfork-shared/net/msg.hpp>
+#include <netfork-shared/net/page_data.hpp>
+#include <netfork-shared/net/sock.hpp>
+#include <netfork-shared/phnt_stub.hpp>
+#include <netfork-shared/post_copy.hpp>
+#include <netfork-shared/utils.hpp>
+
+namespace netfork::post_copy
+{
+    // How long the debug loop waits for an event before checking whether the push is done.
+    constexpr const LONGLONG DEBUG_EVENT_POLL_INTERVAL_100NS = 50 * 10'000;
+
+    // Whether a page with protection `protect` allows the access an access violation
+    // reported (`ExceptionInformation[0]`: 0 read, 1 write, 8 execute).
+    constexpr bool permits_access(const DWORD protect, const ULONG_PTR access_type) noexcept
+    {
+        switch (access_type)
+        {
+        case 0:
+            return net::msg::has_payload(protect);
+        case 1:
+            return (protect & (PAGE_READWRITE | PAGE_EXECUTE_READWRITE)) != 0;
+        case 8:
+            return (protect & (PAGE_EXECUTE | PAGE_EXECUTE_READ | PAGE_EXECUTE_READWRITE)) != 0;
+        default:
+            return false;
+        }
+    }
+
+    // Server half of a post-copy fork on Windows. The forked process is created under a
+    // debug object and starts with only the hot set the client sent up front; every other
+    // payload page stays `PAGE_NOACCESS` until it's installed, so its first touch is reported
+    // as an access violation. `lazy_pages` keeps track of which pages have arrived.
+    //
+    // Pages are only ever written while the process is frozen, either by a pending debug
+    // event or by `NtSuspendProcess`, so a thread can never see a page half written.
+    class lazy_process
+    {
+        HANDLE process_;
+        HANDLE debug_object_;
+        SOCKET sock_;
+        lazy_pages pages_;
+        std::jthread receiver_;
+
+        lazy_process(HANDLE process, HANDLE debug_object, SOCKET sock, net::address_space_manifest manifest)
+            : process_{ process }
+            , debug_object_{ debug_object }
+            , sock_{ sock }
+            , pages_{ std::move(manifest) }
+        {
+        }
+
+        // Receives the pushed pages until the client's `end_of_stream`.
+        void receive_pushed_pages()
+        {
+            const BOOL received = vm::receive_until_end_of_stream(sock_, [this](const net::codec::frame_view& frame) -> BOOL
+            {
+                if (frame.header.type != net::codec::frame_type::page_data)
+                {
+                    LOG_DEBUG() << "Skipping unexpected frame of type "
+                        << std::to_underlying(frame.header.type) << std::endl;
+                    return TRUE;
+                }
+
+                const auto run = net::decode_page_run(frame.body);
+                if (!run || !vm::is_run_in_manifest(pages_.manifest(), run.value()))
+                {
+                    LOG_DEBUG_ERR() << "Malformed page data frame." << std::endl;
+                    return FALSE;
+                }
+
+                pages_.buffer_run(run.value(), frame.body.data() + run->prefix_size());
+                return TRUE;
+            });
+
+            pages_.end_push(received);
+        }
+
+        // Writes a run of pages of `subregion` into the process and gives them their final
+        // protection. Null pages are zero and only need the protection.
+        void install(
+            const net::manifest_subregion& subregion,
+            const std::uint64_t address,
+            std::span<const std::byte* const> pages)
+        {
+            const auto run_base = reinterpret_cast<PVOID>(address);
+            const std::uint64_t run_size = pages.size() * net::MANIFEST_PAGE_SIZE;
+            [[maybe_unused]] DWORD old_protect;
+            ::VirtualProtectEx(process_, run_base, run_size, PAGE_READWRITE, &old_protect);
+
+            for (std::size_t page = 0; page < pages.size(); page++)
+            {
+                if (!pages[page])
+                {
+                    continue;
+                }
+
+                const std::uint64_t page_address = address + page * net::MANIFEST_PAGE_SIZE;
+                SIZE_T bytes_written = 0;
+                if (!::WriteProcessMemory(
+                    process_,
+                    reinterpret_cast<LPVOID>(page_address),
+                    pages[page],
+                    net::MANIFEST_PAGE_SIZE,
+                    &bytes_written))
+                {
+                    LOG_DEBUG_ERR() << "Failed to write memory at 0x"
+                        << std::hex << page_address << std::dec
+                        << " GetLastError: " << ::GetLastError() << std::endl;
+                }
+            }
+
+            const DWORD final_protect = vm::to_private_protection(subregion.protect);
+            if (!::VirtualProtectEx(process_, run_base, run_size, final_protect, &old_protect))
+            {
+                LOG_DEBUG_ERR() << "Failed to change memory protection to: 0x"
+                    << std::hex << final_protect << std::dec
+                    << " GetLastError: " << ::GetLastError() << std::endl;
+            }
+        }
+
+        // The process must be frozen.
+        void install_buffered()
+        {
+            pages_.install_buffered([this](const auto& subregion, const auto address, const auto pages)
+            {
+                install(subregion, address, pages);
+            });
+        }
+
+        // Handles an access violation at `address`. Returns true if it was on a lazy page,
+        // which is then in the process and the faulting instruction can be retried.
+        bool resolve_fault(const std::uint64_t address, const ULONG_PTR access_type)
+        {
+            const auto* subregion = pages_.manifest().find_subregion(address);
+            if (!subregion
+                || !pages_.is_lazy(address)
+                || !permits_access(vm::to_private_protection(subregion->protect), access_type))
+            {
+                return false;
+            }
+
+            const bool arrived = pages_.await_page(address, [this](const page_span& span)
+            {
+                const net::msg::page_request request{ .address = span.address, .page_count = span.page_count };
+                if (const auto result = net::send_msg(sock_, request); FAILED(result))
+                {
+                    LOG_DEBUG_ERR() << "Failed to request pages; error: " << result << std::endl;
+                    return false;
+                }
+
+                return true;
+            });
+            if (!arrived)
+            {
+                return false;
+            }
+
+            install_buffered();
+            return pages_.is_installed(address);
+        }
+
+        // Closes the handles a debug event hands over.
+        static void close_event_handles(const DBGUI_WAIT_STATE_CHANGE& state)
+        {
+            switch (state.NewState)
+            {
+            case DbgCreateThreadStateChange:
+                ::NtClose(state.StateInfo.CreateThread.HandleToThread);
+                break;
+            case DbgCreateProcessStateChange:
+                ::NtClose(state.StateInfo.CreateProcessInfo.HandleToProcess);
+                ::NtClose(state.StateInfo.CreateProcessInfo.HandleToThread);
+                if (state.StateInfo.CreateProcessInfo.NewProcess.FileHandle)
+                {
+                    ::NtClose(state.StateInfo.CreateProcessInfo.NewProcess.FileHandle);
+                }
+                break;
+            case DbgLoadDllStateChange:
+                if (state.StateInfo.LoadDll.FileHandle)
+                {
+                    ::NtClose(state.StateInfo.LoadDll.FileHandle);
+                }
+                break;
+            default:
+                break;
+            }
+        }
+
+        // Handles one debug event and lets the process continue. Returns FALSE if the
+        // process can't be served anymore.
+        BOOL handle_event(const DBGUI_WAIT_STATE_CHANGE& state)
+        {
+            close_event_handles(state);
+
+            NTSTATUS continue_status = DBG_CONTINUE;
+            if (state.NewState == DbgExceptionStateChange)
+            {
+                const auto& exception = state.StateInfo.Exception;
+                continue_status = DBG_EXCEPTION_NOT_HANDLED;
+                if (exception.FirstChance
+                    && exception.ExceptionRecord.ExceptionCode == STATUS_ACCESS_VIOLATION
+                    && exception.ExceptionRecord.NumberParameters >= 2
+                    && resolve_fault(
+                        exception.ExceptionRecord.ExceptionInformation[1],
+                        exception.ExceptionRecord.ExceptionInformation[0]))
+                {
+                    continue_status = DBG_CONTINUE;
+                }
+            }
+            else if (state.NewState == DbgExitProcessStateChange)
+            {
+                pages_.close();
+            }
+
+            // Whatever else arrived while the process is frozen goes in now too.
+            if (!pages_.closed())
+            {
+                install_buffered();
+            }
+
+            CLIENT_ID client_id = state.AppClientId;
+            if (const NTSTATUS status = ::NtDebugContinue(debug_object_, &client_id, continue_status);
+                NT_ERROR(status))
+            {
+                LOG_DEBUG_ERR() << "NtDebugContinue failed; status: " << status << std::endl;
+                return FALSE;
+            }
+
+            return !pages_.receive_failed();
+        }
+
+        // Called once the push is done: installs whatever is left with the process
+        // suspended, answers any fault already queued, and detaches.
+        BOOL finish()
+        {
+            ::NtSuspendProcess(process_);
+            AT_SCOPE_EXIT(::NtResumeProcess(process_));
+
+            // Pages which never arrived are zero; they only need their protection.
+            pages_.install_remaining([this](const auto& subregion, const auto address, const auto pages)
+            {
+                install(subregion, address, pages);
+            });
+
+            // A thread may have faulted just before the suspend; its event must be answered
+            // before detaching, or the fault would reach the process's own handlers.
+            LARGE_INTEGER no_wait{};
+            DBGUI_WAIT_STATE_CHANGE state{};
+            while (::NtWaitForDebugEvent(debug_object_, FALSE, &no_wait, &state) == STATUS_SUCCESS)
+            {
+                if (!handle_event(state))
+                {
+                    return FALSE;
+                }
+            }
+
+            if (const NTSTATUS status = ::NtRemoveProcessDebug(process_, debug_object_); NT_ERROR(status))
+            {
+                LOG_DEBUG_ERR() << "NtRemoveProcessDebug failed; status: " << status << std::endl;
+                return FALSE;
+            }
+
+            return TRUE;
+        }
+
+    public:
+        lazy_process(const lazy_process&) = delete;
+        lazy_process& operator=(const lazy_process&) = delete;
+
+        // Receives the manifest and the hot set, and leaves every other payload subregion
+        // `PAGE_NOACCESS` so the first touch is reported. `forked_process_handle` must have
+        // been created under `debug_object_handle` and have no running threads yet.
+        static std::expected<std::unique_ptr<lazy_process>, HRESULT> receive_hot_set(
+            HANDLE forked_process_handle,
+            HANDLE debug_object_handle,
+            SOCKET client_sock)
+        {
+            auto manifest = vm::recv_manifest(client_sock);
+            if (!manifest)
+            {
+                return std::unexpected{ manifest.error() };
+            }
+
+            vm::plan_address_space(forked_process_handle, manifest.value());
+
+            std::vector<bool> hot(manifest->subregions.size());
+            const BOOL received = vm::receive_until_end_of_stream(client_sock, [&](const net::codec::frame_view& frame) -> BOOL
+            {
+                if (frame.header.type != net::codec::frame_type::page_data)
+                {
+                    LOG_DEBUG() << "Skipping unexpected frame of type "
+                        << std::to_underlying(frame.header.type) << std::endl;
+                    return TRUE;
+                }
+
+                const auto run = net::decode_page_run(frame.body);
+                if (!run || !vm::is_run_in_manifest(manifest.value(), run.value()))
+                {
+                    LOG_DEBUG_ERR() << "Malformed page data frame." << std::endl;
+                    return FALSE;
+                }
+
+                vm::write_present_pages(forked_process_handle, run.value(), frame.body.subspan(run->prefix_size()));
+                hot[manifest->find_subregion(run->address) - manifest->subregions.data()] = true;
+                return TRUE;
+            });
+            if (!received)
+            {
+                return std::unexpected{ net::INCOMPLETE_RECV_DATA };
+            }
+
+            std::unique_ptr<lazy_process> lazy{ new lazy_process{
+                forked_process_handle,
+                debug_object_handle,
+                client_sock,
+                std::move(manifest).value()
+            } };
+
+            std::uint64_t lazy_bytes = 0;
+            for (std::size_t i = 0; i < lazy->pages_.manifest().subregions.size(); i++)
+            {
+                const auto& subregion = lazy->pages_.manifest().subregions[i];
+                if (!net::msg::has_payload(subregion.protect))
+                {
+                    continue;
+                }
+
+                DWORD protect = vm::to_private_protection(subregion.protect);
+                if (!hot[i])
+                {
+                    protect = PAGE_NOACCESS;
+                    lazy->pages_.mark_lazy(i);
+                    lazy_bytes += subregion.region_size;
+                }
+
+                [[maybe_unused]] DWORD old_protect;
+                ::VirtualProtectEx(
+                    forked_process_handle,
+                    reinterpret_cast<PVOID>(subregion.base_address),
+                    subregion.region_size,
+                    protect,
+                    &old_protect
+                );
+            }
+
+            LOG_DEBUG() << "Received hot set; 0x" << std::hex << lazy_bytes << std::dec
+                << " bytes are left to fetch" << std::endl;
+            return lazy;
+        }
+
+        // Serves the process's faults while the rest of its pages are pushed, and detaches
+        // once it has all of them. Must be called once the initial thread is resumed.
+        BOOL serve()
+        {
+            receiver_ = std::jthread{ [this] { receive_pushed_pages(); } };
+
+            BOOL served = TRUE;
+            while (served)
+            {
+                if (pages_.receive_failed())
+                {
+                    served = FALSE;
+                    break;
+                }
+
+                if (pages_.push_done() || pages_.closed())
+                {
+                    break;
+                }
+
+                LARGE_INTEGER timeout{ .QuadPart = -DEBUG_EVENT_POLL_INTERVAL_100NS };
+                DBGUI_WAIT_STATE_CHANGE state{};
+                const NTSTATUS status = ::NtWaitForDebugEvent(debug_object_, FALSE, &timeout, &state);
+                if (status == STATUS_TIMEOUT)
+                {
+                    continue;
+                }
+
+                if (NT_ERROR(status))
+                {
+                    LOG_DEBUG_ERR() << "NtWaitForDebugEvent failed; status: " << status << std::endl;
+                    served = FALSE;
+                    break;
+                }
+
+                served = handle_event(state);
+            }
+
+            if (served && !pages_.closed())
+            {
+                served = finish();
+            }
+
+            // Lets the client's responder stop; the push has ended or the process is gone.
+            net::send_frames(sock_, net::codec::frame_type::end_of_stream, {});
+            if (receiver_.joinable())
+            {
+                receiver_.join();
+            }
+
+            if (!served)
+            {
+                LOG_DEBUG_ERR() << "Post-copy fork failed; terminating the forked process." << std::endl;
+                ::NtTerminateProcess(process_, STATUS_UNSUCCESSFUL);
+            }
+
+            LOG_DEBUG() << "Post-copy done; " << pages_.pages_requested() << " pages were requested on demand" << std::endl;
+            return served;
+        }
+    };
+}
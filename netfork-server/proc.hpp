@@ -25,12 +25,11 @@
 
 namespace netfork::proc
 {
-    std::expected<unique_nt_handle<attached_process_deleter>, NTSTATUS>
-    create_forked_process(HANDLE image_file_handle)
+    std::expected<unique_nt_handle<default_nt_handle_deleter>, NTSTATUS>
+    create_image_section(HANDLE image_file_handle)
     {
         unique_nt_handle image_section_handle{};
-        // Create an image section from the temporary file.
-        NTSTATUS status = ::NtCreateSection(
+        const NTSTATUS status = ::NtCreateSection(
             &image_section_handle.get(),
             SECTION_ALL_ACCESS,
             nullptr,
@@ -44,15 +43,44 @@ namespace netfork::proc
             return std::unexpected{ status };
         }
 
+        return image_section_handle;
+    }
+
+    // A debug object the forked process can be created under, so that its faults are
+    // reported to the server. Closing it kills any process still attached.
+    std::expected<unique_nt_handle<default_nt_handle_deleter>, NTSTATUS> create_debug_object()
+    {
+        unique_nt_handle debug_object_handle{};
+        const NTSTATUS status = ::NtCreateDebugObject(
+            &debug_object_handle.get(),
+            DEBUG_ALL_ACCESS,
+            nullptr,
+            DEBUG_KILL_ON_CLOSE
+        );
+        if (NT_ERROR(status))
+        {
+            return std::unexpected{ status };
+        }
+
+        return debug_object_handle;
+    }
+
+    // `image_section_handle` must be an image section created from `image_file_handle` (see
+    // `create_image_section`); the file is only used to name the process. With a
+    // `debug_object_handle` (see `create_debug_object`), the process is debugged from the
+    // start, without a remote break-in thread.
+    std::expected<unique_nt_handle<attached_process_deleter>, NTSTATUS>
+    create_forked_process(HANDLE image_file_handle, HANDLE image_section_handle, HANDLE debug_object_handle = nullptr)
+    {
         unique_nt_handle<attached_process_deleter> forked_process_handle{};
-        status = ::NtCreateProcessEx(
+        NTSTATUS status = ::NtCreateProcessEx(
             &forked_process_handle.get(),
             PROCESS_ALL_ACCESS,
             nullptr,
             NtCurrentProcess(),
             0,
-            image_section_handle.get(),
-            nullptr,
+            image_section_handle,
+            debug_object_handle,
             nullptr,
             0
         );
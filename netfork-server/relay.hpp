@@ -0,0 +1,447 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <format>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "metrics.hpp"
+#include "snapshot.hpp"
+
+#include <netfork-shared/auto.hpp>
+#include <netfork-shared/image_hash.hpp>
+#include <netfork-shared/log.hpp>
+#include <netfork-shared/net/async.hpp>
+#include <netfork-shared/net/chunk_log.hpp>
+#include <netfork-shared/net/codec.hpp>
+#include <netfork-shared/net/manifest.hpp>
+#include <netfork-shared/net/msg.hpp>
+#include <netfork-shared/net/page_data.hpp>
+#include <netfork-shared/net/sock.hpp>
+#include <netfork-shared/phnt_stub.hpp>
+
+namespace netfork::relay
+{
+    // A server a relaying server passes forks on to.
+    struct downstream
+    {
+        std::string address;
+        std::string port;
+    };
+
+    // Parses a comma-separated list of `address:port`. Entries without a port are skipped.
+    std::vector<downstream> parse_downstreams(std::string_view list)
+    {
+        std::vector<downstream> downstreams;
+        while (!list.empty())
+        {
+            const auto comma = list.find(',');
+            const auto entry = list.substr(0, comma);
+            list = comma == std::string_view::npos ? std::string_view{} : list.substr(comma + 1);
+
+            const auto colon = entry.rfind(':');
+            if (colon == std::string_view::npos || colon == 0 || colon + 1 == entry.size())
+            {
+                LOG_DEBUG_ERR() << "Ignoring downstream server without a port: " << entry << std::endl;
+                continue;
+            }
+
+            downstreams.push_back(downstream{
+                .address = std::string{ entry.substr(0, colon) },
+                .port = std::string{ entry.substr(colon + 1) }
+            });
+        }
+
+        return downstreams;
+    }
+
+    // What the relay's client sent before the image, passed on to every hop as it is except
+    // for the image's read-only hash (see `image_copy`).
+    struct handshake
+    {
+        CONTEXT thread_context;
+        PEB peb;
+        TEB teb;
+        net::msg::fork_mode fork_mode;
+        net::msg::image_info image_info;
+    };
+
+    // The main image as the relay's own child has it before it starts: patched for execution,
+    // with the client's writable pages in place. A hop whose server misses its image cache is
+    // sent its manifest and all of it, any other hop only the writable ranges.
+    //
+    // The patched headers no longer hash to the client's read-only hash, so the copy is keyed
+    // by a hash of its own, which a downstream server can check it against.
+    struct image_copy
+    {
+        std::uint64_t base = 0;
+        std::vector<std::byte> bytes;
+        // Offsets and sizes of the writable ranges, in ascending order.
+        std::vector<std::pair<std::uint64_t, std::uint64_t>> writable;
+        // The committed ranges, as a client lays out an image it sends.
+        net::address_space_manifest manifest;
+        page_hash read_only_hash;
+    };
+
+    image_copy copy_image(HANDLE forked_process_handle, const std::uint64_t image_base, const std::uint64_t image_size)
+    {
+        image_copy image{ .base = image_base, .bytes = std::vector<std::byte>(image_size) };
+        snapshot::read_readable(forked_process_handle, image_base, image.bytes);
+        image.manifest.add_region(image_base, 0, MEM_IMAGE);
+
+        MEMORY_BASIC_INFORMATION mbi{};
+        for (std::uint64_t offset = 0; offset < image_size; offset += mbi.RegionSize)
+        {
+            if (!::VirtualQueryEx(forked_process_handle, reinterpret_cast<LPCVOID>(image_base + offset), &mbi, sizeof(mbi)))
+            {
+                break;
+            }
+
+            const std::uint64_t region_offset = reinterpret_cast<std::uint64_t>(mbi.BaseAddress) - image_base;
+            mbi.RegionSize = std::min<std::uint64_t>(mbi.RegionSize - (offset - region_offset), image_size - offset);
+            if (mbi.State != MEM_COMMIT)
+            {
+                continue;
+            }
+
+            image.manifest.add_subregion(image_base + offset, mbi.RegionSize, mbi.Protect);
+            if (net::msg::is_writable(mbi.Protect))
+            {
+                image.writable.emplace_back(offset, mbi.RegionSize);
+            }
+        }
+
+        for (const auto& subregion : image.manifest.subregions)
+        {
+            if (is_hashed_image_subregion(subregion))
+            {
+                image.read_only_hash = hash_image_subregion(
+                    image.read_only_hash,
+                    image_base,
+                    subregion,
+                    image.bytes.data() + (subregion.base_address - image_base));
+            }
+        }
+
+        return image;
+    }
+
+    // How one hop went, for the log and the metrics.
+    struct hop_stats
+    {
+        HRESULT result = E_PENDING;
+        // Connecting, admission, waiting for the relay's image and the image cache status.
+        std::chrono::microseconds handshake{};
+        // From connecting until the last byte was sent.
+        std::chrono::microseconds total{};
+        std::uint64_t bytes_sent = 0;
+    };
+
+    // Passes one relayed fork on to every downstream server while the relay rebuilds its own
+    // child from it. Each hop has a thread of its own, starts its handshake straight away, and
+    // then sends the image and the payload as fast as its server takes them. The payload is
+    // what the relay received, byte for byte: it's copied once into chunks of a
+    // `net::chunk_log` which every hop reads from, so compressed chunks are passed on without
+    // being expanded.
+    //
+    // Outlives the session if a hop is still sending; the hops hold on to it.
+    class session : public std::enable_shared_from_this<session>
+    {
+        using clock = std::chrono::steady_clock;
+
+        std::uint64_t session_id_;
+        std::vector<downstream> downstreams_;
+        handshake handshake_;
+        net::chunk_log log_;
+
+        std::mutex mutex_;
+        std::condition_variable image_cv_;
+        std::shared_ptr<const image_copy> image_;
+        // Set once the relay has nothing more to give; hops waiting for the image give up.
+        bool closed_ = false;
+        std::atomic<bool> aborted_ = false;
+        std::vector<hop_stats> stats_;
+
+        // Payload bytes not yet appended to the log, only touched by the receiving session.
+        std::vector<std::byte> pending_;
+
+        void flush()
+        {
+            if (!pending_.empty())
+            {
+                log_.append(std::exchange(pending_, {}));
+            }
+        }
+
+        std::shared_ptr<const image_copy> wait_for_image()
+        {
+            std::unique_lock lock{ mutex_ };
+            image_cv_.wait(lock, [this] { return image_ || closed_; });
+            return image_;
+        }
+
+        HRESULT send_image(SOCKET sock, const image_copy& image, const bool cached, std::uint64_t& bytes_sent)
+        {
+            if (!cached)
+            {
+                if (const auto result = net::send_manifest(sock, image.manifest); FAILED(result))
+                {
+                    return result;
+                }
+
+                bytes_sent += image.bytes.size();
+                return net::send_frames(sock, net::codec::frame_type::image_bytes, image.bytes);
+            }
+
+            for (const auto& [offset, size] : image.writable)
+            {
+                for (std::uint64_t run_offset = 0; run_offset < size;)
+                {
+                    const std::uint64_t run_size = std::min<std::uint64_t>(
+                        size - run_offset,
+                        net::MAX_PAGES_PER_FRAME * net::MANIFEST_PAGE_SIZE);
+
+                    net::page_run run{
+                        .address = image.base + offset + run_offset,
+                        .page_count = static_cast<std::uint32_t>(run_size / net::MANIFEST_PAGE_SIZE)
+                    };
+                    for (std::uint32_t page = 0; page < run.page_count; page++)
+                    {
+                        run.set_present(page);
+                    }
+
+                    const auto pages = std::span{ image.bytes }.subspan(offset + run_offset, run_size);
+                    if (const auto result = net::send_page_run(sock, run, pages); FAILED(result))
+                    {
+                        return result;
+                    }
+
+                    run_offset += run_size;
+                    bytes_sent += run_size;
+                }
+            }
+
+            return net::send_frames(sock, net::codec::frame_type::end_of_stream, {});
+        }
+
+        HRESULT run_hop(const std::size_t hop, hop_stats& stats)
+        {
+            const auto start = clock::now();
+            const auto& target = downstreams_[hop];
+            SOCKET sock = net::connect_to_server(target.address.c_str(), target.port.c_str());
+            if (sock == INVALID_SOCKET)
+            {
+                return HRESULT_FROM_WIN32(::WSAGetLastError());
+            }
+
+            AT_SCOPE_EXIT(::closesocket(sock));
+
+            if (const auto result = net::send_msg(sock, handshake_.thread_context); FAILED(result))
+            {
+                return result;
+            }
+
+            if (const auto result = net::send_msg(sock, handshake_.peb); FAILED(result))
+            {
+                return result;
+            }
+
+            if (const auto result = net::send_msg(sock, handshake_.teb); FAILED(result))
+            {
+                return result;
+            }
+
+            if (const auto result = net::send_msg(sock, handshake_.fork_mode); FAILED(result))
+            {
+                return result;
+            }
+
+            const auto admission = net::recv_msg<net::msg::admission>(sock);
+            if (!admission)
+            {
+                return admission.error();
+            }
+
+            if (!admission->admitted)
+            {
+                return net::FORK_REJECTED;
+            }
+
+            // The image is keyed by the hash of the relay's copy, so the rest of the handshake
+            // waits for it.
+            const auto image = wait_for_image();
+            if (!image)
+            {
+                return E_ABORT;
+            }
+
+            net::msg::image_info image_info = handshake_.image_info;
+            image_info.read_only_hash_low = image->read_only_hash.low;
+            image_info.read_only_hash_high = image->read_only_hash.high;
+            if (const auto result = net::send_msg(sock, image_info); FAILED(result))
+            {
+                return result;
+            }
+
+            const auto cache_status = net::recv_msg<net::msg::image_cache_status>(sock);
+            if (!cache_status)
+            {
+                return cache_status.error();
+            }
+
+            stats.handshake = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - start);
+
+            if (const auto result = send_image(sock, *image, cache_status->hit, stats.bytes_sent); FAILED(result))
+            {
+                return result;
+            }
+
+            while (const auto chunk = log_.next(hop))
+            {
+                if (aborted_)
+                {
+                    return E_ABORT;
+                }
+
+                if (const auto result = net::send_bytes(sock, std::span<const std::byte>{ *chunk }); FAILED(result))
+                {
+                    return result;
+                }
+
+                stats.bytes_sent += chunk->size();
+                metrics::add(metrics::counter::relayed_bytes, chunk->size());
+            }
+
+            if (aborted_)
+            {
+                return E_ABORT;
+            }
+
+            stats.total = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - start);
+            metrics::record_latency(metrics::phase::relay, clock::now() - start);
+            return ERROR_SUCCESS;
+        }
+
+    public:
+        session(const std::uint64_t session_id, std::vector<downstream> downstreams, const handshake& handshake)
+            : session_id_{ session_id }
+            , downstreams_{ std::move(downstreams) }
+            , handshake_{ handshake }
+            , log_{ downstreams_.size() }
+            , stats_(downstreams_.size())
+        {
+        }
+
+        session(const session&) = delete;
+        session& operator=(const session&) = delete;
+
+        ~session()
+        {
+            for (std::size_t hop = 0; hop < stats_.size(); hop++)
+            {
+                const auto& stats = stats_[hop];
+                const double seconds = stats.total.count() / 1e6;
+                LOG_DEBUG() << "Relay hop " << hop << " of session " << session_id_ << " to "
+                    << downstreams_[hop].address << ":" << downstreams_[hop].port << " ended with " << stats.result
+                    << "; handshake " << stats.handshake.count() << "us, total " << stats.total.count() << "us, 0x"
+                    << std::hex << stats.bytes_sent << std::dec << " bytes"
+                    << (seconds > 0.0 ? std::format(" at {:.1f} MiB/s", stats.bytes_sent / seconds / (1 << 20)) : std::string{})
+                    << std::endl;
+            }
+        }
+
+        // Starts every hop. The hops keep the session alive until they're done.
+        void start()
+        {
+            for (std::size_t hop = 0; hop < downstreams_.size(); hop++)
+            {
+                std::thread{ [self = shared_from_this(), hop]
+                {
+                    auto& stats = self->stats_[hop];
+                    stats.result = self->run_hop(hop, stats);
+                    self->log_.abandon(hop);
+                } }.detach();
+            }
+        }
+
+        // The relay's child exists with its image in place; it mustn't have started yet.
+        void image_ready(HANDLE forked_process_handle, const std::uint64_t image_base, const std::uint64_t image_size)
+        {
+            auto image = std::make_shared<const image_copy>(copy_image(forked_process_handle, image_base, image_size));
+            {
+                std::lock_guard lock{ mutex_ };
+                image_ = std::move(image);
+            }
+            image_cv_.notify_all();
+        }
+
+        // The manifest goes first, as the client sent it; the relay received it outside the
+        // payload stream. It fit within `MAX_MANIFEST_SIZE` on the way in, so it fits again.
+        void forward_manifest(const net::address_space_manifest& manifest)
+        {
+            net::codec::frame_writer frames;
+            net::write_manifest(frames, manifest);
+            log_.append(frames.release());
+        }
+
+        // Takes every byte of the payload stream as the relay receives it.
+        net::async_frame_stream::tee_type tee()
+        {
+            return [self = shared_from_this()](std::span<const std::byte> bytes)
+            {
+                self->pending_.insert(self->pending_.end(), bytes.begin(), bytes.end());
+                if (self->pending_.size() >= net::codec::MAX_BYTES_FRAME_LENGTH)
+                {
+                    self->flush();
+                }
+            };
+        }
+
+        // Nothing more will be forwarded. If the relay's own fork failed, the hops stop where
+        // they are, since their servers would only get part of it.
+        void close(const bool complete)
+        {
+            if (!complete)
+            {
+                aborted_ = true;
+            }
+
+            flush();
+            log_.close();
+            {
+                std::lock_guard lock{ mutex_ };
+                closed_ = true;
+            }
+            image_cv_.notify_all();
+        }
+    };
+}
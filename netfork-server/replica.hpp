@@ -0,0 +1,198 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <utility>
+
+#include "vm.hpp"
+
+#include <netfork-shared/log.hpp>
+#include <netfork-shared/net/codec.hpp>
+#include <netfork-shared/net/manifest.hpp>
+#include <netfork-shared/net/msg.hpp>
+#include <netfork-shared/net/page_data.hpp>
+#include <netfork-shared/net/sock.hpp>
+#include <netfork-shared/phnt_stub.hpp>
+
+namespace netfork::replica
+{
+    enum class replication_end
+    {
+        // The client sent `end_of_stream`; it no longer needs a standby.
+        stopped,
+        // The connection went away. This is the failover case.
+        disconnected,
+        // The client sent something malformed.
+        failed,
+    };
+
+    // The standby of a replicated process: a forked process which is never started unless
+    // the client goes away. Every epoch arrives as `manifest` and `page_data` frames
+    // followed by the `thread_context` it was captured with. Nothing is applied until that
+    // context arrives, so the process always holds the last complete epoch however the
+    // connection ends.
+    class standby
+    {
+        HANDLE process_;
+        SOCKET sock_;
+        std::uint64_t image_base_;
+        std::uint64_t image_size_;
+        net::address_space_manifest manifest_;
+        std::optional<CONTEXT> context_;
+        std::uint64_t epochs_ = 0;
+        // Frames of the epoch in progress.
+        net::codec::frame_writer staged_;
+        // A manifest staged over several frames, as far as it has been applied.
+        net::manifest_assembler manifests_;
+        bool failed_ = false;
+
+        // Applies every frame staged since the last epoch, in the order it arrived.
+        BOOL apply_staged()
+        {
+            net::codec::frame_reader reader{ staged_.data() };
+            while (const auto frame = reader.next())
+            {
+                if (frame->header.type == net::codec::frame_type::manifest)
+                {
+                    const auto status = manifests_.add(frame->body);
+                    if (status == net::manifest_assembler::status::incomplete)
+                    {
+                        continue;
+                    }
+
+                    auto manifest = status == net::manifest_assembler::status::complete
+                        ? manifests_.take()
+                        : std::nullopt;
+                    if (!manifest)
+                    {
+                        LOG_DEBUG_ERR() << "Malformed manifest." << std::endl;
+                        return FALSE;
+                    }
+
+                    vm::replan_address_space(process_, manifest_, manifest.value());
+                    manifest_ = std::move(manifest).value();
+                    continue;
+                }
+
+                const auto run = net::decode_page_run(frame->body);
+                if (!run)
+                {
+                    LOG_DEBUG_ERR() << "Malformed page data frame." << std::endl;
+                    return FALSE;
+                }
+
+                if (!vm::is_run_in_image(run.value(), image_base_, image_size_)
+                    && !vm::is_run_in_manifest(manifest_, run.value()))
+                {
+                    return FALSE;
+                }
+
+                vm::write_present_pages(process_, run.value(), frame->body.subspan(run->prefix_size()));
+            }
+
+            return TRUE;
+        }
+
+        BOOL commit(const CONTEXT& context)
+        {
+            const std::size_t staged_size = staged_.size();
+            if (!apply_staged())
+            {
+                failed_ = true;
+                return FALSE;
+            }
+
+            staged_.clear();
+            context_ = context;
+            epochs_++;
+
+            LOG_DEBUG() << "Committed epoch " << epochs_ << " of 0x" << std::hex << staged_size
+                << std::dec << " bytes" << std::endl;
+
+            // Failing to send this means the client is gone, which is the failover case
+            // rather than a failure of the standby.
+            return SUCCEEDED(net::send_msg(sock_, net::msg::replication_ack{ .epoch = epochs_ }));
+        }
+
+    public:
+        standby(HANDLE forked_process_handle, SOCKET client_sock, const std::uint64_t image_base, const std::uint64_t image_size)
+            : process_{ forked_process_handle }
+            , sock_{ client_sock }
+            , image_base_{ image_base }
+            , image_size_{ image_size }
+        {
+        }
+
+        standby(const standby&) = delete;
+        standby& operator=(const standby&) = delete;
+
+        // Keeps the standby up to date until the replication ends one way or another.
+        replication_end receive()
+        {
+            const BOOL received = vm::receive_until_end_of_stream(sock_, [this](const net::codec::frame_view& frame) -> BOOL
+            {
+                switch (frame.header.type)
+                {
+                case net::codec::frame_type::manifest:
+                case net::codec::frame_type::page_data:
+                    staged_.write_bytes(frame.header.type, frame.body);
+                    return TRUE;
+                case net::codec::frame_type::thread_context:
+                {
+                    const auto context = net::codec::decode_body<CONTEXT>(frame.body);
+                    if (!context)
+                    {
+                        LOG_DEBUG_ERR() << "Malformed thread context frame." << std::endl;
+                        failed_ = true;
+                        return FALSE;
+                    }
+
+                    return commit(context.value());
+                }
+                default:
+                    LOG_DEBUG() << "Skipping unexpected frame of type "
+                        << std::to_underlying(frame.header.type) << std::endl;
+                    return TRUE;
+                }
+            });
+
+            if (received)
+            {
+                return replication_end::stopped;
+            }
+
+            return failed_ ? replication_end::failed : replication_end::disconnected;
+        }
+
+        // Gives every subregion of the last epoch its final protection and returns the
+        // context its thread should start from, or nothing if no epoch was committed.
+        std::optional<CONTEXT> promote()
+        {
+            if (!context_)
+            {
+                return std::nullopt;
+            }
+
+            LOG_DEBUG() << "Promoting standby at epoch " << epochs_ << std::endl;
+            vm::apply_final_protections(process_, manifest_);
+            return context_;
+        }
+    };
+}
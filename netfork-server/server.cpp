@@ -15,25 +15,61 @@
  * with this program. If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <bit>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <expected>
+#include <filesystem>
+#include <format>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
 #include <utility>
+#include <vector>
 
+#include "admission.hpp"
 #include "image.hpp"
+#include "image_cache.hpp"
+#include "metrics.hpp"
+#include "page_store.hpp"
+#include "page_writer.hpp"
 #include "pe.hpp"
+#include "phases.hpp"
+#include "post_copy.hpp"
 #include "proc.hpp"
+#include "relay.hpp"
+#include "replica.hpp"
+#include "snapshot.hpp"
+#include "stripes.hpp"
 #include "vm.hpp"
+#include "warm_pool.hpp"
 
 #include <netfork-shared/auto.hpp>
+#include <netfork-shared/image_hash.hpp>
 #include <netfork-shared/log.hpp>
+#include <netfork-shared/net/async.hpp>
 #include <netfork-shared/net/msg.hpp>
 #include <netfork-shared/net/sock.hpp>
 #include <netfork-shared/phnt_stub.hpp>
+#include <netfork-shared/pipeline.hpp>
 #include <netfork-shared/utils.hpp>
+#include <netfork-shared/zero_page.hpp>
 
 namespace
 {
     constexpr PCSTR SERVICE_PORT = "43594";
+    // Serves the server's metrics to local scrapers only.
+    constexpr PCSTR METRICS_PORT = "43595";
+    constexpr PCSTR METRICS_ADDRESS = "127.0.0.1";
 
     std::expected<managed_string, NTSTATUS> get_nt_path(PCWSTR unexpanded_path)
     {
@@ -57,144 +93,1154 @@ namespace
 
         return path;
     }
-}
-
-int main()
-{
-    using namespace netfork;
 
-    if (!net::winsock_init())
+    // The page store outlives the server process so repeated forks of the same program
+    // keep benefiting from it; without one, every page a client hashes must be sent.
+    std::unique_ptr<netfork::store::page_store> open_page_store()
     {
-        LOG_DEBUG_ERR() << "Winsock failed to initialize." << std::endl;
-        return 1;
+        std::array<WCHAR, MAX_PATH> path{};
+        if (!::ExpandEnvironmentStringsW(L"%TEMP%\\netfork-page-store.bin", path.data(), static_cast<DWORD>(path.size())))
+        {
+            LOG_DEBUG_ERR() << "Failed to get page store path; GetLastError: " << ::GetLastError() << std::endl;
+            return nullptr;
+        }
+
+        auto store = netfork::store::page_store::open(path.data());
+        if (!store)
+        {
+            LOG_DEBUG_ERR() << "Failed to open page store; error: " << store.error() << std::endl;
+            return nullptr;
+        }
+
+        return std::move(store).value();
     }
 
-    AT_SCOPE_EXIT(::WSACleanup());
+    // An image whose bytes have all arrived, not yet prepared for execution.
+    struct received_image
+    {
+        unique_nt_handle<default_nt_handle_deleter> file;
+        netfork::io::image_view view;
+    };
 
-    SOCKET client_sock = net::accept_single_client(SERVICE_PORT);
-    if (client_sock == INVALID_SOCKET)
+    // Hashes the read-only pages of a received image the way its client hashed them. Returns
+    // nothing if `image_manifest` doesn't lay out an image based at `image_base` which fits
+    // in `image`.
+    std::optional<netfork::page_hash> hash_received_image(
+        const netfork::net::address_space_manifest& image_manifest,
+        const std::uint64_t image_base,
+        std::span<const std::byte> image)
     {
-        LOG_DEBUG_ERR() << "Failed to accept client on port " << SERVICE_PORT << std::endl;
-        return 1;
-    }
+        using namespace netfork;
 
-    AT_SCOPE_EXIT([client_sock]
+        page_hash hash{};
+        if (image_manifest.regions.empty())
         {
-            ::shutdown(client_sock, SD_BOTH);
-            ::closesocket(client_sock);
-        }());
+            return hash;
+        }
 
-    const auto remote_thread_context = net::recv_as<CONTEXT>(client_sock);
-    const auto forked_peb = net::recv_as<PEB>(client_sock);
-    const auto forked_teb = net::recv_as<TEB>(client_sock);
-    const auto size_of_image = net::recv_as<DWORD>(client_sock);
-    if (!remote_thread_context || !forked_peb || !forked_teb || !size_of_image)
-    {
-        LOG_DEBUG_ERR() << "Failed to receive CONTEXT, PEB, TEB, or image size." << std::endl;
-        return 1;
-    }
+        if (image_manifest.regions.front().base_address != image_base)
+        {
+            return std::nullopt;
+        }
 
-    // FIXME: This will not work if we are netforking multiple images at once.
-    // Fix would involve attaching a unique ID to the name.
-    auto image_path = ::get_nt_path(L"\\??\\%TEMP%\\netforked-image.exe");
-    if (!image_path)
-    {
-	    LOG_DEBUG_ERR() << "Failed to get NT path for image." << std::endl;
-		return 1;
-    }
+        for (const auto& subregion : image_manifest.subregions)
+        {
+            if (!is_hashed_image_subregion(subregion))
+            {
+                continue;
+            }
 
-    auto image_file_handle = io::create_temporary_image(
-        size_of_image.value(),
-        image_path.value().get()
-    );
-    if (!image_file_handle)
-    {
-        LOG_DEBUG_ERR() << "Failed to create temporary image file." << std::endl;
-        return 1;
+            // A decoded manifest doesn't overflow and is made of whole pages.
+            if (subregion.base_address < image_base || subregion.end_address() - image_base > image.size())
+            {
+                return std::nullopt;
+            }
+
+            hash = hash_image_subregion(hash, image_base, subregion, image.data() + (subregion.base_address - image_base));
+        }
+
+        return hash;
     }
 
+    // Receives the image's manifest and bytes. With a cache, they're received into the cache's
+    // staging file so the prepared image can be kept for later forks of the same executable,
+    // and only once the read-only pages are known to hash to the image's key. An image that
+    // doesn't isn't what the client said it runs, so it fails the session rather than only
+    // staying out of the cache.
+    netfork::net::task<std::optional<received_image>> receive_image(
+        SOCKET client_sock,
+        netfork::io::image_cache* cache,
+        const netfork::io::image_key& key,
+        const std::uint64_t session_id)
     {
+        using namespace netfork;
+
+        const DWORD size_of_image = key.size_of_image;
+
+        const auto image_manifest = co_await vm::async_recv_manifest(client_sock);
+        if (!image_manifest)
+        {
+            LOG_DEBUG_ERR() << "Failed to receive image manifest; error: " << image_manifest.error() << std::endl;
+            co_return std::nullopt;
+        }
+
+        std::wstring staging_path;
+        managed_string temporary_path;
+        UNICODE_STRING image_path;
+        if (cache)
+        {
+            staging_path = cache->staging_nt_path(key, session_id);
+            ::RtlInitUnicodeString(&image_path, staging_path.c_str());
+        }
+        else
+        {
+            // Unique to the session, so forks running at the same time don't collide.
+            const auto unexpanded_path = std::format(
+                L"\\??\\%TEMP%\\netforked-image-{:x}-{:x}.exe",
+                ::GetCurrentProcessId(),
+                session_id
+            );
+            auto path = ::get_nt_path(unexpanded_path.c_str());
+            if (!path)
+            {
+                LOG_DEBUG_ERR() << "Failed to get NT path for image." << std::endl;
+                co_return std::nullopt;
+            }
+
+            temporary_path = std::move(path).value();
+            image_path = temporary_path.get();
+        }
+
+        auto image_file_handle = io::create_image_file(
+            size_of_image,
+            image_path,
+            cache ? io::image_lifetime::persistent : io::image_lifetime::temporary
+        );
+        if (!image_file_handle)
+        {
+            LOG_DEBUG_ERR() << "Failed to create image file." << std::endl;
+            co_return std::nullopt;
+        }
+
         auto image_view_info = io::create_image_view(
             image_file_handle.value().get(),
-            size_of_image.value()
+            size_of_image
         );
         if (!image_view_info)
         {
             LOG_DEBUG_ERR() << "Failed to create image view." << std::endl;
-            return 1;
+            co_return std::nullopt;
         }
 
-        io::image_view image_view{ std::move(image_view_info.value()) };
+        received_image image{
+            .file = std::move(image_file_handle).value(),
+            .view = std::move(image_view_info).value()
+        };
 
-        const auto recv_result = net::recv_bytes(
+        const auto recv_result = co_await net::async_recv_frames(
             client_sock,
+            net::codec::frame_type::image_bytes,
             std::span<std::byte>{
-                static_cast<std::byte*>(image_view.view.get()),
-                size_of_image.value()
+                static_cast<std::byte*>(image.view.view.get()),
+                size_of_image
             }
         );
-        if (SUCCEEDED(recv_result))
+        if (FAILED(recv_result))
         {
-            LOG_DEBUG() << "Received 0x" << std::hex << size_of_image.value()
+            LOG_DEBUG_ERR() << "Failed to receive 0x" << std::hex << size_of_image
                 << std::dec << " image bytes" << std::endl;
+            co_return std::nullopt;
         }
-        else
+
+        metrics::add(metrics::counter::received_bytes, size_of_image);
+        LOG_DEBUG() << "Received 0x" << std::hex << size_of_image
+            << std::dec << " image bytes" << std::endl;
+
+        if (cache)
         {
-            LOG_DEBUG() << "Failed to receive 0x" << std::hex << size_of_image.value()
-                << std::dec << " image bytes" << std::endl;
+            const auto hash = ::hash_received_image(
+                image_manifest.value(),
+                key.image_base,
+                std::span<const std::byte>{ static_cast<const std::byte*>(image.view.view.get()), size_of_image }
+            );
+            if (!hash || hash.value() != key.read_only_hash)
+            {
+                LOG_DEBUG_ERR() << "Image doesn't match its read-only hash; failing the session" << std::endl;
+                {
+                    const received_image rejected{ std::move(image) };
+                }
+
+                cache->discard(key, session_id);
+                co_return std::nullopt;
+            }
         }
 
-        if (!io::pe::modify_pe_image_for_execution(image_view.view, forked_peb.value()))
+        co_return std::move(image);
+    }
+
+    // Patches a received image for execution and creates its section, adding it to `cache`
+    // if there is one. Needs no socket, so it runs while the session goes on receiving.
+    std::shared_ptr<const netfork::io::prepared_image> prepare_image(
+        received_image image,
+        netfork::io::image_cache* cache,
+        const netfork::io::image_key& key,
+        const PEB& forked_peb,
+        const std::uint64_t session_id)
+    {
+        using namespace netfork;
+
         {
-            LOG_DEBUG_ERR() << "Failed to modify PE image for execution." << std::endl;
-            return 1;
+            io::image_view image_view{ std::move(image.view) };
+            if (!io::pe::modify_pe_image_for_execution(image_view.view, forked_peb))
+            {
+                LOG_DEBUG_ERR() << "Failed to modify PE image for execution." << std::endl;
+                return nullptr;
+            }
+        }
+
+        if (cache)
+        {
+            // The staged file can only be moved into the cache once it's closed.
+            image.file.reset(nullptr);
+            auto cached = cache->insert(key, session_id);
+            if (!cached)
+            {
+                LOG_DEBUG_ERR() << "Failed to add image to cache; error: " << cached.error() << std::endl;
+                return nullptr;
+            }
+
+            return std::move(cached).value();
+        }
+
+        auto section = proc::create_image_section(image.file.get());
+        if (!section)
+        {
+            LOG_DEBUG_ERR() << "Failed to create image section." << std::endl;
+            return nullptr;
         }
+
+        return std::make_shared<const io::prepared_image>(io::prepared_image{
+            .file = std::move(image.file),
+            .section = std::move(section).value()
+        });
     }
 
-    unique_nt_handle<attached_process_deleter> forked_process_handle{};
+    // Prepared images outlive the server process too; without a cache, every fork sends and
+    // patches its image from scratch.
+    std::unique_ptr<netfork::io::image_cache> open_image_cache()
     {
-        auto handle = proc::create_forked_process(image_file_handle.value().get());
+        std::array<WCHAR, MAX_PATH> path{};
+        if (!::ExpandEnvironmentStringsW(L"%TEMP%\\netfork-image-cache", path.data(), static_cast<DWORD>(path.size())))
+        {
+            LOG_DEBUG_ERR() << "Failed to get image cache path; GetLastError: " << ::GetLastError() << std::endl;
+            return nullptr;
+        }
+
+        auto cache = netfork::io::image_cache::open(path.data());
+        if (!cache)
+        {
+            LOG_DEBUG_ERR() << "Failed to open image cache; error: " << cache.error() << std::endl;
+            return nullptr;
+        }
+
+        return std::move(cache).value();
+    }
+
+    // Where the snapshot of a session is kept; unique to the session, like its image.
+    std::optional<std::wstring> snapshot_path(const std::uint64_t session_id)
+    {
+        std::array<WCHAR, MAX_PATH> directory{};
+        if (!::ExpandEnvironmentStringsW(L"%TEMP%\\netfork-snapshots", directory.data(), static_cast<DWORD>(directory.size())))
+        {
+            LOG_DEBUG_ERR() << "Failed to get snapshot directory; GetLastError: " << ::GetLastError() << std::endl;
+            return std::nullopt;
+        }
+
+        if (!::CreateDirectoryW(directory.data(), nullptr) && ::GetLastError() != ERROR_ALREADY_EXISTS)
+        {
+            LOG_DEBUG_ERR() << "Failed to create snapshot directory; GetLastError: " << ::GetLastError() << std::endl;
+            return std::nullopt;
+        }
+
+        return std::format(
+            L"{}\\snapshot-{:x}-{:x}.nfsnap",
+            directory.data(),
+            ::GetCurrentProcessId(),
+            session_id
+        );
+    }
+
+    // Forked processes created ahead of time from cached images, ready for their memory to
+    // be rebuilt. Each has its parameters written but no thread yet.
+    using process_pool = netfork::warm_pool<
+        netfork::io::image_key,
+        std::shared_ptr<const netfork::io::prepared_image>,
+        unique_nt_handle<attached_process_deleter>,
+        netfork::io::image_key_hasher
+    >;
+
+    // Warm processes per cached image unless given on the command line.
+    constexpr const std::size_t DEFAULT_WARM_PROCESSES_PER_IMAGE = 2;
+
+    std::optional<unique_nt_handle<attached_process_deleter>> create_warm_process(
+        const netfork::io::image_key&,
+        const std::shared_ptr<const netfork::io::prepared_image>& image)
+    {
+        auto handle = netfork::proc::create_forked_process(image->file.get(), image->section.get());
         if (!handle)
         {
-            LOG_DEBUG_ERR() << "Failed create forked process." << std::endl;
-            return 1;
+            LOG_DEBUG_ERR() << "Failed to create warm process." << std::endl;
+            return std::nullopt;
         }
 
-        forked_process_handle = std::move(handle).value();
+        return std::move(handle).value();
     }
 
-    if (!vm::rebuild_forked_process(forked_process_handle.get(), client_sock))
+    // Shared by every session; the page store and image cache may be null.
+    struct server_services
     {
-        LOG_DEBUG_ERR() << "Failed to rebuild forked process." << std::endl;
-        return 1;
+        netfork::store::page_store* page_store;
+        netfork::io::image_cache* image_cache;
+        netfork::vm::page_writer* page_writer;
+        process_pool* warm_processes;
+        netfork::admission::scheduler* admission;
+        netfork::net::io_context* io_context;
+        // Runs the phases which block, such as creating a process, off the context's threads.
+        netfork::work_pool* phase_pool;
+        // Where relayed forks are passed on to; empty unless this server relays.
+        const std::vector<netfork::relay::downstream>* downstreams;
+        // The extra connections of the striped forks being served.
+        netfork::stripes::registry* stripes;
+    };
+
+    // Three quarters of physical memory, leaving the rest to the server itself and to the
+    // children already running.
+    std::uint64_t default_memory_budget()
+    {
+        MEMORYSTATUSEX status{ .dwLength = sizeof(MEMORYSTATUSEX) };
+        if (!::GlobalMemoryStatusEx(&status))
+        {
+            LOG_DEBUG_ERR() << "Failed to query physical memory; GetLastError: " << ::GetLastError() << std::endl;
+            return UINT64_MAX;
+        }
+
+        return status.ullTotalPhys / 4 * 3;
     }
 
-    unique_nt_handle forked_thread_handle{};
+    // Frame buffers in flight per writer thread, so a writer always has the next run
+    // buffered while the receive fills another.
+    constexpr const std::size_t WRITE_BUFFERS_PER_WRITER = 4;
+
+    struct exit_watch
     {
-        auto handle = proc::create_forked_thread(
-            forked_process_handle.get(),
-            remote_thread_context.value()
+        HANDLE process;
+        HANDLE wait;
+    };
+
+    // Logs the exit code of a forked process once it exits and closes its handle, without
+    // tying up a session worker until then.
+    void watch_for_exit(HANDLE forked_process_handle)
+    {
+        auto* watch = new exit_watch{ .process = forked_process_handle, .wait = nullptr };
+        const BOOL registered = ::RegisterWaitForSingleObject(
+            &watch->wait,
+            forked_process_handle,
+            [](PVOID context, BOOLEAN)
+            {
+                auto* watch = static_cast<exit_watch*>(context);
+                if (DWORD exit_code = 0;
+                    ::GetExitCodeProcess(watch->process, static_cast<LPDWORD>(&exit_code)))
+                {
+                    LOG_DEBUG() << "Exit code of child process: " << exit_code << std::endl;
+                }
+
+                ::UnregisterWait(watch->wait);
+                ::NtClose(watch->process);
+                delete watch;
+            },
+            watch,
+            INFINITE,
+            WT_EXECUTEONLYONCE
+        );
+        if (!registered)
+        {
+            LOG_DEBUG_ERR() << "Failed to watch child process; GetLastError: " << ::GetLastError() << std::endl;
+            ::NtClose(forked_process_handle);
+            delete watch;
+        }
+    }
+
+    struct forked_process
+    {
+        std::shared_ptr<const netfork::io::prepared_image> image;
+        unique_nt_handle<attached_process_deleter> handle;
+    };
+
+    // Serves one fork from start to finish. Everything up to the payload is awaited on the
+    // threads of the server's `io_context`, except that the image is prepared and the process
+    // created on a thread of their own while the session receives on. Post-copy and
+    // replication sessions then move to a thread of their own too, since they block for as
+    // long as their client stays connected. Every phase is recorded in `timeline`.
+    // `first_header` is the header of the session's first frame, already received.
+    netfork::net::task<BOOL> serve_session(
+        SOCKET client_sock,
+        const netfork::net::codec::frame_header first_header,
+        const std::uint64_t session_id,
+        const server_services& services,
+        netfork::phases::timeline& timeline)
+    {
+        using namespace netfork;
+
+        auto handshake = timeline.begin("handshake", metrics::phase::handshake);
+        const auto remote_thread_context = co_await net::async_recv_body<CONTEXT>(client_sock, first_header);
+        const auto forked_peb = co_await net::async_recv_msg<PEB>(client_sock);
+        const auto forked_teb = co_await net::async_recv_msg<TEB>(client_sock);
+        const auto fork_mode = co_await net::async_recv_msg<net::msg::fork_mode>(client_sock);
+        if (!remote_thread_context || !forked_peb || !forked_teb || !fork_mode)
+        {
+            LOG_DEBUG_ERR() << "Failed to receive CONTEXT, PEB, TEB, or fork mode." << std::endl;
+            co_return FALSE;
+        }
+
+        // Held until the session is done. The child keeps its memory afterwards, but by then
+        // it's a running process rather than a rebuild competing with others for memory.
+        const auto priority = fork_mode->priority == std::to_underlying(admission::priority::bulk)
+            ? admission::priority::bulk
+            : admission::priority::interactive;
+        const auto ticket = co_await admission::admit(
+            *services.admission,
+            *services.io_context,
+            fork_mode->committed_size,
+            priority
         );
+        if (!ticket)
+        {
+            metrics::add(metrics::counter::sessions_rejected);
+            timeline.reject();
+            LOG_DEBUG_ERR() << "Rejected fork committing 0x" << std::hex << fork_mode->committed_size
+                << "; 0x" << services.admission->in_use() << std::dec << " bytes in use and "
+                << services.admission->queued() << " sessions queued" << std::endl;
+        }
+
+        // A striped fork's other connections attach by the token sent with its admission,
+        // and are held until the payload. Only plain forks are striped.
+        std::uint64_t stripe_token = 0;
+        std::shared_ptr<stripes::stripe_set> striping;
+        if (ticket && fork_mode->stripes > 0 && fork_mode->stripes <= net::msg::MAX_STRIPES
+            && !fork_mode->post_copy && !fork_mode->replicate && !fork_mode->relay)
+        {
+            std::tie(stripe_token, striping) = services.stripes->open(*services.io_context, fork_mode->stripes);
+        }
+
+        AT_SCOPE_EXIT([&]
+            {
+                if (striping)
+                {
+                    services.stripes->close(stripe_token);
+                    striping->abort();
+                }
+            }());
+
+        if (const auto result = co_await net::async_send_msg(client_sock, net::msg::admission{
+                .admitted = ticket.has_value(),
+                .stripe_token = stripe_token
+            });
+            FAILED(result) || !ticket)
+        {
+            co_return FALSE;
+        }
+
+        const auto image_info = co_await net::async_recv_msg<net::msg::image_info>(client_sock);
+        if (!image_info)
+        {
+            LOG_DEBUG_ERR() << "Failed to receive image size." << std::endl;
+            co_return FALSE;
+        }
+
+        // A post-copy child is debugged from the start so its first touch of every page that
+        // hasn't arrived yet is reported.
+        unique_nt_handle debug_object_handle{};
+        if (fork_mode->post_copy)
+        {
+            auto handle = proc::create_debug_object();
+            if (!handle)
+            {
+                LOG_DEBUG_ERR() << "Failed to create debug object; status: " << handle.error() << std::endl;
+                co_return FALSE;
+            }
+
+            debug_object_handle = std::move(handle).value();
+        }
+
+        const io::image_key image_key{
+            .read_only_hash = {
+                .low = image_info->read_only_hash_low,
+                .high = image_info->read_only_hash_high
+            },
+            .image_base = reinterpret_cast<std::uint64_t>(forked_peb->ImageBaseAddress),
+            .size_of_image = image_info->size_of_image
+        };
+
+        std::shared_ptr<const io::prepared_image> image = services.image_cache ? services.image_cache->find(image_key) : nullptr;
+        const bool cache_hit = image != nullptr;
+        if (const auto result = co_await net::async_send_msg(client_sock, net::msg::image_cache_status{ .hit = cache_hit });
+            FAILED(result))
+        {
+            LOG_DEBUG_ERR() << "Failed to send image cache status." << std::endl;
+            co_return FALSE;
+        }
+
+        handshake.end();
+
+        // Relayed forks are passed on while they're received; the hops' handshakes overlap
+        // the rest of this one.
+        std::shared_ptr<relay::session> relaying;
+        if (fork_mode->relay && !fork_mode->post_copy && !fork_mode->replicate && !services.downstreams->empty())
+        {
+            relaying = std::make_shared<relay::session>(session_id, *services.downstreams, relay::handshake{
+                .thread_context = remote_thread_context.value(),
+                .peb = forked_peb.value(),
+                .teb = forked_teb.value(),
+                .fork_mode = fork_mode.value(),
+                .image_info = image_info.value()
+            });
+            relaying->start();
+        }
+
+        AT_SCOPE_EXIT(if (relaying) relaying->close(false));
+
+        std::optional<received_image> received;
+        if (!cache_hit)
+        {
+            auto phase = timeline.begin("receive image", metrics::phase::image);
+            received = co_await ::receive_image(client_sock, services.image_cache, image_key, session_id);
+            if (!received)
+            {
+                co_return FALSE;
+            }
+        }
+        else
+        {
+            LOG_DEBUG() << "Image cache hit" << std::endl;
+        }
+
+        // Only a cached image's processes are pooled: they're patched by the overlay like any
+        // other process of the image. A post-copy child needs its debug object from creation.
+        unique_nt_handle<attached_process_deleter> warm_process{};
+        if (cache_hit && !fork_mode->post_copy)
+        {
+            if (auto warm = services.warm_processes->take(image_key))
+            {
+                warm_process = std::move(warm).value();
+            }
+
+            const auto counters = services.warm_processes->counters();
+            LOG_DEBUG() << "Warm process " << (warm_process ? "hit" : "miss") << "; "
+                << counters.hits << " hits, " << counters.misses << " misses, "
+                << counters.evicted << " evicted, " << services.warm_processes->size() << " ready" << std::endl;
+        }
+
+        // The image is patched and the process created while the session goes on receiving
+        // whatever the client sends next, which is staged until the process exists.
+        phases::concurrent_phase<std::optional<forked_process>> creation{
+            *services.io_context,
+            *services.phase_pool,
+            timeline,
+            "prepare image and create process",
+            metrics::phase::process_create,
+            [&]() -> std::optional<forked_process>
+        {
+            if (received)
+            {
+                image = ::prepare_image(std::move(received).value(), services.image_cache, image_key, forked_peb.value(), session_id);
+                if (!image)
+                {
+                    return std::nullopt;
+                }
+            }
+
+            if (warm_process)
+            {
+                return forked_process{ .image = image, .handle = std::move(warm_process) };
+            }
+
+            auto handle = proc::create_forked_process(
+                image->file.get(),
+                image->section.get(),
+                debug_object_handle.get()
+            );
+            if (!handle)
+            {
+                LOG_DEBUG_ERR() << "Failed create forked process." << std::endl;
+                return std::nullopt;
+            }
+
+            return forked_process{ .image = image, .handle = std::move(handle).value() };
+        } };
+
+        // A cached image holds whatever its writable pages looked like when it was first sent.
+        vm::staged_pages overlay;
+        BOOL overlay_received = TRUE;
+        if (cache_hit)
+        {
+            auto phase = timeline.begin("receive image overlay", metrics::phase::image);
+            overlay_received = co_await vm::receive_image_overlay(overlay, client_sock, image_key.image_base, image_key.size_of_image);
+        }
+
+        // Post-copy and replication sessions go on to frames of their own.
+        std::expected<net::address_space_manifest, HRESULT> manifest = std::unexpected{ E_PENDING };
+        if (overlay_received && !fork_mode->post_copy && !fork_mode->replicate)
+        {
+            auto phase = timeline.begin("receive manifest", metrics::phase::vm_rebuild);
+            manifest = co_await vm::async_recv_manifest(client_sock);
+        }
+
+        // Awaited even if the overlay didn't arrive, since creation uses the session's locals.
+        auto forked = co_await creation;
+        if (!overlay_received)
+        {
+            LOG_DEBUG_ERR() << "Failed to receive image overlay." << std::endl;
+            timeline.fail(metrics::phase::image);
+            co_return FALSE;
+        }
+
+        if (!forked)
+        {
+            timeline.fail(metrics::phase::process_create);
+            co_return FALSE;
+        }
+
+        if (services.image_cache)
+        {
+            services.warm_processes->warm(image_key, forked->image);
+        }
+
+        unique_nt_handle<attached_process_deleter> forked_process_handle = std::move(forked->handle);
+        overlay.write(forked_process_handle.get());
+        if (relaying)
+        {
+            relaying->image_ready(forked_process_handle.get(), image_key.image_base, image_key.size_of_image);
+            if (manifest)
+            {
+                relaying->forward_manifest(manifest.value());
+            }
+        }
+
+        if (fork_mode->post_copy || fork_mode->replicate)
+        {
+            co_await net::resume_on_new_thread();
+        }
+
+        auto payload = timeline.begin("receive payload", metrics::phase::vm_rebuild);
+        CONTEXT thread_context = remote_thread_context.value();
+        // Taken before the final protections, while every page with a payload can still be
+        // read. A fork which can't be snapshotted still goes ahead.
+        std::function<void(const net::address_space_manifest&)> keep_snapshot;
+        if (fork_mode->snapshot && !fork_mode->post_copy && !fork_mode->replicate)
+        {
+            keep_snapshot = [&](const net::address_space_manifest& received_manifest)
+            {
+                const auto path = ::snapshot_path(session_id);
+                if (!path)
+                {
+                    return;
+                }
+
+                if (const auto result = snapshot::write(
+                        path.value(),
+                        forked_process_handle.get(),
+                        thread_context,
+                        forked_peb.value(),
+                        forked_teb.value(),
+                        image_key.image_base,
+                        image_key.size_of_image,
+                        received_manifest);
+                    FAILED(result))
+                {
+                    LOG_DEBUG_ERR() << "Failed to write snapshot; error: " << result << std::endl;
+                    return;
+                }
+
+                LOG_DEBUG() << "Kept snapshot of session " << session_id << std::endl;
+            };
+        }
+
+        std::unique_ptr<post_copy::lazy_process> lazy_process;
+        if (fork_mode->post_copy)
+        {
+            auto lazy = post_copy::lazy_process::receive_hot_set(
+                forked_process_handle.get(),
+                debug_object_handle.get(),
+                client_sock
+            );
+            if (!lazy)
+            {
+                LOG_DEBUG_ERR() << "Failed to receive hot set; error: " << lazy.error() << std::endl;
+                co_return FALSE;
+            }
+
+            lazy_process = std::move(lazy).value();
+        }
+        else if (fork_mode->replicate)
+        {
+            // The standby only starts if the client goes away; a client which stops
+            // replicating on purpose doesn't need it.
+            replica::standby standby{
+                forked_process_handle.get(),
+                client_sock,
+                image_key.image_base,
+                image_key.size_of_image
+            };
+            if (const auto end = standby.receive(); end != replica::replication_end::disconnected)
+            {
+                LOG_DEBUG() << "Replication ended without a failover." << std::endl;
+                co_return end == replica::replication_end::stopped;
+            }
+
+            const auto standby_context = standby.promote();
+            if (!standby_context)
+            {
+                LOG_DEBUG_ERR() << "Client went away before any epoch was committed." << std::endl;
+                co_return FALSE;
+            }
+
+            thread_context = standby_context.value();
+        }
+        else if (!co_await vm::rebuild_forked_process(
+            forked_process_handle.get(),
+            client_sock,
+            std::move(manifest),
+            image_key.image_base,
+            image_key.size_of_image,
+            services.page_store,
+            *services.page_writer,
+            *services.io_context,
+            keep_snapshot,
+            relaying ? relaying->tee() : nullptr,
+            striping.get()))
+        {
+            LOG_DEBUG_ERR() << "Failed to rebuild forked process." << std::endl;
+            co_return FALSE;
+        }
+
+        if (relaying)
+        {
+            relaying->close(true);
+            relaying.reset();
+        }
+
+        payload.end();
+
+        // A child of `fork_many` reads its rank from where the client said.
+        if (fork_mode->rank_address != 0 && !fork_mode->post_copy && !fork_mode->replicate)
+        {
+            const std::uint64_t rank = fork_mode->rank;
+            if (!::WriteProcessMemory(
+                    forked_process_handle.get(),
+                    reinterpret_cast<LPVOID>(fork_mode->rank_address),
+                    &rank,
+                    sizeof(rank),
+                    nullptr))
+            {
+                LOG_DEBUG_ERR() << "Failed to write rank of forked process; GetLastError: " << ::GetLastError() << std::endl;
+                co_return FALSE;
+            }
+        }
+
+        unique_nt_handle forked_thread_handle{};
+        {
+            auto phase = timeline.begin("create thread", metrics::phase::thread_start);
+            auto handle = proc::create_forked_thread(
+                forked_process_handle.get(),
+                thread_context
+            );
+            if (!handle)
+            {
+                LOG_DEBUG_ERR() << "Failed create forked process." << std::endl;
+                co_return FALSE;
+            }
+
+            forked_thread_handle = std::move(handle).value();
+        }
+
+        ::ResumeThread(forked_thread_handle.get());
+        if (lazy_process && !lazy_process->serve())
+        {
+            LOG_DEBUG_ERR() << "Failed to serve post-copy fork." << std::endl;
+            co_return FALSE;
+        }
+
+        // The child outlives the session; its exit is only logged.
+        ::watch_for_exit(forked_process_handle.release());
+        co_return TRUE;
+    }
+
+    std::atomic<std::uint64_t> next_session_id = 1;
+
+    // Hands a connection which opened with `stripe_attach` to the striped fork it's part of.
+    // Returns false if there's no such fork waiting for it, in which case the connection is
+    // still the caller's to close.
+    netfork::net::task<BOOL> attach_stripe(
+        SOCKET client_sock,
+        const netfork::net::codec::frame_header header,
+        const server_services& services)
+    {
+        using namespace netfork;
+
+        const auto attach = co_await net::async_recv_body<net::msg::stripe_attach>(client_sock, header);
+        if (!attach)
+        {
+            LOG_DEBUG_ERR() << "Failed to receive stripe attach; error: " << attach.error() << std::endl;
+            co_return FALSE;
+        }
+
+        if (!services.stripes->attach(attach->token, attach->index, client_sock))
+        {
+            LOG_DEBUG_ERR() << "No striped fork is waiting for stripe " << +attach->index << std::endl;
+            co_return FALSE;
+        }
+
+        LOG_DEBUG() << "Attached stripe " << +attach->index << std::endl;
+        co_return TRUE;
+    }
+
+    netfork::net::task<> run_session(SOCKET client_sock, const server_services& services)
+    {
+        using namespace netfork;
+
+        // The other connections of a striped fork belong to its session from here on.
+        const auto first_header = co_await net::async_recv_header(client_sock);
+        if (first_header
+            && first_header->type == net::codec::frame_type::stripe_attach
+            && co_await attach_stripe(client_sock, first_header.value(), services))
+        {
+            co_return;
+        }
+
+        AT_SCOPE_EXIT([client_sock]
+            {
+                ::shutdown(client_sock, SD_BOTH);
+                ::closesocket(client_sock);
+            }());
+
+        if (!first_header)
+        {
+            LOG_DEBUG_ERR() << "Failed to receive first frame; error: " << first_header.error() << std::endl;
+            co_return;
+        }
+
+        if (first_header->type == net::codec::frame_type::stripe_attach)
+        {
+            co_return;
+        }
+
+        const metrics::in_flight in_flight;
+        metrics::add(metrics::counter::sessions_started);
+
+        const std::uint64_t session_id = next_session_id++;
+        LOG_DEBUG() << "Session " << session_id << " started" << std::endl;
+        phases::timeline timeline;
+        const BOOL served = co_await serve_session(client_sock, first_header.value(), session_id, services, timeline);
+        LOG_DEBUG() << "Session " << session_id << (served ? " finished" : " failed") << std::endl;
+        timeline.log(session_id);
+        if (served)
+        {
+            metrics::add(metrics::counter::sessions_served);
+        }
+        else
+        {
+            if (const auto failed = timeline.failed_phase())
+            {
+                metrics::record_failure(failed.value());
+            }
+        }
+    }
+
+    // Accepts clients until the listening socket is closed and starts a session for each
+    // one on `context`.
+    void accept_sessions(SOCKET listen_sock, netfork::net::io_context& context, const server_services& services)
+    {
+        while (true)
+        {
+            SOCKET client_sock = ::accept(listen_sock, nullptr, nullptr);
+            if (client_sock == INVALID_SOCKET)
+            {
+                const int error = ::WSAGetLastError();
+                if (error == WSAENOTSOCK || error == WSAEINVAL || error == WSAEINTR)
+                {
+                    return;
+                }
+
+                LOG_DEBUG_ERR() << "Failed to accept client; WSAGetLastError: " << error << std::endl;
+                continue;
+            }
+
+            if (const auto result = context.associate(client_sock); FAILED(result))
+            {
+                LOG_DEBUG_ERR() << "Failed to associate client socket; error: " << result << std::endl;
+                ::closesocket(client_sock);
+                continue;
+            }
+
+            netfork::net::spawn(context, ::run_session(client_sock, services));
+        }
+    }
+
+    // Writes the payload of one subregion of a snapshot into a spawned child. Pages of
+    // private memory which are zero are skipped, since fresh memory is zero already.
+    void write_snapshot_payload(
+        HANDLE forked_process_handle,
+        netfork::vm::shared_regions& shared,
+        const netfork::net::manifest_subregion& subregion,
+        std::span<const std::byte> bytes)
+    {
+        using namespace netfork;
+
+        if (auto* view = shared.find(subregion.base_address, bytes.size()))
+        {
+            std::memcpy(view, bytes.data(), bytes.size());
+            return;
+        }
+
+        std::size_t run_start = 0;
+        const auto write_run = [&](const std::size_t run_end)
+        {
+            if (run_end > run_start)
+            {
+                vm::write_process_memory(
+                    forked_process_handle,
+                    subregion.base_address + run_start,
+                    bytes.subspan(run_start, run_end - run_start)
+                );
+            }
+        };
+
+        for (std::size_t offset = 0; offset < bytes.size(); offset += net::MANIFEST_PAGE_SIZE)
+        {
+            if (simd::is_zero_page(bytes.data() + offset))
+            {
+                write_run(offset);
+                run_start = offset + net::MANIFEST_PAGE_SIZE;
+            }
+        }
+
+        write_run(bytes.size());
+    }
+
+    // Spawns one child of `snapshot` from the image section every child shares. Mapped
+    // regions are sections of their own, as in a received fork; the rest is copied out of
+    // the snapshot's read-only view.
+    BOOL spawn_from_snapshot(const netfork::snapshot::snapshot_file& snapshot, const netfork::io::prepared_image& image)
+    {
+        using namespace netfork;
+
+        auto handle = proc::create_forked_process(image.file.get(), image.section.get());
         if (!handle)
         {
             LOG_DEBUG_ERR() << "Failed create forked process." << std::endl;
+            return FALSE;
+        }
+
+        unique_nt_handle<attached_process_deleter> forked_process_handle = std::move(handle).value();
+        {
+            vm::shared_regions shared;
+            vm::plan_address_space(forked_process_handle.get(), snapshot.manifest(), &shared);
+            snapshot.for_each_payload([&](const net::manifest_subregion& subregion, std::span<const std::byte> bytes)
+            {
+                ::write_snapshot_payload(forked_process_handle.get(), shared, subregion, bytes);
+            });
+        }
+
+        vm::apply_final_protections(forked_process_handle.get(), snapshot.manifest());
+
+        auto thread_handle = proc::create_forked_thread(forked_process_handle.get(), snapshot.thread_context());
+        if (!thread_handle)
+        {
+            LOG_DEBUG_ERR() << "Failed create forked thread." << std::endl;
+            return FALSE;
+        }
+
+        ::ResumeThread(thread_handle.value().get());
+        ::watch_for_exit(forked_process_handle.release());
+        return TRUE;
+    }
+
+    // Spawns `count` children of the snapshot at `path` and returns the process exit code.
+    int spawn_children(const std::wstring& path, const unsigned int count)
+    {
+        using namespace netfork;
+
+        auto snapshot = snapshot::snapshot_file::open(path);
+        if (!snapshot)
+        {
+            LOG_DEBUG_ERR() << "Failed to open snapshot; error: " << snapshot.error() << std::endl;
             return 1;
         }
 
-        forked_thread_handle = std::move(handle).value();
+        // The image in a snapshot is already patched for execution; it only needs a file of
+        // its own to back the section.
+        const auto image_bytes = snapshot.value()->image();
+        const auto unexpanded_path = std::format(
+            L"\\??\\%TEMP%\\netfork-snapshot-image-{:x}.exe",
+            ::GetCurrentProcessId()
+        );
+        auto image_path = ::get_nt_path(unexpanded_path.c_str());
+        if (!image_path)
+        {
+            LOG_DEBUG_ERR() << "Failed to get NT path for image." << std::endl;
+            return 1;
+        }
+
+        auto image_file_handle = io::create_image_file(static_cast<DWORD>(image_bytes.size()), image_path.value().get());
+        if (!image_file_handle)
+        {
+            LOG_DEBUG_ERR() << "Failed to create image file." << std::endl;
+            return 1;
+        }
+
+        {
+            auto image_view = io::create_image_view(image_file_handle.value().get(), static_cast<DWORD>(image_bytes.size()));
+            if (!image_view)
+            {
+                LOG_DEBUG_ERR() << "Failed to create image view." << std::endl;
+                return 1;
+            }
+
+            std::memcpy(image_view.value().view.get(), image_bytes.data(), image_bytes.size());
+        }
+
+        auto section = proc::create_image_section(image_file_handle.value().get());
+        if (!section)
+        {
+            LOG_DEBUG_ERR() << "Failed to create image section." << std::endl;
+            return 1;
+        }
+
+        const io::prepared_image image{
+            .file = std::move(image_file_handle).value(),
+            .section = std::move(section).value()
+        };
+
+        unsigned int spawned = 0;
+        for (unsigned int i = 0; i < count; i++)
+        {
+            if (::spawn_from_snapshot(*snapshot.value(), image))
+            {
+                spawned++;
+            }
+        }
+
+        LOG_DEBUG() << "Spawned " << spawned << " of " << count << " children" << std::endl;
+        return spawned == count ? 0 : 1;
     }
+}
+
+// Usage: netfork-server [I/O threads] [warm processes per cached image] [memory budget in MiB]
+//                       [downstream servers to relay to, as address:port,...]
+//        netfork-server spawn <snapshot> [count]
+int main(int argc, char* argv[])
+{
+    using namespace netfork;
 
-    ::ResumeThread(forked_thread_handle.get());
-    ::WaitForSingleObject(forked_process_handle.get(), INFINITE);
+    if (argc > 2 && std::string_view{ argv[1] } == "spawn")
+    {
+        const unsigned int count = argc > 3 ? static_cast<unsigned int>(std::max(1, std::atoi(argv[3]))) : 1;
+        return ::spawn_children(std::filesystem::path{ argv[2] }.wstring(), count);
+    }
+
+    if (!net::winsock_init())
+    {
+        LOG_DEBUG_ERR() << "Winsock failed to initialize." << std::endl;
+        return 1;
+    }
+
+    AT_SCOPE_EXIT(::WSACleanup());
+
+    const auto page_store = ::open_page_store();
+    const auto image_cache = ::open_image_cache();
+    vm::page_writer page_writer{ default_worker_count(), WRITE_BUFFERS_PER_WRITER * default_worker_count(), vm::write_forked_pages };
+
+    unsigned int io_threads = default_worker_count();
+    if (argc > 1)
+    {
+        io_threads = std::max(1, std::atoi(argv[1]));
+    }
 
-    if (DWORD exit_code = 0;
-        ::GetExitCodeProcess(forked_process_handle.get(), static_cast<LPDWORD>(&exit_code)))
+    warm_pool_options pool_options{
+        .items_per_key = DEFAULT_WARM_PROCESSES_PER_IMAGE,
+        .max_keys = io::MAX_CACHED_IMAGES
+    };
+    if (argc > 2)
     {
-        LOG_DEBUG() << "Exit code of child process: " << exit_code << std::endl;
+        pool_options.items_per_key = static_cast<std::size_t>(std::max(0, std::atoi(argv[2])));
     }
 
-    // Release the process handle; we are essentially "detaching" from the process.
-    forked_process_handle.release();
+    process_pool warm_processes{ pool_options, ::create_warm_process };
+
+    admission::options admission_options{ .budget = ::default_memory_budget() };
+    if (argc > 3)
+    {
+        admission_options.budget = std::strtoull(argv[3], nullptr, 10) << 20;
+    }
+
+    admission::scheduler admission{ admission_options };
+
+    std::vector<relay::downstream> downstreams;
+    if (argc > 4)
+    {
+        downstreams = relay::parse_downstreams(argv[4]);
+    }
+
+    auto context = net::io_context::create(io_threads);
+    if (!context)
+    {
+        LOG_DEBUG_ERR() << "Failed to create I/O context; error: " << context.error() << std::endl;
+        return 1;
+    }
+
+    // Gone before the context, which its phases resume their sessions on.
+    work_pool phase_pool{ default_worker_count() };
+    stripes::registry stripes;
+    const server_services services{
+        .page_store = page_store.get(),
+        .image_cache = image_cache.get(),
+        .page_writer = &page_writer,
+        .warm_processes = &warm_processes,
+        .admission = &admission,
+        .io_context = context.value().get(),
+        .phase_pool = &phase_pool,
+        .downstreams = &downstreams,
+        .stripes = &stripes
+    };
+
+    SOCKET listen_sock = net::listen_on(SERVICE_PORT);
+    if (listen_sock == INVALID_SOCKET)
+    {
+        LOG_DEBUG_ERR() << "Failed to listen on port " << SERVICE_PORT << std::endl;
+        return 1;
+    }
+
+    AT_SCOPE_EXIT(::closesocket(listen_sock));
+
+    // Metrics are a convenience; the server runs without them.
+    SOCKET metrics_sock = net::listen_on(METRICS_PORT, METRICS_ADDRESS);
+    if (metrics_sock == INVALID_SOCKET)
+    {
+        LOG_DEBUG_ERR() << "Failed to listen for metrics on port " << METRICS_PORT << std::endl;
+    }
+    else
+    {
+        std::thread{ [metrics_sock] { metrics::serve(metrics_sock); } }.detach();
+        LOG_DEBUG() << "Serving metrics on " << METRICS_ADDRESS << ":" << METRICS_PORT << std::endl;
+    }
+
+    AT_SCOPE_EXIT(if (metrics_sock != INVALID_SOCKET) ::closesocket(metrics_sock));
+
+    LOG_DEBUG() << "Serving sessions on " << io_threads << " I/O threads on port "
+        << SERVICE_PORT << "; " << pool_options.items_per_key << " warm processes per cached image, "
+        << (admission_options.budget >> 20) << " MiB memory budget, relaying to "
+        << downstreams.size() << " servers" << std::endl;
 
+    ::accept_sessions(listen_sock, *context.value(), services);
     return 0;
 }
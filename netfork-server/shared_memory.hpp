@@ -0,0 +1,179 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include <netfork-shared/log.hpp>
+#include <netfork-shared/net/manifest.hpp>
+#include <netfork-shared/phnt_stub.hpp>
+#include <netfork-shared/utils.hpp>
+
+namespace netfork::vm
+{
+    // A region of the forked process backed by a pagefile-backed section which the server
+    // maps as well, so its payload is received straight into memory the child sees.
+    struct shared_region
+    {
+        std::uint64_t base_address;
+        std::uint64_t size;
+        map_view_ptr view;
+    };
+
+    // The shared regions of one forked process, in ascending address order.
+    //
+    // Only regions which were views in the client are shared. A private region has to stay
+    // private in the child: its heaps and stacks decommit and release that memory, which a
+    // view doesn't allow.
+    class shared_regions
+    {
+        std::vector<shared_region> regions_;
+
+        std::vector<shared_region>::iterator find_region(const std::uint64_t address)
+        {
+            auto it = std::upper_bound(regions_.begin(), regions_.end(), address, [](const std::uint64_t address, const shared_region& region)
+            {
+                return address < region.base_address;
+            });
+            if (it == regions_.begin())
+            {
+                return regions_.end();
+            }
+
+            --it;
+            return address - it->base_address < it->size ? it : regions_.end();
+        }
+
+    public:
+        shared_regions() = default;
+        shared_regions(const shared_regions&) = delete;
+        shared_regions& operator=(const shared_regions&) = delete;
+
+        // Maps a fresh section the size of `region` at its base in the forked process and
+        // anywhere in the server. The whole view is committed and writable. Returns false if
+        // the region should be planned as private memory instead.
+        bool map(HANDLE forked_process_handle, const net::manifest_region& region)
+        {
+            if (region.type != MEM_MAPPED)
+            {
+                return false;
+            }
+
+            unique_handle mapping_handle{ ::CreateFileMappingW(
+                INVALID_HANDLE_VALUE,
+                nullptr,
+                PAGE_EXECUTE_READWRITE | SEC_COMMIT,
+                static_cast<DWORD>(region.allocation_size >> 32),
+                static_cast<DWORD>(region.allocation_size),
+                nullptr
+            ) };
+            if (!mapping_handle)
+            {
+                LOG_DEBUG_ERR() << "Failed to create section for region at 0x" << std::hex
+                    << region.base_address << std::dec << " GetLastError: " << ::GetLastError() << std::endl;
+                return false;
+            }
+
+            map_view_ptr view{ ::MapViewOfFile(mapping_handle.get(), FILE_MAP_WRITE, 0, 0, region.allocation_size) };
+            if (!view)
+            {
+                LOG_DEBUG_ERR() << "Failed to map section of region at 0x" << std::hex
+                    << region.base_address << std::dec << " GetLastError: " << ::GetLastError() << std::endl;
+                return false;
+            }
+
+            // The view keeps the section alive once the mapping handle is closed.
+            const PVOID forked_view = ::MapViewOfFile3(
+                mapping_handle.get(),
+                forked_process_handle,
+                reinterpret_cast<PVOID>(region.base_address),
+                0,
+                region.allocation_size,
+                0,
+                PAGE_READWRITE,
+                nullptr,
+                0
+            );
+            if (!forked_view)
+            {
+                LOG_DEBUG_ERR() << "Failed to map section into forked process at 0x" << std::hex
+                    << region.base_address << std::dec << " GetLastError: " << ::GetLastError() << std::endl;
+                return false;
+            }
+
+            const auto it = std::upper_bound(regions_.begin(), regions_.end(), region.base_address, [](const std::uint64_t address, const shared_region& shared)
+            {
+                return address < shared.base_address;
+            });
+            regions_.insert(it, shared_region{
+                .base_address = region.base_address,
+                .size = region.allocation_size,
+                .view = std::move(view)
+            });
+            return true;
+        }
+
+        // Unmaps the region at `base_address` from both processes. Returns false if it
+        // isn't shared, in which case it's private memory of the forked process.
+        bool unmap(HANDLE forked_process_handle, const std::uint64_t base_address)
+        {
+            const auto it = find_region(base_address);
+            if (it == regions_.end() || it->base_address != base_address)
+            {
+                return false;
+            }
+
+            if (!::UnmapViewOfFile2(forked_process_handle, reinterpret_cast<PVOID>(base_address), 0))
+            {
+                LOG_DEBUG_ERR() << "Failed to unmap region at 0x" << std::hex << base_address
+                    << std::dec << " GetLastError: " << ::GetLastError() << std::endl;
+            }
+
+            regions_.erase(it);
+            return true;
+        }
+
+        // The server's view of `[address, address + size)`, or null if that isn't entirely
+        // inside one shared region.
+        std::byte* find(const std::uint64_t address, const std::uint64_t size)
+        {
+            const auto it = find_region(address);
+            if (it == regions_.end() || size > it->size - (address - it->base_address))
+            {
+                return nullptr;
+            }
+
+            return static_cast<std::byte*>(it->view.get()) + (address - it->base_address);
+        }
+
+        // Unmaps every view of the server; the forked process keeps its own.
+        void release_views()
+        {
+            regions_.clear();
+        }
+
+        std::size_t size() const noexcept
+        {
+            return regions_.size();
+        }
+    };
+}
@@ -0,0 +1,281 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <expected>
+#include <memory>
+#include <span>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "snapshot_format.hpp"
+
+#include <netfork-shared/log.hpp>
+#include <netfork-shared/net/manifest.hpp>
+#include <netfork-shared/net/msg.hpp>
+#include <netfork-shared/net/sock.hpp>
+#include <netfork-shared/phnt_stub.hpp>
+#include <netfork-shared/utils.hpp>
+
+namespace netfork::snapshot
+{
+    // The file holds something other than a snapshot of this format.
+    constexpr const HRESULT MALFORMED_SNAPSHOT = 0xA0000007;
+
+    constexpr const state_sizes STATE_SIZES{ .context = sizeof(CONTEXT), .peb = sizeof(PEB), .teb = sizeof(TEB) };
+
+    inline bool has_payload(const std::uint32_t protect) noexcept
+    {
+        return net::msg::has_payload(protect);
+    }
+
+    // Copies `[address, address + out.size())` of `process` into `out`, leaving whatever
+    // can't be read as zero.
+    void read_readable(HANDLE process, const std::uint64_t address, std::span<std::byte> out)
+    {
+        SIZE_T bytes_read = 0;
+        if (::ReadProcessMemory(process, reinterpret_cast<LPCVOID>(address), out.data(), out.size(), &bytes_read)
+            && bytes_read == out.size())
+        {
+            return;
+        }
+
+        // Some page in the range can't be read; fall back to the pages which can.
+        for (std::size_t offset = 0; offset < out.size(); offset += net::MANIFEST_PAGE_SIZE)
+        {
+            const auto page = out.subspan(offset, std::min<std::size_t>(net::MANIFEST_PAGE_SIZE, out.size() - offset));
+            if (!::ReadProcessMemory(process, reinterpret_cast<LPCVOID>(address + offset), page.data(), page.size(), &bytes_read))
+            {
+                std::memset(page.data(), 0, page.size());
+            }
+        }
+    }
+
+    // Writes a snapshot of the forked process to `path`. Must be called once the payload is
+    // in but before the final protections are applied, while every page with a payload is
+    // still readable.
+    HRESULT write(
+        const std::wstring& path,
+        HANDLE forked_process_handle,
+        const CONTEXT& thread_context,
+        const PEB& forked_peb,
+        const TEB& forked_teb,
+        const std::uint64_t image_base,
+        const std::uint64_t image_size,
+        const net::address_space_manifest& manifest)
+    {
+        const auto encoded_manifest = net::encode_manifest(manifest);
+        const header head = plan(STATE_SIZES, encoded_manifest.size(), image_base, image_size, payload_size_of(manifest, has_payload));
+        const std::uint64_t file_size = file_size_of(head);
+
+        unique_handle<> file{ ::CreateFileW(
+            path.c_str(),
+            GENERIC_READ | GENERIC_WRITE,
+            FILE_SHARE_READ,
+            nullptr,
+            CREATE_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL,
+            nullptr
+        ) };
+        if (!file)
+        {
+            return HRESULT_FROM_WIN32(::GetLastError());
+        }
+
+        // Sizes the file as well; the pages are read straight into it.
+        unique_handle<> mapping{ ::CreateFileMappingW(
+            file.get(),
+            nullptr,
+            PAGE_READWRITE,
+            static_cast<DWORD>(file_size >> 32),
+            static_cast<DWORD>(file_size),
+            nullptr
+        ) };
+        if (!mapping)
+        {
+            return HRESULT_FROM_WIN32(::GetLastError());
+        }
+
+        map_view_ptr view{ ::MapViewOfFile(mapping.get(), FILE_MAP_WRITE, 0, 0, file_size) };
+        if (!view)
+        {
+            return HRESULT_FROM_WIN32(::GetLastError());
+        }
+
+        auto* const bytes = static_cast<std::byte*>(view.get());
+        const std::span<std::byte> file_bytes{ bytes, file_size };
+        write_state(
+            file_bytes,
+            head,
+            std::as_bytes(std::span{ &thread_context, 1 }),
+            std::as_bytes(std::span{ &forked_peb, 1 }),
+            std::as_bytes(std::span{ &forked_teb, 1 }),
+            encoded_manifest
+        );
+
+        read_readable(forked_process_handle, image_base, { bytes + head.image_offset, image_size });
+
+        std::uint64_t payload_offset = head.payload_offset;
+        for (const auto& subregion : manifest.subregions)
+        {
+            if (!has_payload(subregion.protect))
+            {
+                continue;
+            }
+
+            read_readable(forked_process_handle, subregion.base_address, { bytes + payload_offset, subregion.region_size });
+            payload_offset += subregion.region_size;
+        }
+
+        seal(file_bytes, head);
+        if (!::FlushViewOfFile(view.get(), 0))
+        {
+            return HRESULT_FROM_WIN32(::GetLastError());
+        }
+
+        LOG_DEBUG() << "Wrote snapshot of 0x" << std::hex << file_size << std::dec << " bytes" << std::endl;
+        return ERROR_SUCCESS;
+    }
+
+    // A snapshot file mapped read-only. Everything it hands out points into the mapping.
+    class snapshot_file
+    {
+        unique_handle<> file_;
+        unique_handle<> mapping_;
+        map_view_ptr view_;
+        std::uint64_t size_;
+        contents contents_;
+
+        snapshot_file(unique_handle<> file, unique_handle<> mapping, map_view_ptr view, const std::uint64_t size, contents contents)
+            : file_{ std::move(file) }
+            , mapping_{ std::move(mapping) }
+            , view_{ std::move(view) }
+            , size_{ size }
+            , contents_{ std::move(contents) }
+        {
+        }
+
+        const std::byte* bytes() const noexcept
+        {
+            return static_cast<const std::byte*>(view_.get());
+        }
+
+    public:
+        snapshot_file(const snapshot_file&) = delete;
+        snapshot_file& operator=(const snapshot_file&) = delete;
+
+        static std::expected<std::unique_ptr<snapshot_file>, HRESULT> open(const std::wstring& path)
+        {
+            unique_handle<> file{ ::CreateFileW(
+                path.c_str(),
+                GENERIC_READ,
+                FILE_SHARE_READ,
+                nullptr,
+                OPEN_EXISTING,
+                FILE_ATTRIBUTE_NORMAL,
+                nullptr
+            ) };
+            if (!file)
+            {
+                return std::unexpected{ HRESULT_FROM_WIN32(::GetLastError()) };
+            }
+
+            LARGE_INTEGER size{};
+            if (!::GetFileSizeEx(file.get(), &size))
+            {
+                return std::unexpected{ HRESULT_FROM_WIN32(::GetLastError()) };
+            }
+
+            unique_handle<> mapping{ ::CreateFileMappingW(file.get(), nullptr, PAGE_READONLY, 0, 0, nullptr) };
+            if (!mapping)
+            {
+                return std::unexpected{ HRESULT_FROM_WIN32(::GetLastError()) };
+            }
+
+            map_view_ptr view{ ::MapViewOfFile(mapping.get(), FILE_MAP_READ, 0, 0, 0) };
+            if (!view)
+            {
+                return std::unexpected{ HRESULT_FROM_WIN32(::GetLastError()) };
+            }
+
+            const std::uint64_t file_size = static_cast<std::uint64_t>(size.QuadPart);
+            auto parsed = parse({ static_cast<const std::byte*>(view.get()), file_size }, STATE_SIZES, has_payload);
+            if (!parsed)
+            {
+                return std::unexpected{ MALFORMED_SNAPSHOT };
+            }
+
+            return std::unique_ptr<snapshot_file>{ new snapshot_file{
+                std::move(file),
+                std::move(mapping),
+                std::move(view),
+                file_size,
+                std::move(parsed).value()
+            } };
+        }
+
+        CONTEXT thread_context() const
+        {
+            CONTEXT context;
+            std::memcpy(&context, bytes() + contents_.head.context_offset, sizeof(CONTEXT));
+            return context;
+        }
+
+        PEB peb() const
+        {
+            PEB peb;
+            std::memcpy(&peb, bytes() + contents_.head.peb_offset, sizeof(PEB));
+            return peb;
+        }
+
+        TEB teb() const
+        {
+            TEB teb;
+            std::memcpy(&teb, bytes() + contents_.head.teb_offset, sizeof(TEB));
+            return teb;
+        }
+
+        const net::address_space_manifest& manifest() const noexcept
+        {
+            return contents_.manifest;
+        }
+
+        std::uint64_t image_base() const noexcept
+        {
+            return contents_.head.image_base;
+        }
+
+        std::span<const std::byte> image() const noexcept
+        {
+            return { bytes() + contents_.head.image_offset, contents_.head.image_size };
+        }
+
+        // Calls `visit(subregion, bytes)` for every subregion with a payload, in manifest order.
+        template <typename Visitor>
+        void for_each_payload(Visitor&& visit) const
+        {
+            snapshot::for_each_payload({ bytes(), size_ }, contents_, has_payload, std::forward<Visitor>(visit));
+        }
+    };
+}
@@ -0,0 +1,212 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <span>
+#include <utility>
+
+#include <netfork-shared/net/manifest.hpp>
+
+namespace netfork::snapshot
+{
+    // A fork as the server received it, written to a file so more children can be spawned
+    // from it without the client. Laid out as:
+    //
+    //   header | CONTEXT | PEB | TEB | encoded manifest | image | payload
+    //
+    // The image and the payload each start on a page boundary, so the file can be mapped
+    // and its pages used where they lie. The image is the whole mapped image as the child
+    // saw it, writable pages included, and can back an image section as it is. The payload
+    // holds every subregion of the manifest which carries one, in manifest order.
+    //
+    // Only the layout lives here; reading a process into a snapshot and mapping one back
+    // are left to `snapshot.hpp`.
+    constexpr const std::array<char, 8> MAGIC{ 'N', 'F', 'S', 'N', 'A', 'P', '\0', '\0' };
+    constexpr const std::uint32_t FORMAT_VERSION = 1;
+
+    struct header
+    {
+        std::array<char, 8> magic;
+        std::uint32_t version;
+        std::uint32_t page_size;
+        std::uint64_t context_offset;
+        std::uint64_t peb_offset;
+        std::uint64_t teb_offset;
+        std::uint64_t manifest_offset;
+        std::uint64_t manifest_size;
+        std::uint64_t image_base;
+        std::uint64_t image_size;
+        std::uint64_t image_offset;
+        std::uint64_t payload_offset;
+        std::uint64_t payload_size;
+    };
+
+    // Sizes of the thread and process state a snapshot holds: `CONTEXT`, `PEB` and `TEB`.
+    struct state_sizes
+    {
+        std::uint64_t context;
+        std::uint64_t peb;
+        std::uint64_t teb;
+    };
+
+    constexpr std::uint64_t align_to_page(const std::uint64_t size) noexcept
+    {
+        return (size + net::MANIFEST_PAGE_SIZE - 1) & ~(net::MANIFEST_PAGE_SIZE - 1);
+    }
+
+    // Bytes of payload a snapshot of `manifest` holds, given which protections carry one.
+    template <typename HasPayload>
+    std::uint64_t payload_size_of(const net::address_space_manifest& manifest, HasPayload&& has_payload)
+    {
+        std::uint64_t size = 0;
+        for (const auto& subregion : manifest.subregions)
+        {
+            if (has_payload(subregion.protect))
+            {
+                size += subregion.region_size;
+            }
+        }
+
+        return size;
+    }
+
+    // Lays out a snapshot of an image of `image_size` bytes at `image_base`.
+    inline header plan(
+        const state_sizes& sizes,
+        const std::uint64_t manifest_size,
+        const std::uint64_t image_base,
+        const std::uint64_t image_size,
+        const std::uint64_t payload_size)
+    {
+        header head{
+            .magic = MAGIC,
+            .version = FORMAT_VERSION,
+            .page_size = net::MANIFEST_PAGE_SIZE,
+            .context_offset = sizeof(header),
+            .peb_offset = sizeof(header) + sizes.context,
+            .teb_offset = sizeof(header) + sizes.context + sizes.peb,
+            .manifest_offset = sizeof(header) + sizes.context + sizes.peb + sizes.teb,
+            .manifest_size = manifest_size,
+            .image_base = image_base,
+            .image_size = image_size,
+            .image_offset = 0,
+            .payload_offset = 0,
+            .payload_size = payload_size
+        };
+        head.image_offset = align_to_page(head.manifest_offset + head.manifest_size);
+        head.payload_offset = align_to_page(head.image_offset + head.image_size);
+        return head;
+    }
+
+    constexpr std::uint64_t file_size_of(const header& head) noexcept
+    {
+        return head.payload_offset + head.payload_size;
+    }
+
+    // Copies the state and the encoded manifest into `file`, which is `file_size_of(head)`
+    // bytes. The image and payload are for the caller to fill in, and the header for `seal`.
+    inline void write_state(
+        std::span<std::byte> file,
+        const header& head,
+        std::span<const std::byte> context,
+        std::span<const std::byte> peb,
+        std::span<const std::byte> teb,
+        std::span<const std::byte> encoded_manifest)
+    {
+        std::memcpy(file.data() + head.context_offset, context.data(), context.size());
+        std::memcpy(file.data() + head.peb_offset, peb.data(), peb.size());
+        std::memcpy(file.data() + head.teb_offset, teb.data(), teb.size());
+        std::memcpy(file.data() + head.manifest_offset, encoded_manifest.data(), encoded_manifest.size());
+    }
+
+    // Writes the header, last, so a snapshot cut short is never taken for a whole one.
+    inline void seal(std::span<std::byte> file, const header& head)
+    {
+        std::memcpy(file.data(), &head, sizeof(header));
+    }
+
+    struct contents
+    {
+        header head;
+        net::address_space_manifest manifest;
+    };
+
+    // Checks that `file` is a whole snapshot of this format with state of `sizes`, and decodes
+    // its manifest. Nothing if it isn't.
+    template <typename HasPayload>
+    std::optional<contents> parse(std::span<const std::byte> file, const state_sizes& sizes, HasPayload&& has_payload)
+    {
+        const auto in_bounds = [&file](const std::uint64_t offset, const std::uint64_t size)
+        {
+            return offset <= file.size() && size <= file.size() - offset;
+        };
+
+        if (file.size() < sizeof(header))
+        {
+            return std::nullopt;
+        }
+
+        header head;
+        std::memcpy(&head, file.data(), sizeof(header));
+        if (head.magic != MAGIC
+            || head.version != FORMAT_VERSION
+            || head.page_size != net::MANIFEST_PAGE_SIZE
+            || head.image_offset % net::MANIFEST_PAGE_SIZE != 0
+            || head.payload_offset % net::MANIFEST_PAGE_SIZE != 0
+            || !in_bounds(head.context_offset, sizes.context)
+            || !in_bounds(head.peb_offset, sizes.peb)
+            || !in_bounds(head.teb_offset, sizes.teb)
+            || !in_bounds(head.manifest_offset, head.manifest_size)
+            || !in_bounds(head.image_offset, head.image_size)
+            || !in_bounds(head.payload_offset, head.payload_size))
+        {
+            return std::nullopt;
+        }
+
+        auto manifest = net::decode_manifest(file.subspan(head.manifest_offset, head.manifest_size));
+        if (!manifest || payload_size_of(manifest.value(), has_payload) != head.payload_size)
+        {
+            return std::nullopt;
+        }
+
+        return contents{ .head = head, .manifest = std::move(manifest).value() };
+    }
+
+    // Calls `visit(subregion, bytes)` for every subregion of a parsed snapshot with a payload,
+    // in manifest order.
+    template <typename HasPayload, typename Visitor>
+    void for_each_payload(std::span<const std::byte> file, const contents& parsed, HasPayload&& has_payload, Visitor&& visit)
+    {
+        std::uint64_t offset = parsed.head.payload_offset;
+        for (const auto& subregion : parsed.manifest.subregions)
+        {
+            if (!has_payload(subregion.protect))
+            {
+                continue;
+            }
+
+            visit(subregion, file.subspan(offset, subregion.region_size));
+            offset += subregion.region_size;
+        }
+    }
+}
@@ -0,0 +1,369 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <netfork-shared/log.hpp>
+#include <netfork-shared/net/async.hpp>
+#include <netfork-shared/phnt_stub.hpp>
+
+#include <bcrypt.h>
+
+namespace netfork::stripes
+{
+    // How long stripes may still take to attach once the fork's own connection has sent its
+    // part of the payload. The client opens them all before it sends any, so by then they
+    // have normally long since attached.
+    constexpr const std::chrono::milliseconds ATTACH_TIMEOUT{ 5000 };
+
+    // The extra connections of one striped fork. They attach as soon as the fork is
+    // admitted, usually well before its process exists, and are only held on to until the
+    // session starts receiving the payload; from then on each one is received on a
+    // coroutine of its own.
+    class stripe_set
+    {
+        net::io_context& context_;
+        std::mutex mutex_;
+        // Indexed by stripe; `INVALID_SOCKET` once it's done, or while it hasn't attached.
+        std::vector<SOCKET> sockets_;
+        std::vector<bool> attached_;
+        std::function<net::task<BOOL>(SOCKET)> receive_;
+        // Stripes which haven't been received in full or given up on yet.
+        std::size_t pending_;
+        bool closed_ = false;
+        bool failed_ = false;
+        net::io_context::operation* joiner_ = nullptr;
+        // Aborts the set if a stripe still hasn't attached when it fires.
+        PTP_TIMER attach_timer_ = nullptr;
+
+        static VOID CALLBACK attach_timed_out(PTP_CALLBACK_INSTANCE, PVOID context, PTP_TIMER)
+        {
+            auto* const set = static_cast<stripe_set*>(context);
+            {
+                std::lock_guard lock{ set->mutex_ };
+                if (std::find(set->attached_.begin(), set->attached_.end(), false) == set->attached_.end())
+                {
+                    return;
+                }
+            }
+
+            LOG_DEBUG_ERR() << "A stripe didn't attach within " << ATTACH_TIMEOUT.count() << "ms." << std::endl;
+            set->abort();
+        }
+
+        net::task<> receive(const std::size_t index, SOCKET sock)
+        {
+            const BOOL received = co_await receive_(sock);
+
+            net::io_context::operation* joiner = nullptr;
+            {
+                std::lock_guard lock{ mutex_ };
+                sockets_[index] = INVALID_SOCKET;
+                failed_ = failed_ || !received;
+                if (--pending_ == 0)
+                {
+                    joiner = std::exchange(joiner_, nullptr);
+                }
+            }
+
+            ::shutdown(sock, SD_BOTH);
+            ::closesocket(sock);
+            // The set may be gone as soon as the joiner resumes.
+            if (joiner)
+            {
+                context_.post(*joiner);
+            }
+        }
+
+    public:
+        stripe_set(net::io_context& context, const std::size_t count)
+            : context_{ context }
+            , sockets_(count, INVALID_SOCKET)
+            , attached_(count, false)
+            , pending_{ count }
+        {
+        }
+
+        stripe_set(const stripe_set&) = delete;
+        stripe_set& operator=(const stripe_set&) = delete;
+
+        ~stripe_set()
+        {
+            if (attach_timer_)
+            {
+                ::SetThreadpoolTimer(attach_timer_, nullptr, 0, 0);
+                ::WaitForThreadpoolTimerCallbacks(attach_timer_, TRUE);
+                ::CloseThreadpoolTimer(attach_timer_);
+            }
+
+            for (const SOCKET sock : sockets_)
+            {
+                if (sock != INVALID_SOCKET)
+                {
+                    ::closesocket(sock);
+                }
+            }
+        }
+
+        // Takes over `sock` as stripe `index`. Returns false if the stripe can't be taken, in
+        // which case the caller still owns the socket.
+        bool attach(const std::size_t index, SOCKET sock)
+        {
+            {
+                std::lock_guard lock{ mutex_ };
+                if (closed_ || index >= sockets_.size() || attached_[index])
+                {
+                    return false;
+                }
+
+                attached_[index] = true;
+                sockets_[index] = sock;
+                if (!receive_)
+                {
+                    return true;
+                }
+            }
+
+            net::spawn(context_, receive(index, sock));
+            return true;
+        }
+
+        // Receives every stripe with `receive`, those attached so far straight away and the
+        // rest as they attach. `receive` must stay valid until `join` returns.
+        void start(std::function<net::task<BOOL>(SOCKET)> receive)
+        {
+            std::vector<std::pair<std::size_t, SOCKET>> attached;
+            {
+                std::lock_guard lock{ mutex_ };
+                receive_ = std::move(receive);
+                for (std::size_t index = 0; index < sockets_.size(); index++)
+                {
+                    if (sockets_[index] != INVALID_SOCKET)
+                    {
+                        attached.emplace_back(index, sockets_[index]);
+                    }
+                }
+            }
+
+            for (const auto& [index, sock] : attached)
+            {
+                net::spawn(context_, this->receive(index, sock));
+            }
+        }
+
+        // Gives up on the stripes: no more may attach, those waiting to be received are closed
+        // and those being received are cut off. Once started, `join` must still be awaited
+        // before the set goes away.
+        void abort()
+        {
+            net::io_context::operation* joiner = nullptr;
+            {
+                std::lock_guard lock{ mutex_ };
+                closed_ = true;
+                failed_ = true;
+                for (std::size_t index = 0; index < sockets_.size(); index++)
+                {
+                    if (!attached_[index])
+                    {
+                        attached_[index] = true;
+                        pending_--;
+                    }
+                    else if (sockets_[index] == INVALID_SOCKET)
+                    {
+                        continue;
+                    }
+                    else if (receive_)
+                    {
+                        ::shutdown(sockets_[index], SD_BOTH);
+                    }
+                    else
+                    {
+                        ::closesocket(std::exchange(sockets_[index], INVALID_SOCKET));
+                        pending_--;
+                    }
+                }
+
+                if (pending_ == 0)
+                {
+                    joiner = std::exchange(joiner_, nullptr);
+                }
+            }
+
+            if (joiner)
+            {
+                context_.post(*joiner);
+            }
+        }
+
+        // The fork's own connection has sent its part; stripes which haven't attached within
+        // `ATTACH_TIMEOUT` from now never will, and the set is aborted, failing the fork.
+        // Returns false if the timer couldn't be set, in which case the set is aborted now
+        // unless every stripe has attached already.
+        bool expect_attached()
+        {
+            attach_timer_ = ::CreateThreadpoolTimer(attach_timed_out, this, nullptr);
+            if (!attach_timer_)
+            {
+                LOG_DEBUG_ERR() << "Failed to create stripe attach timer; GetLastError: " << ::GetLastError() << std::endl;
+                attach_timed_out(nullptr, this, nullptr);
+                return false;
+            }
+
+            // Relative due times are negative, in 100ns units.
+            const auto due = -std::chrono::duration_cast<std::chrono::duration<LONGLONG, std::ratio<1, 10'000'000>>>(ATTACH_TIMEOUT).count();
+            FILETIME due_time{
+                .dwLowDateTime = static_cast<DWORD>(due),
+                .dwHighDateTime = static_cast<DWORD>(due >> 32)
+            };
+            ::SetThreadpoolTimer(attach_timer_, &due_time, 0, 0);
+            return true;
+        }
+
+        // Waits until every stripe has been received, or given up on after `abort`, without
+        // holding up a thread of the context. Resumes with whether all of them arrived.
+        auto join()
+        {
+            struct awaiter : net::io_context::operation
+            {
+                stripe_set* set;
+
+                bool await_ready() const noexcept
+                {
+                    return false;
+                }
+
+                bool await_suspend(std::coroutine_handle<> awaiting)
+                {
+                    waiter = awaiting;
+                    std::lock_guard lock{ set->mutex_ };
+                    if (set->pending_ == 0)
+                    {
+                        return false;
+                    }
+
+                    set->joiner_ = this;
+                    return true;
+                }
+
+                BOOL await_resume() const
+                {
+                    std::lock_guard lock{ set->mutex_ };
+                    return !set->failed_;
+                }
+            };
+
+            return awaiter{ net::io_context::operation{}, this };
+        }
+    };
+
+    // The stripe sets of every striped fork being received, by the token its connections
+    // attach with.
+    class registry
+    {
+        std::mutex mutex_;
+        std::unordered_map<std::uint64_t, std::shared_ptr<stripe_set>> sets_;
+
+        // Random bits from the system's cryptographic RNG, if it has any to give.
+        static std::optional<std::uint64_t> random_token()
+        {
+            std::uint64_t token = 0;
+            const NTSTATUS status = ::BCryptGenRandom(
+                nullptr,
+                reinterpret_cast<PUCHAR>(&token),
+                sizeof(token),
+                BCRYPT_USE_SYSTEM_PREFERRED_RNG
+            );
+            if (!BCRYPT_SUCCESS(status))
+            {
+                LOG_DEBUG_ERR() << "Failed to generate a stripe token; status: " << status << std::endl;
+                return std::nullopt;
+            }
+
+            return token;
+        }
+
+    public:
+        registry() = default;
+        registry(const registry&) = delete;
+        registry& operator=(const registry&) = delete;
+
+        // Opens a set of `count` stripes under a fresh, non-zero token drawn from the system's
+        // cryptographic RNG, so only the client it's sent to can attach to the fork. Returns a
+        // zero token and no set if no token could be drawn, in which case the fork isn't striped.
+        std::pair<std::uint64_t, std::shared_ptr<stripe_set>> open(net::io_context& context, const std::size_t count)
+        {
+            auto set = std::make_shared<stripe_set>(context, count);
+            // Zero, or a token already in use, is drawn again; with 64 random bits a few draws
+            // are plenty.
+            for (int attempt = 0; attempt < 4; attempt++)
+            {
+                const auto token = random_token();
+                if (!token)
+                {
+                    break;
+                }
+
+                std::lock_guard lock{ mutex_ };
+                if (token.value() != 0 && sets_.try_emplace(token.value(), set).second)
+                {
+                    return { token.value(), std::move(set) };
+                }
+            }
+
+            return { 0, nullptr };
+        }
+
+        // No more stripes attach to the set under `token`.
+        void close(const std::uint64_t token)
+        {
+            std::lock_guard lock{ mutex_ };
+            sets_.erase(token);
+        }
+
+        // Hands `sock` to stripe `index` of the set under `token`. Returns false if there's
+        // no such stripe waiting, in which case the caller still owns the socket.
+        bool attach(const std::uint64_t token, const std::size_t index, SOCKET sock)
+        {
+            std::shared_ptr<stripe_set> set;
+            {
+                std::lock_guard lock{ mutex_ };
+                const auto it = sets_.find(token);
+                if (it == sets_.end())
+                {
+                    return false;
+                }
+
+                set = it->second;
+            }
+
+            return set->attach(index, sock);
+        }
+    };
+}
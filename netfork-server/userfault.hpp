@@ -0,0 +1,234 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+// The Linux backend of a post-copy fork. Lazy pages are left unpopulated in a range
+// registered with userfaultfd, so the first touch of one blocks the touching thread and is
+// reported to the server instead; the server fetches the page through `lazy_pages` and
+// installs it with UFFDIO_COPY, which also wakes the thread. The kernel fills each page
+// atomically, so no thread can see one half written.
+//
+// The descriptor decides whose address space is served. A server forking on Linux has the
+// child open it before the child runs and pass it back over a Unix socket; the tests open it
+// in their own process, which stands in for the child.
+
+#include <linux/userfaultfd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+
+#include <netfork-shared/net/manifest.hpp>
+#include <netfork-shared/post_copy.hpp>
+
+namespace netfork::post_copy
+{
+    // How long the fault loop waits for a fault before checking whether the push is done.
+    constexpr const int FAULT_POLL_INTERVAL_MS = 50;
+
+    // Opens a userfaultfd for this process. Faults from the kernel (e.g. a `read` into a
+    // lazy page) are only reported if the process may handle them; otherwise it falls back to
+    // user-mode faults only. Returns nothing if userfaultfd isn't available at all.
+    inline std::optional<int> open_userfaultfd() noexcept
+    {
+        int fd = static_cast<int>(::syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK));
+#ifdef UFFD_USER_MODE_ONLY
+        if (fd == -1 && errno == EPERM)
+        {
+            fd = static_cast<int>(::syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY));
+        }
+#endif
+        if (fd == -1)
+        {
+            return std::nullopt;
+        }
+
+        uffdio_api api{ .api = UFFD_API, .features = 0, .ioctls = 0 };
+        if (::ioctl(fd, UFFDIO_API, &api) == -1)
+        {
+            ::close(fd);
+            return std::nullopt;
+        }
+
+        return fd;
+    }
+
+    class userfault_region
+    {
+        int uffd_;
+        lazy_pages& pages_;
+
+        // Fills a run of pages of `subregion`. Null pages are zero.
+        void install(const net::manifest_subregion&, const std::uint64_t address, std::span<const std::byte* const> pages)
+        {
+            for (std::size_t page = 0; page < pages.size();)
+            {
+                const std::uint64_t page_address = address + page * net::MANIFEST_PAGE_SIZE;
+                if (pages[page])
+                {
+                    uffdio_copy copy{
+                        .dst = page_address,
+                        .src = reinterpret_cast<std::uint64_t>(pages[page]),
+                        .len = net::MANIFEST_PAGE_SIZE,
+                        .mode = 0,
+                        .copy = 0
+                    };
+                    // EEXIST: already populated, which can only mean it's already right.
+                    ::ioctl(uffd_, UFFDIO_COPY, &copy);
+                    page++;
+                    continue;
+                }
+
+                const std::size_t first = page;
+                while (page < pages.size() && !pages[page])
+                {
+                    page++;
+                }
+
+                uffdio_zeropage zero{
+                    .range = { .start = page_address, .len = (page - first) * net::MANIFEST_PAGE_SIZE },
+                    .mode = 0,
+                    .zeropage = 0
+                };
+                ::ioctl(uffd_, UFFDIO_ZEROPAGE, &zero);
+            }
+        }
+
+        void install_buffered()
+        {
+            pages_.install_buffered([this](const auto& subregion, const auto address, const auto pages)
+            {
+                install(subregion, address, pages);
+            });
+        }
+
+        void unregister() noexcept
+        {
+            for (std::size_t i = 0; i < pages_.manifest().subregions.size(); i++)
+            {
+                const auto& subregion = pages_.manifest().subregions[i];
+                if (pages_.is_lazy(subregion.base_address))
+                {
+                    uffdio_range range{ .start = subregion.base_address, .len = subregion.region_size };
+                    ::ioctl(uffd_, UFFDIO_UNREGISTER, &range);
+                }
+            }
+        }
+
+    public:
+        // Takes ownership of `uffd`, from `open_userfaultfd`.
+        userfault_region(const int uffd, lazy_pages& pages) noexcept
+            : uffd_{ uffd }
+            , pages_{ pages }
+        {
+        }
+
+        userfault_region(const userfault_region&) = delete;
+        userfault_region& operator=(const userfault_region&) = delete;
+
+        ~userfault_region()
+        {
+            ::close(uffd_);
+        }
+
+        // Registers every lazy subregion, which must be mapped and not touched yet, so
+        // their first touch is reported. Returns false if one can't be registered.
+        bool register_lazy_subregions() noexcept
+        {
+            for (const auto& subregion : pages_.manifest().subregions)
+            {
+                if (!pages_.is_lazy(subregion.base_address))
+                {
+                    continue;
+                }
+
+                uffdio_register registration{
+                    .range = { .start = subregion.base_address, .len = subregion.region_size },
+                    .mode = UFFDIO_REGISTER_MODE_MISSING,
+                    .ioctls = 0
+                };
+                if (::ioctl(uffd_, UFFDIO_REGISTER, &registration) == -1)
+                {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+        // Serves faults until the push is done, then installs every page left and stops
+        // trapping. `request(page_span)` asks the client for pages. Returns false if
+        // receiving failed or a request couldn't be sent; pages that haven't arrived then
+        // stay unpopulated, and the caller should kill the child.
+        template <typename Request>
+        bool serve(Request&& request)
+        {
+            while (!pages_.push_done() && !pages_.closed())
+            {
+                if (pages_.receive_failed())
+                {
+                    return false;
+                }
+
+                // Pushed pages go in as they come, so fewer are left to fault on.
+                install_buffered();
+
+                pollfd poll_fd{ .fd = uffd_, .events = POLLIN, .revents = 0 };
+                if (::poll(&poll_fd, 1, FAULT_POLL_INTERVAL_MS) <= 0)
+                {
+                    continue;
+                }
+
+                uffd_msg message{};
+                if (::read(uffd_, &message, sizeof(message)) != sizeof(message)
+                    || message.event != UFFD_EVENT_PAGEFAULT)
+                {
+                    continue;
+                }
+
+                if (!pages_.await_page(message.arg.pagefault.address, request))
+                {
+                    return false;
+                }
+
+                install_buffered();
+            }
+
+            if (pages_.receive_failed() || pages_.closed())
+            {
+                return false;
+            }
+
+            // Any fault still queued is answered by the pages installed here.
+            pages_.install_remaining([this](const auto& subregion, const auto address, const auto pages)
+            {
+                install(subregion, address, pages);
+            });
+            unregister();
+            return true;
+        }
+    };
+}
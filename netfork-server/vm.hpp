@@ -17,200 +17,1001 @@
 
 #pragma once
 
-#include <algorithm>
-#include <array>
+#include <cstdint>
+#include <cstring>
+#include <expected>
+#include <functional>
+#include <optional>
+#include <span>
+#include <utility>
 #include <vector>
 
+#include "metrics.hpp"
+#include "page_store.hpp"
+#include "page_writer.hpp"
+#include "shared_memory.hpp"
+#include "stripes.hpp"
+
 #include <netfork-shared/log.hpp>
+#include <netfork-shared/net/async.hpp>
+#include <netfork-shared/net/codec.hpp>
+#include <netfork-shared/net/manifest.hpp>
 #include <netfork-shared/net/msg.hpp>
+#include <netfork-shared/net/page_data.hpp>
 #include <netfork-shared/net/sock.hpp>
+#include <netfork-shared/net/stream.hpp>
 #include <netfork-shared/phnt_stub.hpp>
+#include <netfork-shared/pipeline.hpp>
 #include <netfork-shared/utils.hpp>
 
 namespace netfork::vm
 {
-    constexpr const std::size_t REGION_BUFFER_SIZE = 4096;
+    // Copy-on-write protections only make sense for shared views; the forked process gets
+    // private memory, so use the plain writable equivalent.
+    DWORD to_private_protection(DWORD protect)
+    {
+        if (protect & PAGE_EXECUTE_WRITECOPY)
+        {
+            protect &= ~PAGE_EXECUTE_WRITECOPY;
+            protect |= PAGE_EXECUTE_READWRITE;
+        }
+        if (protect & PAGE_WRITECOPY)
+        {
+            protect &= ~PAGE_WRITECOPY;
+            protect |= PAGE_READWRITE;
+        }
 
-    BOOL rebuild_forked_process(HANDLE forked_process_handle, SOCKET client_sock)
+        return protect;
+    }
+
+    void protect_subregion(HANDLE forked_process_handle, const net::manifest_subregion& subregion, const DWORD protect)
     {
-        while (true)
+        [[maybe_unused]] DWORD old_protect; // required for VirtualProtectEx
+        if (!::VirtualProtectEx(
+            forked_process_handle,
+            reinterpret_cast<PVOID>(subregion.base_address),
+            subregion.region_size,
+            protect,
+            &old_protect))
         {
-            net::msg::region_info region_info;
+            LOG_DEBUG_ERR() << "Failed to change memory protection to: 0x"
+                << std::hex << protect << std::dec
+                << " GetLastError: " << ::GetLastError() << std::endl;
+        }
+    }
 
+    // Reserves `region` and commits every one of its subregions. Subregions with a payload
+    // are left writable until `apply_final_protections`.
+    //
+    // With `shared`, a region which was a view in the client is mapped from a section the
+    // server can write its payload into directly. The whole view is committed, so its
+    // reserved subregions are made inaccessible instead.
+    void plan_region(
+        HANDLE forked_process_handle,
+        const net::address_space_manifest& manifest,
+        const net::manifest_region& region,
+        shared_regions* shared = nullptr)
+    {
+        LOG_DEBUG() << "Planning: Region\n" << region << std::endl;
+
+        if (shared && shared->map(forked_process_handle, region))
+        {
+            for (const auto& subregion : manifest.subregions_of(region))
             {
-                auto region_info_msg = net::recv_as<net::msg::region_info>(client_sock);
-                if (!region_info_msg)
+                if (subregion.protect == 0)
                 {
-                    break;
+                    protect_subregion(forked_process_handle, subregion, PAGE_NOACCESS);
+                }
+                else if (!net::msg::has_payload(subregion.protect))
+                {
+                    protect_subregion(forked_process_handle, subregion, to_private_protection(subregion.protect));
                 }
-
-                region_info = std::move(region_info_msg).value();
             }
 
-            LOG_DEBUG() << "Received: Region\n" << region_info << std::endl;
+            return;
+        }
 
-            DWORD region_allocation_protect = region_info.protect;
-            if (region_allocation_protect & PAGE_EXECUTE_WRITECOPY)
-            {
-                region_allocation_protect &= ~PAGE_EXECUTE_WRITECOPY;
-                region_allocation_protect |= PAGE_EXECUTE_READWRITE;
-            }
-            if (region_allocation_protect & PAGE_WRITECOPY)
+        const auto region_base = reinterpret_cast<PVOID>(region.base_address);
+        PVOID region_ptr = ::VirtualAlloc2(
+            forked_process_handle,
+            region_base,
+            region.allocation_size,
+            MEM_RESERVE,
+            to_private_protection(region.protect),
+            nullptr,
+            0
+        );
+        if (!region_ptr)
+        {
+            LOG_DEBUG_ERR() << "Failed to allocate reserved memory at 0x"
+                << std::hex << region_base << std::dec
+                << " GetLastError: " << ::GetLastError() << std::endl;
+        }
+
+        for (const auto& subregion : manifest.subregions_of(region))
+        {
+            // Likely a reserved block; there's nothing to commit.
+            if (subregion.protect == 0)
             {
-                region_allocation_protect &= ~PAGE_WRITECOPY;
-                region_allocation_protect |= PAGE_READWRITE;
+                continue;
             }
 
-            PVOID region_ptr = ::VirtualAlloc2(
+            const auto subregion_base = reinterpret_cast<PVOID>(subregion.base_address);
+            region_ptr = ::VirtualAlloc2(
                 forked_process_handle,
-                region_info.base_address,
-                region_info.allocation_size,
-                MEM_RESERVE,
-                region_allocation_protect,
+                subregion_base,
+                subregion.region_size,
+                MEM_COMMIT,
+                PAGE_READWRITE,
                 nullptr,
                 0
             );
             if (!region_ptr)
             {
                 LOG_DEBUG_ERR() << "Failed to allocate reserved memory at 0x"
-                    << std::hex << region_info.base_address << std::dec
+                    << std::hex << subregion_base << std::dec
+                    << " GetLastError: " << ::GetLastError() << std::endl;
+            }
+
+            // The client never sends these, so they can get their final protection now.
+            if (!net::msg::has_payload(subregion.protect))
+            {
+                protect_subregion(forked_process_handle, subregion, to_private_protection(subregion.protect));
+            }
+        }
+    }
+
+    // Reserves every region and commits every subregion of `manifest` in one pass.
+    void plan_address_space(
+        HANDLE forked_process_handle,
+        const net::address_space_manifest& manifest,
+        shared_regions* shared = nullptr)
+    {
+        for (const auto& region : manifest.regions)
+        {
+            plan_region(forked_process_handle, manifest, region, shared);
+        }
+    }
+
+    // Moves the forked process from `old_manifest` to `new_manifest` when a pre-copy client
+    // finds its address space has changed mid-stream. Regions laid out the same in both are
+    // kept along with whatever was already written to them; every other old region is
+    // released, and every other new one is planned from scratch and will be sent in full.
+    void replan_address_space(
+        HANDLE forked_process_handle,
+        const net::address_space_manifest& old_manifest,
+        const net::address_space_manifest& new_manifest,
+        shared_regions* shared = nullptr)
+    {
+        std::size_t kept_regions = 0;
+        for (const auto& region : old_manifest.regions)
+        {
+            if (new_manifest.find_same_region(old_manifest, region))
+            {
+                kept_regions++;
+                continue;
+            }
+
+            if (shared && shared->unmap(forked_process_handle, region.base_address))
+            {
+                continue;
+            }
+
+            if (!::VirtualFreeEx(
+                forked_process_handle,
+                reinterpret_cast<PVOID>(region.base_address),
+                0,
+                MEM_RELEASE))
+            {
+                LOG_DEBUG_ERR() << "Failed to release region at 0x"
+                    << std::hex << region.base_address << std::dec
                     << " GetLastError: " << ::GetLastError() << std::endl;
             }
+        }
+
+        for (const auto& region : new_manifest.regions)
+        {
+            if (!old_manifest.find_same_region(new_manifest, region))
+            {
+                plan_region(forked_process_handle, new_manifest, region, shared);
+            }
+        }
+
+        LOG_DEBUG() << "Replanned address space; kept " << kept_regions << " of "
+            << old_manifest.regions.size() << " regions" << std::endl;
+    }
+
+    void apply_final_protections(HANDLE forked_process_handle, const net::address_space_manifest& manifest)
+    {
+        for (const auto& subregion : manifest.subregions)
+        {
+            if (!net::msg::has_payload(subregion.protect))
+            {
+                continue;
+            }
+
+            protect_subregion(forked_process_handle, subregion, to_private_protection(subregion.protect));
+        }
+    }
+
+    // Checks that a run lands entirely inside a subregion of `manifest` which carries a
+    // payload.
+    bool is_run_in_manifest(const net::address_space_manifest& manifest, const net::page_run& run)
+    {
+        const std::uint64_t run_size = run.page_count * net::MANIFEST_PAGE_SIZE;
+        const auto* subregion = manifest.find_subregion(run.address);
+        if (!subregion
+            || !net::msg::has_payload(subregion->protect)
+            || run_size > subregion->end_address() - run.address)
+        {
+            LOG_DEBUG_ERR() << "Page run at 0x" << std::hex << run.address << std::dec
+                << " is outside of the manifest." << std::endl;
+            return false;
+        }
+
+        return true;
+    }
+
+    // Checks that a run lands entirely inside the image mapped at `image_base`.
+    bool is_run_in_image(const net::page_run& run, const std::uint64_t image_base, const std::uint64_t image_size)
+    {
+        return run.address >= image_base
+            && run.address - image_base <= image_size
+            && run.page_count * net::MANIFEST_PAGE_SIZE <= image_size - (run.address - image_base);
+    }
+
+    // Writes the present pages of `run` into the forked process; `pages` holds only the
+    // present pages, back to back.
+    void write_present_pages(HANDLE forked_process_handle, const net::page_run& run, std::span<const std::byte> pages)
+    {
+        write_present_pages(forked_process_handle, run, pages, write_process_memory);
+    }
+
+    // Runs `handle(frame)` on every frame up to the next `end_of_stream`. Compressed chunks
+    // are expanded by `frame_stream` on a pool of workers while earlier frames are still
+    // being handled, so the client may compress or not as it likes.
+    template <typename FrameHandler>
+    BOOL receive_until_end_of_stream(SOCKET client_sock, FrameHandler&& handle)
+    {
+        net::frame_stream stream{ client_sock, default_worker_count() };
+
+        while (true)
+        {
+            const auto frame = stream.next();
+            if (!frame)
+            {
+                LOG_DEBUG_ERR() << "Fatal error when receiving frame: "
+                    << frame.error() << std::endl;
+                return FALSE;
+            }
+
+            if (frame->header.type == net::codec::frame_type::end_of_stream)
+            {
+                return TRUE;
+            }
+
+            if (!handle(frame.value()))
+            {
+                return FALSE;
+            }
+        }
+    }
+
+    // Runs `handle(frame)` on every frame up to the next `end_of_stream`, like the blocking
+    // overload, with every receive awaited. `client_sock` must be associated with an
+    // `io_context`.
+    template <typename FrameHandler>
+    net::task<BOOL> async_receive_until_end_of_stream(SOCKET client_sock, FrameHandler handle)
+    {
+        net::async_frame_stream stream{ client_sock };
+
+        while (true)
+        {
+            const auto frame = co_await stream.next();
+            if (!frame)
+            {
+                LOG_DEBUG_ERR() << "Fatal error when receiving frame: "
+                    << frame.error() << std::endl;
+                co_return FALSE;
+            }
+
+            if (frame->header.type == net::codec::frame_type::end_of_stream)
+            {
+                co_return TRUE;
+            }
+
+            if (!handle(frame.value()))
+            {
+                co_return FALSE;
+            }
+        }
+    }
+
+    // Pages received before the process they belong to has been created, written into it
+    // once it has.
+    class staged_pages
+    {
+        struct staged_run
+        {
+            net::page_run run;
+            std::vector<std::byte> pages;
+        };
+
+        std::vector<staged_run> runs_;
+        std::uint64_t size_ = 0;
+
+    public:
+        void stage(const net::page_run& run, std::span<const std::byte> pages)
+        {
+            runs_.push_back(staged_run{
+                .run = run,
+                .pages = std::vector<std::byte>(pages.begin(), pages.end())
+            });
+            size_ += pages.size();
+        }
+
+        void write(HANDLE forked_process_handle) const
+        {
+            for (const auto& staged : runs_)
+            {
+                write_present_pages(forked_process_handle, staged.run, staged.pages);
+            }
+        }
+
+        std::uint64_t size() const noexcept
+        {
+            return size_;
+        }
+    };
+
+    // Receives the writable pages of a cached image, which replace whatever an earlier fork
+    // left in the cached file. Every run must land inside the image. They're staged, since
+    // the forked process may still be being created while they arrive.
+    net::task<BOOL> receive_image_overlay(
+        staged_pages& overlay,
+        SOCKET client_sock,
+        const std::uint64_t image_base,
+        const std::uint64_t image_size)
+    {
+        const BOOL received = co_await async_receive_until_end_of_stream(client_sock, [&](const net::codec::frame_view& frame) -> BOOL
+        {
+            if (frame.header.type != net::codec::frame_type::page_data)
+            {
+                LOG_DEBUG() << "Skipping unexpected frame of type "
+                    << std::to_underlying(frame.header.type) << std::endl;
+                return TRUE;
+            }
+
+            const auto run = net::decode_page_run(frame.body);
+            if (!run || !is_run_in_image(run.value(), image_base, image_size))
+            {
+                LOG_DEBUG_ERR() << "Malformed or out of bounds image overlay frame." << std::endl;
+                return FALSE;
+            }
+
+            overlay.stage(run.value(), frame.body.subspan(run->prefix_size()));
+            return TRUE;
+        });
 
-            for (SIZE_T subregion_idx = 0; subregion_idx < region_info.subregion_info_size; subregion_idx++)
+        metrics::add(metrics::counter::received_bytes, overlay.size());
+        LOG_DEBUG() << "Received 0x" << std::hex << overlay.size() << std::dec
+            << " bytes of image overlay" << std::endl;
+        co_return received;
+    }
+
+    // Applies the payload of the forked process frame by frame. Frames may arrive in any
+    // order, but each one must land entirely inside a subregion of `manifest` which carries
+    // a payload. Pages left out of a frame are zero and are neither received nor written.
+    //
+    // A pre-copy client sends a new `manifest` whenever its address space changes between
+    // rounds; the process is replanned to match and `manifest` is replaced, so later frames
+    // are checked against it. It also resends the writable pages of its image as they
+    // change, so runs inside the image at `image_base` are accepted too.
+    //
+    // A client may start with `page_hashes` frames instead. Pages found in `store` are
+    // written straight away, and once the hashes end the client is told which pages are
+    // missing; only those follow as `page_data`, and they're added to `store` on the way.
+    //
+    // Pages of a shared region are received straight into the server's view of it. Every
+    // other page is written by `writes` behind the receive, so those have to be drained
+    // before the process is replanned and once the payload ends.
+    class payload_receiver
+    {
+        HANDLE process_;
+        page_writer::batch& writes_;
+        net::io_context& context_;
+        shared_regions& shared_;
+        net::address_space_manifest& manifest_;
+        std::uint64_t image_base_;
+        std::uint64_t image_size_;
+        store::page_store* store_;
+        // One bit per hashed page in the order the hashes arrived; set if the page must be sent.
+        std::vector<std::uint64_t> missing_pages_;
+        std::uint64_t hashed_pages_ = 0;
+        bool accept_hashes_ = true;
+        bool accept_manifests_ = true;
+        // A new manifest sent mid-payload, as far as it has arrived.
+        net::manifest_assembler manifests_;
+        bool store_pages_ = false;
+        std::vector<std::byte> stored_pages_;
+        // Where a run is received when no buffer of the writer's ring can be spared.
+        std::vector<std::byte> received_pages_;
+
+        // The server's view of the pages of `run` if they're in a shared region.
+        std::byte* shared_view_of(const net::page_run& run, const bool in_image)
+        {
+            return in_image ? nullptr : shared_.find(run.address, run.page_count * net::MANIFEST_PAGE_SIZE);
+        }
+
+        // Writes the present pages of `run`, back to back in `pages`, wherever they go.
+        net::task<> place_pages(const net::page_run& run, std::span<const std::byte> pages, const bool in_image)
+        {
+            std::byte* const view = shared_view_of(run, in_image);
+            if (!view)
             {
-                net::msg::subregion_info subregion_info;
+                co_await submit(writes_, context_, run, pages);
+                co_return;
+            }
 
+            std::size_t pages_offset = 0;
+            run.for_each_present_run([&](const std::uint32_t first_page, const std::uint32_t page_count)
+            {
+                const std::size_t size = page_count * net::MANIFEST_PAGE_SIZE;
+                std::memcpy(view + first_page * net::MANIFEST_PAGE_SIZE, pages.data() + pages_offset, size);
+                pages_offset += size;
+            });
+            metrics::add(metrics::counter::written_bytes, pages.size());
+        }
+
+        void store_received(std::span<const std::byte> pages, const bool in_image)
+        {
+            if (store_pages_ && !in_image)
+            {
+                for (std::size_t offset = 0; offset < pages.size(); offset += net::MANIFEST_PAGE_SIZE)
                 {
-                    auto subregion_info_msg = net::recv_as<net::msg::subregion_info>(client_sock);
-                    if (!subregion_info_msg)
+                    store_->insert(pages.data() + offset);
+                }
+            }
+        }
+
+        // Returns whether the run may be written, and whether it's inside the image.
+        std::optional<bool> check_run(const net::page_run& run)
+        {
+            const bool in_image = is_run_in_image(run, image_base_, image_size_);
+            if (!in_image && !is_run_in_manifest(manifest_, run))
+            {
+                return std::nullopt;
+            }
+
+            return in_image;
+        }
+
+        static void log_received(const net::page_run& run, const std::size_t size)
+        {
+            metrics::add(metrics::counter::received_bytes, size);
+            LOG_DEBUG() << "Received 0x"
+                << std::hex << size << std::dec << " of 0x"
+                << std::hex << run.page_count * net::MANIFEST_PAGE_SIZE << std::dec
+                << " bytes of region" << std::endl;
+        }
+
+        net::task<BOOL> handle_page_data(const net::codec::frame_view& frame)
+        {
+            const auto run = net::decode_page_run(frame.body);
+            if (!run)
+            {
+                LOG_DEBUG_ERR() << "Malformed page data frame." << std::endl;
+                co_return FALSE;
+            }
+
+            const auto in_image = check_run(run.value());
+            if (!in_image)
+            {
+                co_return FALSE;
+            }
+
+            // Only the non-zero pages are on the wire; the rest of the run is left as the
+            // zero-filled memory `plan_address_space` committed.
+            const auto pages = frame.body.subspan(run->prefix_size());
+            co_await place_pages(run.value(), pages, in_image.value());
+            store_received(pages, in_image.value());
+            log_received(run.value(), pages.size());
+            co_return TRUE;
+        }
+
+        // Receives the pages of an uncompressed run, whose prefix is all `frame` holds, to
+        // where they belong: each stretch of present pages straight into a shared view, or
+        // all of them into a buffer of the writer's ring.
+        net::task<BOOL> receive_page_data(net::async_frame_stream& stream, const net::codec::frame_view& frame)
+        {
+            const auto run = net::decode_page_run_prefix(frame.body);
+            if (!run || frame.header.length != run->body_size())
+            {
+                LOG_DEBUG_ERR() << "Malformed page data frame." << std::endl;
+                co_return FALSE;
+            }
+
+            const auto in_image = check_run(run.value());
+            if (!in_image)
+            {
+                co_return FALSE;
+            }
+
+            const std::size_t size = run->present_count() * net::MANIFEST_PAGE_SIZE;
+            if (std::byte* const view = shared_view_of(run.value(), in_image.value()))
+            {
+                std::uint32_t page = 0;
+                while (page < run->page_count)
+                {
+                    if (!run->is_present(page))
                     {
-                        LOG_DEBUG_ERR() << "Fatal error when rebuilding virtual memory: "
-                            << subregion_info_msg.error() << std::endl;
-                        return FALSE;
+                        page++;
+                        continue;
                     }
 
-                    subregion_info = std::move(subregion_info_msg).value();
+                    const std::uint32_t first_page = page;
+                    while (page < run->page_count && run->is_present(page))
+                    {
+                        page++;
+                    }
+
+                    const std::span<std::byte> pages{
+                        view + first_page * net::MANIFEST_PAGE_SIZE,
+                        (page - first_page) * net::MANIFEST_PAGE_SIZE
+                    };
+                    if (FAILED(co_await stream.receive_deferred(pages)))
+                    {
+                        co_return FALSE;
+                    }
+
+                    store_received(pages, false);
                 }
 
+                metrics::add(metrics::counter::written_bytes, size);
+                log_received(run.value(), size);
+                co_return TRUE;
+            }
+
+            auto lease = writes_.try_acquire();
+            const auto pages = lease
+                ? lease->bytes().first(size)
+                : std::span{ received_pages_ }.first(size);
+            if (FAILED(co_await stream.receive_deferred(pages)))
+            {
+                co_return FALSE;
+            }
+
+            store_received(pages, in_image.value());
+            if (lease)
+            {
+                writes_.submit(run.value(), std::move(lease).value(), size);
+            }
+            else
+            {
+                co_await submit(writes_, context_, run.value(), pages);
+            }
+
+            log_received(run.value(), size);
+            co_return TRUE;
+        }
 
-                LOG_DEBUG() << "Received: Subregion\n" << subregion_info << std::endl;
+        net::task<BOOL> handle_manifest(const net::codec::frame_view& frame)
+        {
+            const auto status = manifests_.add(frame.body);
+            if (status == net::manifest_assembler::status::incomplete)
+            {
+                co_return TRUE;
+            }
 
-                // Likely a reserved block.
-                // It's safe to skip the rest of this block since the client isn't sending
-                // the region over.
-                if (subregion_info.protect == 0)
+            auto new_manifest = status == net::manifest_assembler::status::complete
+                ? manifests_.take()
+                : std::nullopt;
+            if (!new_manifest)
+            {
+                LOG_DEBUG_ERR() << "Malformed manifest." << std::endl;
+                co_return FALSE;
+            }
+
+            co_await drain(writes_, context_);
+            replan_address_space(process_, manifest_, new_manifest.value(), &shared_);
+            manifest_ = std::move(new_manifest).value();
+            co_return TRUE;
+        }
+
+        net::task<BOOL> handle_page_hashes(const net::codec::frame_view& frame)
+        {
+            const auto run = net::decode_page_hashes(frame.body);
+            if (!run)
+            {
+                LOG_DEBUG_ERR() << "Malformed page hashes frame." << std::endl;
+                co_return FALSE;
+            }
+
+            if (!is_run_in_manifest(manifest_, run.value()))
+            {
+                co_return FALSE;
+            }
+
+            const auto hashes = frame.body.subspan(run->prefix_size());
+            net::page_run found{ .address = run->address, .page_count = run->page_count };
+            std::size_t hash_index = 0;
+            run->for_each_present_run([&](const std::uint32_t first_page, const std::uint32_t page_count)
+            {
+                for (std::uint32_t page = first_page; page < first_page + page_count; page++, hash_index++)
                 {
-                    continue;
+                    if (hashed_pages_ % 64 == 0)
+                    {
+                        missing_pages_.push_back(0);
+                    }
+
+                    std::byte* const out = stored_pages_.data()
+                        + found.present_count() * net::MANIFEST_PAGE_SIZE;
+                    if (store_ && store_->lookup(net::read_page_hash(hashes, hash_index), out))
+                    {
+                        found.set_present(page);
+                    }
+                    else
+                    {
+                        missing_pages_.back() |= std::uint64_t{ 1 } << (hashed_pages_ % 64);
+                    }
+
+                    hashed_pages_++;
                 }
+            });
 
-                DWORD block_allocation_protect = subregion_info.protect;
-                if (block_allocation_protect & PAGE_EXECUTE_WRITECOPY)
+            co_await place_pages(found, std::span{ stored_pages_ }.first(found.present_count() * net::MANIFEST_PAGE_SIZE), false);
+            co_return TRUE;
+        }
+
+        net::task<BOOL> handle(const net::codec::frame_view& frame)
+        {
+            switch (frame.header.type)
+            {
+            case net::codec::frame_type::page_data:
+                co_return co_await handle_page_data(frame);
+            case net::codec::frame_type::manifest:
+                if (accept_manifests_)
                 {
-                    block_allocation_protect &= ~PAGE_EXECUTE_WRITECOPY;
-                    block_allocation_protect |= PAGE_EXECUTE_READWRITE;
+                    co_return co_await handle_manifest(frame);
                 }
-                if (block_allocation_protect & PAGE_WRITECOPY)
+                break;
+            case net::codec::frame_type::page_hashes:
+                if (accept_hashes_)
                 {
-                    block_allocation_protect &= ~PAGE_WRITECOPY;
-                    block_allocation_protect |= PAGE_READWRITE;
+                    co_return co_await handle_page_hashes(frame);
                 }
+                break;
+            default:
+                break;
+            }
 
-                region_ptr = ::VirtualAlloc2(
-                    forked_process_handle,
-                    subregion_info.base_address,
-                    subregion_info.region_size,
-                    MEM_COMMIT,
-                    PAGE_READWRITE,
-                    nullptr,
-                    0
-                );
-                if (!region_ptr)
-                {
-                    LOG_DEBUG_ERR() << "Failed to allocate reserved memory at 0x"
-                        << std::hex << subregion_info.base_address << std::dec
-                        << " GetLastError: " << ::GetLastError() << std::endl;
-                }
+            LOG_DEBUG() << "Skipping unexpected frame of type "
+                << std::to_underlying(frame.header.type) << std::endl;
+            co_return TRUE;
+        }
 
-                if (subregion_info.protect & (PAGE_NOACCESS | PAGE_GUARD))
-                {
-                    [[maybe_unused]] DWORD old_protect; // required for VirtualProtectEx
-                    if (!::VirtualProtectEx(
-                        forked_process_handle,
-                        subregion_info.base_address,
-                        subregion_info.region_size,
-                        block_allocation_protect,
-                        &old_protect))
-                    {
-                        LOG_DEBUG_ERR() << "Failed to change memory protection to: 0x"
-                            << std::hex << block_allocation_protect << std::dec
-                            << " GetLastError: " << ::GetLastError() << std::endl;
-                    }
+    public:
+        payload_receiver(
+            HANDLE forked_process_handle,
+            page_writer::batch& writes,
+            net::io_context& context,
+            shared_regions& shared,
+            net::address_space_manifest& manifest,
+            const std::uint64_t image_base,
+            const std::uint64_t image_size,
+            store::page_store* store)
+            : process_{ forked_process_handle }
+            , writes_{ writes }
+            , context_{ context }
+            , shared_{ shared }
+            , manifest_{ manifest }
+            , image_base_{ image_base }
+            , image_size_{ image_size }
+            , store_{ store }
+            , stored_pages_(net::codec::MAX_BYTES_FRAME_LENGTH)
+            , received_pages_(net::codec::MAX_BYTES_FRAME_LENGTH)
+        {
+        }
 
-                    // It's safe to skip the rest of this block since the client isn't
-                    // sending the region over.
-                    continue;
-                }
+        payload_receiver(const payload_receiver&) = delete;
+        payload_receiver& operator=(const payload_receiver&) = delete;
+
+        // Has the receiver skip anything but pages, for a payload striped over several
+        // connections: their receivers share `manifest`, so none of them may replan it.
+        void accept_only_pages()
+        {
+            accept_hashes_ = false;
+            accept_manifests_ = false;
+        }
+
+        // Handles every frame up to the next `end_of_stream`, handing every byte received to
+        // `tee` as well if there is one.
+        net::task<BOOL> receive_stream(SOCKET client_sock, net::async_frame_stream::tee_type tee = nullptr)
+        {
+            net::async_frame_stream stream{ client_sock, std::move(tee) };
+            stream.defer_page_data(true);
 
+            while (true)
+            {
+                const auto frame = co_await stream.next();
+                if (!frame)
                 {
-                    std::size_t remaining_region_size = subregion_info.region_size;
-                    std::uintptr_t offset = 0;
-                    std::vector<std::byte> buffer(REGION_BUFFER_SIZE);
+                    LOG_DEBUG_ERR() << "Fatal error when receiving frame: "
+                        << frame.error() << std::endl;
+                    co_return FALSE;
+                }
 
-                    while (remaining_region_size > 0)
-                    {
-                        const auto bytes_to_read = std::min(
-                            REGION_BUFFER_SIZE,
-                            remaining_region_size
-                        );
-
-                        if (FAILED(net::recv_bytes(client_sock, std::span{ buffer.data(), bytes_to_read })))
-                        {
-                            LOG_DEBUG_ERR() << "Failed to receive full region." << std::endl;
-                        }
-
-                        const auto target_address = reinterpret_cast<LPVOID>(
-                            reinterpret_cast<std::uintptr_t>(subregion_info.base_address) + offset);
-                        SIZE_T bytes_written = 0;
-                        const BOOL write_successful = ::WriteProcessMemory(
-                            forked_process_handle,
-                            target_address,
-                            buffer.data(),
-                            bytes_to_read,
-                            &bytes_written
-                        );
-                        if (!write_successful || bytes_written != bytes_to_read)
-                        {
-                            LOG_DEBUG_ERR() << "Failed to write memory at 0x"
-                                << std::hex << target_address << std::dec
-                                << " GetLastError: " << ::GetLastError() << std::endl;
-                        }
-
-                        LOG_DEBUG() << "Received 0x"
-                            << std::hex << subregion_info.region_size << std::dec
-                            << " bytes of region; written 0x"
-                            << std::hex << bytes_written << std::dec << std::endl;
-
-                        remaining_region_size -= bytes_to_read;
-                        offset += bytes_to_read;
-                    }
+                if (frame->header.type == net::codec::frame_type::end_of_stream)
+                {
+                    co_return TRUE;
                 }
 
-                [[maybe_unused]] DWORD old_protect; // required for VirtualProtectEx
-                if (!::VirtualProtectEx(
-                    forked_process_handle,
-                    subregion_info.base_address,
-                    subregion_info.region_size,
-                    block_allocation_protect,
-                    &old_protect))
+                const BOOL handled = stream.has_deferred()
+                    ? co_await receive_page_data(stream, frame.value())
+                    : co_await handle(frame.value());
+                if (!handled)
                 {
-                    LOG_DEBUG_ERR() << "Failed to change memory protection to: 0x"
-                        << std::hex << block_allocation_protect << std::dec
-                        << " GetLastError: " << ::GetLastError() << std::endl;
+                    co_return FALSE;
                 }
             }
         }
 
-        return TRUE;
+        // Called once the first stream ends. Returns the encoded `missing_pages` bitmap the
+        // client is waiting for before it sends the pages in it, or nothing if the client
+        // didn't send any hashes and the payload is already complete.
+        std::optional<std::vector<std::byte>> end_hashes()
+        {
+            accept_hashes_ = false;
+            if (hashed_pages_ == 0)
+            {
+                return std::nullopt;
+            }
+
+            if (store_)
+            {
+                const auto counters = store_->counters();
+                LOG_DEBUG() << "Page store: " << counters.hits << " of " << counters.lookups
+                    << " lookups hit (" << counters.hit_rate() * 100.0 << "%), 0x" << std::hex
+                    << counters.bytes_saved << std::dec << " bytes saved so far" << std::endl;
+            }
+
+            store_pages_ = store_ != nullptr;
+            return net::encode_bitmap(missing_pages_);
+        }
+    };
+
+    // Receives the part of a striped payload which comes over one of the fork's other
+    // connections: pages only, up to its own `end_of_stream`.
+    net::task<BOOL> receive_stripe(
+        HANDLE forked_process_handle,
+        SOCKET stripe_sock,
+        net::address_space_manifest& manifest,
+        const std::uint64_t image_base,
+        const std::uint64_t image_size,
+        page_writer& writer,
+        net::io_context& context,
+        shared_regions& shared)
+    {
+        page_writer::batch writes{ writer, forked_process_handle };
+        payload_receiver receiver{ forked_process_handle, writes, context, shared, manifest, image_base, image_size, nullptr };
+        receiver.accept_only_pages();
+        co_return co_await receiver.receive_stream(stripe_sock);
+    }
+
+    // `stripes`, if given, are the fork's other connections; the payload is only complete
+    // once every one of them has been received as well.
+    net::task<BOOL> receive_payload(
+        HANDLE forked_process_handle,
+        SOCKET client_sock,
+        net::address_space_manifest& manifest,
+        const std::uint64_t image_base,
+        const std::uint64_t image_size,
+        store::page_store* store,
+        page_writer& writer,
+        net::io_context& context,
+        shared_regions& shared,
+        net::async_frame_stream::tee_type tee,
+        stripes::stripe_set* stripes = nullptr)
+    {
+        // Drains on the way out, so every page has been written by the time this returns.
+        page_writer::batch writes{ writer, forked_process_handle };
+        payload_receiver receiver{ forked_process_handle, writes, context, shared, manifest, image_base, image_size, store };
+
+        if (stripes)
+        {
+            receiver.accept_only_pages();
+            stripes->start([&](SOCKET stripe_sock)
+            {
+                return receive_stripe(forked_process_handle, stripe_sock, manifest, image_base, image_size, writer, context, shared);
+            });
+
+            const BOOL received = co_await receiver.receive_stream(client_sock, tee);
+            if (!received)
+            {
+                stripes->abort();
+            }
+            else
+            {
+                stripes->expect_attached();
+            }
+
+            // The stripes write into `manifest` and `shared`, so they're waited for either way.
+            if (!co_await stripes->join())
+            {
+                LOG_DEBUG_ERR() << "Failed to receive every stripe of the payload." << std::endl;
+                co_return FALSE;
+            }
+
+            co_return received;
+        }
+
+        if (!co_await receiver.receive_stream(client_sock, tee))
+        {
+            co_return FALSE;
+        }
+
+        const auto missing_pages = receiver.end_hashes();
+        if (!missing_pages)
+        {
+            co_return TRUE;
+        }
+
+        if (const auto result = co_await net::async_send_frames(
+                client_sock,
+                net::codec::frame_type::missing_pages,
+                missing_pages.value());
+            FAILED(result))
+        {
+            LOG_DEBUG_ERR() << "Failed to send missing pages; error: " << result << std::endl;
+            co_return FALSE;
+        }
+
+        co_return co_await receiver.receive_stream(client_sock, std::move(tee));
+    }
+
+    // Takes the manifest out of `assembler` once it's complete.
+    std::expected<net::address_space_manifest, HRESULT> take_received_manifest(net::manifest_assembler& assembler)
+    {
+        const std::size_t encoded_size = assembler.size();
+        auto manifest = assembler.take();
+        if (!manifest)
+        {
+            LOG_DEBUG_ERR() << "Malformed manifest." << std::endl;
+            return std::unexpected{ net::MALFORMED_MANIFEST };
+        }
+
+        LOG_DEBUG() << "Received manifest of " << manifest->regions.size() << " regions and "
+            << manifest->subregions.size() << " subregions in 0x" << std::hex
+            << encoded_size << std::dec << " bytes" << std::endl;
+
+        return std::move(manifest).value();
+    }
+
+    // Receives the `manifest` frames of one manifest. Each frame's length is checked before
+    // its body is allocated for.
+    std::expected<net::address_space_manifest, HRESULT> recv_manifest(SOCKET client_sock)
+    {
+        net::manifest_assembler assembler;
+        std::vector<std::byte> body;
+        while (true)
+        {
+            const auto header = net::recv_header(client_sock);
+            if (!header)
+            {
+                return std::unexpected{ header.error() };
+            }
+
+            if (header->type != net::codec::frame_type::manifest)
+            {
+                return std::unexpected{ net::UNEXPECTED_FRAME };
+            }
+
+            if (!assembler.accepts(header->length))
+            {
+                return std::unexpected{ net::MALFORMED_MANIFEST };
+            }
+
+            body.resize(header->length);
+            if (const auto result = net::recv_bytes(client_sock, std::span{ body }); FAILED(result))
+            {
+                return std::unexpected{ result };
+            }
+
+            switch (assembler.add(body))
+            {
+            case net::manifest_assembler::status::complete:
+                return take_received_manifest(assembler);
+            case net::manifest_assembler::status::malformed:
+                return std::unexpected{ net::MALFORMED_MANIFEST };
+            default:
+                break;
+            }
+        }
+    }
+
+    net::task<std::expected<net::address_space_manifest, HRESULT>> async_recv_manifest(SOCKET client_sock)
+    {
+        net::manifest_assembler assembler;
+        std::vector<std::byte> body;
+        while (true)
+        {
+            const auto header = co_await net::async_recv_header(client_sock);
+            if (!header)
+            {
+                co_return std::unexpected{ header.error() };
+            }
+
+            if (header->type != net::codec::frame_type::manifest)
+            {
+                co_return std::unexpected{ net::UNEXPECTED_FRAME };
+            }
+
+            if (!assembler.accepts(header->length))
+            {
+                co_return std::unexpected{ net::MALFORMED_MANIFEST };
+            }
+
+            body.resize(header->length);
+            if (const auto result = co_await net::async_recv_bytes(client_sock, std::span{ body }); FAILED(result))
+            {
+                co_return std::unexpected{ result };
+            }
+
+            switch (assembler.add(body))
+            {
+            case net::manifest_assembler::status::complete:
+                co_return take_received_manifest(assembler);
+            case net::manifest_assembler::status::malformed:
+                co_return std::unexpected{ net::MALFORMED_MANIFEST };
+            default:
+                break;
+            }
+        }
+    }
+
+    // `manifest` is the first frame of the payload, which may be received before the forked
+    // process exists. `store` may be null, in which case every hashed page is reported missing.
+    // A session waiting for a buffer of `writer` waits on `context`, which it runs on.
+    // `on_received`, if given, is called once the whole payload is in, while every page which
+    // carries one is still readable. `tee`, if given, gets every byte of the payload stream as
+    // it's received. `stripes`, if given, carry the rest of a striped payload.
+    net::task<BOOL> rebuild_forked_process(
+        HANDLE forked_process_handle,
+        SOCKET client_sock,
+        std::expected<net::address_space_manifest, HRESULT> manifest,
+        const std::uint64_t image_base,
+        const std::uint64_t image_size,
+        store::page_store* store,
+        page_writer& writer,
+        net::io_context& context,
+        std::function<void(const net::address_space_manifest&)> on_received = nullptr,
+        net::async_frame_stream::tee_type tee = nullptr,
+        stripes::stripe_set* stripes = nullptr)
+    {
+        if (!manifest)
+        {
+            LOG_DEBUG_ERR() << "Fatal error when receiving manifest: "
+                << manifest.error() << std::endl;
+            co_return FALSE;
+        }
+
+        // The server's views of the shared regions are only needed while receiving.
+        shared_regions shared;
+        plan_address_space(forked_process_handle, manifest.value(), &shared);
+        LOG_DEBUG() << "Receiving " << shared.size() << " of " << manifest->regions.size()
+            << " regions straight into shared memory" << std::endl;
+
+        if (!co_await receive_payload(forked_process_handle, client_sock, manifest.value(), image_base, image_size, store, writer, context, shared, std::move(tee), stripes))
+        {
+            co_return FALSE;
+        }
+
+        if (on_received)
+        {
+            on_received(manifest.value());
+        }
+
+        apply_final_protections(forked_process_handle, manifest.value());
+        co_return TRUE;
     }
 }
@@ -0,0 +1,285 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <stop_token>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace netfork
+{
+    struct warm_pool_options
+    {
+        // Items kept ready per key; 0 disables the pool.
+        std::size_t items_per_key = 2;
+        // Keys kept at once. The least recently used key is evicted, along with its items.
+        std::size_t max_keys = 16;
+    };
+
+    struct warm_pool_counters
+    {
+        std::uint64_t hits = 0;
+        std::uint64_t misses = 0;
+        std::uint64_t created = 0;
+        std::uint64_t failed = 0;
+        // Items dropped along with their key.
+        std::uint64_t evicted = 0;
+
+        double hit_rate() const noexcept
+        {
+            const std::uint64_t takes = hits + misses;
+            return takes == 0 ? 0.0 : static_cast<double>(hits) / takes;
+        }
+    };
+
+    // Items made ahead of time from a `Source` kept per key, so whoever needs one only pays
+    // for making it when the pool runs dry. A thread of the pool's own tops every key back up
+    // to `items_per_key` after each take.
+    //
+    // `factory` knows nothing of the pool, so the pool can be exercised with any item type.
+    template <typename Key, typename Source, typename Item, typename Hasher = std::hash<Key>>
+    class warm_pool
+    {
+    public:
+        using factory_type = std::function<std::optional<Item>(const Key&, const Source&)>;
+
+    private:
+        struct entry
+        {
+            Source source;
+            std::deque<Item> items;
+            // Items being made for this key right now.
+            std::size_t pending = 0;
+            typename std::list<Key>::iterator lru_position;
+        };
+
+        warm_pool_options options_;
+        factory_type factory_;
+
+        std::mutex mutex_;
+        std::condition_variable_any refill_cv_;
+        // Most recently used first.
+        std::list<Key> lru_;
+        std::unordered_map<Key, entry, Hasher> entries_;
+        // Keys which may be short of items, oldest request first.
+        std::deque<Key> refills_;
+        warm_pool_counters counters_;
+        std::jthread refiller_;
+
+        void touch(entry& e)
+        {
+            lru_.splice(lru_.begin(), lru_, e.lru_position);
+        }
+
+        // Drops the least recently used keys past `max_keys`. Their items are handed back so
+        // they're destroyed without holding the lock.
+        std::vector<Item> evict()
+        {
+            std::vector<Item> evicted;
+            while (entries_.size() > options_.max_keys)
+            {
+                const auto it = entries_.find(lru_.back());
+                for (auto& item : it->second.items)
+                {
+                    evicted.push_back(std::move(item));
+                }
+
+                counters_.evicted += it->second.items.size();
+                entries_.erase(it);
+                lru_.pop_back();
+            }
+
+            return evicted;
+        }
+
+        void refill(std::stop_token stop)
+        {
+            std::unique_lock lock{ mutex_ };
+            while (true)
+            {
+                refill_cv_.wait(lock, stop, [this] { return !refills_.empty(); });
+                if (stop.stop_requested())
+                {
+                    return;
+                }
+
+                const Key key = refills_.front();
+                refills_.pop_front();
+
+                auto it = entries_.find(key);
+                while (it != entries_.end() && it->second.items.size() + it->second.pending < options_.items_per_key)
+                {
+                    it->second.pending++;
+                    const Source source = it->second.source;
+
+                    lock.unlock();
+                    auto item = factory_(key, source);
+                    lock.lock();
+
+                    // The key may have been evicted or given a new source meanwhile.
+                    it = entries_.find(key);
+                    if (it != entries_.end())
+                    {
+                        it->second.pending--;
+                    }
+
+                    if (!item)
+                    {
+                        counters_.failed++;
+                        break;
+                    }
+
+                    counters_.created++;
+                    if (it == entries_.end() || !(it->second.source == source) || stop.stop_requested())
+                    {
+                        // Dropped with the lock released, like an evicted item.
+                        lock.unlock();
+                        item.reset();
+                        lock.lock();
+                        break;
+                    }
+
+                    it->second.items.push_back(std::move(item).value());
+                }
+            }
+        }
+
+    public:
+        warm_pool(const warm_pool_options& options, factory_type factory)
+            : options_{ options }
+            , factory_{ std::move(factory) }
+            , refiller_{ [this](std::stop_token stop) { refill(stop); } }
+        {
+        }
+
+        warm_pool(const warm_pool&) = delete;
+        warm_pool& operator=(const warm_pool&) = delete;
+
+        bool enabled() const noexcept
+        {
+            return options_.items_per_key > 0;
+        }
+
+        // Makes `source` the source of `key`'s items and tops the key up in the background.
+        // Items already made from an older source are dropped.
+        void warm(const Key& key, Source source)
+        {
+            if (!enabled())
+            {
+                return;
+            }
+
+            std::vector<Item> dropped;
+            {
+                std::lock_guard lock{ mutex_ };
+                auto it = entries_.find(key);
+                if (it == entries_.end())
+                {
+                    lru_.push_front(key);
+                    it = entries_.emplace(key, entry{
+                        .source = std::move(source),
+                        .items = {},
+                        .pending = 0,
+                        .lru_position = lru_.begin()
+                    }).first;
+                    dropped = evict();
+                }
+                else
+                {
+                    touch(it->second);
+                    if (!(it->second.source == source))
+                    {
+                        it->second.source = std::move(source);
+                        for (auto& item : it->second.items)
+                        {
+                            dropped.push_back(std::move(item));
+                        }
+
+                        it->second.items.clear();
+                    }
+                }
+
+                refills_.push_back(key);
+            }
+            refill_cv_.notify_one();
+        }
+
+        // Takes a ready item of `key` if there is one. The key is topped back up in the
+        // background either way.
+        std::optional<Item> take(const Key& key)
+        {
+            if (!enabled())
+            {
+                return std::nullopt;
+            }
+
+            std::optional<Item> item;
+            {
+                std::lock_guard lock{ mutex_ };
+                const auto it = entries_.find(key);
+                if (it == entries_.end() || it->second.items.empty())
+                {
+                    counters_.misses++;
+                }
+                else
+                {
+                    counters_.hits++;
+                    touch(it->second);
+                    item = std::move(it->second.items.front());
+                    it->second.items.pop_front();
+                }
+
+                if (it != entries_.end())
+                {
+                    refills_.push_back(key);
+                }
+            }
+            refill_cv_.notify_one();
+            return item;
+        }
+
+        warm_pool_counters counters()
+        {
+            std::lock_guard lock{ mutex_ };
+            return counters_;
+        }
+
+        // Items ready across every key.
+        std::size_t size()
+        {
+            std::lock_guard lock{ mutex_ };
+            std::size_t size = 0;
+            for (const auto& [key, e] : entries_)
+            {
+                size += e.items.size();
+            }
+
+            return size;
+        }
+    };
+}
@@ -0,0 +1,464 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+// The write stage of the payload receive, apart from how pages get into a process and how a
+// waiting session is resumed. Free of Windows dependencies: Windows servers write with
+// WriteProcessMemory and resume sessions on their I/O context (see page_writer.hpp), and the
+// benchmarks write into a Linux child with process_vm_writev.
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <netfork-shared/net/manifest.hpp>
+#include <netfork-shared/net/page_data.hpp>
+
+namespace netfork::vm
+{
+    // Writes the present pages of `run` to `target` with `write`, one call per stretch of
+    // consecutive present pages; `pages` holds only the present pages, back to back.
+    template <typename Target, typename Backend>
+    void write_present_pages(const Target& target, const net::page_run& run, std::span<const std::byte> pages, Backend&& write)
+    {
+        std::size_t pages_offset = 0;
+        run.for_each_present_run([&](const std::uint32_t first_page, const std::uint32_t page_count)
+        {
+            const std::size_t bytes_to_write = page_count * net::MANIFEST_PAGE_SIZE;
+            write(
+                target,
+                run.address + first_page * net::MANIFEST_PAGE_SIZE,
+                pages.subspan(pages_offset, bytes_to_write)
+            );
+            pages_offset += bytes_to_write;
+        });
+    }
+
+    // A session receives or copies each run into one of a fixed ring of frame-sized buffers
+    // and goes straight back to the network, while a pool of writer threads applies the
+    // buffered runs to the forked processes, each a `Target`. Memory writes then overlap the
+    // receive instead of taking turns with it, and the ring bounds how far the network may
+    // run ahead of the writers.
+    //
+    // Runs of the same process which overlap are written in the order they were submitted,
+    // since pre-copy sends a page again whenever it changes.
+    template <typename Target>
+    class write_ring
+    {
+    public:
+        // Writes `bytes` at `address` in `target`.
+        using backend_type = std::function<bool(const Target& target, std::uint64_t address, std::span<const std::byte> bytes)>;
+
+        // A session waiting on the ring, for a buffer to submit into or for its batch to be
+        // written. Once the wait is over `ready` is called, with the ring's lock released; for
+        // a buffer, `buffer` is the session's by then.
+        struct ring_wait
+        {
+            std::size_t buffer = 0;
+
+            virtual void ready() = 0;
+
+        protected:
+            ~ring_wait() = default;
+        };
+
+        class batch;
+
+        static constexpr std::size_t BUFFER_SIZE = net::MAX_PAGES_PER_FRAME * net::MANIFEST_PAGE_SIZE;
+
+    private:
+        struct job
+        {
+            batch* owner;
+            net::page_run run;
+            std::size_t buffer;
+            std::size_t size;
+            // Set once a writer has picked the job up.
+            bool started;
+        };
+
+        backend_type write_;
+        std::vector<std::byte> buffers_;
+        std::vector<std::size_t> free_buffers_;
+        // Buffers handed out by `try_acquire` and not yet submitted. They're waiting on the
+        // network rather than on a writer, so only half the ring may be leased at once.
+        std::size_t leased_ = 0;
+        std::size_t max_leased_;
+
+        std::mutex mutex_;
+        std::condition_variable work_cv_;
+        std::condition_variable done_cv_;
+        // Sessions waiting for a buffer, first come first served. A freed buffer goes to
+        // them before anyone blocked in `submit`.
+        std::deque<ring_wait*> buffer_waits_;
+        // Every job submitted but not yet written, in submission order.
+        std::deque<job> jobs_;
+        bool stopping_ = false;
+        std::vector<std::jthread> writers_;
+
+        static bool overlaps(const job& a, const job& b)
+        {
+            const std::uint64_t a_end = a.run.address + a.run.page_count * net::MANIFEST_PAGE_SIZE;
+            const std::uint64_t b_end = b.run.address + b.run.page_count * net::MANIFEST_PAGE_SIZE;
+            return a.owner == b.owner && a.run.address < b_end && b.run.address < a_end;
+        }
+
+        // The first job which isn't running and doesn't overlap any job submitted before it.
+        typename std::deque<job>::iterator next_ready_job()
+        {
+            for (auto it = jobs_.begin(); it != jobs_.end(); ++it)
+            {
+                if (it->started)
+                {
+                    continue;
+                }
+
+                const bool blocked = std::any_of(jobs_.begin(), it, [&](const job& earlier)
+                {
+                    return overlaps(earlier, *it);
+                });
+                if (!blocked)
+                {
+                    return it;
+                }
+            }
+
+            return jobs_.end();
+        }
+
+        // Hands `buffer` to the first session waiting for one, which is returned to be told
+        // once the lock is released, or puts it back in the ring. Called with the lock held.
+        ring_wait* release_buffer(const std::size_t buffer)
+        {
+            if (buffer_waits_.empty())
+            {
+                free_buffers_.push_back(buffer);
+                return nullptr;
+            }
+
+            ring_wait* const wait = buffer_waits_.front();
+            buffer_waits_.pop_front();
+            wait->buffer = buffer;
+            return wait;
+        }
+
+        void work()
+        {
+            while (true)
+            {
+                job current{};
+                {
+                    std::unique_lock lock{ mutex_ };
+                    auto it = jobs_.end();
+                    work_cv_.wait(lock, [&]
+                    {
+                        it = next_ready_job();
+                        return stopping_ || it != jobs_.end();
+                    });
+                    if (it == jobs_.end())
+                    {
+                        return;
+                    }
+
+                    it->started = true;
+                    current = *it;
+                }
+
+                write_present_pages(
+                    current.owner->target_,
+                    current.run,
+                    std::span<const std::byte>{ buffers_.data() + current.buffer * BUFFER_SIZE, current.size },
+                    write_
+                );
+
+                ring_wait* got_buffer = nullptr;
+                ring_wait* drained = nullptr;
+                {
+                    std::lock_guard lock{ mutex_ };
+                    const auto it = std::find_if(jobs_.begin(), jobs_.end(), [&](const job& j)
+                    {
+                        return j.started && j.owner == current.owner && j.buffer == current.buffer;
+                    });
+                    jobs_.erase(it);
+                    got_buffer = release_buffer(current.buffer);
+                    if (--current.owner->pending_ == 0)
+                    {
+                        drained = std::exchange(current.owner->drain_wait_, nullptr);
+                    }
+                }
+
+                // A finished job frees a buffer and may unblock a job which overlapped it.
+                if (got_buffer)
+                {
+                    got_buffer->ready();
+                }
+
+                if (drained)
+                {
+                    drained->ready();
+                }
+
+                done_cv_.notify_all();
+                work_cv_.notify_all();
+            }
+        }
+
+    public:
+        write_ring(const unsigned int writer_count, const std::size_t buffer_count, backend_type write)
+            : write_{ std::move(write) }
+            , buffers_(std::max<std::size_t>(1, buffer_count) * BUFFER_SIZE)
+            , max_leased_{ std::max<std::size_t>(1, buffer_count) / 2 }
+        {
+            free_buffers_.reserve(std::max<std::size_t>(1, buffer_count));
+            for (std::size_t i = 0; i < std::max<std::size_t>(1, buffer_count); i++)
+            {
+                free_buffers_.push_back(i);
+            }
+
+            writers_.reserve(writer_count);
+            for (unsigned int i = 0; i < std::max(1u, writer_count); i++)
+            {
+                writers_.emplace_back([this] { work(); });
+            }
+        }
+
+        write_ring(const write_ring&) = delete;
+        write_ring& operator=(const write_ring&) = delete;
+
+        ~write_ring()
+        {
+            {
+                std::lock_guard lock{ mutex_ };
+                stopping_ = true;
+            }
+            work_cv_.notify_all();
+        }
+
+        // A buffer of the ring taken to receive a run's pages straight into. It goes back to
+        // the ring unless it's submitted.
+        class buffer_lease
+        {
+            write_ring* ring_;
+            std::size_t index_;
+
+            friend class write_ring;
+
+            buffer_lease(write_ring& ring, const std::size_t index)
+                : ring_{ &ring }
+                , index_{ index }
+            {
+            }
+
+        public:
+            buffer_lease(buffer_lease&& other) noexcept
+                : ring_{ std::exchange(other.ring_, nullptr) }
+                , index_{ other.index_ }
+            {
+            }
+
+            buffer_lease(const buffer_lease&) = delete;
+            buffer_lease& operator=(const buffer_lease&) = delete;
+            buffer_lease& operator=(buffer_lease&&) = delete;
+
+            ~buffer_lease()
+            {
+                if (ring_)
+                {
+                    ring_wait* got_buffer = nullptr;
+                    {
+                        std::lock_guard lock{ ring_->mutex_ };
+                        got_buffer = ring_->release_buffer(index_);
+                        ring_->leased_--;
+                    }
+
+                    if (got_buffer)
+                    {
+                        got_buffer->ready();
+                    }
+                    ring_->done_cv_.notify_all();
+                }
+            }
+
+            std::span<std::byte> bytes() const noexcept
+            {
+                return { ring_->buffers_.data() + index_ * BUFFER_SIZE, BUFFER_SIZE };
+            }
+        };
+
+    private:
+        std::optional<buffer_lease> take_buffer()
+        {
+            std::lock_guard lock{ mutex_ };
+            if (free_buffers_.empty() || leased_ >= max_leased_)
+            {
+                return std::nullopt;
+            }
+
+            const std::size_t index = free_buffers_.back();
+            free_buffers_.pop_back();
+            leased_++;
+            return buffer_lease{ *this, index };
+        }
+
+    public:
+        // The runs one session submits to one forked process.
+        class batch
+        {
+            write_ring& ring_;
+            Target target_;
+            // Guarded by the ring's mutex.
+            std::size_t pending_ = 0;
+            ring_wait* drain_wait_ = nullptr;
+
+            friend class write_ring;
+
+            void queue(const net::page_run& run, const std::size_t buffer, const std::size_t size)
+            {
+                {
+                    std::lock_guard lock{ ring_.mutex_ };
+                    ring_.jobs_.push_back(job{
+                        .owner = this,
+                        .run = run,
+                        .buffer = buffer,
+                        .size = size,
+                        .started = false
+                    });
+                    pending_++;
+                }
+                ring_.work_cv_.notify_one();
+            }
+
+        public:
+            batch(write_ring& ring, Target target)
+                : ring_{ ring }
+                , target_{ std::move(target) }
+            {
+            }
+
+            batch(const batch&) = delete;
+            batch& operator=(const batch&) = delete;
+
+            ~batch()
+            {
+                drain();
+            }
+
+            // Takes a buffer of the ring to receive a run into if one can be spared, without
+            // blocking. A session may hold it across any number of receives, so it can't wait
+            // for one: the buffers it would wait for may be held by sessions waiting on their
+            // own receives.
+            std::optional<buffer_lease> try_acquire()
+            {
+                return ring_.take_buffer();
+            }
+
+            // Copies the present pages of `run` into a buffer of the ring and queues them to
+            // be written, if a buffer is free. Otherwise queues `wait` for the next buffer
+            // freed and returns false; once `wait` is ready, `submit_into(wait.buffer, ...)`
+            // finishes the submit.
+            bool submit_or_wait(const net::page_run& run, std::span<const std::byte> pages, ring_wait& wait)
+            {
+                std::size_t buffer = 0;
+                {
+                    std::lock_guard lock{ ring_.mutex_ };
+                    if (ring_.free_buffers_.empty())
+                    {
+                        ring_.buffer_waits_.push_back(&wait);
+                        return false;
+                    }
+
+                    buffer = ring_.free_buffers_.back();
+                    ring_.free_buffers_.pop_back();
+                }
+
+                submit_into(buffer, run, pages);
+                return true;
+            }
+
+            // Copies the present pages of `run` into `buffer`, which a `ring_wait` was
+            // handed, and queues them to be written.
+            void submit_into(const std::size_t buffer, const net::page_run& run, std::span<const std::byte> pages)
+            {
+                std::memcpy(ring_.buffers_.data() + buffer * BUFFER_SIZE, pages.data(), pages.size());
+                queue(run, buffer, pages.size());
+            }
+
+            // Like `submit_or_wait`, but blocks the calling thread while every buffer is in
+            // flight. Only for callers on a thread of their own.
+            void submit(const net::page_run& run, std::span<const std::byte> pages)
+            {
+                std::size_t buffer = 0;
+                {
+                    std::unique_lock lock{ ring_.mutex_ };
+                    ring_.done_cv_.wait(lock, [this] { return !ring_.free_buffers_.empty(); });
+                    buffer = ring_.free_buffers_.back();
+                    ring_.free_buffers_.pop_back();
+                }
+
+                submit_into(buffer, run, pages);
+            }
+
+            // Queues `run`, whose present pages were received into the first `size` bytes
+            // of `lease`, to be written.
+            void submit(const net::page_run& run, buffer_lease lease, const std::size_t size)
+            {
+                const std::size_t buffer = lease.index_;
+                lease.ring_ = nullptr;
+                {
+                    std::lock_guard lock{ ring_.mutex_ };
+                    ring_.leased_--;
+                }
+
+                queue(run, buffer, size);
+            }
+
+            // Returns true if every run submitted so far has been written. Otherwise `wait`
+            // is made ready once they have, and false is returned. A run must be written
+            // before the memory under it is replanned or reprotected.
+            bool drained_or_wait(ring_wait& wait)
+            {
+                std::lock_guard lock{ ring_.mutex_ };
+                if (pending_ == 0)
+                {
+                    return true;
+                }
+
+                drain_wait_ = &wait;
+                return false;
+            }
+
+            // Blocks until every run submitted so far has been written.
+            void drain()
+            {
+                std::unique_lock lock{ ring_.mutex_ };
+                ring_.done_cv_.wait(lock, [this] { return pending_ == 0; });
+            }
+        };
+    };
+}
@@ -0,0 +1,223 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+// The layout of a `compressed_chunk` frame and its store-as-is escape, apart from the codec
+// that does the work. Free of Windows dependencies: Windows builds compress with XPRESS (see
+// compress.hpp), and builds with zlib can use the raw deflate backend below, which is what
+// the Linux benchmarks run.
+//
+// A backend has
+//
+//   std::size_t compress(codec, std::span<const std::byte> in, std::span<std::byte> out)
+//   bool decompress(codec, std::span<const std::byte> in, std::span<std::byte> out)
+//
+// `compress` returns the compressed size, or 0 if it failed or the result didn't fit in
+// `out`; `decompress` succeeds only if it fills `out` exactly. Chunks are compressed
+// headerless, since the chunk prefix already records everything needed to decompress them.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <span>
+#include <vector>
+
+#ifdef NETFORK_HAVE_ZLIB
+#	include <zlib.h>
+#endif
+
+#include <netfork-shared/net/codec.hpp>
+
+namespace netfork::compress
+{
+    enum class codec : std::uint8_t
+    {
+        // Stored as-is; used for any chunk that compression doesn't make smaller.
+        store = 0,
+        // Plain LZ77: cheap enough to keep up with a gigabit link on a few cores.
+        fast,
+        // LZ77 with Huffman coding: noticeably smaller output for roughly twice the CPU.
+        dense,
+    };
+
+    // Body of a `compressed_chunk` frame:
+    //
+    //   u8 codec | u32 uncompressed size | compressed bytes
+    //
+    // Uncompressed, a chunk is a run of whole frames.
+    constexpr const std::size_t CHUNK_PREFIX_SIZE = sizeof(std::uint8_t) + sizeof(std::uint32_t);
+    // Senders cut a chunk once it holds at least this many bytes of frames.
+    constexpr const std::size_t CHUNK_TARGET_SIZE = net::codec::MAX_BYTES_FRAME_LENGTH;
+    // A chunk overshoots the target by at most one frame; anything past this is rejected.
+    constexpr const std::size_t MAX_CHUNK_SIZE = 4 * net::codec::MAX_BYTES_FRAME_LENGTH;
+
+    // Compresses a run of whole frames into a complete `compressed_chunk` frame. Falls back to
+    // storing the frames as-is if `method` doesn't make them any smaller.
+    template <typename Backend>
+    std::vector<std::byte> compress_chunk(Backend& backend, const codec method, std::span<const std::byte> frames)
+    {
+        constexpr std::size_t payload_offset = net::codec::FRAME_HEADER_SIZE + CHUNK_PREFIX_SIZE;
+        std::vector<std::byte> out(payload_offset + frames.size());
+
+        codec used = codec::store;
+        std::size_t payload_size = frames.size();
+        if (method != codec::store)
+        {
+            // The output buffer is only as large as the input, so anything that wouldn't
+            // shrink fails and is stored instead.
+            const std::size_t compressed_size = backend.compress(
+                method,
+                frames,
+                std::span{ out }.subspan(payload_offset)
+            );
+            if (compressed_size != 0 && compressed_size < frames.size())
+            {
+                used = method;
+                payload_size = compressed_size;
+            }
+        }
+
+        if (used == codec::store)
+        {
+            std::memcpy(out.data() + payload_offset, frames.data(), frames.size());
+        }
+
+        out.resize(payload_offset + payload_size);
+
+        const auto header = net::codec::encode_header({
+            .type = net::codec::frame_type::compressed_chunk,
+            .length = static_cast<std::uint32_t>(CHUNK_PREFIX_SIZE + payload_size)
+        });
+        std::memcpy(out.data(), header.data(), header.size());
+        out[net::codec::FRAME_HEADER_SIZE] = static_cast<std::byte>(used);
+        net::codec::store_le(
+            out.data() + net::codec::FRAME_HEADER_SIZE + sizeof(std::uint8_t),
+            static_cast<std::uint32_t>(frames.size()));
+
+        return out;
+    }
+
+    // Expands the body of a `compressed_chunk` frame back into the frames it holds. Returns
+    // nothing if the body is malformed.
+    template <typename Backend>
+    std::optional<std::vector<std::byte>> decompress_chunk(Backend& backend, std::span<const std::byte> body)
+    {
+        if (body.size() < CHUNK_PREFIX_SIZE)
+        {
+            return std::nullopt;
+        }
+
+        const auto method = static_cast<codec>(body[0]);
+        const auto frames_size = net::codec::load_le<std::uint32_t>(body.data() + sizeof(std::uint8_t));
+        const auto payload = body.subspan(CHUNK_PREFIX_SIZE);
+        if (frames_size > MAX_CHUNK_SIZE)
+        {
+            return std::nullopt;
+        }
+
+        std::vector<std::byte> frames(frames_size);
+        switch (method)
+        {
+        case codec::store:
+            if (payload.size() != frames_size)
+            {
+                return std::nullopt;
+            }
+
+            std::memcpy(frames.data(), payload.data(), payload.size());
+            break;
+        case codec::fast:
+        case codec::dense:
+            // Raw mode needs the exact uncompressed size, which the prefix provides.
+            if (!backend.decompress(method, payload, frames))
+            {
+                return std::nullopt;
+            }
+
+            break;
+        default:
+            return std::nullopt;
+        }
+
+        return frames;
+    }
+
+#ifdef NETFORK_HAVE_ZLIB
+    // Raw deflate: level 1 stands in for the fast codec and level 6 for the dense one. Like
+    // the XPRESS handles, the streams are cheap to reset but not to create, and mustn't be used
+    // by two threads at once.
+    class deflate_backend
+    {
+        z_stream fast_{};
+        z_stream dense_{};
+        z_stream inflate_{};
+
+    public:
+        deflate_backend() noexcept
+        {
+            // -15: a raw stream with the largest window and no zlib header or trailer.
+            ::deflateInit2(&fast_, 1, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+            ::deflateInit2(&dense_, 6, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+            ::inflateInit2(&inflate_, -15);
+        }
+
+        deflate_backend(const deflate_backend&) = delete;
+        deflate_backend& operator=(const deflate_backend&) = delete;
+
+        ~deflate_backend()
+        {
+            ::deflateEnd(&fast_);
+            ::deflateEnd(&dense_);
+            ::inflateEnd(&inflate_);
+        }
+
+        std::size_t compress(const codec method, std::span<const std::byte> in, std::span<std::byte> out) noexcept
+        {
+            z_stream& stream = method == codec::dense ? dense_ : fast_;
+            if (::deflateReset(&stream) != Z_OK)
+            {
+                return 0;
+            }
+
+            stream.next_in = reinterpret_cast<Bytef*>(const_cast<std::byte*>(in.data()));
+            stream.avail_in = static_cast<uInt>(in.size());
+            stream.next_out = reinterpret_cast<Bytef*>(out.data());
+            stream.avail_out = static_cast<uInt>(out.size());
+            return ::deflate(&stream, Z_FINISH) == Z_STREAM_END ? stream.total_out : 0;
+        }
+
+        bool decompress(codec, std::span<const std::byte> in, std::span<std::byte> out) noexcept
+        {
+            if (::inflateReset(&inflate_) != Z_OK)
+            {
+                return false;
+            }
+
+            inflate_.next_in = reinterpret_cast<Bytef*>(const_cast<std::byte*>(in.data()));
+            inflate_.avail_in = static_cast<uInt>(in.size());
+            inflate_.next_out = reinterpret_cast<Bytef*>(out.data());
+            inflate_.avail_out = static_cast<uInt>(out.size());
+            return ::inflate(&inflate_, Z_FINISH) == Z_STREAM_END
+                && inflate_.total_out == out.size()
+                && inflate_.avail_in == 0;
+        }
+    };
+#endif
+}
@@ -0,0 +1,151 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// Chunk compression for the frame stream, built on the Windows Compression API so there's
+// nothing extra to ship. The chunk layout lives in chunk_codec.hpp; this is its XPRESS
+// backend.
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <expected>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include <compressapi.h>
+
+#include <netfork-shared/chunk_codec.hpp>
+#include <netfork-shared/net/codec.hpp>
+#include <netfork-shared/phnt_stub.hpp>
+
+namespace netfork::compress
+{
+    constexpr const HRESULT MALFORMED_CHUNK = 0xA0000004;
+
+    namespace detail
+    {
+        // The fast codec is XPRESS, and the dense one XPRESS with Huffman coding.
+        constexpr DWORD algorithm_of(const codec method) noexcept
+        {
+            return (method == codec::dense ? COMPRESS_ALGORITHM_XPRESS_HUFF : COMPRESS_ALGORITHM_XPRESS)
+                | COMPRESS_RAW;
+        }
+
+        // (De)compressor handles are cheap to use but not to create, and mustn't be used by
+        // two threads at once, so every worker lazily creates and keeps its own.
+        class thread_codecs
+        {
+            std::array<COMPRESSOR_HANDLE, 3> compressors_{};
+            std::array<DECOMPRESSOR_HANDLE, 3> decompressors_{};
+
+        public:
+            thread_codecs() = default;
+            thread_codecs(const thread_codecs&) = delete;
+            thread_codecs& operator=(const thread_codecs&) = delete;
+
+            ~thread_codecs()
+            {
+                for (const auto handle : compressors_)
+                {
+                    if (handle)
+                    {
+                        ::CloseCompressor(handle);
+                    }
+                }
+
+                for (const auto handle : decompressors_)
+                {
+                    if (handle)
+                    {
+                        ::CloseDecompressor(handle);
+                    }
+                }
+            }
+
+            COMPRESSOR_HANDLE compressor(const codec method) noexcept
+            {
+                auto& handle = compressors_[static_cast<std::size_t>(method)];
+                if (!handle && !::CreateCompressor(algorithm_of(method), nullptr, &handle))
+                {
+                    handle = nullptr;
+                }
+
+                return handle;
+            }
+
+            DECOMPRESSOR_HANDLE decompressor(const codec method) noexcept
+            {
+                auto& handle = decompressors_[static_cast<std::size_t>(method)];
+                if (!handle && !::CreateDecompressor(algorithm_of(method), nullptr, &handle))
+                {
+                    handle = nullptr;
+                }
+
+                return handle;
+            }
+
+            std::size_t compress(const codec method, std::span<const std::byte> in, std::span<std::byte> out) noexcept
+            {
+                const auto handle = compressor(method);
+                SIZE_T compressed_size = 0;
+                if (!handle || !::Compress(handle, in.data(), in.size(), out.data(), out.size(), &compressed_size))
+                {
+                    return 0;
+                }
+
+                return compressed_size;
+            }
+
+            bool decompress(const codec method, std::span<const std::byte> in, std::span<std::byte> out) noexcept
+            {
+                const auto handle = decompressor(method);
+                SIZE_T decompressed_size = 0;
+                return handle
+                    && ::Decompress(handle, in.data(), in.size(), out.data(), out.size(), &decompressed_size)
+                    && decompressed_size == out.size();
+            }
+        };
+
+        inline thread_codecs& this_thread_codecs()
+        {
+            thread_local thread_codecs codecs;
+            return codecs;
+        }
+    }
+
+    // Compresses a run of whole frames into a complete `compressed_chunk` frame. Falls back to
+    // storing the frames as-is if `method` doesn't make them any smaller.
+    inline std::vector<std::byte> compress_chunk(const codec method, std::span<const std::byte> frames)
+    {
+        return compress_chunk(detail::this_thread_codecs(), method, frames);
+    }
+
+    // Expands the body of a `compressed_chunk` frame back into the frames it holds.
+    inline std::expected<std::vector<std::byte>, HRESULT> decompress_chunk(std::span<const std::byte> body)
+    {
+        auto frames = decompress_chunk(detail::this_thread_codecs(), body);
+        if (!frames)
+        {
+            return std::unexpected{ MALFORMED_CHUNK };
+        }
+
+        return std::move(*frames);
+    }
+}
@@ -0,0 +1,58 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// The read-only hash of a main image, which keys the server's image cache. The client
+// hashes the image as it's mapped; a server which is sent the image hashes what it
+// received the same way before caching it, so a client can't file bytes under a key they
+// don't hash to.
+
+#include <cstddef>
+#include <cstdint>
+
+#include <netfork-shared/net/manifest.hpp>
+#include <netfork-shared/net/msg.hpp>
+#include <netfork-shared/page_hash.hpp>
+
+namespace netfork
+{
+    // Whether the pages of `subregion` are part of its image's read-only hash.
+    constexpr bool is_hashed_image_subregion(const net::manifest_subregion& subregion) noexcept
+    {
+        return net::msg::has_payload(subregion.protect) && !net::msg::is_writable(subregion.protect);
+    }
+
+    // Folds the hashed `subregion` of an image based at `image_base` into `hash`; `pages` are
+    // its `region_size` bytes. The subregion's offset from the image base and its size are
+    // folded in first, so the layout is part of the hash too. Subregions are folded in
+    // address order, starting from an all-zero hash.
+    inline page_hash hash_image_subregion(
+        page_hash hash,
+        const std::uint64_t image_base,
+        const net::manifest_subregion& subregion,
+        const std::byte* pages) noexcept
+    {
+        hash = hash_values(hash, subregion.base_address - image_base, subregion.region_size);
+        for (std::uint64_t offset = 0; offset < subregion.region_size; offset += HASHED_PAGE_SIZE)
+        {
+            hash = hash_page(pages + offset, hash);
+        }
+
+        return hash;
+    }
+}
@@ -0,0 +1,579 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <coroutine>
+#include <cstdint>
+#include <expected>
+#include <functional>
+#include <memory>
+#include <span>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <winsock2.h>
+
+#include <netfork-shared/compress.hpp>
+#include <netfork-shared/log.hpp>
+#include <netfork-shared/net/codec.hpp>
+#include <netfork-shared/net/page_data.hpp>
+#include <netfork-shared/net/sock.hpp>
+#include <netfork-shared/net/task.hpp>
+#include <netfork-shared/phnt_stub.hpp>
+#include <netfork-shared/utils.hpp>
+
+namespace netfork::net
+{
+    // An I/O completion port and the threads draining it. Every overlapped send or receive
+    // on a socket associated with it suspends the awaiting coroutine until its completion is
+    // dequeued, so a session waiting on a slow or idle client holds a coroutine frame rather
+    // than a thread.
+    class io_context
+    {
+    public:
+        // The state of one pending operation. It lives in the frame of the suspended
+        // coroutine, which the thread dequeuing its completion resumes.
+        struct operation : OVERLAPPED
+        {
+            std::coroutine_handle<> waiter;
+            DWORD bytes = 0;
+            DWORD error = ERROR_SUCCESS;
+        };
+
+    private:
+        unique_handle<> port_;
+        std::vector<std::jthread> threads_;
+
+        explicit io_context(unique_handle<> port)
+            : port_{ std::move(port) }
+        {
+        }
+
+        void run()
+        {
+            while (true)
+            {
+                DWORD bytes = 0;
+                ULONG_PTR key = 0;
+                LPOVERLAPPED overlapped = nullptr;
+                const BOOL dequeued = ::GetQueuedCompletionStatus(port_.get(), &bytes, &key, &overlapped, INFINITE);
+                // A packet without an operation is the signal to stop.
+                if (!overlapped)
+                {
+                    return;
+                }
+
+                auto* const op = static_cast<operation*>(overlapped);
+                op->bytes = bytes;
+                op->error = dequeued ? ERROR_SUCCESS : ::GetLastError();
+                op->waiter.resume();
+            }
+        }
+
+    public:
+        io_context(const io_context&) = delete;
+        io_context& operator=(const io_context&) = delete;
+
+        ~io_context()
+        {
+            stop();
+        }
+
+        static std::expected<std::unique_ptr<io_context>, HRESULT> create(const unsigned int thread_count)
+        {
+            unique_handle<> port{ ::CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, thread_count) };
+            if (!port)
+            {
+                return std::unexpected{ HRESULT_FROM_WIN32(::GetLastError()) };
+            }
+
+            std::unique_ptr<io_context> context{ new io_context{ std::move(port) } };
+            context->threads_.reserve(thread_count);
+            for (unsigned int i = 0; i < thread_count; i++)
+            {
+                context->threads_.emplace_back([context = context.get()] { context->run(); });
+            }
+
+            return context;
+        }
+
+        // Routes the completions of every overlapped operation on `sock` to this context.
+        HRESULT associate(SOCKET sock)
+        {
+            if (!::CreateIoCompletionPort(reinterpret_cast<HANDLE>(sock), port_.get(), 0, 0))
+            {
+                return HRESULT_FROM_WIN32(::GetLastError());
+            }
+
+            return ERROR_SUCCESS;
+        }
+
+        // Resumes the awaiting coroutine on one of the threads of this context.
+        auto schedule()
+        {
+            struct awaiter : operation
+            {
+                HANDLE port;
+
+                bool await_ready() const noexcept
+                {
+                    return false;
+                }
+
+                bool await_suspend(std::coroutine_handle<> awaiting) noexcept
+                {
+                    waiter = awaiting;
+                    // Carry on where we are if the packet can't be queued.
+                    return ::PostQueuedCompletionStatus(port, 0, 0, this);
+                }
+
+                void await_resume() const noexcept {}
+            };
+
+            return awaiter{ operation{}, port_.get() };
+        }
+
+        // Resumes `op.waiter` on one of the threads of this context, or right here if the
+        // packet can't be queued. `op` must stay alive until then.
+        void post(operation& op)
+        {
+            if (!::PostQueuedCompletionStatus(port_.get(), 0, 0, &op))
+            {
+                op.waiter.resume();
+            }
+        }
+
+        // Waits for every thread to finish the coroutine it's running. Coroutines still
+        // suspended on I/O are never resumed.
+        void stop()
+        {
+            for (std::size_t i = 0; i < threads_.size(); i++)
+            {
+                ::PostQueuedCompletionStatus(port_.get(), 0, 0, nullptr);
+            }
+
+            threads_.clear();
+        }
+    };
+
+    namespace detail
+    {
+        // One overlapped send or receive of at most `buf.len` bytes. Unless the operation
+        // fails outright, its completion is always queued, even when it finishes at once.
+        class socket_operation : public io_context::operation
+        {
+            SOCKET sock_;
+            WSABUF buf_;
+            bool send_;
+
+        public:
+            socket_operation(SOCKET sock, std::span<const std::byte> buf, const bool send)
+                : io_context::operation{}
+                , sock_{ sock }
+                , buf_{
+                    .len = static_cast<ULONG>(buf.size()),
+                    .buf = const_cast<char*>(reinterpret_cast<const char*>(buf.data()))
+                }
+                , send_{ send }
+            {
+            }
+
+            bool await_ready() const noexcept
+            {
+                return false;
+            }
+
+            bool await_suspend(std::coroutine_handle<> awaiting) noexcept
+            {
+                waiter = awaiting;
+
+                // Once the operation is issued, another thread may resume the coroutine and
+                // destroy this operation at any moment, so nothing here is touched after.
+                DWORD flags = 0;
+                const int rc = send_
+                    ? ::WSASend(sock_, &buf_, 1, nullptr, 0, this, nullptr)
+                    : ::WSARecv(sock_, &buf_, 1, nullptr, &flags, this, nullptr);
+                if (rc == SOCKET_ERROR)
+                {
+                    const int error_code = ::WSAGetLastError();
+                    if (error_code != WSA_IO_PENDING)
+                    {
+                        error = error_code;
+                        return false;
+                    }
+                }
+
+                return true;
+            }
+
+            std::expected<DWORD, HRESULT> await_resume() const noexcept
+            {
+                if (error != ERROR_SUCCESS)
+                {
+                    return std::unexpected{ HRESULT_FROM_WIN32(error) };
+                }
+
+                return bytes;
+            }
+        };
+    }
+
+    // Starts `work` on a thread of `context` and returns at once; the coroutine frame is
+    // freed when it finishes.
+    inline detail::detached_task spawn(io_context& context, task<> work)
+    {
+        co_await context.schedule();
+        co_await std::move(work);
+    }
+
+    // The functions below are the awaitable counterparts of those in sock.hpp. `sock` must
+    // have been associated with an `io_context` first.
+
+    template <typename T, std::size_t N>
+    task<HRESULT> async_recv_bytes(SOCKET sock, std::span<T, N> buf)
+    {
+        std::span<std::byte> bytes = std::as_writable_bytes(buf);
+        while (!bytes.empty())
+        {
+            const auto received = co_await detail::socket_operation{ sock, bytes, false };
+            if (!received)
+            {
+                co_return received.error();
+            }
+
+            // Client may have closed the connection early.
+            if (received.value() == 0) [[unlikely]]
+            {
+                co_return INCOMPLETE_RECV_DATA;
+            }
+
+            bytes = bytes.subspan(received.value());
+        }
+
+        co_return ERROR_SUCCESS;
+    }
+
+    template <std::size_t N>
+    task<HRESULT> async_send_bytes(SOCKET sock, std::span<const std::byte, N> buf)
+    {
+        std::span<const std::byte> bytes = buf;
+        while (!bytes.empty())
+        {
+            const auto sent = co_await detail::socket_operation{ sock, bytes, true };
+            if (!sent)
+            {
+                co_return sent.error();
+            }
+
+            bytes = bytes.subspan(sent.value());
+        }
+
+        co_return ERROR_SUCCESS;
+    }
+
+    inline task<std::expected<codec::frame_header, HRESULT>> async_recv_header(SOCKET sock)
+    {
+        std::array<std::byte, codec::FRAME_HEADER_SIZE> buf{};
+        if (const auto result = co_await async_recv_bytes(sock, std::span{ buf }); FAILED(result))
+        {
+            co_return std::unexpected{ result };
+        }
+
+        const auto header = codec::decode_header(buf);
+        if (!codec::is_current_version(header))
+        {
+            LOG_DEBUG_ERR() << "Protocol version mismatch; expected " << codec::PROTOCOL_VERSION
+                << " but got " << header.version << std::endl;
+            co_return std::unexpected{ PROTOCOL_VERSION_MISMATCH };
+        }
+
+        co_return header;
+    }
+
+    template <codec::message T>
+    task<std::expected<T, HRESULT>> async_recv_body(SOCKET sock, const codec::frame_header header)
+    {
+        if (header.type != codec::frame_type_of<T>() || header.length != codec::encoded_size_v<T>)
+        {
+            co_return std::unexpected{ UNEXPECTED_FRAME };
+        }
+
+        std::array<std::byte, codec::encoded_size_v<T>> buf{};
+        if (const auto result = co_await async_recv_bytes(sock, std::span{ buf }); FAILED(result))
+        {
+            co_return std::unexpected{ result };
+        }
+
+        co_return codec::decode<T>(buf);
+    }
+
+    template <codec::message T>
+    task<std::expected<T, HRESULT>> async_recv_msg(SOCKET sock)
+    {
+        const auto header = co_await async_recv_header(sock);
+        if (!header)
+        {
+            co_return std::unexpected{ header.error() };
+        }
+
+        co_return co_await async_recv_body<T>(sock, header.value());
+    }
+
+    // Receives consecutive frames of `type` until `buf` has been completely filled.
+    inline task<HRESULT> async_recv_frames(SOCKET sock, const codec::frame_type type, std::span<std::byte> buf)
+    {
+        while (!buf.empty())
+        {
+            const auto header = co_await async_recv_header(sock);
+            if (!header)
+            {
+                co_return header.error();
+            }
+
+            if (header->type != type || header->length > buf.size())
+            {
+                co_return UNEXPECTED_FRAME;
+            }
+
+            if (const auto result = co_await async_recv_bytes(sock, buf.first(header->length)); FAILED(result))
+            {
+                co_return result;
+            }
+
+            buf = buf.subspan(header->length);
+        }
+
+        co_return ERROR_SUCCESS;
+    }
+
+    template <codec::message T>
+    task<HRESULT> async_send_msg(SOCKET sock, const T& msg)
+    {
+        const auto frame = codec::encode_frame(msg);
+        co_return co_await async_send_bytes(sock, std::span{ frame });
+    }
+
+    // Sends `bytes` as one or more frames of `type`, each at most `MAX_BYTES_FRAME_LENGTH`.
+    inline task<HRESULT> async_send_frames(SOCKET sock, const codec::frame_type type, std::span<const std::byte> bytes)
+    {
+        do
+        {
+            const auto chunk = bytes.first(std::min(bytes.size(), codec::MAX_BYTES_FRAME_LENGTH));
+            const auto header = codec::encode_header({
+                .type = type,
+                .length = static_cast<std::uint32_t>(chunk.size())
+            });
+            if (const auto result = co_await async_send_bytes(sock, std::span{ header }); FAILED(result))
+            {
+                co_return result;
+            }
+
+            if (const auto result = co_await async_send_bytes(sock, chunk); FAILED(result))
+            {
+                co_return result;
+            }
+
+            bytes = bytes.subspan(chunk.size());
+        } while (!bytes.empty());
+
+        co_return ERROR_SUCCESS;
+    }
+
+    // The awaitable counterpart of `frame_stream`. Compressed chunks are expanded on the
+    // thread that received them instead of a pool of their own: with many sessions at once,
+    // the threads of the context are kept busy by other sessions meanwhile.
+    //
+    // With `defer_page_data` on, an uncompressed `page_data` frame is returned once its run
+    // prefix has been received, and its present pages are left on the socket for the caller
+    // to receive wherever they belong with `receive_deferred`. Runs inside compressed chunks
+    // still arrive whole.
+    //
+    // With a `tee`, every byte taken off the socket is also handed to it, in order and before
+    // the frame it belongs to is returned, so the stream can be passed on exactly as it came.
+    class async_frame_stream
+    {
+    public:
+        using tee_type = std::function<void(std::span<const std::byte>)>;
+
+    private:
+        SOCKET sock_;
+        tee_type tee_;
+        std::vector<std::byte> frame_;
+        std::vector<std::byte> expanded_;
+        codec::frame_reader reader_{ {} };
+        bool defer_page_data_ = false;
+        // Bytes of the last frame still on the socket.
+        std::size_t deferred_ = 0;
+
+        task<std::expected<codec::frame_view, HRESULT>> receive_page_run_prefix(const codec::frame_header& header)
+        {
+            if (header.length < PAGE_RUN_FIXED_SIZE)
+            {
+                co_return std::unexpected{ UNEXPECTED_FRAME };
+            }
+
+            frame_.resize(PAGE_RUN_FIXED_SIZE + PAGE_BITMAP_WORDS * sizeof(std::uint64_t));
+            if (const auto result = co_await async_recv_bytes(sock_, std::span{ frame_ }.first(PAGE_RUN_FIXED_SIZE));
+                FAILED(result))
+            {
+                co_return std::unexpected{ result };
+            }
+
+            forward(std::span{ frame_ }.first(PAGE_RUN_FIXED_SIZE));
+            const auto run = decode_page_run_fixed(std::span{ frame_ }.first<PAGE_RUN_FIXED_SIZE>());
+            if (!run || header.length < run->prefix_size())
+            {
+                co_return std::unexpected{ UNEXPECTED_FRAME };
+            }
+
+            const auto prefix = std::span{ frame_ }.first(run->prefix_size());
+            if (const auto result = co_await async_recv_bytes(sock_, prefix.subspan(PAGE_RUN_FIXED_SIZE));
+                FAILED(result))
+            {
+                co_return std::unexpected{ result };
+            }
+
+            forward(prefix.subspan(PAGE_RUN_FIXED_SIZE));
+
+            deferred_ = header.length - prefix.size();
+            co_return codec::frame_view{ .header = header, .body = prefix };
+        }
+
+        void forward(std::span<const std::byte> bytes)
+        {
+            if (tee_)
+            {
+                tee_(bytes);
+            }
+        }
+
+    public:
+        explicit async_frame_stream(SOCKET sock, tee_type tee = nullptr)
+            : sock_{ sock }
+            , tee_{ std::move(tee) }
+        {
+        }
+
+        async_frame_stream(const async_frame_stream&) = delete;
+        async_frame_stream& operator=(const async_frame_stream&) = delete;
+
+        void defer_page_data(const bool defer) noexcept
+        {
+            defer_page_data_ = defer;
+        }
+
+        // Whether the last frame returned still has bytes on the socket.
+        bool has_deferred() const noexcept
+        {
+            return deferred_ != 0;
+        }
+
+        // Receives the next `into.size()` bytes of the last frame returned.
+        task<HRESULT> receive_deferred(std::span<std::byte> into)
+        {
+            if (into.size() > deferred_)
+            {
+                co_return UNEXPECTED_FRAME;
+            }
+
+            deferred_ -= into.size();
+            const auto result = co_await async_recv_bytes(sock_, into);
+            if (SUCCEEDED(result))
+            {
+                forward(into);
+            }
+
+            co_return result;
+        }
+
+        // The body of the returned frame stays valid until the next call. Every deferred
+        // byte of the last frame must have been received by then.
+        task<std::expected<codec::frame_view, HRESULT>> next()
+        {
+            if (deferred_ != 0)
+            {
+                co_return std::unexpected{ UNEXPECTED_FRAME };
+            }
+
+            while (true)
+            {
+                if (const auto frame = reader_.next())
+                {
+                    co_return frame.value();
+                }
+
+                if (!reader_.remaining().empty())
+                {
+                    co_return std::unexpected{ UNEXPECTED_FRAME };
+                }
+
+                const auto header = co_await async_recv_header(sock_);
+                if (!header)
+                {
+                    co_return std::unexpected{ header.error() };
+                }
+
+                if (header->length > compress::CHUNK_PREFIX_SIZE + compress::MAX_CHUNK_SIZE)
+                {
+                    co_return std::unexpected{ UNEXPECTED_FRAME };
+                }
+
+                if (tee_)
+                {
+                    const auto encoded_header = codec::encode_header(header.value());
+                    tee_(encoded_header);
+                }
+
+                if (defer_page_data_ && header->type == codec::frame_type::page_data)
+                {
+                    co_return co_await receive_page_run_prefix(header.value());
+                }
+
+                // The header is kept in front of the body so the frame can be read back with a
+                // `frame_reader` like the contents of an expanded chunk.
+                frame_.resize(codec::FRAME_HEADER_SIZE + header->length);
+                const auto encoded_header = codec::encode_header(header.value());
+                std::copy(encoded_header.begin(), encoded_header.end(), frame_.begin());
+                if (const auto result = co_await async_recv_bytes(sock_, std::span{ frame_ }.subspan(codec::FRAME_HEADER_SIZE));
+                    FAILED(result))
+                {
+                    co_return std::unexpected{ result };
+                }
+
+                forward(std::span{ frame_ }.subspan(codec::FRAME_HEADER_SIZE));
+                if (header->type != codec::frame_type::compressed_chunk)
+                {
+                    reader_ = codec::frame_reader{ frame_ };
+                    continue;
+                }
+
+                auto expanded = compress::decompress_chunk(std::span{ frame_ }.subspan(codec::FRAME_HEADER_SIZE));
+                if (!expanded)
+                {
+                    co_return std::unexpected{ expanded.error() };
+                }
+
+                expanded_ = std::move(expanded).value();
+                reader_ = codec::frame_reader{ expanded_ };
+            }
+        }
+    };
+}
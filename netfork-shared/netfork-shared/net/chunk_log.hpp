@@ -0,0 +1,200 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace netfork::net
+{
+    using chunk = std::shared_ptr<const std::vector<std::byte>>;
+
+    // Encoded frames going out to several servers, appended by one producer and read by one
+    // sender per destination, each at its own pace. A chunk is dropped once every
+    // destination has read it, so a slow server only holds on to what it hasn't sent yet.
+    //
+    // With a window, no destination falls more than about that many bytes behind: `append`
+    // waits for the slowest one to make room, so the destinations throttle the producer.
+    // With a lag limit as well, a destination which makes no room within it is dropped
+    // instead, so one stalled server can't hold up the others for longer than that.
+    //
+    // Several senders may also read one destination between them, each chunk going to
+    // whichever asks first, to spread the chunks over connections by how fast each drains.
+    class chunk_log
+    {
+        // Marks a destination which won't read any more.
+        static constexpr std::size_t ABANDONED = std::numeric_limits<std::size_t>::max();
+
+        std::size_t window_;
+        std::optional<std::chrono::milliseconds> lag_limit_;
+
+        std::mutex mutex_;
+        std::condition_variable appended_cv_;
+        std::condition_variable trimmed_cv_;
+        std::deque<chunk> chunks_;
+        // Bytes of `chunks_`.
+        std::size_t kept_ = 0;
+        // Index of `chunks_.front()` in the whole log.
+        std::size_t first_ = 0;
+        // Index in the whole log of the next chunk each destination reads.
+        std::vector<std::size_t> cursors_;
+        // Destinations which fell behind by a whole window for longer than the lag limit.
+        std::vector<bool> dropped_;
+        bool closed_ = false;
+        std::uint64_t bytes_ = 0;
+
+        void trim()
+        {
+            const std::size_t slowest = cursors_.empty() ? ABANDONED : *std::min_element(cursors_.begin(), cursors_.end());
+            while (!chunks_.empty() && first_ < slowest)
+            {
+                kept_ -= chunks_.front()->size();
+                chunks_.pop_front();
+                first_++;
+            }
+        }
+
+        // Drops every destination still to read the oldest chunk kept.
+        void drop_slowest()
+        {
+            for (std::size_t destination = 0; destination < cursors_.size(); destination++)
+            {
+                if (cursors_[destination] == first_)
+                {
+                    cursors_[destination] = ABANDONED;
+                    dropped_[destination] = true;
+                }
+            }
+
+            trim();
+        }
+
+    public:
+        // No bound on how far behind a destination may fall.
+        static constexpr std::size_t UNBOUNDED = std::numeric_limits<std::size_t>::max();
+
+        explicit chunk_log(
+            const std::size_t destination_count,
+            const std::size_t window = UNBOUNDED,
+            const std::optional<std::chrono::milliseconds> lag_limit = std::nullopt)
+            : window_{ window }
+            , lag_limit_{ lag_limit }
+            , cursors_(destination_count, 0)
+            , dropped_(destination_count, false)
+        {
+        }
+
+        chunk_log(const chunk_log&) = delete;
+        chunk_log& operator=(const chunk_log&) = delete;
+
+        // Waits while the slowest destination is a whole window behind, dropping it if the
+        // lag limit runs out first. The chunk itself may take the log past the window.
+        void append(std::vector<std::byte> frames)
+        {
+            {
+                std::unique_lock lock{ mutex_ };
+                const auto has_room = [this] { return kept_ < window_; };
+                while (!has_room())
+                {
+                    if (!lag_limit_)
+                    {
+                        trimmed_cv_.wait(lock, has_room);
+                    }
+                    else if (!trimmed_cv_.wait_for(lock, *lag_limit_, has_room))
+                    {
+                        drop_slowest();
+                    }
+                }
+
+                bytes_ += frames.size();
+                kept_ += frames.size();
+                chunks_.push_back(std::make_shared<const std::vector<std::byte>>(std::move(frames)));
+            }
+            appended_cv_.notify_all();
+        }
+
+        // Nothing more will be appended.
+        void close()
+        {
+            {
+                std::lock_guard lock{ mutex_ };
+                closed_ = true;
+            }
+            appended_cv_.notify_all();
+        }
+
+        // Blocks until `destination` has another chunk to send. Returns null once the log is
+        // closed and the destination has read all of it, or once it's been dropped.
+        chunk next(const std::size_t destination)
+        {
+            chunk next;
+            {
+                std::unique_lock lock{ mutex_ };
+                appended_cv_.wait(lock, [&]
+                {
+                    return closed_ || cursors_[destination] == ABANDONED || cursors_[destination] < first_ + chunks_.size();
+                });
+                if (cursors_[destination] >= first_ + chunks_.size())
+                {
+                    return nullptr;
+                }
+
+                next = chunks_[cursors_[destination] - first_];
+                cursors_[destination]++;
+                trim();
+            }
+            trimmed_cv_.notify_all();
+            return next;
+        }
+
+        // `destination` gave up; what it hadn't read is no longer kept for it.
+        void abandon(const std::size_t destination)
+        {
+            {
+                std::lock_guard lock{ mutex_ };
+                cursors_[destination] = ABANDONED;
+                trim();
+            }
+            trimmed_cv_.notify_all();
+        }
+
+        // Whether `destination` was dropped for falling behind.
+        bool dropped(const std::size_t destination)
+        {
+            std::lock_guard lock{ mutex_ };
+            return dropped_[destination];
+        }
+
+        // Bytes appended so far.
+        std::uint64_t bytes()
+        {
+            std::lock_guard lock{ mutex_ };
+            return bytes_;
+        }
+    };
+}
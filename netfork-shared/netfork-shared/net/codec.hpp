@@ -0,0 +1,546 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// This header is deliberately free of any Windows/phnt dependencies so the wire format
+// can be built and exercised on any platform.
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace netfork::net::codec
+{
+    // Bump whenever the layout of the frame header or any message changes.
+    constexpr const std::uint16_t PROTOCOL_VERSION = 17;
+
+    enum class frame_type : std::uint16_t
+    {
+        thread_context = 1,
+        peb,
+        teb,
+        image_info,
+        image_bytes,
+        // Compact description of the whole captured address space (see `manifest.hpp`),
+        // split over as many of these as it takes (see `write_manifest`). A pre-copy client
+        // sends it again mid-payload whenever its address space changes.
+        manifest,
+        // A run of pages, of which only the non-zero ones are sent (see `page_data.hpp`).
+        page_data,
+        end_of_stream,
+        // A compressed run of whole frames (see `compress.hpp`).
+        compressed_chunk,
+        // Like `page_data`, but with the hash of every present page instead of its bytes
+        // (see `page_data.hpp`).
+        page_hashes,
+        // The server's reply to `page_hashes`: one bit per hashed page, set if the server
+        // doesn't have it and the page must be sent.
+        missing_pages,
+        // The server's reply to `image_info`, saying whether it has the image cached.
+        image_cache_status,
+        // How the client is going to send its memory (see `msg::fork_mode`).
+        fork_mode,
+        // Post-copy only: the server asking for pages the forked process touched before
+        // they were pushed.
+        page_request,
+        // Replication only: the server confirming an epoch has been applied.
+        replication_ack,
+        // The server's reply to `fork_mode`, once it has room for the fork or has turned it
+        // down (see `msg::admission`).
+        admission,
+        // Opens one of the extra connections of a striped fork (see `msg::stripe_attach`).
+        stripe_attach,
+    };
+
+    // Every frame on the wire starts with this header:
+    //   u16 version | u16 type | u32 body length
+    // All integers are little-endian regardless of the host.
+    struct frame_header
+    {
+        std::uint16_t version = PROTOCOL_VERSION;
+        frame_type type{};
+        std::uint32_t length = 0;
+    };
+
+    constexpr const std::size_t FRAME_HEADER_SIZE = 8;
+    // Raw byte payloads (image and region bytes) are split into frames of at most this size.
+    constexpr const std::size_t MAX_BYTES_FRAME_LENGTH = 1024 * 1024;
+
+    template <std::unsigned_integral U>
+    constexpr void store_le(std::byte* out, const U value) noexcept
+    {
+        for (std::size_t i = 0; i < sizeof(U); i++)
+        {
+            out[i] = static_cast<std::byte>(value >> (i * 8));
+        }
+    }
+
+    template <std::unsigned_integral U>
+    constexpr U load_le(const std::byte* in) noexcept
+    {
+        U value = 0;
+        for (std::size_t i = 0; i < sizeof(U); i++)
+        {
+            value |= static_cast<U>(std::to_integer<U>(in[i]) << (i * 8));
+        }
+
+        return value;
+    }
+
+    // Unsigned LEB128: 7 bits per byte, high bit set on every byte but the last.
+    constexpr const std::size_t MAX_VARINT_SIZE = 10;
+
+    inline void write_varint(std::vector<std::byte>& out, std::uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            out.push_back(static_cast<std::byte>((value & 0x7F) | 0x80));
+            value >>= 7;
+        }
+
+        out.push_back(static_cast<std::byte>(value));
+    }
+
+    // Reads a varint from the front of `in` and advances it past the varint.
+    constexpr std::optional<std::uint64_t> read_varint(std::span<const std::byte>& in) noexcept
+    {
+        std::uint64_t value = 0;
+        for (std::size_t i = 0; i < in.size() && i < MAX_VARINT_SIZE; i++)
+        {
+            const auto byte = std::to_integer<std::uint64_t>(in[i]);
+            value |= (byte & 0x7F) << (i * 7);
+            if ((byte & 0x80) == 0)
+            {
+                in = in.subspan(i + 1);
+                return value;
+            }
+        }
+
+        return std::nullopt;
+    }
+
+    constexpr std::array<std::byte, FRAME_HEADER_SIZE> encode_header(const frame_header& header) noexcept
+    {
+        std::array<std::byte, FRAME_HEADER_SIZE> buf{};
+        store_le(buf.data(), header.version);
+        store_le(buf.data() + 2, std::to_underlying(header.type));
+        store_le(buf.data() + 4, header.length);
+        return buf;
+    }
+
+    constexpr frame_header decode_header(std::span<const std::byte, FRAME_HEADER_SIZE> buf) noexcept
+    {
+        return {
+            .version = load_le<std::uint16_t>(buf.data()),
+            .type = static_cast<frame_type>(load_le<std::uint16_t>(buf.data() + 2)),
+            .length = load_le<std::uint32_t>(buf.data() + 4)
+        };
+    }
+
+    // Whether `header` comes from a peer speaking this version of the protocol. Nothing past
+    // the header of a frame from any other version can be relied on.
+    constexpr bool is_current_version(const frame_header& header) noexcept
+    {
+        return header.version == PROTOCOL_VERSION;
+    }
+
+    // Maps a message field type onto the fixed-width unsigned integer used on the wire.
+    // Pointers are always widened to 64 bits.
+    template <typename F>
+    struct wire_field;
+
+    template <typename F>
+        requires std::is_integral_v<F> && (!std::same_as<F, bool>)
+    struct wire_field<F>
+    {
+        using type = std::make_unsigned_t<F>;
+    };
+
+    template <typename F>
+        requires std::is_enum_v<F>
+    struct wire_field<F>
+    {
+        using type = std::make_unsigned_t<std::underlying_type_t<F>>;
+    };
+
+    template <typename F>
+        requires std::is_pointer_v<F>
+    struct wire_field<F>
+    {
+        using type = std::uint64_t;
+    };
+
+    template <typename F>
+    using wire_field_t = typename wire_field<F>::type;
+
+    template <typename M>
+    struct member_pointer_traits;
+
+    template <typename C, typename F>
+    struct member_pointer_traits<F C::*>
+    {
+        using class_type = C;
+        using field_type = F;
+    };
+
+    // Specialize for every message that is encoded field-by-field:
+    //
+    //   template <>
+    //   struct message_traits<my_msg>
+    //   {
+    //       static constexpr frame_type type = frame_type::...;
+    //       static constexpr auto fields = std::make_tuple(&my_msg::a, &my_msg::b);
+    //   };
+    //
+    // Fields are packed in declaration order of `fields` with no padding.
+    template <typename T>
+    struct message_traits;
+
+    // Specialize for structures which are only meaningful as an opaque image on a machine
+    // with the same architecture (e.g. `CONTEXT`, `PEB`, `TEB`). They are framed, but their
+    // body is the raw object representation.
+    template <typename T>
+    struct opaque_traits;
+
+    template <typename T>
+    concept packed_message = requires
+    {
+        { message_traits<T>::type } -> std::convertible_to<frame_type>;
+        message_traits<T>::fields;
+    };
+
+    template <typename T>
+    concept opaque_message = std::is_trivially_copyable_v<T> && requires
+    {
+        { opaque_traits<T>::type } -> std::convertible_to<frame_type>;
+    };
+
+    template <typename T>
+    concept message = packed_message<T> || opaque_message<T>;
+
+    namespace detail
+    {
+        template <typename T, std::size_t I>
+        using field_t = typename member_pointer_traits<
+            std::remove_cvref_t<decltype(std::get<I>(message_traits<T>::fields))>>::field_type;
+
+        template <typename T>
+        constexpr std::size_t field_count_v = std::tuple_size_v<
+            std::remove_cvref_t<decltype(message_traits<T>::fields)>>;
+
+        template <typename T, std::size_t... I>
+        consteval std::size_t packed_size(std::index_sequence<I...>)
+        {
+            return (std::size_t{ 0 } + ... + sizeof(wire_field_t<field_t<T, I>>));
+        }
+
+        template <typename T, std::size_t I>
+        consteval std::size_t field_offset()
+        {
+            return packed_size<T>(std::make_index_sequence<I>{});
+        }
+
+        template <typename F>
+        constexpr wire_field_t<F> to_wire(const F& value) noexcept
+        {
+            if constexpr (std::is_pointer_v<F>)
+            {
+                return static_cast<std::uint64_t>(reinterpret_cast<std::uintptr_t>(value));
+            }
+            else if constexpr (std::is_enum_v<F>)
+            {
+                return static_cast<wire_field_t<F>>(std::to_underlying(value));
+            }
+            else
+            {
+                return static_cast<wire_field_t<F>>(value);
+            }
+        }
+
+        template <typename F>
+        constexpr F from_wire(const wire_field_t<F> value) noexcept
+        {
+            if constexpr (std::is_pointer_v<F>)
+            {
+                return reinterpret_cast<F>(static_cast<std::uintptr_t>(value));
+            }
+            else
+            {
+                return static_cast<F>(value);
+            }
+        }
+    }
+
+    template <typename T>
+    struct encoded_size;
+
+    template <packed_message T>
+    struct encoded_size<T>
+        : std::integral_constant<std::size_t,
+            detail::packed_size<T>(std::make_index_sequence<detail::field_count_v<T>>{})>
+    {
+    };
+
+    template <opaque_message T>
+    struct encoded_size<T> : std::integral_constant<std::size_t, sizeof(T)>
+    {
+    };
+
+    template <message T>
+    constexpr std::size_t encoded_size_v = encoded_size<T>::value;
+
+    template <message T>
+    consteval frame_type frame_type_of()
+    {
+        if constexpr (packed_message<T>)
+        {
+            return message_traits<T>::type;
+        }
+        else
+        {
+            return opaque_traits<T>::type;
+        }
+    }
+
+    template <message T>
+    constexpr void encode(const T& msg, std::span<std::byte, encoded_size_v<T>> out) noexcept
+    {
+        if constexpr (packed_message<T>)
+        {
+            [&]<std::size_t... I>(std::index_sequence<I...>)
+            {
+                (store_le(
+                    out.data() + detail::field_offset<T, I>(),
+                    detail::to_wire(msg.*std::get<I>(message_traits<T>::fields))
+                ), ...);
+            }(std::make_index_sequence<detail::field_count_v<T>>{});
+        }
+        else
+        {
+            const auto bytes = std::bit_cast<std::array<std::byte, sizeof(T)>>(msg);
+            std::copy(bytes.begin(), bytes.end(), out.begin());
+        }
+    }
+
+    template <message T>
+    constexpr T decode(std::span<const std::byte, encoded_size_v<T>> in) noexcept
+    {
+        if constexpr (packed_message<T>)
+        {
+            T msg{};
+            [&]<std::size_t... I>(std::index_sequence<I...>)
+            {
+                ((msg.*std::get<I>(message_traits<T>::fields) =
+                    detail::from_wire<detail::field_t<T, I>>(
+                        load_le<wire_field_t<detail::field_t<T, I>>>(
+                            in.data() + detail::field_offset<T, I>()))), ...);
+            }(std::make_index_sequence<detail::field_count_v<T>>{});
+            return msg;
+        }
+        else
+        {
+            std::array<std::byte, sizeof(T)> bytes;
+            std::copy(in.begin(), in.end(), bytes.begin());
+            return std::bit_cast<T>(bytes);
+        }
+    }
+
+    // Decodes a message from a frame body of unknown length. Returns nothing if the
+    // body size doesn't match the encoded size of `T`.
+    template <message T>
+    constexpr std::optional<T> decode_body(std::span<const std::byte> body) noexcept
+    {
+        if (body.size() != encoded_size_v<T>)
+        {
+            return std::nullopt;
+        }
+
+        return decode<T>(body.first<encoded_size_v<T>>());
+    }
+
+    // A complete frame (header and body) for a single message, encoded into one
+    // contiguous array so it can be sent with a single call.
+    template <message T>
+    constexpr std::array<std::byte, FRAME_HEADER_SIZE + encoded_size_v<T>> encode_frame(const T& msg) noexcept
+    {
+        std::array<std::byte, FRAME_HEADER_SIZE + encoded_size_v<T>> buf{};
+        const auto header = encode_header({
+            .type = frame_type_of<T>(),
+            .length = static_cast<std::uint32_t>(encoded_size_v<T>)
+        });
+        std::copy(header.begin(), header.end(), buf.begin());
+        encode(msg, std::span{ buf }.template subspan<FRAME_HEADER_SIZE, encoded_size_v<T>>());
+        return buf;
+    }
+
+    // Appends frames into a single contiguous buffer so many small messages can be
+    // flushed to the socket with one send.
+    class frame_writer
+    {
+        std::vector<std::byte> buffer_;
+
+    public:
+        frame_writer() = default;
+
+        explicit frame_writer(const std::size_t reserve)
+        {
+            buffer_.reserve(reserve);
+        }
+
+        template <message T>
+        void write(const T& msg)
+        {
+            const auto frame = encode_frame(msg);
+            buffer_.insert(buffer_.end(), frame.begin(), frame.end());
+        }
+
+        // Batch encode: one frame per message, without intermediate copies.
+        template <message T>
+        void write_batch(std::span<const T> msgs)
+        {
+            constexpr std::size_t frame_size = FRAME_HEADER_SIZE + encoded_size_v<T>;
+            std::size_t offset = buffer_.size();
+            buffer_.resize(offset + msgs.size() * frame_size);
+
+            const auto header = encode_header({
+                .type = frame_type_of<T>(),
+                .length = static_cast<std::uint32_t>(encoded_size_v<T>)
+            });
+            for (const auto& msg : msgs)
+            {
+                std::copy(header.begin(), header.end(), buffer_.begin() + offset);
+                encode(msg, std::span<std::byte, encoded_size_v<T>>{
+                    buffer_.data() + offset + FRAME_HEADER_SIZE,
+                    encoded_size_v<T>
+                });
+                offset += frame_size;
+            }
+        }
+
+        // `bytes` must be at most `UINT32_MAX` bytes; use `write_bytes_chunked` otherwise.
+        void write_bytes(const frame_type type, std::span<const std::byte> bytes)
+        {
+            const auto header = encode_header({
+                .type = type,
+                .length = static_cast<std::uint32_t>(bytes.size())
+            });
+            buffer_.insert(buffer_.end(), header.begin(), header.end());
+            buffer_.insert(buffer_.end(), bytes.begin(), bytes.end());
+        }
+
+        void write_bytes_chunked(const frame_type type, std::span<const std::byte> bytes)
+        {
+            while (!bytes.empty())
+            {
+                const auto chunk = bytes.first(std::min(bytes.size(), MAX_BYTES_FRAME_LENGTH));
+                write_bytes(type, chunk);
+                bytes = bytes.subspan(chunk.size());
+            }
+        }
+
+        // Starts a frame whose body is then written with `append`, `length` bytes in total.
+        void begin_frame(const frame_type type, const std::uint32_t length)
+        {
+            const auto header = encode_header({ .type = type, .length = length });
+            buffer_.insert(buffer_.end(), header.begin(), header.end());
+        }
+
+        void append(std::span<const std::byte> bytes)
+        {
+            buffer_.insert(buffer_.end(), bytes.begin(), bytes.end());
+        }
+
+        std::span<const std::byte> data() const noexcept
+        {
+            return buffer_;
+        }
+
+        // Hands the encoded frames over to the caller and leaves the writer empty.
+        std::vector<std::byte> release() noexcept
+        {
+            return std::exchange(buffer_, {});
+        }
+
+        std::size_t size() const noexcept
+        {
+            return buffer_.size();
+        }
+
+        bool empty() const noexcept
+        {
+            return buffer_.empty();
+        }
+
+        void clear() noexcept
+        {
+            buffer_.clear();
+        }
+    };
+
+    struct frame_view
+    {
+        frame_header header;
+        std::span<const std::byte> body;
+    };
+
+    // Walks the frames of a contiguous buffer (e.g. one produced by `frame_writer`).
+    class frame_reader
+    {
+        std::span<const std::byte> buffer_;
+
+    public:
+        explicit frame_reader(std::span<const std::byte> buffer) noexcept
+            : buffer_{ buffer }
+        {
+        }
+
+        // Returns the next complete frame, or nothing if the buffer is exhausted or the
+        // remaining bytes don't form a complete frame.
+        std::optional<frame_view> next() noexcept
+        {
+            if (buffer_.size() < FRAME_HEADER_SIZE)
+            {
+                return std::nullopt;
+            }
+
+            const auto header = decode_header(buffer_.first<FRAME_HEADER_SIZE>());
+            if (buffer_.size() - FRAME_HEADER_SIZE < header.length)
+            {
+                return std::nullopt;
+            }
+
+            frame_view frame{ header, buffer_.subspan(FRAME_HEADER_SIZE, header.length) };
+            buffer_ = buffer_.subspan(FRAME_HEADER_SIZE + header.length);
+            return frame;
+        }
+
+        std::span<const std::byte> remaining() const noexcept
+        {
+            return buffer_;
+        }
+    };
+}
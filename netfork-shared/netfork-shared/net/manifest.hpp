@@ -0,0 +1,489 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <ostream>
+#include <span>
+#include <vector>
+
+#include <netfork-shared/net/codec.hpp>
+
+namespace netfork::net
+{
+    constexpr const std::uint64_t MANIFEST_PAGE_SIZE = 4096;
+    // The largest encoded manifest either side handles. Even a process with millions of
+    // subregions takes a fraction of this.
+    constexpr const std::size_t MAX_MANIFEST_SIZE = 64 * 1024 * 1024;
+
+    struct manifest_subregion
+    {
+        // Base address of the subregion. Every `base_address` is in range of
+        // `manifest_region::base_address` and `manifest_region::base_address + manifest_region::allocation_size`.
+        std::uint64_t base_address;
+        // Subregion size in bytes.
+        std::uint64_t region_size;
+        // Memory protection flags. See: https://docs.microsoft.com/en-us/windows/win32/memory/memory-protection-constants
+        std::uint32_t protect;
+
+        std::uint64_t end_address() const noexcept
+        {
+            return base_address + region_size;
+        }
+    };
+
+    inline std::ostream& operator<<(std::ostream& os, const manifest_subregion& s)
+    {
+        os << "Base Address: 0x" << std::hex << s.base_address << '\n';
+        os << "Region Size: 0x" << s.region_size << '\n';
+        os << "Protect: 0x" << s.protect << std::dec;
+        return os;
+    }
+
+    struct manifest_region
+    {
+        // Base address of the region (i.e. the allocation base).
+        std::uint64_t base_address;
+        // Size of the region in bytes.
+        std::uint64_t allocation_size;
+        // Memory protection flags the region was allocated with.
+        std::uint32_t protect;
+        // Type of the pages in the region (e.g. `MEM_PRIVATE` or `MEM_MAPPED`).
+        std::uint32_t type;
+        // Subregions of this region are `subregions[first_subregion, first_subregion + subregion_count)`.
+        std::uint32_t first_subregion;
+        std::uint32_t subregion_count;
+
+        std::uint64_t end_address() const noexcept
+        {
+            return base_address + allocation_size;
+        }
+    };
+
+    inline std::ostream& operator<<(std::ostream& os, const manifest_region& r)
+    {
+        os << "Base Address: 0x" << std::hex << r.base_address << '\n';
+        os << "Protect: 0x" << r.protect << '\n';
+        os << "Type: 0x" << r.type << '\n';
+        os << "Allocation Size: 0x" << r.allocation_size << '\n';
+        os << "Subregion Count: 0x" << r.subregion_count << std::dec;
+        return os;
+    }
+
+    // Shape of a captured address space, sent once before any payload so the receiver can
+    // plan every reservation and commit up front.
+    //
+    // Regions are in ascending address order and don't overlap; the subregions of a region
+    // are contiguous and in ascending order. All addresses and sizes are page-aligned.
+    struct address_space_manifest
+    {
+        std::vector<manifest_region> regions;
+        std::vector<manifest_subregion> subregions;
+
+        void add_region(const std::uint64_t base_address, const std::uint32_t protect, const std::uint32_t type)
+        {
+            regions.push_back({
+                .base_address = base_address,
+                .allocation_size = 0,
+                .protect = protect,
+                .type = type,
+                .first_subregion = static_cast<std::uint32_t>(subregions.size()),
+                .subregion_count = 0
+            });
+        }
+
+        // Appends a subregion to the most recently added region.
+        void add_subregion(
+            const std::uint64_t base_address,
+            const std::uint64_t region_size,
+            const std::uint32_t protect)
+        {
+            auto& region = regions.back();
+            subregions.push_back({ base_address, region_size, protect });
+            region.subregion_count++;
+            region.allocation_size = base_address + region_size - region.base_address;
+        }
+
+        std::span<const manifest_subregion> subregions_of(const manifest_region& region) const noexcept
+        {
+            return std::span{ subregions }.subspan(region.first_subregion, region.subregion_count);
+        }
+
+        // Finds the subregion containing `address`, if any.
+        const manifest_subregion* find_subregion(const std::uint64_t address) const noexcept
+        {
+            auto it = std::upper_bound(
+                subregions.begin(),
+                subregions.end(),
+                address,
+                [](const std::uint64_t addr, const manifest_subregion& s)
+                {
+                    return addr < s.base_address;
+                });
+            if (it == subregions.begin())
+            {
+                return nullptr;
+            }
+
+            --it;
+            return address < it->end_address() ? &*it : nullptr;
+        }
+
+        // Finds the region of this manifest which is laid out exactly like `region` of
+        // `other`: same base, size, type and protection, and the same subregions.
+        const manifest_region* find_same_region(
+            const address_space_manifest& other,
+            const manifest_region& region) const noexcept
+        {
+            const auto it = std::lower_bound(
+                regions.begin(),
+                regions.end(),
+                region.base_address,
+                [](const manifest_region& r, const std::uint64_t addr)
+                {
+                    return r.base_address < addr;
+                });
+            if (it == regions.end()
+                || it->base_address != region.base_address
+                || it->allocation_size != region.allocation_size
+                || it->type != region.type
+                || it->protect != region.protect
+                || it->subregion_count != region.subregion_count)
+            {
+                return nullptr;
+            }
+
+            const auto ours = subregions_of(*it);
+            const auto theirs = other.subregions_of(region);
+            for (std::size_t i = 0; i < ours.size(); i++)
+            {
+                if (ours[i].base_address != theirs[i].base_address
+                    || ours[i].region_size != theirs[i].region_size
+                    || ours[i].protect != theirs[i].protect)
+                {
+                    return nullptr;
+                }
+            }
+
+            return &*it;
+        }
+
+        std::uint64_t total_size() const noexcept
+        {
+            std::uint64_t size = 0;
+            for (const auto& region : regions)
+            {
+                size += region.allocation_size;
+            }
+
+            return size;
+        }
+    };
+
+    namespace detail
+    {
+        template <typename Range, typename Projection>
+        void write_runs(std::vector<std::byte>& out, const Range& range, Projection proj)
+        {
+            for (std::size_t i = 0; i < range.size();)
+            {
+                const std::uint32_t value = proj(range[i]);
+                std::size_t run = 1;
+                while (i + run < range.size() && proj(range[i + run]) == value)
+                {
+                    run++;
+                }
+
+                codec::write_varint(out, value);
+                codec::write_varint(out, run);
+                i += run;
+            }
+        }
+
+        template <typename Range, typename Assign>
+        bool read_runs(std::span<const std::byte>& in, Range& range, Assign assign)
+        {
+            for (std::size_t i = 0; i < range.size();)
+            {
+                const auto value = codec::read_varint(in);
+                const auto run = codec::read_varint(in);
+                if (!value || !run || *value > std::numeric_limits<std::uint32_t>::max()
+                    || *run == 0 || *run > range.size() - i)
+                {
+                    return false;
+                }
+
+                for (std::uint64_t j = 0; j < *run; j++, i++)
+                {
+                    assign(range[i], static_cast<std::uint32_t>(*value));
+                }
+            }
+
+            return true;
+        }
+
+        // `address` moved on by `pages` pages, or nothing if that's past the end of the
+        // address space.
+        constexpr std::optional<std::uint64_t> advance_pages(const std::uint64_t address, const std::uint64_t pages) noexcept
+        {
+            if (pages > (std::numeric_limits<std::uint64_t>::max() - address) / MANIFEST_PAGE_SIZE)
+            {
+                return std::nullopt;
+            }
+
+            return address + pages * MANIFEST_PAGE_SIZE;
+        }
+    }
+
+    // Wire layout (all integers are varints):
+    //
+    //   region count, subregion count
+    //   per region:
+    //     pages between the end of the previous region and this region's base
+    //     allocation protect
+    //     subregion count
+    //     per subregion: pages between the end of the previous subregion and its base
+    //                    (almost always 0), size in pages
+    //   protections of all subregions as (protect, run length) pairs
+    //   types of all regions as (type, run length) pairs
+    //
+    // Deltas and page counts keep most descriptors to a few bytes, and neighbouring
+    // (sub)regions share protections and types often enough that run-length encoding
+    // pays for itself.
+    inline std::vector<std::byte> encode_manifest(const address_space_manifest& manifest)
+    {
+        std::vector<std::byte> out;
+        out.reserve(16 + manifest.regions.size() * 4 + manifest.subregions.size() * 3);
+
+        codec::write_varint(out, manifest.regions.size());
+        codec::write_varint(out, manifest.subregions.size());
+
+        std::uint64_t previous_region_end = 0;
+        for (const auto& region : manifest.regions)
+        {
+            codec::write_varint(out, (region.base_address - previous_region_end) / MANIFEST_PAGE_SIZE);
+            codec::write_varint(out, region.protect);
+            codec::write_varint(out, region.subregion_count);
+
+            std::uint64_t previous_subregion_end = region.base_address;
+            for (const auto& subregion : manifest.subregions_of(region))
+            {
+                codec::write_varint(out, (subregion.base_address - previous_subregion_end) / MANIFEST_PAGE_SIZE);
+                codec::write_varint(out, subregion.region_size / MANIFEST_PAGE_SIZE);
+                previous_subregion_end = subregion.end_address();
+            }
+
+            previous_region_end = region.end_address();
+        }
+
+        detail::write_runs(out, manifest.subregions, [](const manifest_subregion& s) { return s.protect; });
+        detail::write_runs(out, manifest.regions, [](const manifest_region& r) { return r.type; });
+
+        return out;
+    }
+
+    // Returns nothing unless `in` is exactly one well-formed manifest. Every address is
+    // decoded as an unsigned distance from the end of what came before it, so once none of
+    // them overflow, regions and subregions are in ascending order and don't overlap, as
+    // `find_subregion` relies on. Every region has at least one subregion and every
+    // subregion at least one page.
+    inline std::optional<address_space_manifest> decode_manifest(std::span<const std::byte> in)
+    {
+        const auto region_count = codec::read_varint(in);
+        const auto subregion_count = codec::read_varint(in);
+        // Every descriptor takes at least one byte on the wire, which bounds the counts
+        // before anything gets allocated.
+        if (!region_count || !subregion_count
+            || *region_count > in.size() || *subregion_count > in.size())
+        {
+            return std::nullopt;
+        }
+
+        address_space_manifest manifest;
+        manifest.regions.reserve(*region_count);
+        manifest.subregions.reserve(*subregion_count);
+
+        std::uint64_t previous_region_end = 0;
+        for (std::uint64_t r = 0; r < *region_count; r++)
+        {
+            const auto delta_pages = codec::read_varint(in);
+            const auto protect = codec::read_varint(in);
+            const auto count = codec::read_varint(in);
+            if (!delta_pages || !protect || !count
+                || *protect > std::numeric_limits<std::uint32_t>::max()
+                || *count == 0
+                || *count > *subregion_count - manifest.subregions.size())
+            {
+                return std::nullopt;
+            }
+
+            const auto base_address = detail::advance_pages(previous_region_end, *delta_pages);
+            if (!base_address)
+            {
+                return std::nullopt;
+            }
+
+            manifest.add_region(base_address.value(), static_cast<std::uint32_t>(*protect), 0);
+
+            std::uint64_t previous_subregion_end = base_address.value();
+            for (std::uint64_t s = 0; s < *count; s++)
+            {
+                const auto gap_pages = codec::read_varint(in);
+                const auto size_pages = codec::read_varint(in);
+                if (!gap_pages || !size_pages || *size_pages == 0)
+                {
+                    return std::nullopt;
+                }
+
+                const auto subregion_base = detail::advance_pages(previous_subregion_end, *gap_pages);
+                const auto subregion_end = subregion_base
+                    ? detail::advance_pages(subregion_base.value(), *size_pages)
+                    : std::nullopt;
+                if (!subregion_end)
+                {
+                    return std::nullopt;
+                }
+
+                manifest.add_subregion(subregion_base.value(), subregion_end.value() - subregion_base.value(), 0);
+                previous_subregion_end = subregion_end.value();
+            }
+
+            previous_region_end = manifest.regions.back().end_address();
+        }
+
+        if (manifest.subregions.size() != *subregion_count)
+        {
+            return std::nullopt;
+        }
+
+        if (!detail::read_runs(in, manifest.subregions,
+                [](manifest_subregion& s, const std::uint32_t protect) { s.protect = protect; })
+            || !detail::read_runs(in, manifest.regions,
+                [](manifest_region& r, const std::uint32_t type) { r.type = type; }))
+        {
+            return std::nullopt;
+        }
+
+        if (!in.empty())
+        {
+            return std::nullopt;
+        }
+
+        return manifest;
+    }
+
+    // A manifest goes out as `encode_manifest` has it, prefixed with its size as a u32 and
+    // split over as many consecutive `manifest` frames as it takes, so a receiver knows
+    // where it ends before it has all of it. Returns false, writing nothing, if the manifest
+    // is larger than `MAX_MANIFEST_SIZE`.
+    inline bool write_manifest(codec::frame_writer& out, const address_space_manifest& manifest)
+    {
+        const auto encoded = encode_manifest(manifest);
+        if (encoded.size() > MAX_MANIFEST_SIZE)
+        {
+            return false;
+        }
+
+        std::vector<std::byte> prefixed(sizeof(std::uint32_t) + encoded.size());
+        codec::store_le(prefixed.data(), static_cast<std::uint32_t>(encoded.size()));
+        std::copy(encoded.begin(), encoded.end(), prefixed.begin() + sizeof(std::uint32_t));
+        out.write_bytes_chunked(codec::frame_type::manifest, prefixed);
+        return true;
+    }
+
+    // Puts a manifest back together from the bodies of the `manifest` frames `write_manifest`
+    // split it over, one frame at a time.
+    class manifest_assembler
+    {
+        std::vector<std::byte> encoded_;
+        std::size_t expected_size_ = 0;
+        bool started_ = false;
+
+    public:
+        enum class status
+        {
+            // More frames of the manifest are to come.
+            incomplete,
+            // The manifest is ready to `take`.
+            complete,
+            // The frames don't make up a manifest; the assembler is of no more use.
+            malformed
+        };
+
+        // Whether the next frame may have a body of `length` bytes. Meant to be asked before
+        // the body is received, so a bogus length is never allocated for.
+        bool accepts(const std::size_t length) const noexcept
+        {
+            if (length > codec::MAX_BYTES_FRAME_LENGTH)
+            {
+                return false;
+            }
+
+            return started_
+                ? length != 0 && length <= expected_size_ - encoded_.size()
+                : length >= sizeof(std::uint32_t) && length - sizeof(std::uint32_t) <= MAX_MANIFEST_SIZE;
+        }
+
+        status add(std::span<const std::byte> body)
+        {
+            if (!accepts(body.size()))
+            {
+                return status::malformed;
+            }
+
+            if (!started_)
+            {
+                expected_size_ = codec::load_le<std::uint32_t>(body.data());
+                body = body.subspan(sizeof(std::uint32_t));
+                if (expected_size_ > MAX_MANIFEST_SIZE || body.size() > expected_size_)
+                {
+                    return status::malformed;
+                }
+
+                started_ = true;
+                encoded_.reserve(expected_size_);
+            }
+
+            encoded_.insert(encoded_.end(), body.begin(), body.end());
+            return encoded_.size() == expected_size_ ? status::complete : status::incomplete;
+        }
+
+        // Decodes the manifest once `add` has reported it complete, and readies the assembler
+        // for the next one.
+        std::optional<address_space_manifest> take()
+        {
+            auto manifest = started_ && encoded_.size() == expected_size_
+                ? decode_manifest(encoded_)
+                : std::nullopt;
+            encoded_.clear();
+            expected_size_ = 0;
+            started_ = false;
+            return manifest;
+        }
+
+        // Bytes of the encoded manifest received so far.
+        std::size_t size() const noexcept
+        {
+            return encoded_.size();
+        }
+    };
+}
@@ -17,53 +17,214 @@
 
 #pragma once
 
-#include <ostream>
-#include <span>
-#include <variant>
+#include <cstdint>
+#include <tuple>
 
+#include <netfork-shared/net/codec.hpp>
 #include <netfork-shared/phnt_stub.hpp>
 
 namespace netfork::net::msg
 {
-	struct region_info
+	struct image_info
 	{
-		// Base address of the region.
-		LPVOID base_address;
-		// Memory protection flags. See: https://docs.microsoft.com/en-us/windows/win32/memory/memory-protection-constants
-		DWORD protect;
-		// Size of the region in bytes.
-		SIZE_T allocation_size;
-		// Number of subregions (`subregion_info` structures) in region.
-		SIZE_T subregion_info_size;
+		// Size of the main module's image in bytes (`SizeOfImage`).
+		DWORD size_of_image;
+		// Hash of every read-only page of the image, in address order (see `image_hash.hpp`).
+		// Together with `PEB::ImageBaseAddress` and `size_of_image` it identifies a prepared
+		// image on the server; writable pages are left out since they differ from one fork
+		// to the next. A server which has to be sent the image checks it against the pages.
+		std::uint64_t read_only_hash_low;
+		std::uint64_t read_only_hash_high;
 	};
 
-	std::ostream& operator<<(std::ostream& os, const region_info& r)
+	struct image_cache_status
 	{
-		os << "Base Address: 0x" << std::hex << r.base_address << '\n';
-		os << "Protect: 0x" << r.protect << '\n';
-		os << "Allocation Size: 0x" << r.allocation_size << '\n';
-		os << "Subregion Info Size: 0x" << r.subregion_info_size << std::dec;
-		return os;
-	}
+		// Non-zero if the server has the image cached. The client then sends only the
+		// writable parts of the image as `page_data` frames ending with `end_of_stream`;
+		// otherwise it sends the image's manifest, which lays out its subregions, and then
+		// the whole image as `image_bytes` frames.
+		std::uint8_t hit;
+	};
+
+	struct fork_mode
+	{
+		// Non-zero for a post-copy fork. Only a small hot set is sent before the forked
+		// process starts; the server fetches anything else it touches with `page_request`
+		// while the client pushes the rest in the background.
+		std::uint8_t post_copy;
+		// Non-zero for continuous replication. The client keeps sending epochs, each one
+		// ending with the `thread_context` it was captured with, and the server keeps the
+		// last complete one as a standby (see `replica.hpp` in the server).
+		std::uint8_t replicate;
+		// Roughly how much memory the forked process will commit on the server: every
+		// committed page of the client outside its images.
+		std::uint64_t committed_size;
+		// One of `fork_priority`. The server admits forks within a memory budget and lets
+		// interactive ones ahead of bulk ones.
+		std::uint8_t priority;
+		// Non-zero to have the server keep a snapshot of the fork once it's rebuilt, from
+		// which more children can be spawned without the client. Plain forks only.
+		std::uint8_t snapshot;
+		// Non-zero to have the server pass the fork on to the servers downstream of it while
+		// it receives it, if it has any. Plain and pre-copy forks without deduplication only.
+		std::uint8_t relay;
+		// How many more connections the client opens to stripe the payload over alongside
+		// this one, at most `MAX_STRIPES`. Plain forks without deduplication or relaying only.
+		std::uint8_t stripes;
+		// Where in the child the server writes `rank` (8 bytes) before the child starts, or 0
+		// for nowhere. `fork_many` gives each of its servers the child's index this way,
+		// so the payload is the same for all of them. Plain forks only.
+		std::uint64_t rank_address;
+		std::uint64_t rank;
+	};
+
+	constexpr const std::uint8_t MAX_STRIPES = 15;
+
+	enum class fork_priority : std::uint8_t
+	{
+		// Small, latency-sensitive forks.
+		interactive = 0,
+		// Large forks which may wait for memory, and never take all of it.
+		bulk = 1
+	};
+
+	// The server's reply to `fork_mode`. It's held back while the fork is queued for memory.
+	struct admission
+	{
+		// Non-zero if the fork goes ahead. Otherwise the server closes the connection; the
+		// fork can never fit or too many forks are queued already.
+		std::uint8_t admitted;
+		// For a fork with `stripes`, what its other connections present to join it.
+		std::uint64_t stripe_token;
+	};
+
+	// The first message on each of the other connections of a striped fork, instead of a
+	// `thread_context`. The connection then carries part of the payload, like the fork's own
+	// connection does after its manifest, in no particular order with the rest.
+	struct stripe_attach
+	{
+		std::uint64_t token;
+		// Which of the fork's `stripes` this is, from 0.
+		std::uint8_t index;
+	};
 
-	struct subregion_info
+	// The server's reply once a replication epoch has been applied to the standby.
+	struct replication_ack
 	{
-		// Base address of the subregion. Every `base_address` is in range of
-		// `region_info::base_address` and `region_info::base_address + region_info::allocation_size`.
-		LPVOID base_address;
-		// Subregion size in bytes.
-		SIZE_T region_size;
-		// Memory protection flags. See: https://docs.microsoft.com/en-us/windows/win32/memory/memory-protection-constants
-		DWORD protect;
+		// Epochs committed so far, this one included.
+		std::uint64_t epoch;
 	};
 
-	std::ostream& operator<<(std::ostream& os, const subregion_info& s)
+	// Asks for `page_count` pages starting at `address`. The client answers with one
+	// `page_data` frame covering exactly that run, even if every page is zero.
+	struct page_request
 	{
-		os << "Base Address: 0x" << std::hex << s.base_address << '\n';
-		os << "Region Size: 0x" << s.region_size << '\n';
-		os << "Protect: 0x" << s.protect << std::dec;
-		return os;
+		std::uint64_t address;
+		std::uint32_t page_count;
+	};
+
+	// Whether the bytes of a (sub)region with the given protection are sent over the wire.
+	// Reserved memory has no protection, and no-access/guard pages can't be read.
+	constexpr bool has_payload(const DWORD protect) noexcept
+	{
+		return protect != 0 && !(protect & (PAGE_NOACCESS | PAGE_GUARD));
 	}
 
-	using message_type = std::variant<net::msg::region_info, net::msg::subregion_info, std::span<char>>;
+	constexpr bool is_writable(const DWORD protect) noexcept
+	{
+		return (protect & (PAGE_READWRITE | PAGE_WRITECOPY | PAGE_EXECUTE_READWRITE | PAGE_EXECUTE_WRITECOPY)) != 0;
+	}
+}
+
+namespace netfork::net::codec
+{
+	template <>
+	struct message_traits<msg::image_info>
+	{
+		static constexpr frame_type type = frame_type::image_info;
+		static constexpr auto fields = std::make_tuple(
+			&msg::image_info::size_of_image,
+			&msg::image_info::read_only_hash_low,
+			&msg::image_info::read_only_hash_high
+		);
+	};
+
+	template <>
+	struct message_traits<msg::image_cache_status>
+	{
+		static constexpr frame_type type = frame_type::image_cache_status;
+		static constexpr auto fields = std::make_tuple(&msg::image_cache_status::hit);
+	};
+
+	template <>
+	struct message_traits<msg::fork_mode>
+	{
+		static constexpr frame_type type = frame_type::fork_mode;
+		static constexpr auto fields = std::make_tuple(
+			&msg::fork_mode::post_copy,
+			&msg::fork_mode::replicate,
+			&msg::fork_mode::committed_size,
+			&msg::fork_mode::priority,
+			&msg::fork_mode::snapshot,
+			&msg::fork_mode::relay,
+			&msg::fork_mode::stripes,
+			&msg::fork_mode::rank_address,
+			&msg::fork_mode::rank
+		);
+	};
+
+	template <>
+	struct message_traits<msg::admission>
+	{
+		static constexpr frame_type type = frame_type::admission;
+		static constexpr auto fields = std::make_tuple(
+			&msg::admission::admitted,
+			&msg::admission::stripe_token
+		);
+	};
+
+	template <>
+	struct message_traits<msg::stripe_attach>
+	{
+		static constexpr frame_type type = frame_type::stripe_attach;
+		static constexpr auto fields = std::make_tuple(
+			&msg::stripe_attach::token,
+			&msg::stripe_attach::index
+		);
+	};
+
+	template <>
+	struct message_traits<msg::replication_ack>
+	{
+		static constexpr frame_type type = frame_type::replication_ack;
+		static constexpr auto fields = std::make_tuple(&msg::replication_ack::epoch);
+	};
+
+	template <>
+	struct message_traits<msg::page_request>
+	{
+		static constexpr frame_type type = frame_type::page_request;
+		static constexpr auto fields = std::make_tuple(
+			&msg::page_request::address,
+			&msg::page_request::page_count
+		);
+	};
+
+	template <>
+	struct opaque_traits<CONTEXT>
+	{
+		static constexpr frame_type type = frame_type::thread_context;
+	};
+
+	template <>
+	struct opaque_traits<PEB>
+	{
+		static constexpr frame_type type = frame_type::peb;
+	};
+
+	template <>
+	struct opaque_traits<TEB>
+	{
+		static constexpr frame_type type = frame_type::teb;
+	};
 }
@@ -0,0 +1,271 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include <netfork-shared/net/codec.hpp>
+#include <netfork-shared/net/manifest.hpp>
+#include <netfork-shared/page_hash.hpp>
+
+namespace netfork::net
+{
+    constexpr const std::uint32_t MAX_PAGES_PER_FRAME =
+        static_cast<std::uint32_t>(codec::MAX_BYTES_FRAME_LENGTH / MANIFEST_PAGE_SIZE);
+    constexpr const std::size_t PAGE_BITMAP_WORDS = (MAX_PAGES_PER_FRAME + 63) / 64;
+    // Size of the address and page count that start every `page_data` body.
+    constexpr const std::size_t PAGE_RUN_FIXED_SIZE = sizeof(std::uint64_t) + sizeof(std::uint32_t);
+
+    // Describes the body of a `page_data` frame:
+    //
+    //   u64 address | u32 page count | ceil(page count / 64) u64 bitmap words | present pages
+    //
+    // A set bit means the page's bytes follow, in page order. A clear bit means the page
+    // isn't sent; for a fresh commit that means it stays zero-filled.
+    struct page_run
+    {
+        std::uint64_t address = 0;
+        std::uint32_t page_count = 0;
+        std::array<std::uint64_t, PAGE_BITMAP_WORDS> present{};
+
+        bool is_present(const std::uint32_t page) const noexcept
+        {
+            return (present[page / 64] >> (page % 64)) & 1;
+        }
+
+        void set_present(const std::uint32_t page) noexcept
+        {
+            present[page / 64] |= std::uint64_t{ 1 } << (page % 64);
+        }
+
+        std::uint32_t present_count() const noexcept
+        {
+            std::uint32_t count = 0;
+            for (const auto word : present)
+            {
+                count += static_cast<std::uint32_t>(std::popcount(word));
+            }
+
+            return count;
+        }
+
+        std::size_t bitmap_words() const noexcept
+        {
+            return (page_count + 63) / 64;
+        }
+
+        std::size_t prefix_size() const noexcept
+        {
+            return PAGE_RUN_FIXED_SIZE + bitmap_words() * sizeof(std::uint64_t);
+        }
+
+        // Size of the whole frame body, including the present pages.
+        std::size_t body_size() const noexcept
+        {
+            return prefix_size() + present_count() * MANIFEST_PAGE_SIZE;
+        }
+
+        // Calls `fn(first_page, page_count)` for every run of consecutive present pages.
+        template <typename Fn>
+        void for_each_present_run(Fn&& fn) const
+        {
+            std::uint32_t page = 0;
+            while (page < page_count)
+            {
+                if (!is_present(page))
+                {
+                    page++;
+                    continue;
+                }
+
+                const std::uint32_t first = page;
+                while (page < page_count && is_present(page))
+                {
+                    page++;
+                }
+
+                fn(first, page - first);
+            }
+        }
+    };
+
+    // Writes the address, page count and bitmap of `run` into `out`, which must be at
+    // least `run.prefix_size()` bytes.
+    inline void encode_page_run_prefix(const page_run& run, std::span<std::byte> out) noexcept
+    {
+        codec::store_le(out.data(), run.address);
+        codec::store_le(out.data() + sizeof(std::uint64_t), run.page_count);
+        for (std::size_t i = 0; i < run.bitmap_words(); i++)
+        {
+            codec::store_le(out.data() + PAGE_RUN_FIXED_SIZE + i * sizeof(std::uint64_t), run.present[i]);
+        }
+    }
+
+    // Appends one `page_data` frame for `run` to `writer`. `pages` holds the bytes of every
+    // page in the run, but only the pages marked present are written.
+    inline void write_page_run(codec::frame_writer& writer, const page_run& run, std::span<const std::byte> pages)
+    {
+        std::array<std::byte, PAGE_RUN_FIXED_SIZE + PAGE_BITMAP_WORDS * sizeof(std::uint64_t)> prefix{};
+        encode_page_run_prefix(run, prefix);
+
+        writer.begin_frame(codec::frame_type::page_data, static_cast<std::uint32_t>(run.body_size()));
+        writer.append(std::span{ prefix }.first(run.prefix_size()));
+        run.for_each_present_run([&](const std::uint32_t first_page, const std::uint32_t page_count)
+        {
+            writer.append(pages.subspan(first_page * MANIFEST_PAGE_SIZE, page_count * MANIFEST_PAGE_SIZE));
+        });
+    }
+
+    // Decodes the fixed part of a `page_data` body. The bitmap is read separately with
+    // `decode_page_run_bitmap` once its length is known.
+    inline std::optional<page_run> decode_page_run_fixed(std::span<const std::byte, PAGE_RUN_FIXED_SIZE> in) noexcept
+    {
+        page_run run;
+        run.address = codec::load_le<std::uint64_t>(in.data());
+        run.page_count = codec::load_le<std::uint32_t>(in.data() + sizeof(std::uint64_t));
+        if (run.page_count == 0 || run.page_count > MAX_PAGES_PER_FRAME
+            || run.address % MANIFEST_PAGE_SIZE != 0)
+        {
+            return std::nullopt;
+        }
+
+        return run;
+    }
+
+    inline void decode_page_run_bitmap(page_run& run, std::span<const std::byte> in) noexcept
+    {
+        for (std::size_t i = 0; i < run.bitmap_words() && (i + 1) * sizeof(std::uint64_t) <= in.size(); i++)
+        {
+            run.present[i] = codec::load_le<std::uint64_t>(in.data() + i * sizeof(std::uint64_t));
+        }
+
+        // Ignore any bits past the end of the run.
+        if (const auto tail = run.page_count % 64; tail != 0)
+        {
+            run.present[run.bitmap_words() - 1] &= (std::uint64_t{ 1 } << tail) - 1;
+        }
+    }
+
+    // Decodes the address, page count and bitmap at the start of a body already in memory.
+    inline std::optional<page_run> decode_page_run_prefix(std::span<const std::byte> body) noexcept
+    {
+        if (body.size() < PAGE_RUN_FIXED_SIZE)
+        {
+            return std::nullopt;
+        }
+
+        auto run = decode_page_run_fixed(body.first<PAGE_RUN_FIXED_SIZE>());
+        if (!run || body.size() < run->prefix_size())
+        {
+            return std::nullopt;
+        }
+
+        decode_page_run_bitmap(*run, body.subspan(PAGE_RUN_FIXED_SIZE, run->prefix_size() - PAGE_RUN_FIXED_SIZE));
+        return run;
+    }
+
+    // Decodes a whole `page_data` body already in memory. The present pages follow the
+    // returned run's `prefix_size()` bytes into `body`.
+    inline std::optional<page_run> decode_page_run(std::span<const std::byte> body) noexcept
+    {
+        auto run = decode_page_run_prefix(body);
+        if (!run || body.size() != run->body_size())
+        {
+            return std::nullopt;
+        }
+
+        return run;
+    }
+
+    // A `page_hashes` body is laid out like a `page_data` body, except that every present
+    // page is replaced by its 16-byte hash (low then high half):
+    //
+    //   u64 address | u32 page count | bitmap words | hashes of present pages
+    inline std::size_t page_hashes_body_size(const page_run& run) noexcept
+    {
+        return run.prefix_size() + run.present_count() * PAGE_HASH_SIZE;
+    }
+
+    // Appends one `page_hashes` frame to `writer`, with one hash per present page of `run`.
+    inline void write_page_hashes(codec::frame_writer& writer, const page_run& run, std::span<const page_hash> hashes)
+    {
+        std::array<std::byte, PAGE_RUN_FIXED_SIZE + PAGE_BITMAP_WORDS * sizeof(std::uint64_t)> prefix{};
+        encode_page_run_prefix(run, prefix);
+
+        writer.begin_frame(codec::frame_type::page_hashes, static_cast<std::uint32_t>(page_hashes_body_size(run)));
+        writer.append(std::span{ prefix }.first(run.prefix_size()));
+        for (const auto& hash : hashes)
+        {
+            std::array<std::byte, PAGE_HASH_SIZE> encoded{};
+            codec::store_le(encoded.data(), hash.low);
+            codec::store_le(encoded.data() + sizeof(std::uint64_t), hash.high);
+            writer.append(encoded);
+        }
+    }
+
+    // Decodes a whole `page_hashes` body; the hashes follow the run's `prefix_size()` bytes
+    // into `body` and are read with `read_page_hash`.
+    inline std::optional<page_run> decode_page_hashes(std::span<const std::byte> body) noexcept
+    {
+        auto run = decode_page_run_prefix(body);
+        if (!run || body.size() != page_hashes_body_size(*run))
+        {
+            return std::nullopt;
+        }
+
+        return run;
+    }
+
+    inline page_hash read_page_hash(std::span<const std::byte> hashes, const std::size_t index) noexcept
+    {
+        const std::byte* in = hashes.data() + index * PAGE_HASH_SIZE;
+        return {
+            .low = codec::load_le<std::uint64_t>(in),
+            .high = codec::load_le<std::uint64_t>(in + sizeof(std::uint64_t))
+        };
+    }
+
+    // The `missing_pages` reply is a plain bitmap of little-endian u64 words.
+    inline std::vector<std::byte> encode_bitmap(std::span<const std::uint64_t> words)
+    {
+        std::vector<std::byte> out(words.size() * sizeof(std::uint64_t));
+        for (std::size_t i = 0; i < words.size(); i++)
+        {
+            codec::store_le(out.data() + i * sizeof(std::uint64_t), words[i]);
+        }
+
+        return out;
+    }
+
+    inline std::vector<std::uint64_t> decode_bitmap(std::span<const std::byte> in)
+    {
+        std::vector<std::uint64_t> words(in.size() / sizeof(std::uint64_t));
+        for (std::size_t i = 0; i < words.size(); i++)
+        {
+            words[i] = codec::load_le<std::uint64_t>(in.data() + i * sizeof(std::uint64_t));
+        }
+
+        return words;
+    }
+}
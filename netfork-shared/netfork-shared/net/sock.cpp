@@ -68,7 +68,31 @@ namespace netfork::net
         return sock;
     }
 
-    SOCKET accept_single_client(PCSTR port)
+    SOCKET connect_to_peer(SOCKET sock)
+    {
+        sockaddr_storage peer{};
+        int peer_size = sizeof(peer);
+        if (::getpeername(sock, reinterpret_cast<sockaddr*>(&peer), &peer_size) == SOCKET_ERROR)
+        {
+            return INVALID_SOCKET;
+        }
+
+        SOCKET peer_sock = ::socket(peer.ss_family, SOCK_STREAM, IPPROTO_TCP);
+        if (peer_sock == INVALID_SOCKET)
+        {
+            return peer_sock;
+        }
+
+        if (::connect(peer_sock, reinterpret_cast<const sockaddr*>(&peer), peer_size) == SOCKET_ERROR)
+        {
+            ::closesocket(peer_sock);
+            return INVALID_SOCKET;
+        }
+
+        return peer_sock;
+    }
+
+    SOCKET listen_on(PCSTR port, PCSTR address)
     {
         const addrinfo hints{
             .ai_flags = AI_PASSIVE,
@@ -78,7 +102,7 @@ namespace netfork::net
         };
         addrinfo* result = nullptr;
 
-        if (::getaddrinfo(nullptr, port, &hints, &result) != 0)
+        if (::getaddrinfo(address, port, &hints, &result) != 0)
         {
             return INVALID_SOCKET;
         }
@@ -95,19 +119,27 @@ namespace netfork::net
             return INVALID_SOCKET;
         }
 
-        AT_SCOPE_EXIT(::closesocket(listen_sock));
-
         if (::bind(listen_sock, result->ai_addr,
-                static_cast<int>(result->ai_addrlen)) == SOCKET_ERROR)
+                static_cast<int>(result->ai_addrlen)) == SOCKET_ERROR
+            || ::listen(listen_sock, SOMAXCONN) == SOCKET_ERROR)
         {
+            ::closesocket(listen_sock);
             return INVALID_SOCKET;
         }
 
-        if (::listen(listen_sock, SOMAXCONN) == SOCKET_ERROR)
+        return listen_sock;
+    }
+
+    SOCKET accept_single_client(PCSTR port)
+    {
+        SOCKET listen_sock = listen_on(port);
+        if (listen_sock == INVALID_SOCKET)
         {
             return INVALID_SOCKET;
         }
 
+        AT_SCOPE_EXIT(::closesocket(listen_sock));
+
         return ::accept(listen_sock, nullptr, nullptr);
     }
 }
@@ -17,8 +17,8 @@
 
 #pragma once
 
+#include <algorithm>
 #include <array>
-#include <bit>
 #include <cstdint>
 #include <expected>
 #include <span>
@@ -26,11 +26,21 @@
 #include <winsock2.h>
 
 #include <netfork-shared/log.hpp>
+#include <netfork-shared/net/codec.hpp>
+#include <netfork-shared/net/manifest.hpp>
+#include <netfork-shared/net/page_data.hpp>
 #include <netfork-shared/phnt_stub.hpp>
 
 namespace netfork::net
 {
     constexpr const HRESULT INCOMPLETE_RECV_DATA = 0xA0000001;
+    // The peer sent a frame other than the one expected, or one with a malformed length.
+    constexpr const HRESULT UNEXPECTED_FRAME = 0xA0000002;
+    constexpr const HRESULT PROTOCOL_VERSION_MISMATCH = 0xA0000003;
+    // The server turned the fork down for lack of memory (see `msg::admission`).
+    constexpr const HRESULT FORK_REJECTED = 0xA0000006;
+    // A manifest which doesn't decode, or one larger than `MAX_MANIFEST_SIZE`.
+    constexpr const HRESULT MALFORMED_MANIFEST = 0xA0000009;
 
     inline BOOL winsock_init()
     {
@@ -39,7 +49,12 @@ namespace netfork::net
     }
 
     SOCKET connect_to_server(PCSTR address, PCSTR port);
-    // TODO: accept multiple clients
+    // Opens another connection to whatever `sock` is connected to.
+    SOCKET connect_to_peer(SOCKET sock);
+    // Returns a socket listening on `port` on `address`, or on every interface if it's null.
+    // Any number of threads may block in `accept` on it at once; each connection goes to
+    // exactly one of them.
+    SOCKET listen_on(PCSTR port, PCSTR address = nullptr);
     SOCKET accept_single_client(PCSTR port);
 
     template <typename T, std::size_t N>
@@ -77,19 +92,6 @@ namespace netfork::net
         return total_size == offset ? ERROR_SUCCESS : INCOMPLETE_RECV_DATA;
     }
 
-    template <typename T>
-    std::expected<T, HRESULT> recv_as(SOCKET sock)
-    {
-        alignas(alignof(T)) char buf[sizeof(T)] = { 0 };
-
-        if (FAILED(recv_bytes(sock, std::span{ buf })))
-        {
-            return std::unexpected{ HRESULT_FROM_WIN32(::WSAGetLastError()) };
-        }
-
-        return std::bit_cast<T>(buf);
-    }
-
     template <std::size_t N>
     HRESULT send_bytes(SOCKET sock, std::span<const std::byte, N> buf)
     {
@@ -117,10 +119,188 @@ namespace netfork::net
         return ERROR_SUCCESS;
     }
 
-    template <typename T>
-    HRESULT send_as(SOCKET sock, const T& t)
+    inline std::expected<codec::frame_header, HRESULT> recv_header(SOCKET sock)
+    {
+        std::array<std::byte, codec::FRAME_HEADER_SIZE> buf{};
+        if (const auto result = recv_bytes(sock, std::span{ buf }); FAILED(result))
+        {
+            return std::unexpected{ result };
+        }
+
+        const auto header = codec::decode_header(buf);
+        if (!codec::is_current_version(header))
+        {
+            LOG_DEBUG_ERR() << "Protocol version mismatch; expected " << codec::PROTOCOL_VERSION
+                << " but got " << header.version << std::endl;
+            return std::unexpected{ PROTOCOL_VERSION_MISMATCH };
+        }
+
+        return header;
+    }
+
+    // Discards the body of a frame whose header has already been received.
+    inline HRESULT skip_frame(SOCKET sock, const codec::frame_header& header)
+    {
+        std::array<std::byte, 4096> buf;
+        std::size_t remaining = header.length;
+        while (remaining > 0)
+        {
+            const std::size_t chunk = std::min(remaining, buf.size());
+            if (const auto result = recv_bytes(sock, std::span{ buf.data(), chunk }); FAILED(result))
+            {
+                return result;
+            }
+
+            remaining -= chunk;
+        }
+
+        return ERROR_SUCCESS;
+    }
+
+    // Receives the body of a frame whose header has already been received.
+    template <codec::message T>
+    std::expected<T, HRESULT> recv_body(SOCKET sock, const codec::frame_header& header)
+    {
+        if (header.type != codec::frame_type_of<T>() || header.length != codec::encoded_size_v<T>)
+        {
+            return std::unexpected{ UNEXPECTED_FRAME };
+        }
+
+        std::array<std::byte, codec::encoded_size_v<T>> buf{};
+        if (const auto result = recv_bytes(sock, std::span{ buf }); FAILED(result))
+        {
+            return std::unexpected{ result };
+        }
+
+        return codec::decode<T>(buf);
+    }
+
+    template <codec::message T>
+    std::expected<T, HRESULT> recv_msg(SOCKET sock)
+    {
+        const auto header = recv_header(sock);
+        if (!header)
+        {
+            return std::unexpected{ header.error() };
+        }
+
+        return recv_body<T>(sock, header.value());
+    }
+
+    // Receives consecutive frames of `type` until `buf` has been completely filled.
+    inline HRESULT recv_frames(SOCKET sock, const codec::frame_type type, std::span<std::byte> buf)
+    {
+        while (!buf.empty())
+        {
+            const auto header = recv_header(sock);
+            if (!header)
+            {
+                return header.error();
+            }
+
+            if (header->type != type || header->length > buf.size())
+            {
+                return UNEXPECTED_FRAME;
+            }
+
+            if (const auto result = recv_bytes(sock, buf.first(header->length)); FAILED(result))
+            {
+                return result;
+            }
+
+            buf = buf.subspan(header->length);
+        }
+
+        return ERROR_SUCCESS;
+    }
+
+    template <codec::message T>
+    HRESULT send_msg(SOCKET sock, const T& msg)
+    {
+        const auto frame = codec::encode_frame(msg);
+        return send_bytes(sock, std::span{ frame });
+    }
+
+    // Sends `bytes` as one or more frames of `type`, each at most `MAX_BYTES_FRAME_LENGTH`.
+    inline HRESULT send_frames(SOCKET sock, const codec::frame_type type, std::span<const std::byte> bytes)
+    {
+        do
+        {
+            const auto chunk = bytes.first(std::min(bytes.size(), codec::MAX_BYTES_FRAME_LENGTH));
+            const auto header = codec::encode_header({
+                .type = type,
+                .length = static_cast<std::uint32_t>(chunk.size())
+            });
+            if (const auto result = send_bytes(sock, std::span{ header }); FAILED(result))
+            {
+                return result;
+            }
+
+            if (const auto result = send_bytes(sock, chunk); FAILED(result))
+            {
+                return result;
+            }
+
+            bytes = bytes.subspan(chunk.size());
+        } while (!bytes.empty());
+
+        return ERROR_SUCCESS;
+    }
+
+    // Sends `manifest` over as many frames as `write_manifest` splits it into.
+    inline HRESULT send_manifest(SOCKET sock, const address_space_manifest& manifest)
+    {
+        codec::frame_writer frames;
+        if (!write_manifest(frames, manifest))
+        {
+            LOG_DEBUG_ERR() << "Manifest of " << manifest.subregions.size()
+                << " subregions is too large to send" << std::endl;
+            return MALFORMED_MANIFEST;
+        }
+
+        return send_bytes(sock, frames.data());
+    }
+
+    // Sends one `page_data` frame for `run`. `pages` holds the bytes of every page in
+    // the run, but only the pages marked present are put on the wire.
+    inline HRESULT send_page_run(SOCKET sock, const page_run& run, std::span<const std::byte> pages)
+    {
+        std::array<std::byte, codec::FRAME_HEADER_SIZE + PAGE_RUN_FIXED_SIZE
+            + PAGE_BITMAP_WORDS * sizeof(std::uint64_t)> prefix{};
+        const auto header = codec::encode_header({
+            .type = codec::frame_type::page_data,
+            .length = static_cast<std::uint32_t>(run.body_size())
+        });
+        std::copy(header.begin(), header.end(), prefix.begin());
+        encode_page_run_prefix(run, std::span{ prefix }.subspan(codec::FRAME_HEADER_SIZE));
+
+        if (const auto result = send_bytes(
+                sock,
+                std::span<const std::byte>{ prefix.data(), codec::FRAME_HEADER_SIZE + run.prefix_size() });
+            FAILED(result))
+        {
+            return result;
+        }
+
+        // Consecutive present pages go out with a single send.
+        HRESULT result = ERROR_SUCCESS;
+        run.for_each_present_run([&](const std::uint32_t first_page, const std::uint32_t page_count)
+        {
+            if (SUCCEEDED(result))
+            {
+                result = send_bytes(sock, pages.subspan(
+                    first_page * MANIFEST_PAGE_SIZE,
+                    page_count * MANIFEST_PAGE_SIZE
+                ));
+            }
+        });
+
+        return result;
+    }
+
+    // Flushes every frame batched in `writer` with as few sends as possible.
+    inline HRESULT send_batch(SOCKET sock, const codec::frame_writer& writer)
     {
-        const auto buf = std::bit_cast<std::array<const std::byte, sizeof(T)>>(t);
-        return send_bytes(sock, std::span{ buf });
+        return send_bytes(sock, writer.data());
     }
 }
@@ -0,0 +1,270 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <expected>
+#include <span>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <winsock2.h>
+
+#include <netfork-shared/compress.hpp>
+#include <netfork-shared/log.hpp>
+#include <netfork-shared/net/codec.hpp>
+#include <netfork-shared/net/sock.hpp>
+#include <netfork-shared/pipeline.hpp>
+
+namespace netfork::net
+{
+    // Sending half of the compression pipeline. Frames are written into `writer()` and cut into
+    // chunks of about `CHUNK_TARGET_SIZE` bytes; the chunks are compressed on a pool of workers
+    // and sent in order by a dedicated thread, so reading memory, compressing and sending all
+    // overlap.
+    //
+    // Nothing else may send on the socket until `finish` returns.
+    class compressing_sender
+    {
+        using pipeline_type = ordered_pipeline<std::vector<std::byte>, std::vector<std::byte>>;
+
+        SOCKET sock_;
+        codec::frame_writer chunk_;
+        pipeline_type pipeline_;
+        std::atomic<HRESULT> send_result_ = ERROR_SUCCESS;
+        std::atomic<std::uint64_t> bytes_sent_ = 0;
+        std::jthread sender_;
+
+        void send_chunks()
+        {
+            while (auto chunk = pipeline_.pop())
+            {
+                if (const auto result = send_bytes(sock_, std::span<const std::byte>{ *chunk }); FAILED(result))
+                {
+                    LOG_DEBUG_ERR() << "Failed to send compressed chunk; error: " << result << std::endl;
+                    send_result_ = result;
+                    // Unblocks the producer, whose next `commit` reports the error.
+                    pipeline_.cancel();
+                    return;
+                }
+
+                bytes_sent_ += chunk->size();
+            }
+        }
+
+    public:
+        compressing_sender(SOCKET sock, const compress::codec method, const unsigned int worker_count)
+            : sock_{ sock }
+            , chunk_{ compress::CHUNK_TARGET_SIZE + codec::MAX_BYTES_FRAME_LENGTH }
+            // Two chunks per worker keeps everyone busy without buffering much of the process.
+            , pipeline_{
+                worker_count,
+                2 * static_cast<std::size_t>(worker_count),
+                [method](std::vector<std::byte>& frames)
+                {
+                    return compress::compress_chunk(method, frames);
+                }
+            }
+            , sender_{ [this] { send_chunks(); } }
+        {
+        }
+
+        compressing_sender(const compressing_sender&) = delete;
+        compressing_sender& operator=(const compressing_sender&) = delete;
+
+        ~compressing_sender()
+        {
+            pipeline_.cancel();
+        }
+
+        // Frames written here go out with the next chunk; call `commit` after every frame.
+        codec::frame_writer& writer() noexcept
+        {
+            return chunk_;
+        }
+
+        // Hands the current chunk to the workers once it's large enough.
+        HRESULT commit()
+        {
+            if (chunk_.size() >= compress::CHUNK_TARGET_SIZE)
+            {
+                // A failed push means the sender gave up, and `send_result_` says why.
+                pipeline_.push(chunk_.release());
+                chunk_ = codec::frame_writer{ compress::CHUNK_TARGET_SIZE + codec::MAX_BYTES_FRAME_LENGTH };
+            }
+
+            return send_result_;
+        }
+
+        // Flushes whatever is left and waits until every chunk has been sent.
+        HRESULT finish()
+        {
+            if (!chunk_.empty())
+            {
+                pipeline_.push(chunk_.release());
+            }
+
+            pipeline_.close();
+            if (sender_.joinable())
+            {
+                sender_.join();
+            }
+
+            return send_result_;
+        }
+
+        // Bytes put on the wire so far, including framing.
+        std::uint64_t bytes_sent() const noexcept
+        {
+            return bytes_sent_;
+        }
+    };
+
+    // Receiving half of the compression pipeline. A dedicated thread receives frames up to and
+    // including `end_of_stream`, `compressed_chunk` frames are expanded on a pool of workers, and
+    // `next` hands every frame back in the order it was sent. Frames that weren't compressed
+    // pass through as they are, so the sender is free to mix both.
+    //
+    // Nothing else may receive on the socket until `end_of_stream` has been returned.
+    class frame_stream
+    {
+        using chunk = std::expected<std::vector<std::byte>, HRESULT>;
+        using pipeline_type = ordered_pipeline<chunk, chunk>;
+
+        SOCKET sock_;
+        pipeline_type pipeline_;
+        // Set once the receiver won't touch the socket again.
+        std::atomic<bool> receiver_done_ = false;
+        std::vector<std::byte> current_;
+        codec::frame_reader reader_{ {} };
+        std::jthread receiver_;
+
+        void receive_frames()
+        {
+            while (true)
+            {
+                const auto header = recv_header(sock_);
+                if (!header || header->length > compress::CHUNK_PREFIX_SIZE + compress::MAX_CHUNK_SIZE)
+                {
+                    receiver_done_ = true;
+                    pipeline_.push(std::unexpected{ header ? UNEXPECTED_FRAME : header.error() });
+                    pipeline_.close();
+                    return;
+                }
+
+                // The header is kept in front of the body so the frame can be read back
+                // with a `frame_reader` like the contents of an expanded chunk.
+                std::vector<std::byte> frame(codec::FRAME_HEADER_SIZE + header->length);
+                const auto encoded_header = codec::encode_header(header.value());
+                std::copy(encoded_header.begin(), encoded_header.end(), frame.begin());
+                if (const auto result = recv_bytes(sock_, std::span{ frame }.subspan(codec::FRAME_HEADER_SIZE));
+                    FAILED(result))
+                {
+                    receiver_done_ = true;
+                    pipeline_.push(std::unexpected{ result });
+                    pipeline_.close();
+                    return;
+                }
+
+                const bool last = header->type == codec::frame_type::end_of_stream;
+                if (last)
+                {
+                    receiver_done_ = true;
+                }
+
+                if (!pipeline_.push(std::move(frame)) || last)
+                {
+                    pipeline_.close();
+                    return;
+                }
+            }
+        }
+
+        static chunk expand(chunk& frame)
+        {
+            if (!frame)
+            {
+                return std::move(frame);
+            }
+
+            const auto header = codec::decode_header(std::span{ *frame }.first<codec::FRAME_HEADER_SIZE>());
+            if (header.type != codec::frame_type::compressed_chunk)
+            {
+                return std::move(frame);
+            }
+
+            return compress::decompress_chunk(std::span{ *frame }.subspan(codec::FRAME_HEADER_SIZE));
+        }
+
+    public:
+        frame_stream(SOCKET sock, const unsigned int worker_count)
+            : sock_{ sock }
+            , pipeline_{ worker_count, 2 * static_cast<std::size_t>(worker_count), &frame_stream::expand }
+            , receiver_{ [this] { receive_frames(); } }
+        {
+        }
+
+        frame_stream(const frame_stream&) = delete;
+        frame_stream& operator=(const frame_stream&) = delete;
+
+        ~frame_stream()
+        {
+            pipeline_.cancel();
+            // Bailing out before the end of the stream leaves the receiver blocked in `recv`;
+            // the session is lost at that point anyway.
+            if (!receiver_done_)
+            {
+                ::shutdown(sock_, SD_RECEIVE);
+            }
+        }
+
+        // The body of the returned frame stays valid until the next call.
+        std::expected<codec::frame_view, HRESULT> next()
+        {
+            while (true)
+            {
+                if (const auto frame = reader_.next())
+                {
+                    return frame.value();
+                }
+
+                if (!reader_.remaining().empty())
+                {
+                    return std::unexpected{ UNEXPECTED_FRAME };
+                }
+
+                auto frames = pipeline_.pop();
+                if (!frames)
+                {
+                    return std::unexpected{ INCOMPLETE_RECV_DATA };
+                }
+
+                if (!frames->has_value())
+                {
+                    return std::unexpected{ frames->error() };
+                }
+
+                current_ = std::move(frames->value());
+                reader_ = codec::frame_reader{ current_ };
+            }
+        }
+    };
+}
@@ -0,0 +1,214 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// The coroutine types the asynchronous runtime in `async.hpp` is built on. Free of Windows
+// dependencies.
+
+#include <concepts>
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <thread>
+#include <utility>
+
+namespace netfork::net
+{
+    template <typename T = void>
+    class task;
+
+    namespace detail
+    {
+        struct promise_base
+        {
+            std::coroutine_handle<> continuation_;
+
+            std::suspend_always initial_suspend() noexcept
+            {
+                return {};
+            }
+
+            // Failures are returned rather than thrown everywhere in netfork, so an
+            // exception escaping a session is a bug.
+            void unhandled_exception() noexcept
+            {
+                std::terminate();
+            }
+        };
+
+        template <typename T>
+        struct task_result
+        {
+            std::optional<T> value_;
+
+            template <std::convertible_to<T> From>
+            void return_value(From&& from)
+            {
+                value_.emplace(std::forward<From>(from));
+            }
+
+            T result()
+            {
+                return std::move(*value_);
+            }
+        };
+
+        template <>
+        struct task_result<void>
+        {
+            void return_void() noexcept {}
+            void result() noexcept {}
+        };
+
+        // Hands the thread back to whoever awaited the finished task without growing the stack.
+        template <typename Promise>
+        struct resume_continuation
+        {
+            bool await_ready() const noexcept
+            {
+                return false;
+            }
+
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> finished) noexcept
+            {
+                const auto continuation = finished.promise().continuation_;
+                return continuation ? continuation : std::noop_coroutine();
+            }
+
+            void await_resume() const noexcept {}
+        };
+    }
+
+    // A coroutine which doesn't start until it's awaited. The awaiter is resumed on
+    // whichever thread the task finished on.
+    template <typename T>
+    class task
+    {
+    public:
+        struct promise_type : detail::promise_base, detail::task_result<T>
+        {
+            task get_return_object()
+            {
+                return task{ std::coroutine_handle<promise_type>::from_promise(*this) };
+            }
+
+            detail::resume_continuation<promise_type> final_suspend() noexcept
+            {
+                return {};
+            }
+        };
+
+        using handle_type = std::coroutine_handle<promise_type>;
+
+        task(task&& other) noexcept
+            : h_{ std::exchange(other.h_, nullptr) }
+        {
+        }
+
+        task(const task&) = delete;
+        task& operator=(const task&) = delete;
+        task& operator=(task&&) = delete;
+
+        ~task()
+        {
+            if (h_)
+            {
+                h_.destroy();
+            }
+        }
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept
+        {
+            h_.promise().continuation_ = awaiter;
+            return h_;
+        }
+
+        T await_resume()
+        {
+            return h_.promise().result();
+        }
+
+    private:
+        handle_type h_;
+
+        explicit task(handle_type h)
+            : h_{ h }
+        {
+        }
+    };
+
+    namespace detail
+    {
+        // A coroutine which starts at once and frees itself when it finishes.
+        struct detached_task
+        {
+            struct promise_type
+            {
+                detached_task get_return_object() noexcept
+                {
+                    return {};
+                }
+
+                std::suspend_never initial_suspend() noexcept
+                {
+                    return {};
+                }
+
+                std::suspend_never final_suspend() noexcept
+                {
+                    return {};
+                }
+
+                void return_void() noexcept {}
+
+                void unhandled_exception() noexcept
+                {
+                    std::terminate();
+                }
+            };
+        };
+    }
+
+    // Moves the awaiting coroutine onto a thread of its own, e.g. off the threads of an
+    // `io_context` for the rest of a session which blocks for as long as its client stays
+    // connected.
+    inline auto resume_on_new_thread()
+    {
+        struct awaiter
+        {
+            bool await_ready() const noexcept
+            {
+                return false;
+            }
+
+            void await_suspend(std::coroutine_handle<> awaiting)
+            {
+                std::thread{ [awaiting] { awaiting.resume(); } }.detach();
+            }
+
+            void await_resume() const noexcept {}
+        };
+
+        return awaiter{};
+    }
+}
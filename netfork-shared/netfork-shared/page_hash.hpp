@@ -0,0 +1,261 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// 128-bit page hashes used to address pages by content. The server trusts a hash it's sent
+// to stand for the page, so they must be collision resistant: each is SHA-256 truncated to
+// its first 16 bytes. Windows builds hash with CNG, which uses the CPU's SHA extensions
+// where there are any; the portable implementation below is used everywhere else, and if
+// CNG ever fails.
+
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <span>
+
+#ifdef _WIN32
+#	include <netfork-shared/phnt_stub.hpp>
+#	include <bcrypt.h>
+#endif
+
+namespace netfork
+{
+    constexpr const std::size_t HASHED_PAGE_SIZE = 4096;
+
+    struct page_hash
+    {
+        std::uint64_t low = 0;
+        std::uint64_t high = 0;
+
+        friend bool operator==(const page_hash&, const page_hash&) = default;
+    };
+
+    constexpr const std::size_t PAGE_HASH_SIZE = 2 * sizeof(std::uint64_t);
+
+    namespace detail
+    {
+        constexpr const std::size_t SHA256_DIGEST_SIZE = 32;
+        using sha256_digest = std::array<std::byte, SHA256_DIGEST_SIZE>;
+
+        inline std::uint64_t load_u64_le(const std::byte* in) noexcept
+        {
+            std::uint64_t value;
+            std::memcpy(&value, in, sizeof(value));
+            if constexpr (std::endian::native == std::endian::big)
+            {
+                value = std::byteswap(value);
+            }
+
+            return value;
+        }
+
+        inline void store_u64_le(std::byte* out, std::uint64_t value) noexcept
+        {
+            if constexpr (std::endian::native == std::endian::big)
+            {
+                value = std::byteswap(value);
+            }
+
+            std::memcpy(out, &value, sizeof(value));
+        }
+
+        inline std::uint32_t load_u32_be(const std::byte* in) noexcept
+        {
+            std::uint32_t value;
+            std::memcpy(&value, in, sizeof(value));
+            if constexpr (std::endian::native == std::endian::little)
+            {
+                value = std::byteswap(value);
+            }
+
+            return value;
+        }
+
+        // FIPS 180-4 SHA-256, one message at a time.
+        inline sha256_digest sha256_portable(std::span<const std::byte> message) noexcept
+        {
+            static constexpr std::uint32_t k[64] = {
+                0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+                0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+                0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+                0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+                0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+                0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+                0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+                0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+            };
+
+            std::uint32_t h[8] = {
+                0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+            };
+
+            const auto compress = [&h](const std::byte* block)
+            {
+                std::uint32_t w[64];
+                for (int i = 0; i < 16; i++)
+                {
+                    w[i] = load_u32_be(block + i * 4);
+                }
+
+                for (int i = 16; i < 64; i++)
+                {
+                    const std::uint32_t s0 = std::rotr(w[i - 15], 7) ^ std::rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+                    const std::uint32_t s1 = std::rotr(w[i - 2], 17) ^ std::rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+                    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+                }
+
+                std::uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+                for (int i = 0; i < 64; i++)
+                {
+                    const std::uint32_t s1 = std::rotr(e, 6) ^ std::rotr(e, 11) ^ std::rotr(e, 25);
+                    const std::uint32_t ch = (e & f) ^ (~e & g);
+                    const std::uint32_t t1 = hh + s1 + ch + k[i] + w[i];
+                    const std::uint32_t s0 = std::rotr(a, 2) ^ std::rotr(a, 13) ^ std::rotr(a, 22);
+                    const std::uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+                    const std::uint32_t t2 = s0 + maj;
+                    hh = g;
+                    g = f;
+                    f = e;
+                    e = d + t1;
+                    d = c;
+                    c = b;
+                    b = a;
+                    a = t1 + t2;
+                }
+
+                h[0] += a;
+                h[1] += b;
+                h[2] += c;
+                h[3] += d;
+                h[4] += e;
+                h[5] += f;
+                h[6] += g;
+                h[7] += hh;
+            };
+
+            constexpr std::size_t BLOCK_SIZE = 64;
+            const std::size_t whole_blocks = message.size() / BLOCK_SIZE;
+            for (std::size_t block = 0; block < whole_blocks; block++)
+            {
+                compress(message.data() + block * BLOCK_SIZE);
+            }
+
+            // The tail, the 0x80 terminator and the big-endian bit length, in one block or two.
+            std::array<std::byte, 2 * BLOCK_SIZE> tail{};
+            const std::size_t tail_size = message.size() % BLOCK_SIZE;
+            if (tail_size != 0)
+            {
+                std::memcpy(tail.data(), message.data() + whole_blocks * BLOCK_SIZE, tail_size);
+            }
+
+            tail[tail_size] = std::byte{ 0x80 };
+            const std::size_t tail_blocks = tail_size + 1 + sizeof(std::uint64_t) > BLOCK_SIZE ? 2 : 1;
+            std::uint64_t bit_length = static_cast<std::uint64_t>(message.size()) * 8;
+            if constexpr (std::endian::native == std::endian::little)
+            {
+                bit_length = std::byteswap(bit_length);
+            }
+
+            std::memcpy(tail.data() + tail_blocks * BLOCK_SIZE - sizeof(bit_length), &bit_length, sizeof(bit_length));
+            for (std::size_t block = 0; block < tail_blocks; block++)
+            {
+                compress(tail.data() + block * BLOCK_SIZE);
+            }
+
+            sha256_digest digest;
+            for (int i = 0; i < 8; i++)
+            {
+                const std::uint32_t word = std::endian::native == std::endian::little ? std::byteswap(h[i]) : h[i];
+                std::memcpy(digest.data() + i * 4, &word, sizeof(word));
+            }
+
+            return digest;
+        }
+
+        inline sha256_digest sha256(std::span<const std::byte> message) noexcept
+        {
+#ifdef _WIN32
+            sha256_digest digest;
+            if (BCRYPT_SUCCESS(::BCryptHash(BCRYPT_SHA256_ALG_HANDLE, nullptr, 0,
+                reinterpret_cast<PUCHAR>(const_cast<std::byte*>(message.data())), static_cast<ULONG>(message.size()),
+                reinterpret_cast<PUCHAR>(digest.data()), static_cast<ULONG>(digest.size()))))
+            {
+                return digest;
+            }
+#endif
+            return sha256_portable(message);
+        }
+
+        inline void encode_page_hash(std::byte* out, const page_hash& hash) noexcept
+        {
+            store_u64_le(out, hash.low);
+            store_u64_le(out + sizeof(std::uint64_t), hash.high);
+        }
+    }
+
+    // The first 16 bytes of the SHA-256 digest of `bytes`, little-endian in each half, so a
+    // hash's wire encoding (low then high) is the truncated digest itself. The result is the
+    // same on every host.
+    inline page_hash hash_bytes(std::span<const std::byte> bytes) noexcept
+    {
+        const auto digest = detail::sha256(bytes);
+        return {
+            .low = detail::load_u64_le(digest.data()),
+            .high = detail::load_u64_le(digest.data() + sizeof(std::uint64_t))
+        };
+    }
+
+    // The hash of one `HASHED_PAGE_SIZE` page.
+    inline page_hash hash_page(const std::byte* page) noexcept
+    {
+        return hash_bytes({ page, HASHED_PAGE_SIZE });
+    }
+
+    // The hash of `previous`'s encoding followed by `page`, which chains the hashes of a
+    // sequence of pages together.
+    inline page_hash hash_page(const std::byte* page, const page_hash& previous) noexcept
+    {
+        std::array<std::byte, PAGE_HASH_SIZE + HASHED_PAGE_SIZE> chained;
+        detail::encode_page_hash(chained.data(), previous);
+        std::memcpy(chained.data() + PAGE_HASH_SIZE, page, HASHED_PAGE_SIZE);
+        return hash_bytes(chained);
+    }
+
+    // Folds two 64-bit values (e.g. where the next pages go and how many there are) into the
+    // chain, so they're part of the hash as much as the pages are.
+    inline page_hash hash_values(const page_hash& previous, const std::uint64_t first, const std::uint64_t second) noexcept
+    {
+        std::array<std::byte, PAGE_HASH_SIZE + 2 * sizeof(std::uint64_t)> chained;
+        detail::encode_page_hash(chained.data(), previous);
+        detail::store_u64_le(chained.data() + PAGE_HASH_SIZE, first);
+        detail::store_u64_le(chained.data() + PAGE_HASH_SIZE + sizeof(std::uint64_t), second);
+        return hash_bytes(chained);
+    }
+
+    struct page_hash_hasher
+    {
+        std::size_t operator()(const page_hash& hash) const noexcept
+        {
+            // Already well mixed.
+            return static_cast<std::size_t>(hash.low);
+        }
+    };
+}
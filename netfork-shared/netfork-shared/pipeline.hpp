@@ -0,0 +1,264 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace netfork
+{
+    // Number of workers to use when the caller asks for "one per core".
+    inline unsigned int default_worker_count() noexcept
+    {
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    // A fixed set of threads which run submitted jobs, oldest first. For work which blocks for
+    // a while and mustn't hold up the thread it comes from, without a thread per job.
+    //
+    // Destroying the pool runs every job already submitted before it returns.
+    class work_pool
+    {
+        std::mutex mutex_;
+        std::condition_variable cv_;
+        std::deque<std::move_only_function<void()>> jobs_;
+        bool stopping_ = false;
+        std::vector<std::jthread> threads_;
+
+        void work()
+        {
+            while (true)
+            {
+                std::move_only_function<void()> job;
+                {
+                    std::unique_lock lock{ mutex_ };
+                    cv_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+                    if (jobs_.empty())
+                    {
+                        return;
+                    }
+
+                    job = std::move(jobs_.front());
+                    jobs_.pop_front();
+                }
+
+                job();
+            }
+        }
+
+    public:
+        explicit work_pool(const unsigned int thread_count)
+        {
+            threads_.reserve(std::max(1u, thread_count));
+            for (unsigned int i = 0; i < std::max(1u, thread_count); i++)
+            {
+                threads_.emplace_back([this] { work(); });
+            }
+        }
+
+        work_pool(const work_pool&) = delete;
+        work_pool& operator=(const work_pool&) = delete;
+
+        ~work_pool()
+        {
+            {
+                std::lock_guard lock{ mutex_ };
+                stopping_ = true;
+            }
+            cv_.notify_all();
+            threads_.clear();
+        }
+
+        void submit(std::move_only_function<void()> job)
+        {
+            {
+                std::lock_guard lock{ mutex_ };
+                jobs_.push_back(std::move(job));
+            }
+            cv_.notify_one();
+        }
+
+        // Jobs submitted but not yet picked up by a thread.
+        std::size_t queued()
+        {
+            std::lock_guard lock{ mutex_ };
+            return jobs_.size();
+        }
+    };
+
+    // Runs `transform` over pushed items on a pool of workers and hands the results back in
+    // the order the items were pushed.
+    //
+    // At most `max_in_flight` items may be pushed but not yet popped; `push` blocks past
+    // that, which bounds memory use and pushes back on a producer that outruns the consumer.
+    template <typename Input, typename Output>
+    class ordered_pipeline
+    {
+    public:
+        using transform_type = std::function<Output(Input&)>;
+
+    private:
+        transform_type transform_;
+        std::size_t max_in_flight_;
+
+        std::mutex mutex_;
+        std::condition_variable input_cv_;
+        std::condition_variable output_cv_;
+        std::condition_variable space_cv_;
+
+        std::deque<std::pair<std::uint64_t, Input>> inputs_;
+        std::map<std::uint64_t, Output> outputs_;
+        std::uint64_t next_input_seq_ = 0;
+        std::uint64_t next_output_seq_ = 0;
+        bool closed_ = false;
+        bool cancelled_ = false;
+
+        std::vector<std::jthread> workers_;
+
+        void work()
+        {
+            while (true)
+            {
+                std::pair<std::uint64_t, Input> item;
+                {
+                    std::unique_lock lock{ mutex_ };
+                    input_cv_.wait(lock, [this] { return cancelled_ || closed_ || !inputs_.empty(); });
+                    if (cancelled_ || inputs_.empty())
+                    {
+                        return;
+                    }
+
+                    item = std::move(inputs_.front());
+                    inputs_.pop_front();
+                }
+
+                Output output = transform_(item.second);
+
+                {
+                    std::lock_guard lock{ mutex_ };
+                    outputs_.emplace(item.first, std::move(output));
+                }
+                output_cv_.notify_all();
+            }
+        }
+
+    public:
+        ordered_pipeline(const unsigned int worker_count, const std::size_t max_in_flight, transform_type transform)
+            : transform_{ std::move(transform) }
+            , max_in_flight_{ std::max<std::size_t>(1, max_in_flight) }
+        {
+            workers_.reserve(worker_count);
+            for (unsigned int i = 0; i < std::max(1u, worker_count); i++)
+            {
+                workers_.emplace_back([this] { work(); });
+            }
+        }
+
+        ordered_pipeline(const ordered_pipeline&) = delete;
+        ordered_pipeline& operator=(const ordered_pipeline&) = delete;
+
+        ~ordered_pipeline()
+        {
+            cancel();
+        }
+
+        // Returns false if the pipeline was cancelled or closed; `input` is dropped.
+        bool push(Input input)
+        {
+            {
+                std::unique_lock lock{ mutex_ };
+                space_cv_.wait(lock, [this]
+                {
+                    return cancelled_ || closed_ || next_input_seq_ - next_output_seq_ < max_in_flight_;
+                });
+                if (cancelled_ || closed_)
+                {
+                    return false;
+                }
+
+                inputs_.emplace_back(next_input_seq_++, std::move(input));
+            }
+            input_cv_.notify_one();
+            return true;
+        }
+
+        // Blocks until the next result in push order is ready. Returns nothing once the
+        // pipeline is closed and drained, or cancelled.
+        std::optional<Output> pop()
+        {
+            std::optional<Output> output;
+            {
+                std::unique_lock lock{ mutex_ };
+                output_cv_.wait(lock, [this]
+                {
+                    return cancelled_
+                        || outputs_.contains(next_output_seq_)
+                        || (closed_ && next_output_seq_ == next_input_seq_);
+                });
+
+                const auto it = outputs_.find(next_output_seq_);
+                if (cancelled_ || it == outputs_.end())
+                {
+                    return std::nullopt;
+                }
+
+                output = std::move(it->second);
+                outputs_.erase(it);
+                next_output_seq_++;
+            }
+            space_cv_.notify_one();
+            return output;
+        }
+
+        // No more input will be pushed; `pop` drains what's left and then returns nothing.
+        void close()
+        {
+            {
+                std::lock_guard lock{ mutex_ };
+                closed_ = true;
+            }
+            input_cv_.notify_all();
+            output_cv_.notify_all();
+            space_cv_.notify_all();
+        }
+
+        // Drops all pending work and wakes everyone up.
+        void cancel()
+        {
+            {
+                std::lock_guard lock{ mutex_ };
+                cancelled_ = true;
+                inputs_.clear();
+                outputs_.clear();
+            }
+            input_cv_.notify_all();
+            output_cv_.notify_all();
+            space_cv_.notify_all();
+        }
+    };
+}
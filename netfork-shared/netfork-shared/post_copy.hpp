@@ -0,0 +1,358 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+// The page-fetching protocol of a post-copy fork, apart from how a platform traps the first
+// touch of a page and installs it. Free of Windows dependencies: Windows servers trap faults
+// as access violations under a debug object (see netfork-server/post_copy.hpp), and the Linux
+// backend with userfaultfd (see netfork-server/userfault.hpp).
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include <netfork-shared/net/manifest.hpp>
+#include <netfork-shared/net/page_data.hpp>
+
+namespace netfork::post_copy
+{
+    // Pages asked for on every fault, starting at the faulting one. Touching one page of a
+    // heap or stack usually means its neighbours are next.
+    constexpr const std::uint32_t FAULT_READAHEAD_PAGES = 16;
+
+    // A run of pages, as a `page_request` asks for them.
+    struct page_span
+    {
+        std::uint64_t address;
+        std::uint32_t page_count;
+
+        friend bool operator==(const page_span&, const page_span&) = default;
+    };
+
+    // What to ask for on a fault at `page_address`: that page and the ones after it, up to
+    // `FAULT_READAHEAD_PAGES` but without leaving the subregion.
+    inline page_span readahead(const net::manifest_subregion& subregion, const std::uint64_t page_address) noexcept
+    {
+        return {
+            .address = page_address,
+            .page_count = static_cast<std::uint32_t>(std::min<std::uint64_t>(
+                FAULT_READAHEAD_PAGES,
+                (subregion.end_address() - page_address) / net::MANIFEST_PAGE_SIZE))
+        };
+    }
+
+    // Whether a client should answer `request`: whole pages, no more than fit in one frame,
+    // inside a single subregion which carries a payload (`has_payload(protect)`).
+    template <typename HasPayload>
+    bool is_valid_request(const net::address_space_manifest& manifest, const page_span& request, HasPayload&& has_payload)
+    {
+        const auto* subregion = manifest.find_subregion(request.address);
+        return request.page_count != 0
+            && request.page_count <= net::MAX_PAGES_PER_FRAME
+            && request.address % net::MANIFEST_PAGE_SIZE == 0
+            && subregion
+            && has_payload(subregion->protect)
+            && request.page_count * net::MANIFEST_PAGE_SIZE <= subregion->end_address() - request.address;
+    }
+
+    // Which pages of a post-copy fork the server has, and which it still waits for. Pages
+    // arrive two ways: pushed by the client in the background, or asked for when the child
+    // faults on one first. Either way they're buffered here until the backend installs them,
+    // which it only does while the child can't observe a page half written.
+    //
+    // Thread-safe: a receiver thread buffers pushed pages while the fault handler waits for
+    // and installs them.
+    class lazy_pages
+    {
+        enum class page_state : std::uint8_t
+        {
+            pending,
+            buffered,
+            installed
+        };
+
+        net::address_space_manifest manifest_;
+        // One entry per page of every lazy subregion; empty for the rest. Indexed like
+        // `manifest_.subregions`.
+        std::vector<std::vector<page_state>> pages_;
+
+        mutable std::mutex mutex_;
+        std::condition_variable page_arrived_;
+        // Pages received but not installed yet, by address. Null for a page which is zero
+        // and so only needs its protection set.
+        std::map<std::uint64_t, std::unique_ptr<std::byte[]>> buffered_;
+        bool push_done_ = false;
+        bool receive_failed_ = false;
+        bool closed_ = false;
+        std::uint64_t pages_requested_ = 0;
+
+        std::size_t index_of(const net::manifest_subregion& subregion) const noexcept
+        {
+            return static_cast<std::size_t>(&subregion - manifest_.subregions.data());
+        }
+
+        // The state of the lazy page at `address`, if it is one.
+        page_state* state_of(const std::uint64_t address) noexcept
+        {
+            const auto* subregion = manifest_.find_subregion(address);
+            if (!subregion || pages_[index_of(*subregion)].empty())
+            {
+                return nullptr;
+            }
+
+            return &pages_[index_of(*subregion)][(address - subregion->base_address) / net::MANIFEST_PAGE_SIZE];
+        }
+
+    public:
+        explicit lazy_pages(net::address_space_manifest manifest)
+            : manifest_{ std::move(manifest) }
+            , pages_(manifest_.subregions.size())
+        {
+        }
+
+        lazy_pages(const lazy_pages&) = delete;
+        lazy_pages& operator=(const lazy_pages&) = delete;
+
+        const net::address_space_manifest& manifest() const noexcept
+        {
+            return manifest_;
+        }
+
+        // Every page of subregion `index` is to be fetched. Call before anything else.
+        void mark_lazy(const std::size_t index)
+        {
+            pages_[index].assign(manifest_.subregions[index].region_size / net::MANIFEST_PAGE_SIZE, page_state::pending);
+        }
+
+        bool is_lazy(const std::uint64_t address) const noexcept
+        {
+            const auto* subregion = manifest_.find_subregion(address);
+            return subregion && !pages_[index_of(*subregion)].empty();
+        }
+
+        std::uint64_t pages_requested() const
+        {
+            std::lock_guard lock{ mutex_ };
+            return pages_requested_;
+        }
+
+        // Buffers the pages of a received `page_data` frame whose present pages start at
+        // `page_bytes`. `run` must lie within one subregion of the manifest. Pages which
+        // aren't lazy or were buffered before are left alone; the child may have written to
+        // them since.
+        void buffer_run(const net::page_run& run, const std::byte* page_bytes)
+        {
+            std::lock_guard lock{ mutex_ };
+            if (closed_)
+            {
+                return;
+            }
+
+            for (std::uint32_t page = 0; page < run.page_count; page++)
+            {
+                const std::byte* bytes = nullptr;
+                if (run.is_present(page))
+                {
+                    bytes = page_bytes;
+                    page_bytes += net::MANIFEST_PAGE_SIZE;
+                }
+
+                const std::uint64_t address = run.address + page * net::MANIFEST_PAGE_SIZE;
+                auto* state = state_of(address);
+                if (!state || *state != page_state::pending)
+                {
+                    continue;
+                }
+
+                std::unique_ptr<std::byte[]> copy;
+                if (bytes)
+                {
+                    copy = std::make_unique_for_overwrite<std::byte[]>(net::MANIFEST_PAGE_SIZE);
+                    std::memcpy(copy.get(), bytes, net::MANIFEST_PAGE_SIZE);
+                }
+
+                *state = page_state::buffered;
+                buffered_.emplace(address, std::move(copy));
+            }
+
+            page_arrived_.notify_all();
+        }
+
+        // The client's push has ended, or receiving failed.
+        void end_push(const bool received)
+        {
+            {
+                std::lock_guard lock{ mutex_ };
+                (received ? push_done_ : receive_failed_) = true;
+            }
+            page_arrived_.notify_all();
+        }
+
+        bool push_done() const
+        {
+            std::lock_guard lock{ mutex_ };
+            return push_done_;
+        }
+
+        bool receive_failed() const
+        {
+            std::lock_guard lock{ mutex_ };
+            return receive_failed_;
+        }
+
+        // The child is gone; buffered pages are dropped and nothing more is buffered.
+        void close()
+        {
+            {
+                std::lock_guard lock{ mutex_ };
+                closed_ = true;
+                buffered_.clear();
+            }
+            page_arrived_.notify_all();
+        }
+
+        bool closed() const
+        {
+            std::lock_guard lock{ mutex_ };
+            return closed_;
+        }
+
+        // Handles a fault on the lazy page at `address`. If the page hasn't arrived yet,
+        // `request(page_span)` asks for it and its readahead, and this waits until it's
+        // buffered. Once the push is done, a page that never arrived is zero. Returns false
+        // if the page isn't lazy, can't be asked for, or receiving failed.
+        template <typename Request>
+        bool await_page(const std::uint64_t address, Request&& request)
+        {
+            const auto* subregion = manifest_.find_subregion(address);
+            if (!subregion || pages_[index_of(*subregion)].empty())
+            {
+                return false;
+            }
+
+            const std::uint64_t page_address = address & ~(net::MANIFEST_PAGE_SIZE - 1);
+            auto& state = pages_[index_of(*subregion)][(page_address - subregion->base_address) / net::MANIFEST_PAGE_SIZE];
+
+            std::unique_lock lock{ mutex_ };
+            if (state == page_state::pending && !push_done_)
+            {
+                const page_span span = readahead(*subregion, page_address);
+                if (!request(span))
+                {
+                    return false;
+                }
+
+                pages_requested_ += span.page_count;
+                page_arrived_.wait(lock, [&]
+                {
+                    return state != page_state::pending || receive_failed_ || push_done_ || closed_;
+                });
+            }
+
+            if (state == page_state::pending && push_done_)
+            {
+                state = page_state::buffered;
+                buffered_.emplace(page_address, nullptr);
+            }
+
+            return state != page_state::pending;
+        }
+
+        // Whether the lazy page at `address` has been installed.
+        bool is_installed(const std::uint64_t address)
+        {
+            std::lock_guard lock{ mutex_ };
+            const auto* state = state_of(address & ~(net::MANIFEST_PAGE_SIZE - 1));
+            return state && *state == page_state::installed;
+        }
+
+        // Installs every buffered page with `install(subregion, address, pages)`, one call
+        // per run of consecutive pages in a subregion. `pages` has one entry per page, null
+        // for a zero page. Must only be called while the child can't touch those pages.
+        template <typename Install>
+        void install_buffered(Install&& install)
+        {
+            std::lock_guard lock{ mutex_ };
+            std::vector<const std::byte*> pages;
+
+            auto it = buffered_.begin();
+            while (it != buffered_.end())
+            {
+                const auto& subregion = *manifest_.find_subregion(it->first);
+                auto& states = pages_[index_of(subregion)];
+
+                const std::uint64_t run_address = it->first;
+                std::uint64_t next_address = run_address;
+                pages.clear();
+                for (; it != buffered_.end() && it->first == next_address && next_address < subregion.end_address(); ++it)
+                {
+                    pages.push_back(it->second.get());
+                    states[(next_address - subregion.base_address) / net::MANIFEST_PAGE_SIZE] = page_state::installed;
+                    next_address += net::MANIFEST_PAGE_SIZE;
+                }
+
+                install(subregion, run_address, std::span<const std::byte* const>{ pages });
+            }
+
+            buffered_.clear();
+        }
+
+        // Once the push is done: installs whatever is buffered, then calls
+        // `install(subregion, address, pages)` with null pages for every run of pages that
+        // never arrived, since they're zero. Every lazy page is installed afterwards.
+        template <typename Install>
+        void install_remaining(Install&& install)
+        {
+            install_buffered(install);
+
+            std::lock_guard lock{ mutex_ };
+            std::vector<const std::byte*> zeros;
+            for (std::size_t i = 0; i < manifest_.subregions.size(); i++)
+            {
+                auto& states = pages_[i];
+                for (std::size_t page = 0; page < states.size();)
+                {
+                    if (states[page] != page_state::pending)
+                    {
+                        page++;
+                        continue;
+                    }
+
+                    const std::size_t first = page;
+                    while (page < states.size() && states[page] == page_state::pending)
+                    {
+                        states[page++] = page_state::installed;
+                    }
+
+                    zeros.assign(page - first, nullptr);
+                    const auto& subregion = manifest_.subregions[i];
+                    install(subregion, subregion.base_address + first * net::MANIFEST_PAGE_SIZE, std::span<const std::byte* const>{ zeros });
+                }
+            }
+        }
+    };
+}
@@ -58,7 +58,7 @@ class unique_handle_impl
 	}
 
 protected:
-	HandleType handle_;
+	HandleType handle_{};
 	Deleter deleter_;
 
 public:
@@ -136,10 +136,9 @@ public:
 
 	void reset(HandleType new_handle)
 	{
-		HandleType old_handle = std::move(derived().release());
 		if (derived().is_valid())
 		{
-			deleter_(old_handle);
+			deleter_(handle_);
 		}
 
 		handle_ = std::move(new_handle);
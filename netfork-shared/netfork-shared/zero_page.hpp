@@ -0,0 +1,141 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// Zero-page detection for the capture path. The kernel is picked once at runtime:
+// AVX2 if the CPU and OS support it, SSE2 on any other x64 CPU, and a portable scalar
+// loop everywhere else. Free of Windows dependencies.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(_M_X64) || defined(__x86_64__)
+#	define NETFORK_X64_KERNELS 1
+#	include <immintrin.h>
+#	ifdef _MSC_VER
+#		include <intrin.h>
+#		define NETFORK_TARGET_AVX2
+#	else
+#		define NETFORK_TARGET_AVX2 __attribute__((target("avx2")))
+#	endif
+#endif
+
+namespace netfork::simd
+{
+    constexpr const std::size_t ZERO_PAGE_SIZE = 4096;
+
+    using zero_page_kernel = bool (*)(const std::byte* page) noexcept;
+
+    inline bool is_zero_page_scalar(const std::byte* page) noexcept
+    {
+        std::uint64_t acc = 0;
+        for (std::size_t offset = 0; offset < ZERO_PAGE_SIZE; offset += sizeof(std::uint64_t))
+        {
+            std::uint64_t word;
+            std::memcpy(&word, page + offset, sizeof(word));
+            acc |= word;
+        }
+
+        return acc == 0;
+    }
+
+#ifdef NETFORK_X64_KERNELS
+    inline bool is_zero_page_sse2(const std::byte* page) noexcept
+    {
+        const auto* p = reinterpret_cast<const __m128i*>(page);
+        __m128i acc = _mm_setzero_si128();
+        // Four independent loads per iteration keep the load ports busy.
+        for (std::size_t i = 0; i < ZERO_PAGE_SIZE / sizeof(__m128i); i += 4)
+        {
+            const __m128i a = _mm_or_si128(_mm_loadu_si128(p + i), _mm_loadu_si128(p + i + 1));
+            const __m128i b = _mm_or_si128(_mm_loadu_si128(p + i + 2), _mm_loadu_si128(p + i + 3));
+            acc = _mm_or_si128(acc, _mm_or_si128(a, b));
+        }
+
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) == 0xFFFF;
+    }
+
+    NETFORK_TARGET_AVX2 inline bool is_zero_page_avx2(const std::byte* page) noexcept
+    {
+        const auto* p = reinterpret_cast<const __m256i*>(page);
+        __m256i acc = _mm256_setzero_si256();
+        for (std::size_t i = 0; i < ZERO_PAGE_SIZE / sizeof(__m256i); i += 4)
+        {
+            const __m256i a = _mm256_or_si256(_mm256_loadu_si256(p + i), _mm256_loadu_si256(p + i + 1));
+            const __m256i b = _mm256_or_si256(_mm256_loadu_si256(p + i + 2), _mm256_loadu_si256(p + i + 3));
+            acc = _mm256_or_si256(acc, _mm256_or_si256(a, b));
+        }
+
+        return _mm256_testz_si256(acc, acc) != 0;
+    }
+
+    inline bool cpu_supports_avx2() noexcept
+    {
+#ifdef _MSC_VER
+        int info[4];
+        __cpuid(info, 0);
+        if (info[0] < 7)
+        {
+            return false;
+        }
+
+        __cpuid(info, 1);
+        constexpr int OSXSAVE = 1 << 27;
+        constexpr int AVX = 1 << 28;
+        if ((info[2] & (OSXSAVE | AVX)) != (OSXSAVE | AVX))
+        {
+            return false;
+        }
+
+        // The OS must save the upper halves of the YMM registers on context switches.
+        if ((_xgetbv(0) & 0x6) != 0x6)
+        {
+            return false;
+        }
+
+        __cpuidex(info, 7, 0);
+        return (info[1] & (1 << 5)) != 0;
+#else
+        return __builtin_cpu_supports("avx2");
+#endif
+    }
+#endif
+
+    inline zero_page_kernel select_zero_page_kernel() noexcept
+    {
+#ifdef NETFORK_X64_KERNELS
+        if (cpu_supports_avx2())
+        {
+            return &is_zero_page_avx2;
+        }
+
+        // SSE2 is part of the x64 baseline.
+        return &is_zero_page_sse2;
+#else
+        return &is_zero_page_scalar;
+#endif
+    }
+
+    // `page` must point to `ZERO_PAGE_SIZE` readable bytes.
+    inline bool is_zero_page(const std::byte* page) noexcept
+    {
+        static const zero_page_kernel kernel = select_zero_page_kernel();
+        return kernel(page);
+    }
+}
@@ -0,0 +1,137 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include "check.hpp"
+
+#include <netfork-server/admission_scheduler.hpp>
+
+using namespace netfork::admission;
+
+namespace
+{
+    constexpr std::uint64_t MiB = 1 << 20;
+
+    // Requests `size` bytes of `p`, noting in `admitted` under `id` once they're admitted
+    // after queueing.
+    decision request(scheduler& s, const std::uint64_t size, const priority p, std::vector<int>& admitted, const int id)
+    {
+        return s.request(size, p, [&admitted, id] { admitted.push_back(id); });
+    }
+}
+
+TEST_CASE(admission, admits_within_budget)
+{
+    scheduler s{ options{ .budget = 100 * MiB } };
+    std::vector<int> admitted;
+    CHECK(request(s, 60 * MiB, priority::interactive, admitted, 1) == decision::admitted);
+    CHECK(request(s, 40 * MiB, priority::interactive, admitted, 2) == decision::admitted);
+    CHECK(s.in_use() == 100 * MiB);
+    CHECK(s.queued() == 0);
+
+    // Admitted straight away; the callbacks are only for queued sessions.
+    CHECK(admitted.empty());
+}
+
+TEST_CASE(admission, rejects_what_never_fits)
+{
+    scheduler s{ options{ .budget = 100 * MiB, .bulk_share = 0.5 } };
+    std::vector<int> admitted;
+    CHECK(request(s, 101 * MiB, priority::interactive, admitted, 1) == decision::rejected);
+    CHECK(request(s, 51 * MiB, priority::bulk, admitted, 2) == decision::rejected);
+    CHECK(request(s, 51 * MiB, priority::interactive, admitted, 3) == decision::admitted);
+    CHECK(s.queued() == 0);
+}
+
+TEST_CASE(admission, release_admits_in_order)
+{
+    scheduler s{ options{ .budget = 100 * MiB } };
+    std::vector<int> admitted;
+    CHECK(request(s, 80 * MiB, priority::interactive, admitted, 1) == decision::admitted);
+    CHECK(request(s, 50 * MiB, priority::interactive, admitted, 2) == decision::queued);
+    // Fits, but doesn't jump ahead of the session queued before it.
+    CHECK(request(s, 10 * MiB, priority::interactive, admitted, 3) == decision::queued);
+    CHECK(s.queued() == 2);
+
+    s.release(80 * MiB, priority::interactive);
+    CHECK((admitted == std::vector<int>{ 2, 3 }));
+    CHECK(s.in_use() == 60 * MiB);
+    CHECK(s.queued() == 0);
+}
+
+TEST_CASE(admission, interactive_goes_ahead_of_bulk)
+{
+    scheduler s{ options{ .budget = 100 * MiB, .bulk_share = 0.75 } };
+    std::vector<int> admitted;
+    CHECK(request(s, 70 * MiB, priority::bulk, admitted, 1) == decision::admitted);
+    CHECK(request(s, 50 * MiB, priority::interactive, admitted, 2) == decision::queued);
+    // Would fit in the budget, but waits behind the queued interactive session.
+    CHECK(request(s, 5 * MiB, priority::bulk, admitted, 3) == decision::queued);
+
+    s.release(70 * MiB, priority::bulk);
+    CHECK((admitted == std::vector<int>{ 2, 3 }));
+}
+
+TEST_CASE(admission, bulk_leaves_room_for_interactive)
+{
+    scheduler s{ options{ .budget = 100 * MiB, .bulk_share = 0.75 } };
+    std::vector<int> admitted;
+    CHECK(request(s, 50 * MiB, priority::bulk, admitted, 1) == decision::admitted);
+    CHECK(request(s, 30 * MiB, priority::bulk, admitted, 2) == decision::queued);
+    CHECK(request(s, 25 * MiB, priority::interactive, admitted, 3) == decision::admitted);
+
+    // Freeing interactive memory doesn't let bulk sessions past their share.
+    s.release(25 * MiB, priority::interactive);
+    CHECK(admitted.empty());
+    s.release(50 * MiB, priority::bulk);
+    CHECK((admitted == std::vector<int>{ 2 }));
+}
+
+TEST_CASE(admission, rejects_past_max_queued)
+{
+    scheduler s{ options{ .budget = 100 * MiB, .max_queued = 2 } };
+    std::vector<int> admitted;
+    CHECK(request(s, 100 * MiB, priority::interactive, admitted, 1) == decision::admitted);
+    CHECK(request(s, 10 * MiB, priority::interactive, admitted, 2) == decision::queued);
+    CHECK(request(s, 10 * MiB, priority::interactive, admitted, 3) == decision::queued);
+    CHECK(request(s, 10 * MiB, priority::interactive, admitted, 4) == decision::rejected);
+    // The limit is per priority.
+    CHECK(request(s, 10 * MiB, priority::bulk, admitted, 5) == decision::queued);
+    CHECK(s.queued() == 3);
+}
+
+TEST_CASE(admission, ticket_releases)
+{
+    scheduler s{ options{ .budget = 100 * MiB } };
+    std::vector<int> admitted;
+    {
+        CHECK(request(s, 100 * MiB, priority::interactive, admitted, 1) == decision::admitted);
+        std::optional<ticket> held{ std::in_place, s, 100 * MiB, priority::interactive };
+        CHECK(request(s, 20 * MiB, priority::interactive, admitted, 2) == decision::queued);
+
+        // A moved-from ticket gives nothing back.
+        std::optional<ticket> moved{ std::move(held).value() };
+        held.reset();
+        CHECK(admitted.empty());
+    }
+
+    CHECK((admitted == std::vector<int>{ 2 }));
+    CHECK(s.in_use() == 20 * MiB);
+}
@@ -0,0 +1,191 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "check.hpp"
+
+#include <netfork-lib/capture.hpp>
+
+#ifdef __linux__
+#	include <sys/mman.h>
+#	include <unistd.h>
+#	include <netfork-lib/clone_job.hpp>
+#endif
+
+using namespace netfork;
+using namespace netfork::vm;
+
+namespace
+{
+    constexpr std::uint64_t page_size = net::MANIFEST_PAGE_SIZE;
+
+    struct batch
+    {
+        std::vector<capture_run> runs;
+        std::uint64_t bytes;
+    };
+
+    std::vector<batch> batches_of(const net::address_space_manifest& manifest, const std::size_t max_runs, const std::uint64_t max_bytes)
+    {
+        std::vector<batch> batches;
+        for_each_capture_batch(manifest, is_readable, max_runs, max_bytes, [&](std::span<const capture_run> runs, const std::uint64_t bytes)
+        {
+            batches.push_back({ { runs.begin(), runs.end() }, bytes });
+            return true;
+        });
+        return batches;
+    }
+}
+
+TEST_CASE(capture, parse_maps_line)
+{
+    const auto library = parse_maps_line("7f1234560000-7f1234562000 r-xp 00001000 08:01 1234                       /usr/lib/libc.so.6");
+    CHECK(library && library->start == 0x7f1234560000 && library->end == 0x7f1234562000);
+    CHECK(library && library->read && !library->write && library->execute && !library->shared);
+    CHECK(library && library->path == "/usr/lib/libc.so.6");
+    CHECK(library && protect_of(*library) == PROTECT_EXECUTE_READ);
+
+    const auto anonymous = parse_maps_line("7ffd00000000-7ffd00021000 rw-s 00000000 00:00 0");
+    CHECK(anonymous && anonymous->shared && anonymous->path.empty());
+    CHECK(anonymous && protect_of(*anonymous) == PROTECT_READ_WRITE);
+
+    const auto guard = parse_maps_line("7ffd00021000-7ffd00022000 ---p 00000000 00:00 0 ");
+    CHECK(guard && protect_of(*guard) == PROTECT_NO_ACCESS);
+
+    const auto vvar = parse_maps_line("7ffd00030000-7ffd00034000 r--p 00000000 00:00 0                          [vvar]");
+    CHECK(vvar && vvar->path == "[vvar]" && protect_of(*vvar) == PROTECT_NO_ACCESS);
+
+    CHECK(!parse_maps_line(""));
+    CHECK(!parse_maps_line("7ffd00021000 rw-p 00000000 00:00 0"));
+    CHECK(!parse_maps_line("7ffd00022000-7ffd00021000 rw-p 00000000 00:00 0"));
+    CHECK(!parse_maps_line("7ffd00021000-7ffd00022000 rw-"));
+}
+
+TEST_CASE(capture, manifest_from_maps)
+{
+    const auto manifest = manifest_from_maps(
+        "555555554000-555555556000 r--p 00000000 08:01 42    /usr/bin/true\n"
+        "555555556000-555555557000 rw-p 00000000 00:00 0 \n"
+        "7ffff7ff8000-7ffff7ffc000 r--p 00000000 00:00 0     [vvar]\n"
+        "ffffffffff600000-ffffffffff601000 --xp 00000000 00:00 0    [vsyscall]\n");
+
+    CHECK(manifest.regions.size() == 3);
+    CHECK(manifest.subregions.size() == 3);
+    CHECK(manifest.regions[0].type == TYPE_MAPPED && manifest.regions[0].allocation_size == 2 * page_size);
+    CHECK(manifest.regions[1].type == TYPE_PRIVATE && manifest.subregions[1].protect == PROTECT_READ_WRITE);
+    CHECK(manifest.subregions[2].protect == PROTECT_NO_ACCESS);
+}
+
+TEST_CASE(capture, batches)
+{
+    net::address_space_manifest manifest;
+    manifest.add_region(0x10000, PROTECT_READ_WRITE, TYPE_PRIVATE);
+    manifest.add_subregion(0x10000, 2 * page_size, PROTECT_READ_WRITE);
+    manifest.add_subregion(0x12000, page_size, PROTECT_READ_ONLY);
+    manifest.add_subregion(0x13000, page_size, PROTECT_NO_ACCESS);
+    manifest.add_subregion(0x14000, page_size, PROTECT_READ_WRITE);
+    manifest.add_region(0x20000, PROTECT_READ_WRITE, TYPE_PRIVATE);
+    manifest.add_subregion(0x20000, 8 * page_size, PROTECT_READ_WRITE);
+
+    // Adjacent readable subregions are one run; the no-access page splits them.
+    const auto whole = batches_of(manifest, 16, 64 * page_size);
+    CHECK(whole.size() == 1);
+    CHECK(whole.size() == 1 && whole[0].bytes == 12 * page_size && whole[0].runs.size() == 3);
+    CHECK(whole.size() == 1 && whole[0].runs[0].address == 0x10000 && whole[0].runs[0].size == 3 * page_size);
+
+    // Two runs a batch.
+    const auto by_runs = batches_of(manifest, 2, 64 * page_size);
+    CHECK(by_runs.size() == 2 && by_runs[0].runs.size() == 2 && by_runs[1].runs.size() == 1);
+
+    // At most four pages a batch; the large subregion is split across batches.
+    const auto by_bytes = batches_of(manifest, 16, 4 * page_size);
+    bool within_limit = true;
+    std::uint64_t total = 0;
+    for (const auto& b : by_bytes)
+    {
+        within_limit = within_limit && b.bytes <= 4 * page_size;
+        total += b.bytes;
+    }
+    CHECK(within_limit);
+    CHECK(total == 12 * page_size);
+    CHECK(by_bytes.size() == 3);
+
+    // Stops when told to.
+    std::size_t calls = 0;
+    CHECK(!for_each_capture_batch(manifest, is_readable, 1, 64 * page_size, [&](auto, auto) { return ++calls < 2; }));
+    CHECK(calls == 2);
+}
+
+#ifdef __linux__
+TEST_CASE(capture, read_from_clone)
+{
+    auto* memory = static_cast<std::byte*>(::mmap(nullptr, 4 * page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (!CHECK(memory != MAP_FAILED))
+    {
+        return;
+    }
+
+    for (std::uint64_t page = 0; page < 4; page++)
+    {
+        std::fill_n(memory + page * page_size, page_size, static_cast<std::byte>(page + 1));
+    }
+    ::mprotect(memory + page_size, page_size, PROT_READ);
+    ::mprotect(memory + 2 * page_size, page_size, PROT_NONE);
+
+    const auto base = reinterpret_cast<std::uint64_t>(memory);
+    const auto maps = read_maps(::getpid());
+    if (CHECK(maps.has_value()))
+    {
+        const auto manifest = manifest_from_maps(*maps);
+        const auto* read_only = manifest.find_subregion(base + page_size);
+        const auto* no_access = manifest.find_subregion(base + 2 * page_size);
+        CHECK(read_only && read_only->protect == PROTECT_READ_ONLY);
+        CHECK(no_access && no_access->protect == PROTECT_NO_ACCESS);
+    }
+
+    auto clone = async_fork::fork_clone::capture();
+    if (!clone)
+    {
+        ::munmap(memory, 4 * page_size);
+        std::cerr << "Couldn't fork a clone; skipping" << std::endl;
+        return;
+    }
+
+    std::fill_n(memory, page_size, std::byte{ 0x7F });
+
+    // The no-access page stops the batched read; the pages after it are still read, and it
+    // is left zero.
+    const std::vector<capture_run> runs{ { base, 2 * page_size }, { base + 2 * page_size, 2 * page_size } };
+    std::vector<std::byte> out(4 * page_size, std::byte{ 0xEE });
+    CHECK(read_batch(clone->pid(), runs, out) == 2 * page_size);
+    CHECK(std::all_of(out.begin(), out.begin() + page_size, [](const std::byte b) { return b == std::byte{ 1 }; }));
+    CHECK(std::all_of(out.begin() + page_size, out.begin() + 2 * page_size, [](const std::byte b) { return b == std::byte{ 2 }; }));
+    CHECK(std::all_of(out.begin() + 2 * page_size, out.end(), [](const std::byte b) { return b == std::byte{}; }));
+
+    const std::vector<capture_run> readable{ { base, 2 * page_size }, { base + 3 * page_size, page_size } };
+    out.assign(3 * page_size, std::byte{});
+    CHECK(read_batch(clone->pid(), readable, out) == 3 * page_size);
+    CHECK(out[2 * page_size] == std::byte{ 4 });
+
+    clone.reset();
+    ::munmap(memory, 4 * page_size);
+}
+#endif
@@ -0,0 +1,74 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <iostream>
+#include <string_view>
+#include <vector>
+
+// Just enough of a test harness for the portable parts of netfork, which are the only ones
+// built off Windows. Every `TEST_CASE` registers itself under its suite, and `netfork-tests
+// <suite>` runs the cases of one suite.
+namespace netfork::tests
+{
+    struct test_case
+    {
+        std::string_view suite;
+        std::string_view name;
+        void (*run)();
+    };
+
+    inline std::vector<test_case>& registered()
+    {
+        static std::vector<test_case> cases;
+        return cases;
+    }
+
+    inline std::size_t& failed_checks()
+    {
+        static std::size_t failed = 0;
+        return failed;
+    }
+
+    struct registrar
+    {
+        registrar(const std::string_view suite, const std::string_view name, void (*run)())
+        {
+            registered().push_back({ suite, name, run });
+        }
+    };
+
+    inline bool check(const bool passed, const char* expression, const char* file, const int line)
+    {
+        if (!passed)
+        {
+            failed_checks()++;
+            std::cerr << file << ":" << line << ": check failed: " << expression << std::endl;
+        }
+
+        return passed;
+    }
+}
+
+#define TEST_CASE(suite, name) \
+    static void suite##_##name(); \
+    static const ::netfork::tests::registrar suite##_##name##_registrar{ #suite, #name, &suite##_##name }; \
+    static void suite##_##name()
+
+#define CHECK(...) ::netfork::tests::check(static_cast<bool>(__VA_ARGS__), #__VA_ARGS__, __FILE__, __LINE__)
@@ -0,0 +1,192 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <span>
+#include <vector>
+
+#include "check.hpp"
+
+#include <netfork-shared/chunk_codec.hpp>
+
+using namespace netfork;
+using namespace netfork::compress;
+
+namespace
+{
+    // Halves its input by dropping every other byte, or fails if told to.
+    struct halving_backend
+    {
+        bool fail = false;
+
+        std::size_t compress(codec, std::span<const std::byte> in, std::span<std::byte> out) const noexcept
+        {
+            if (fail || in.size() / 2 > out.size())
+            {
+                return 0;
+            }
+
+            for (std::size_t i = 0; i < in.size() / 2; i++)
+            {
+                out[i] = in[2 * i];
+            }
+
+            return in.size() / 2;
+        }
+
+        bool decompress(codec, std::span<const std::byte> in, std::span<std::byte> out) const noexcept
+        {
+            if (fail || in.size() * 2 != out.size())
+            {
+                return false;
+            }
+
+            for (std::size_t i = 0; i < in.size(); i++)
+            {
+                out[2 * i] = in[i];
+                out[2 * i + 1] = in[i];
+            }
+
+            return true;
+        }
+    };
+
+    // Every byte repeated, so halving loses nothing.
+    std::vector<std::byte> doubled(const std::size_t size)
+    {
+        std::vector<std::byte> bytes(size);
+        for (std::size_t i = 0; i < size; i++)
+        {
+            bytes[i] = static_cast<std::byte>(i / 2);
+        }
+
+        return bytes;
+    }
+
+    std::span<const std::byte> body_of(const std::vector<std::byte>& frame)
+    {
+        return std::span{ frame }.subspan(net::codec::FRAME_HEADER_SIZE);
+    }
+
+    codec codec_of(const std::vector<std::byte>& frame)
+    {
+        return static_cast<codec>(frame[net::codec::FRAME_HEADER_SIZE]);
+    }
+}
+
+TEST_CASE(chunk_codec, frames_the_chunk)
+{
+    halving_backend backend;
+    const auto frames = doubled(1000);
+    const auto chunk = compress_chunk(backend, codec::fast, frames);
+
+    const auto header = net::codec::decode_header(std::span{ chunk }.first<net::codec::FRAME_HEADER_SIZE>());
+    CHECK(header.type == net::codec::frame_type::compressed_chunk);
+    CHECK(header.length == CHUNK_PREFIX_SIZE + frames.size() / 2);
+    CHECK(chunk.size() == net::codec::FRAME_HEADER_SIZE + header.length);
+    CHECK(codec_of(chunk) == codec::fast);
+
+    const auto expanded = decompress_chunk(backend, body_of(chunk));
+    CHECK(expanded.has_value() && *expanded == frames);
+}
+
+TEST_CASE(chunk_codec, stores_what_does_not_shrink)
+{
+    const auto frames = doubled(1000);
+
+    // Asked to store, or the backend fails: the frames go as they are.
+    halving_backend backend;
+    halving_backend failing{ true };
+    for (const auto& chunk : { compress_chunk(backend, codec::store, frames), compress_chunk(failing, codec::dense, frames) })
+    {
+        CHECK(codec_of(chunk) == codec::store);
+        const auto expanded = decompress_chunk(backend, body_of(chunk));
+        CHECK(expanded.has_value() && *expanded == frames);
+    }
+}
+
+TEST_CASE(chunk_codec, rejects_malformed_bodies)
+{
+    halving_backend backend;
+    halving_backend failing{ true };
+    const auto frames = doubled(64);
+
+    // Too short for the prefix.
+    const std::vector<std::byte> short_body(CHUNK_PREFIX_SIZE - 1);
+    CHECK(!decompress_chunk(backend, short_body));
+
+    // Claims more than any chunk may hold.
+    auto oversized = compress_chunk(backend, codec::store, frames);
+    net::codec::store_le(oversized.data() + net::codec::FRAME_HEADER_SIZE + 1, static_cast<std::uint32_t>(MAX_CHUNK_SIZE + 1));
+    CHECK(!decompress_chunk(backend, body_of(oversized)));
+
+    // A stored chunk whose size doesn't match its prefix.
+    auto truncated = compress_chunk(backend, codec::store, frames);
+    truncated.pop_back();
+    CHECK(!decompress_chunk(backend, body_of(truncated)));
+
+    // An unknown codec.
+    auto unknown = compress_chunk(backend, codec::fast, frames);
+    unknown[net::codec::FRAME_HEADER_SIZE] = std::byte{ 3 };
+    CHECK(!decompress_chunk(backend, body_of(unknown)));
+
+    // A compressed payload the backend can't expand.
+    CHECK(!decompress_chunk(failing, body_of(compress_chunk(backend, codec::fast, frames))));
+}
+
+#ifdef NETFORK_HAVE_ZLIB
+TEST_CASE(chunk_codec, deflate_round_trip)
+{
+    deflate_backend backend;
+
+    std::vector<std::byte> compressible(CHUNK_TARGET_SIZE);
+    for (std::size_t i = 0; i < compressible.size(); i++)
+    {
+        compressible[i] = static_cast<std::byte>(i % 251 < 200 ? 0 : i % 7);
+    }
+
+    std::vector<std::byte> random(CHUNK_TARGET_SIZE);
+    std::mt19937 engine{ 42 };
+    for (auto& byte : random)
+    {
+        byte = static_cast<std::byte>(engine());
+    }
+
+    for (const codec method : { codec::fast, codec::dense })
+    {
+        const auto small = compress_chunk(backend, method, compressible);
+        CHECK(codec_of(small) == method);
+        CHECK(small.size() < compressible.size() / 4);
+        const auto expanded = decompress_chunk(backend, body_of(small));
+        CHECK(expanded.has_value() && *expanded == compressible);
+
+        // Random bytes don't shrink, so they're stored.
+        const auto stored = compress_chunk(backend, method, random);
+        CHECK(codec_of(stored) == codec::store);
+        const auto same = decompress_chunk(backend, body_of(stored));
+        CHECK(same.has_value() && *same == random);
+    }
+
+    // A payload cut short doesn't fill the chunk.
+    auto cut = compress_chunk(backend, codec::fast, compressible);
+    cut.resize(cut.size() - 16);
+    CHECK(!decompress_chunk(backend, body_of(cut)));
+}
+#endif
@@ -0,0 +1,219 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include "check.hpp"
+
+#include <netfork-shared/net/chunk_log.hpp>
+
+using namespace netfork::net;
+
+namespace
+{
+    std::vector<std::byte> chunk_of(const std::size_t size, const std::uint8_t value)
+    {
+        return std::vector<std::byte>(size, std::byte{ value });
+    }
+
+    std::uint8_t value_of(const chunk& c)
+    {
+        return std::to_integer<std::uint8_t>(c->front());
+    }
+}
+
+TEST_CASE(chunk_log, every_destination_reads_everything)
+{
+    chunk_log log{ 3 };
+    for (std::uint8_t i = 0; i < 10; i++)
+    {
+        log.append(chunk_of(i + 1, i));
+    }
+
+    log.close();
+    CHECK(log.bytes() == 55);
+
+    for (std::size_t destination = 0; destination < 3; destination++)
+    {
+        std::uint8_t expected = 0;
+        while (const auto c = log.next(destination))
+        {
+            CHECK(value_of(c) == expected);
+            CHECK(c->size() == expected + 1u);
+            expected++;
+        }
+
+        CHECK(expected == 10);
+    }
+}
+
+TEST_CASE(chunk_log, chunks_are_shared_not_copied)
+{
+    chunk_log log{ 2 };
+    log.append(chunk_of(16, 1));
+    log.close();
+
+    const auto first = log.next(0);
+    const auto second = log.next(1);
+    CHECK(first && second && first.get() == second.get());
+}
+
+TEST_CASE(chunk_log, slow_destination_holds_nobody_up)
+{
+    chunk_log log{ 2 };
+    log.append(chunk_of(1, 1));
+    log.append(chunk_of(1, 2));
+
+    // Destination 0 reads everything appended so far while 1 hasn't read anything.
+    CHECK(value_of(log.next(0)) == 1);
+    CHECK(value_of(log.next(0)) == 2);
+
+    log.append(chunk_of(1, 3));
+    CHECK(value_of(log.next(0)) == 3);
+    log.close();
+    CHECK(!log.next(0));
+
+    // The slow destination still gets all of it afterwards.
+    CHECK(value_of(log.next(1)) == 1);
+    CHECK(value_of(log.next(1)) == 2);
+    CHECK(value_of(log.next(1)) == 3);
+    CHECK(!log.next(1));
+}
+
+TEST_CASE(chunk_log, abandoned_destination_is_skipped)
+{
+    chunk_log log{ 2 };
+    log.abandon(1);
+    log.append(chunk_of(1, 7));
+    log.close();
+
+    CHECK(value_of(log.next(0)) == 7);
+    CHECK(!log.next(0));
+}
+
+TEST_CASE(chunk_log, window_holds_back_the_producer)
+{
+    chunk_log log{ 1, 4 };
+    log.append(chunk_of(2, 1));
+    log.append(chunk_of(2, 2));
+
+    std::atomic<bool> appended = false;
+    std::jthread producer{ [&]
+    {
+        log.append(chunk_of(2, 3));
+        appended = true;
+    } };
+
+    std::this_thread::sleep_for(std::chrono::milliseconds{ 50 });
+    CHECK(!appended);
+
+    // Reading one chunk makes room for the next.
+    CHECK(value_of(log.next(0)) == 1);
+    producer.join();
+    CHECK(appended);
+    CHECK(value_of(log.next(0)) == 2);
+    CHECK(value_of(log.next(0)) == 3);
+}
+
+TEST_CASE(chunk_log, lagging_destination_is_dropped)
+{
+    chunk_log log{ 2, 4, std::chrono::milliseconds{ 20 } };
+    log.append(chunk_of(2, 1));
+    log.append(chunk_of(2, 2));
+    CHECK(value_of(log.next(0)) == 1);
+    CHECK(value_of(log.next(0)) == 2);
+
+    // Destination 1 hasn't read anything for longer than the lag limit.
+    log.append(chunk_of(2, 3));
+    log.close();
+
+    CHECK(!log.dropped(0));
+    CHECK(log.dropped(1));
+    CHECK(value_of(log.next(0)) == 3);
+    CHECK(!log.next(0));
+    CHECK(!log.next(1));
+}
+
+TEST_CASE(chunk_log, next_waits_for_appends)
+{
+    chunk_log log{ 1 };
+    std::vector<std::uint8_t> read;
+    std::jthread reader{ [&]
+    {
+        while (const auto c = log.next(0))
+        {
+            read.push_back(value_of(c));
+        }
+    } };
+
+    for (std::uint8_t i = 0; i < 100; i++)
+    {
+        log.append(chunk_of(1, i));
+    }
+
+    log.close();
+    reader.join();
+
+    CHECK(read.size() == 100);
+    for (std::size_t i = 0; i < read.size(); i++)
+    {
+        CHECK(read[i] == i);
+    }
+}
+
+TEST_CASE(chunk_log, readers_of_one_destination_split_it)
+{
+    // As with the stripes of one fork: each chunk goes to exactly one of the readers.
+    constexpr std::size_t READERS = 4;
+    constexpr std::size_t CHUNKS = 1000;
+    chunk_log log{ 1 };
+    std::vector<std::atomic<int>> seen(CHUNKS);
+    {
+        std::vector<std::jthread> readers;
+        for (std::size_t i = 0; i < READERS; i++)
+        {
+            readers.emplace_back([&]
+            {
+                while (const auto c = log.next(0))
+                {
+                    const std::size_t index = std::to_integer<std::size_t>((*c)[0]) | (std::to_integer<std::size_t>((*c)[1]) << 8);
+                    seen[index]++;
+                }
+            });
+        }
+
+        for (std::size_t i = 0; i < CHUNKS; i++)
+        {
+            log.append({ static_cast<std::byte>(i & 0xFF), static_cast<std::byte>(i >> 8) });
+        }
+
+        log.close();
+    }
+
+    bool each_once = true;
+    for (const auto& count : seen)
+    {
+        each_once = each_once && count == 1;
+    }
+
+    CHECK(each_once);
+}
@@ -0,0 +1,139 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <thread>
+#include <vector>
+
+#include "check.hpp"
+
+#include <netfork-lib/clone_job.hpp>
+
+using namespace netfork::async_fork;
+
+namespace
+{
+    // Stands in for a clone: what it read at the time it was taken.
+    struct copied_clone
+    {
+        std::vector<std::byte> bytes;
+    };
+}
+
+TEST_CASE(clone_job, progress_and_result)
+{
+    std::vector<std::uint64_t> done;
+    std::uint64_t total = 0;
+    clone_job<copied_clone, int, std::size_t> job{
+        std::make_unique<copied_clone>(copied_clone{ std::vector<std::byte>(4096) }),
+        [&](const std::uint64_t bytes_done, const std::uint64_t bytes_total)
+        {
+            done.push_back(bytes_done);
+            total = bytes_total;
+        },
+        nullptr
+    };
+
+    job.start([&](std::size_t& stats)
+    {
+        job.set_total(job.clone().bytes.size());
+        for (std::size_t offset = 0; offset < job.clone().bytes.size(); offset += 1024)
+        {
+            job.advance(1024);
+            stats++;
+        }
+
+        return 7;
+    });
+
+    std::size_t stats = 0;
+    CHECK(job.wait(&stats) == 7);
+    CHECK(stats == 4);
+    CHECK(total == 4096);
+    CHECK((done == std::vector<std::uint64_t>{ 0, 1024, 2048, 3072, 4096 }));
+}
+
+TEST_CASE(clone_job, cancel)
+{
+    std::atomic<int> hooks = 0;
+    clone_job<copied_clone, bool, int> job{ std::make_unique<copied_clone>(), nullptr, [&] { hooks++; } };
+    job.start([&](int&)
+    {
+        while (!job.cancelled())
+        {
+            std::this_thread::yield();
+        }
+
+        return false;
+    });
+
+    job.cancel();
+    job.cancel();
+    CHECK(!job.wait(nullptr));
+    CHECK(hooks == 1);
+}
+
+#ifdef __linux__
+// Reads from the clone see memory as it was when it was taken.
+TEST_CASE(clone_job, fork_clone)
+{
+    std::vector<std::byte> memory(64 * 1024, std::byte{ 1 });
+    const auto address = reinterpret_cast<std::uint64_t>(memory.data());
+    auto clone = fork_clone::capture();
+    if (!clone)
+    {
+        std::cerr << "Couldn't fork a clone; skipping" << std::endl;
+        return;
+    }
+
+    std::ranges::fill(memory, std::byte{ 2 });
+
+    clone_job<fork_clone, bool, std::size_t> job{ std::move(clone), nullptr, nullptr };
+    std::vector<std::byte> sent(memory.size());
+    job.start([&](std::size_t& stats)
+    {
+        job.set_total(sent.size());
+        for (std::size_t offset = 0; offset < sent.size(); offset += 4096)
+        {
+            if (!job.clone().read(address + offset, std::span{ sent }.subspan(offset, 4096)))
+            {
+                return false;
+            }
+
+            // The parent carries on meanwhile.
+            memory[offset] = std::byte{ 3 };
+            job.advance(4096);
+            stats += 4096;
+        }
+
+        return true;
+    });
+
+    std::size_t stats = 0;
+    if (!CHECK(job.wait(&stats)))
+    {
+        return;
+    }
+
+    CHECK(stats == memory.size());
+    CHECK(std::ranges::all_of(sent, [](const std::byte b) { return b == std::byte{ 1 }; }));
+}
+#endif
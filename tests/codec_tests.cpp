@@ -0,0 +1,243 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <tuple>
+#include <vector>
+
+#include "check.hpp"
+
+#include <netfork-shared/net/codec.hpp>
+
+namespace
+{
+    enum class colour : std::uint16_t
+    {
+        red = 1,
+        blue = 0x1234
+    };
+
+    // Padded in memory after `tag` and `shade`, but not on the wire.
+    struct sample
+    {
+        std::uint8_t tag = 0;
+        std::uint64_t address = 0;
+        colour shade = colour::red;
+        std::int32_t delta = 0;
+        const void* pointer = nullptr;
+    };
+
+    struct blob
+    {
+        std::uint32_t words[3];
+    };
+
+    std::vector<std::byte> bytes_of(std::initializer_list<int> values)
+    {
+        std::vector<std::byte> bytes;
+        for (const int value : values)
+        {
+            bytes.push_back(static_cast<std::byte>(value));
+        }
+
+        return bytes;
+    }
+}
+
+namespace netfork::net::codec
+{
+    template <>
+    struct message_traits<sample>
+    {
+        static constexpr frame_type type = frame_type::image_info;
+        static constexpr auto fields = std::make_tuple(
+            &sample::tag,
+            &sample::address,
+            &sample::shade,
+            &sample::delta,
+            &sample::pointer
+        );
+    };
+
+    template <>
+    struct opaque_traits<blob>
+    {
+        static constexpr frame_type type = frame_type::thread_context;
+    };
+}
+
+using namespace netfork::net;
+
+static_assert(codec::encoded_size_v<sample> == 1 + 8 + 2 + 4 + 8);
+static_assert(codec::encoded_size_v<blob> == sizeof(blob));
+static_assert(codec::frame_type_of<sample>() == codec::frame_type::image_info);
+
+TEST_CASE(codec, packed_round_trip)
+{
+    const sample in{
+        .tag = 0xAB,
+        .address = 0x0011223344556677,
+        .shade = colour::blue,
+        .delta = -2,
+        .pointer = reinterpret_cast<const void*>(std::uintptr_t{ 0x7FF000 })
+    };
+
+    std::array<std::byte, codec::encoded_size_v<sample>> buf{};
+    codec::encode(in, std::span{ buf });
+
+    // Fields back to back, little-endian whatever the host.
+    CHECK(buf[0] == std::byte{ 0xAB });
+    CHECK(buf[1] == std::byte{ 0x77 });
+    CHECK(buf[8] == std::byte{ 0x00 });
+    CHECK(buf[9] == std::byte{ 0x34 });
+    CHECK(buf[10] == std::byte{ 0x12 });
+    CHECK(buf[11] == std::byte{ 0xFE });
+    CHECK(buf[14] == std::byte{ 0xFF });
+
+    const auto out = codec::decode<sample>(std::span<const std::byte, codec::encoded_size_v<sample>>{ buf });
+    CHECK(out.tag == in.tag);
+    CHECK(out.address == in.address);
+    CHECK(out.shade == in.shade);
+    CHECK(out.delta == in.delta);
+    CHECK(out.pointer == in.pointer);
+}
+
+TEST_CASE(codec, opaque_round_trip)
+{
+    const blob in{ { 1, 0xDEADBEEF, 3 } };
+    const auto frame = codec::encode_frame(in);
+
+    codec::frame_reader reader{ frame };
+    const auto view = reader.next();
+    CHECK(view.has_value());
+    CHECK(view->header.type == codec::frame_type::thread_context);
+    CHECK(view->header.length == sizeof(blob));
+
+    const auto out = codec::decode_body<blob>(view->body);
+    CHECK(out.has_value());
+    CHECK(out->words[1] == 0xDEADBEEF);
+}
+
+TEST_CASE(codec, header_round_trip)
+{
+    const codec::frame_header in{ .type = codec::frame_type::page_data, .length = 0x01020304 };
+    const auto buf = codec::encode_header(in);
+    CHECK(buf[4] == std::byte{ 0x04 });
+    CHECK(buf[7] == std::byte{ 0x01 });
+
+    const auto out = codec::decode_header(buf);
+    CHECK(out.version == codec::PROTOCOL_VERSION);
+    CHECK(out.type == in.type);
+    CHECK(out.length == in.length);
+    CHECK(codec::is_current_version(out));
+}
+
+TEST_CASE(codec, version_mismatch)
+{
+    for (const std::uint16_t version : { 0, codec::PROTOCOL_VERSION - 1, codec::PROTOCOL_VERSION + 1, 0xFFFF })
+    {
+        const auto buf = codec::encode_header({ .version = version, .type = codec::frame_type::manifest });
+        const auto header = codec::decode_header(buf);
+        CHECK(header.version == version);
+        CHECK(!codec::is_current_version(header));
+    }
+}
+
+TEST_CASE(codec, writer_and_reader)
+{
+    const std::array<sample, 3> batch{ {
+        { .tag = 1, .address = 0x1000 },
+        { .tag = 2, .address = 0x2000 },
+        { .tag = 3, .address = 0x3000 }
+    } };
+    std::vector<std::byte> large(codec::MAX_BYTES_FRAME_LENGTH + 10, std::byte{ 0x5A });
+
+    codec::frame_writer writer;
+    writer.write_batch(std::span<const sample>{ batch });
+    writer.write_bytes_chunked(codec::frame_type::image_bytes, large);
+    writer.write_bytes(codec::frame_type::end_of_stream, {});
+
+    const auto frames = writer.release();
+    CHECK(writer.empty());
+
+    codec::frame_reader reader{ frames };
+    for (const auto& expected : batch)
+    {
+        const auto view = reader.next();
+        CHECK(view.has_value() && view->header.type == codec::frame_type::image_info);
+        const auto decoded = codec::decode_body<sample>(view->body);
+        CHECK(decoded.has_value() && decoded->tag == expected.tag && decoded->address == expected.address);
+    }
+
+    const auto first_chunk = reader.next();
+    CHECK(first_chunk.has_value() && first_chunk->header.length == codec::MAX_BYTES_FRAME_LENGTH);
+    const auto second_chunk = reader.next();
+    CHECK(second_chunk.has_value() && second_chunk->header.length == 10);
+    const auto end = reader.next();
+    CHECK(end.has_value() && end->header.type == codec::frame_type::end_of_stream && end->body.empty());
+    CHECK(!reader.next().has_value());
+    CHECK(reader.remaining().empty());
+}
+
+TEST_CASE(codec, truncated_frames)
+{
+    const auto frame = codec::encode_frame(sample{ .tag = 7 });
+
+    // Every proper prefix is an incomplete frame, and is left unread.
+    for (std::size_t size = 0; size < frame.size(); size++)
+    {
+        codec::frame_reader reader{ std::span<const std::byte>{ frame }.first(size) };
+        CHECK(!reader.next().has_value());
+        CHECK(reader.remaining().size() == size);
+    }
+
+    // A body of the wrong size for the message doesn't decode.
+    const std::span<const std::byte> body = std::span<const std::byte>{ frame }.subspan(codec::FRAME_HEADER_SIZE);
+    CHECK(codec::decode_body<sample>(body).has_value());
+    CHECK(!codec::decode_body<sample>(body.first(body.size() - 1)).has_value());
+    std::vector<std::byte> longer{ body.begin(), body.end() };
+    longer.push_back(std::byte{ 0 });
+    CHECK(!codec::decode_body<sample>(longer).has_value());
+}
+
+TEST_CASE(codec, varints)
+{
+    for (const std::uint64_t value : { std::uint64_t{ 0 }, std::uint64_t{ 0x7F }, std::uint64_t{ 0x80 }, std::uint64_t{ 0x123456789 }, ~std::uint64_t{ 0 } })
+    {
+        std::vector<std::byte> buf;
+        codec::write_varint(buf, value);
+        buf.push_back(std::byte{ 0xEE });
+
+        std::span<const std::byte> in{ buf };
+        const auto decoded = codec::read_varint(in);
+        CHECK(decoded.has_value() && decoded.value() == value);
+        CHECK(in.size() == 1);
+    }
+
+    // A varint cut short, or one which never ends, doesn't decode and isn't consumed.
+    const auto truncated = bytes_of({ 0x80, 0x80 });
+    std::span<const std::byte> in{ truncated };
+    CHECK(!codec::read_varint(in).has_value());
+    CHECK(in.size() == truncated.size());
+
+    const std::vector<std::byte> endless(codec::MAX_VARINT_SIZE + 1, std::byte{ 0xFF });
+    in = endless;
+    CHECK(!codec::read_varint(in).has_value());
+}
@@ -0,0 +1,53 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cstddef>
+#include <iostream>
+#include <string_view>
+
+#include "check.hpp"
+
+// Usage: netfork-tests [suite]
+// Runs every case, or only those of `suite`. Exits non-zero if any check failed.
+int main(int argc, char* argv[])
+{
+    using namespace netfork::tests;
+
+    const std::string_view suite = argc > 1 ? argv[1] : "";
+    std::size_t ran = 0;
+    for (const auto& test : registered())
+    {
+        if (!suite.empty() && test.suite != suite)
+        {
+            continue;
+        }
+
+        const std::size_t failed_before = failed_checks();
+        test.run();
+        ran++;
+        std::cout << (failed_checks() == failed_before ? "[ pass ] " : "[ FAIL ] ")
+            << test.suite << "." << test.name << std::endl;
+    }
+
+    if (ran == 0)
+    {
+        std::cerr << "No test cases in suite " << suite << std::endl;
+        return 1;
+    }
+
+    return failed_checks() == 0 ? 0 : 1;
+}
@@ -0,0 +1,218 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "check.hpp"
+
+#include <netfork-shared/net/codec.hpp>
+#include <netfork-shared/net/manifest.hpp>
+
+using namespace netfork::net;
+
+namespace
+{
+    constexpr std::uint64_t PAGE = MANIFEST_PAGE_SIZE;
+
+    address_space_manifest sample_manifest()
+    {
+        address_space_manifest manifest;
+        manifest.add_region(0x10000, 0x04, 0x20000);
+        manifest.add_subregion(0x10000, 2 * PAGE, 0x04);
+        manifest.add_subregion(0x12000, 1 * PAGE, 0x02);
+        manifest.add_region(0x7FF000000000, 0x20, 0x1000000);
+        manifest.add_subregion(0x7FF000001000, 3 * PAGE, 0x20);
+        return manifest;
+    }
+
+    // A manifest with `subregions` one-page subregions, in regions of 16, with varying
+    // protections so the encoding doesn't collapse into a few runs.
+    address_space_manifest large_manifest(const std::size_t subregions)
+    {
+        address_space_manifest manifest;
+        std::uint64_t address = 0x10000;
+        for (std::size_t i = 0; i < subregions; i++)
+        {
+            if (i % 16 == 0)
+            {
+                address += 0x100 * PAGE;
+                manifest.add_region(address, 0x04, 0x20000);
+            }
+
+            manifest.add_subregion(address, PAGE, static_cast<std::uint32_t>(i * 0x9E3779B1));
+            address += 2 * PAGE;
+        }
+
+        return manifest;
+    }
+
+    bool same(const address_space_manifest& a, const address_space_manifest& b)
+    {
+        if (a.regions.size() != b.regions.size() || a.subregions.size() != b.subregions.size())
+        {
+            return false;
+        }
+
+        for (const auto& region : a.regions)
+        {
+            if (!b.find_same_region(a, region))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    std::vector<std::byte> varints(std::initializer_list<std::uint64_t> values)
+    {
+        std::vector<std::byte> out;
+        for (const auto value : values)
+        {
+            codec::write_varint(out, value);
+        }
+
+        return out;
+    }
+}
+
+TEST_CASE(manifest, round_trip)
+{
+    const auto manifest = sample_manifest();
+    const auto decoded = decode_manifest(encode_manifest(manifest));
+    CHECK(decoded.has_value() && same(manifest, decoded.value()));
+    CHECK(decoded->find_subregion(0x12000)->protect == 0x02);
+    CHECK(decoded->find_subregion(0x13000) == nullptr);
+    CHECK(decode_manifest(encode_manifest({})).has_value());
+}
+
+TEST_CASE(manifest, rejects_trailing_bytes)
+{
+    auto encoded = encode_manifest(sample_manifest());
+    encoded.push_back(std::byte{ 0 });
+    CHECK(!decode_manifest(encoded).has_value());
+}
+
+TEST_CASE(manifest, rejects_truncation)
+{
+    const auto encoded = encode_manifest(sample_manifest());
+    for (std::size_t size = 0; size < encoded.size(); size++)
+    {
+        CHECK(!decode_manifest(std::span{ encoded }.first(size)).has_value());
+    }
+}
+
+TEST_CASE(manifest, rejects_empty_regions_and_subregions)
+{
+    // One region with no subregions.
+    CHECK(!decode_manifest(varints({ 1, 0, 16, 4, 0, 1, 1 })).has_value());
+    // One region with one subregion of no pages.
+    CHECK(!decode_manifest(varints({ 1, 1, 16, 4, 1, 0, 0, 4, 1, 1, 1 })).has_value());
+    // The same with one page decodes.
+    CHECK(decode_manifest(varints({ 1, 1, 16, 4, 1, 0, 1, 4, 1, 1, 1 })).has_value());
+}
+
+TEST_CASE(manifest, rejects_overflow)
+{
+    constexpr std::uint64_t MAX_PAGES = ~std::uint64_t{ 0 } / PAGE;
+
+    // A region based past the end of the address space.
+    CHECK(!decode_manifest(varints({ 1, 1, MAX_PAGES + 1, 4, 1, 0, 1, 4, 1, 1, 1 })).has_value());
+    // A subregion running past it.
+    CHECK(!decode_manifest(varints({ 1, 1, MAX_PAGES - 1, 4, 1, 0, 2, 4, 1, 1, 1 })).has_value());
+    // A second region whose delta would wrap it around below the first.
+    CHECK(!decode_manifest(varints({ 2, 2, 16, 4, 1, 0, 1, MAX_PAGES - 4, 4, 1, 0, 1, 4, 2, 1, 2 })).has_value());
+    // Protections which don't fit in 32 bits.
+    CHECK(!decode_manifest(varints({ 1, 1, 16, 4, 1, 0, 1, 0x100000000, 1, 1, 1 })).has_value());
+}
+
+TEST_CASE(manifest, decoded_regions_ascend)
+{
+    const auto decoded = decode_manifest(encode_manifest(large_manifest(1000)));
+    CHECK(decoded.has_value());
+
+    std::uint64_t previous_end = 0;
+    for (const auto& subregion : decoded->subregions)
+    {
+        CHECK(subregion.base_address >= previous_end);
+        CHECK(subregion.region_size != 0);
+        previous_end = subregion.end_address();
+    }
+}
+
+TEST_CASE(manifest, assembles_split_frames)
+{
+    // Large enough to take several frames.
+    const auto manifest = large_manifest(600000);
+    codec::frame_writer writer;
+    CHECK(write_manifest(writer, manifest));
+
+    manifest_assembler assembler;
+    codec::frame_reader reader{ writer.data() };
+    std::size_t frames = 0;
+    auto status = manifest_assembler::status::incomplete;
+    while (const auto frame = reader.next())
+    {
+        CHECK(frame->header.type == codec::frame_type::manifest);
+        CHECK(assembler.accepts(frame->header.length));
+        CHECK(status == manifest_assembler::status::incomplete);
+        status = assembler.add(frame->body);
+        frames++;
+    }
+
+    CHECK(frames > 1);
+    CHECK(status == manifest_assembler::status::complete);
+    const auto decoded = assembler.take();
+    CHECK(decoded.has_value() && same(manifest, decoded.value()));
+
+    // The assembler is ready for the next manifest.
+    codec::frame_writer small;
+    CHECK(write_manifest(small, sample_manifest()));
+    codec::frame_reader small_reader{ small.data() };
+    CHECK(assembler.add(small_reader.next()->body) == manifest_assembler::status::complete);
+    CHECK(assembler.take().has_value());
+}
+
+TEST_CASE(manifest, assembler_rejects_bad_lengths)
+{
+    manifest_assembler assembler;
+    CHECK(!assembler.accepts(0));
+    CHECK(!assembler.accepts(3));
+    CHECK(!assembler.accepts(0xFFFFFFFF));
+    CHECK(!assembler.accepts(codec::MAX_BYTES_FRAME_LENGTH + 1));
+
+    // A size prefix over the cap.
+    std::vector<std::byte> body(8);
+    codec::store_le(body.data(), static_cast<std::uint32_t>(MAX_MANIFEST_SIZE + 1));
+    CHECK(assembler.add(body) == manifest_assembler::status::malformed);
+
+    // More bytes than the prefix promised.
+    manifest_assembler overfull;
+    codec::store_le(body.data(), std::uint32_t{ 2 });
+    CHECK(overfull.add(body) == manifest_assembler::status::malformed);
+
+    // Once started, nothing past the promised size is accepted.
+    manifest_assembler partial;
+    codec::store_le(body.data(), std::uint32_t{ 10 });
+    CHECK(partial.add(body) == manifest_assembler::status::incomplete);
+    CHECK(partial.accepts(6));
+    CHECK(!partial.accepts(7));
+    CHECK(!partial.accepts(0));
+}
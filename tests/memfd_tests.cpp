@@ -0,0 +1,109 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "check.hpp"
+
+#include <netfork-server/memfd_regions.hpp>
+
+using namespace netfork;
+using namespace netfork::vm;
+
+namespace
+{
+    constexpr std::size_t page_size = 4096;
+    constexpr std::size_t region_size = 8 * page_size;
+}
+
+TEST_CASE(memfd, find)
+{
+    memfd_regions regions;
+    const std::uint64_t base = 0x10000000;
+    if (!CHECK(regions.map(base + region_size, region_size)) || !CHECK(regions.map(base, region_size)))
+    {
+        return;
+    }
+
+    CHECK(regions.size() == 2);
+    CHECK(regions.find(base, region_size) != nullptr);
+    CHECK(regions.find(base + region_size - page_size, page_size) != nullptr);
+    // Straddling two regions, or before the first.
+    CHECK(regions.find(base + region_size - page_size, 2 * page_size) == nullptr);
+    CHECK(regions.find(base - page_size, page_size) == nullptr);
+    CHECK(regions.find(base + 2 * region_size, page_size) == nullptr);
+
+    CHECK(!regions.unmap(base + page_size));
+    CHECK(regions.unmap(base));
+    CHECK(regions.find(base, page_size) == nullptr);
+    CHECK(regions.size() == 1);
+}
+
+// What the server receives into the views is what the child sees at the regions' bases,
+// and what the child writes there is what the server sees.
+TEST_CASE(memfd, child_sees_views)
+{
+    // The child's address space has the regions reserved, as a forked process would.
+    auto* reserved = static_cast<std::byte*>(::mmap(nullptr, 2 * region_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (!CHECK(reserved != MAP_FAILED))
+    {
+        return;
+    }
+
+    const auto base = reinterpret_cast<std::uint64_t>(reserved);
+    memfd_regions regions;
+    if (!CHECK(regions.map(base, region_size)) || !CHECK(regions.map(base + region_size, region_size)))
+    {
+        ::munmap(reserved, 2 * region_size);
+        return;
+    }
+
+    std::fill_n(regions.find(base, region_size), region_size, std::byte{ 0x11 });
+    std::fill_n(regions.find(base + region_size, region_size), region_size, std::byte{ 0x22 });
+
+    const pid_t pid = ::fork();
+    if (pid == 0)
+    {
+        if (!regions.map_fixed())
+        {
+            ::_exit(2);
+        }
+
+        const bool matches = std::all_of(reserved, reserved + region_size, [](const std::byte b) { return b == std::byte{ 0x11 }; })
+            && std::all_of(reserved + region_size, reserved + 2 * region_size, [](const std::byte b) { return b == std::byte{ 0x22 }; });
+        reserved[0] = std::byte{ 0x33 };
+        reserved[region_size] = std::byte{ 0x44 };
+        ::_exit(matches ? 0 : 1);
+    }
+
+    int status = 0;
+    if (CHECK(pid > 0) && CHECK(::waitpid(pid, &status, 0) == pid))
+    {
+        CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        CHECK(*regions.find(base, 1) == std::byte{ 0x33 });
+        CHECK(*regions.find(base + region_size, 1) == std::byte{ 0x44 });
+    }
+
+    regions.release_views();
+    ::munmap(reserved, 2 * region_size);
+}
@@ -0,0 +1,104 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <array>
+#include <cstddef>
+#include <string_view>
+#include <vector>
+
+#include "check.hpp"
+
+#include <netfork-shared/page_hash.hpp>
+
+using namespace netfork;
+
+namespace
+{
+    // The first 16 bytes of a hex SHA-256 digest, as a `page_hash`.
+    page_hash truncated(const std::string_view hex)
+    {
+        std::array<std::byte, PAGE_HASH_SIZE> bytes{};
+        for (std::size_t i = 0; i < bytes.size(); i++)
+        {
+            const auto nibble = [](const char c) { return c <= '9' ? c - '0' : c - 'a' + 10; };
+            bytes[i] = static_cast<std::byte>(nibble(hex[2 * i]) << 4 | nibble(hex[2 * i + 1]));
+        }
+
+        return {
+            .low = detail::load_u64_le(bytes.data()),
+            .high = detail::load_u64_le(bytes.data() + sizeof(std::uint64_t))
+        };
+    }
+
+    std::vector<std::byte> repeated(const char c, const std::size_t count)
+    {
+        return std::vector<std::byte>(count, static_cast<std::byte>(c));
+    }
+
+    // Bytes 0 to 255, over and over.
+    std::vector<std::byte> counting_page()
+    {
+        std::vector<std::byte> page(HASHED_PAGE_SIZE);
+        for (std::size_t i = 0; i < page.size(); i++)
+        {
+            page[i] = static_cast<std::byte>(i);
+        }
+
+        return page;
+    }
+}
+
+TEST_CASE(page_hash, known_answers)
+{
+    // FIPS 180-4 examples, and lengths either side of where padding needs a second block.
+    const std::array<std::byte, 3> abc{ std::byte{ 'a' }, std::byte{ 'b' }, std::byte{ 'c' } };
+    CHECK(hash_bytes(abc) == truncated("ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"));
+    CHECK(hash_bytes({}) == truncated("e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"));
+    CHECK(hash_bytes(repeated('a', 55)) == truncated("9f4390f8d30c2dd92ec9f095b65e2b9ae9b0a925a5258e241c9f1e910f734318"));
+    CHECK(hash_bytes(repeated('a', 56)) == truncated("b35439a4ac6f0948b6d6f9e3c6af0f5f590ce20f1bde7090ef7970686ec6738a"));
+    CHECK(hash_bytes(repeated('a', 63)) == truncated("7d3e74a05d7db15bce4ad9ec0658ea98e3f06eeecf16b4c6fff2da457ddc2f34"));
+    CHECK(hash_bytes(repeated('a', 64)) == truncated("ffe054fe7ae0cb6dc65c3af9b61d5209f439851db43d0ba5997337df154668eb"));
+    CHECK(hash_bytes(repeated('a', 119)) == truncated("31eba51c313a5c08226adf18d4a359cfdfd8d2e816b13f4af952f7ea6584dcfb"));
+    CHECK(hash_bytes(repeated('a', 1000000)) == truncated("cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0"));
+}
+
+TEST_CASE(page_hash, pages)
+{
+    const std::vector<std::byte> zero(HASHED_PAGE_SIZE);
+    CHECK(hash_page(zero.data()) == truncated("ad7facb2586fc6e966c004d7d1d16b024f5805ff7cb47c7a85dabd8b48892ca7"));
+
+    const auto page = counting_page();
+    CHECK(hash_page(page.data()) == truncated("c8f5d0341d54d951a71b136e6e2afcb14d11ed8489a7ae126a8fee0df6ecf193"));
+
+    // Chained from an all-zero hash, the page follows 16 zero bytes.
+    CHECK(hash_page(page.data(), page_hash{}) == truncated("bc090c1df9bd536b793b08ef2ecabbb1cd5d093d806d91819d732f1fc8e2e0bf"));
+}
+
+TEST_CASE(page_hash, chaining_depends_on_everything)
+{
+    const auto page = counting_page();
+    const page_hash start = hash_page(page.data());
+
+    // The order of pages, the starting point and the values folded in all change the result.
+    auto flipped = page;
+    flipped[HASHED_PAGE_SIZE - 1] ^= std::byte{ 1 };
+    CHECK(hash_page(flipped.data(), start) != hash_page(page.data(), start));
+    CHECK(hash_page(page.data(), hash_page(flipped.data())) != hash_page(flipped.data(), start));
+    CHECK(hash_values(start, 0x1000, 0x2000) != hash_values(start, 0x2000, 0x1000));
+    CHECK(hash_values(start, 0x1000, 0x2000) != hash_values({}, 0x1000, 0x2000));
+    CHECK(hash_values(start, 0x1000, 0x2000) == hash_values(start, 0x1000, 0x2000));
+}
@@ -0,0 +1,178 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <thread>
+
+#include "check.hpp"
+
+#include <netfork-shared/pipeline.hpp>
+
+using namespace netfork;
+using namespace std::chrono_literals;
+
+TEST_CASE(pipeline, results_in_push_order)
+{
+    // Early items take longest, so the workers finish them out of order.
+    constexpr int COUNT = 64;
+    ordered_pipeline<int, int> pipeline{ 4, 16, [](int& item)
+    {
+        std::this_thread::sleep_for(std::chrono::microseconds{ (COUNT - item) * 50 });
+        return item * 3;
+    } };
+
+    std::jthread producer{ [&]
+    {
+        for (int item = 0; item < COUNT; item++)
+        {
+            CHECK(pipeline.push(item));
+        }
+
+        pipeline.close();
+    } };
+
+    int expected = 0;
+    while (const auto output = pipeline.pop())
+    {
+        CHECK(*output == expected * 3);
+        expected++;
+    }
+
+    CHECK(expected == COUNT);
+}
+
+TEST_CASE(pipeline, bounds_items_in_flight)
+{
+    ordered_pipeline<int, int> pipeline{ 2, 2, [](int& item) { return item; } };
+    std::atomic<int> pushed = 0;
+    std::jthread producer{ [&]
+    {
+        for (int item = 0; item < 5; item++)
+        {
+            CHECK(pipeline.push(item));
+            pushed++;
+        }
+
+        pipeline.close();
+    } };
+
+    // Nothing has been popped, so only two items get in.
+    std::this_thread::sleep_for(50ms);
+    CHECK(pushed == 2);
+
+    for (int item = 0; item < 5; item++)
+    {
+        const auto output = pipeline.pop();
+        CHECK(output.has_value() && *output == item);
+    }
+
+    CHECK(!pipeline.pop().has_value());
+    CHECK(pushed == 5);
+}
+
+TEST_CASE(pipeline, close_drains_then_ends)
+{
+    ordered_pipeline<int, int> pipeline{ 3, 8, [](int& item) { return -item; } };
+    for (int item = 0; item < 8; item++)
+    {
+        CHECK(pipeline.push(item));
+    }
+
+    pipeline.close();
+    CHECK(!pipeline.push(8));
+    for (int item = 0; item < 8; item++)
+    {
+        const auto output = pipeline.pop();
+        CHECK(output.has_value() && *output == -item);
+    }
+
+    CHECK(!pipeline.pop().has_value());
+}
+
+TEST_CASE(pipeline, cancel_wakes_producer_and_consumer)
+{
+    ordered_pipeline<int, int> pipeline{ 1, 1, [](int& item) { return item; } };
+    CHECK(pipeline.push(0));
+
+    std::atomic<bool> blocked_push = true;
+    std::jthread producer{ [&]
+    {
+        blocked_push = pipeline.push(1);
+    } };
+
+    std::this_thread::sleep_for(20ms);
+    pipeline.cancel();
+    producer.join();
+    CHECK(!blocked_push);
+    CHECK(!pipeline.pop().has_value());
+    CHECK(!pipeline.push(2));
+}
+
+TEST_CASE(pipeline, work_pool_runs_every_job)
+{
+    std::atomic<int> ran = 0;
+    std::atomic<bool> on_caller = false;
+    const auto caller = std::this_thread::get_id();
+    {
+        work_pool pool{ 3 };
+        for (int i = 0; i < 100; i++)
+        {
+            pool.submit([&, guard = std::make_unique<int>(i)]
+            {
+                on_caller = on_caller || std::this_thread::get_id() == caller;
+                ran++;
+            });
+        }
+    }
+
+    // Everything submitted ran before the pool went away, none of it on the caller.
+    CHECK(ran == 100);
+    CHECK(!on_caller);
+}
+
+TEST_CASE(pipeline, work_pool_is_bounded)
+{
+    constexpr unsigned int THREADS = 2;
+    std::atomic<int> running = 0;
+    std::atomic<int> most_running = 0;
+    work_pool pool{ THREADS };
+    for (int i = 0; i < 16; i++)
+    {
+        pool.submit([&]
+        {
+            const int now = ++running;
+            for (int seen = most_running; now > seen && !most_running.compare_exchange_weak(seen, now);)
+            {
+            }
+
+            std::this_thread::sleep_for(2ms);
+            running--;
+        });
+    }
+
+    // However much is queued, no more jobs run at once than there are threads.
+    CHECK(pool.queued() > 0);
+    while (pool.queued() > 0)
+    {
+        std::this_thread::sleep_for(1ms);
+    }
+
+    CHECK(most_running > 0 && most_running <= static_cast<int>(THREADS));
+}
@@ -0,0 +1,409 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "check.hpp"
+
+#include <netfork-shared/post_copy.hpp>
+
+#ifdef __linux__
+#	include <sys/mman.h>
+#	include <netfork-server/userfault.hpp>
+#endif
+
+using namespace netfork;
+using namespace netfork::post_copy;
+
+namespace
+{
+    constexpr std::uint64_t page_size = net::MANIFEST_PAGE_SIZE;
+    constexpr std::uint32_t PAGE_READWRITE = 0x04;
+    constexpr std::uint32_t PAGE_NOACCESS = 0x01;
+
+    // One region of `page_count` pages at `base`, split in two subregions at `split`.
+    net::address_space_manifest make_manifest(const std::uint64_t base, const std::uint64_t page_count, const std::uint64_t split)
+    {
+        net::address_space_manifest manifest;
+        manifest.add_region(base, PAGE_READWRITE, 0);
+        manifest.add_subregion(base, split * page_size, PAGE_READWRITE);
+        manifest.add_subregion(base + split * page_size, (page_count - split) * page_size, PAGE_READWRITE);
+        return manifest;
+    }
+
+    // A run of `page_count` pages at `address` whose present pages are those for which
+    // `present(page)` holds.
+    template <typename Present>
+    net::page_run make_run(const std::uint64_t address, const std::uint32_t page_count, Present&& present)
+    {
+        net::page_run run{ .address = address, .page_count = page_count };
+        for (std::uint32_t page = 0; page < page_count; page++)
+        {
+            if (present(page))
+            {
+                run.set_present(page);
+            }
+        }
+        return run;
+    }
+
+    bool has_payload(const std::uint32_t protect)
+    {
+        return protect != PAGE_NOACCESS;
+    }
+
+    struct installed_run
+    {
+        std::uint64_t address;
+        std::vector<const std::byte*> pages;
+    };
+}
+
+TEST_CASE(post_copy, readahead)
+{
+    const auto manifest = make_manifest(0x10000, 40, 20);
+    const auto& first = manifest.subregions[0];
+
+    CHECK(readahead(first, 0x10000) == page_span{ 0x10000, FAULT_READAHEAD_PAGES });
+    // Near the end of a subregion, readahead stops at it.
+    CHECK(readahead(first, 0x10000 + 17 * page_size) == page_span{ 0x10000 + 17 * page_size, 3 });
+    CHECK(readahead(first, 0x10000 + 19 * page_size) == page_span{ 0x10000 + 19 * page_size, 1 });
+}
+
+TEST_CASE(post_copy, is_valid_request)
+{
+    auto manifest = make_manifest(0x10000, 40, 20);
+    manifest.add_region(0x100000, PAGE_NOACCESS, 0);
+    manifest.add_subregion(0x100000, 4 * page_size, PAGE_NOACCESS);
+
+    CHECK(is_valid_request(manifest, { 0x10000, 20 }, has_payload));
+    CHECK(is_valid_request(manifest, { 0x10000 + 20 * page_size, 1 }, has_payload));
+    CHECK(!is_valid_request(manifest, { 0x10000, 0 }, has_payload));
+    CHECK(!is_valid_request(manifest, { 0x10001, 1 }, has_payload));
+    // Spans two subregions, or runs off the end of one.
+    CHECK(!is_valid_request(manifest, { 0x10000, 21 }, has_payload));
+    CHECK(!is_valid_request(manifest, { 0x10000 + 39 * page_size, 2 }, has_payload));
+    // Outside the manifest, or in a subregion with nothing to send.
+    CHECK(!is_valid_request(manifest, { 0x8000, 1 }, has_payload));
+    CHECK(!is_valid_request(manifest, { 0x100000, 1 }, has_payload));
+    CHECK(!is_valid_request(manifest, { 0x10000, net::MAX_PAGES_PER_FRAME + 1 }, has_payload));
+}
+
+TEST_CASE(post_copy, install_buffered_runs)
+{
+    lazy_pages pages{ make_manifest(0x10000, 8, 4) };
+    pages.mark_lazy(0);
+    CHECK(pages.is_lazy(0x10000));
+    CHECK(!pages.is_lazy(0x10000 + 4 * page_size));
+
+    // Pages 1 and 2 present, 0 and 3 zero; the second run is in a subregion that isn't lazy.
+    std::vector<std::byte> bytes(2 * page_size, std::byte{ 0x11 });
+    pages.buffer_run(make_run(0x10000, 4, [](auto page) { return page == 1 || page == 2; }), bytes.data());
+    pages.buffer_run(make_run(0x10000 + 4 * page_size, 1, [](auto) { return true; }), bytes.data());
+
+    std::vector<installed_run> installed;
+    pages.install_buffered([&](const auto&, const auto address, const auto run)
+    {
+        installed.push_back({ address, { run.begin(), run.end() } });
+    });
+
+    if (!CHECK(installed.size() == 1))
+    {
+        return;
+    }
+
+    CHECK(installed[0].address == 0x10000);
+    CHECK(installed[0].pages.size() == 4);
+    CHECK(installed[0].pages[0] == nullptr && installed[0].pages[3] == nullptr);
+    CHECK(installed[0].pages[1] && std::to_integer<int>(installed[0].pages[1][0]) == 0x11);
+    CHECK(pages.is_installed(0x10000 + 2 * page_size + 5));
+
+    // Installed pages are never buffered again; the child may have written to them.
+    pages.buffer_run(make_run(0x10000, 1, [](auto) { return true; }), bytes.data());
+    installed.clear();
+    pages.install_buffered([&](const auto&, const auto address, const auto run)
+    {
+        installed.push_back({ address, { run.begin(), run.end() } });
+    });
+    CHECK(installed.empty());
+}
+
+TEST_CASE(post_copy, await_page)
+{
+    lazy_pages pages{ make_manifest(0x10000, 8, 4) };
+    pages.mark_lazy(0);
+
+    std::vector<page_span> requests;
+    std::vector<std::byte> bytes(page_size, std::byte{ 0x22 });
+
+    // A buffered page is served without asking.
+    pages.buffer_run(make_run(0x10000, 1, [](auto) { return true; }), bytes.data());
+    CHECK(pages.await_page(0x10000 + 12, [&](const page_span& span) { requests.push_back(span); return true; }));
+    CHECK(requests.empty());
+
+    // A pending one is asked for with its readahead, and waited for.
+    std::thread client{ [&]
+    {
+        while (pages.pages_requested() == 0)
+        {
+            std::this_thread::yield();
+        }
+        pages.buffer_run(make_run(0x10000 + page_size, 3, [](auto) { return false; }), nullptr);
+    } };
+    CHECK(pages.await_page(0x10000 + page_size, [&](const page_span& span) { requests.push_back(span); return true; }));
+    client.join();
+
+    CHECK(requests.size() == 1 && requests[0] == page_span{ 0x10000 + page_size, 3 });
+    CHECK(pages.pages_requested() == 3);
+
+    // Outside the lazy subregions, or when the request can't be sent.
+    lazy_pages other{ make_manifest(0x10000, 8, 4) };
+    other.mark_lazy(0);
+    CHECK(!other.await_page(0x10000 + 4 * page_size, [](const page_span&) { return true; }));
+    CHECK(!other.await_page(0x10000, [](const page_span&) { return false; }));
+}
+
+TEST_CASE(post_copy, install_remaining)
+{
+    lazy_pages pages{ make_manifest(0x10000, 8, 4) };
+    pages.mark_lazy(1);
+
+    std::vector<std::byte> bytes(page_size, std::byte{ 0x33 });
+    pages.buffer_run(make_run(0x10000 + 5 * page_size, 1, [](auto) { return true; }), bytes.data());
+    pages.end_push(true);
+
+    // Once the push is done, a page that never arrived is zero and needs no request.
+    CHECK(pages.await_page(0x10000 + 7 * page_size, [](const page_span&) { return false; }));
+
+    std::vector<installed_run> installed;
+    pages.install_remaining([&](const auto&, const auto address, const auto run)
+    {
+        installed.push_back({ address, { run.begin(), run.end() } });
+    });
+
+    // Pages 5 and 7 as buffered, then 4 and 6 as zero runs of their own.
+    if (!CHECK(installed.size() == 4))
+    {
+        return;
+    }
+
+    CHECK(installed[0].address == 0x10000 + 5 * page_size && installed[0].pages[0] != nullptr);
+    CHECK(installed[1].address == 0x10000 + 7 * page_size && installed[1].pages[0] == nullptr);
+    CHECK(installed[2].address == 0x10000 + 4 * page_size && installed[2].pages.size() == 1);
+    CHECK(installed[3].address == 0x10000 + 6 * page_size && installed[3].pages.size() == 1);
+    for (std::uint64_t page = 4; page < 8; page++)
+    {
+        CHECK(pages.is_installed(0x10000 + page * page_size));
+    }
+}
+
+TEST_CASE(post_copy, receive_failed)
+{
+    lazy_pages pages{ make_manifest(0x10000, 8, 4) };
+    pages.mark_lazy(0);
+
+    std::thread receiver{ [&]
+    {
+        while (pages.pages_requested() == 0)
+        {
+            std::this_thread::yield();
+        }
+        pages.end_push(false);
+    } };
+    CHECK(!pages.await_page(0x10000, [](const page_span&) { return true; }));
+    receiver.join();
+    CHECK(pages.receive_failed());
+}
+
+#ifdef __linux__
+namespace
+{
+    // Stands in for the client: answers page requests, and pushes every page once told to.
+    class fake_client
+    {
+        lazy_pages& pages_;
+        const std::byte* source_;
+        std::uint64_t base_;
+        std::uint32_t page_count_;
+
+        std::mutex mutex_;
+        std::condition_variable wake_;
+        std::deque<page_span> requests_;
+        bool push_ = false;
+
+        // Sends `span` the way `page_data` frames carry it: zero pages aren't present.
+        void send(const page_span& span)
+        {
+            const std::uint64_t first = (span.address - base_) / page_size;
+            std::vector<std::byte> bytes;
+            const auto run = make_run(span.address, span.page_count, [&](const std::uint32_t page)
+            {
+                const std::byte* contents = source_ + (first + page) * page_size;
+                if (std::all_of(contents, contents + page_size, [](std::byte b) { return b == std::byte{ 0 }; }))
+                {
+                    return false;
+                }
+
+                bytes.insert(bytes.end(), contents, contents + page_size);
+                return true;
+            });
+            pages_.buffer_run(run, bytes.data());
+        }
+
+    public:
+        fake_client(lazy_pages& pages, const std::byte* source, const std::uint64_t base, const std::uint32_t page_count)
+            : pages_{ pages }
+            , source_{ source }
+            , base_{ base }
+            , page_count_{ page_count }
+        {
+        }
+
+        bool request(const page_span& span)
+        {
+            {
+                std::lock_guard lock{ mutex_ };
+                requests_.push_back(span);
+            }
+            wake_.notify_one();
+            return true;
+        }
+
+        void push()
+        {
+            {
+                std::lock_guard lock{ mutex_ };
+                push_ = true;
+            }
+            wake_.notify_one();
+        }
+
+        void run()
+        {
+            while (true)
+            {
+                std::unique_lock lock{ mutex_ };
+                wake_.wait(lock, [&] { return !requests_.empty() || push_; });
+                if (!requests_.empty())
+                {
+                    const page_span span = requests_.front();
+                    requests_.pop_front();
+                    lock.unlock();
+                    send(span);
+                    continue;
+                }
+
+                lock.unlock();
+                for (std::uint32_t page = 0; page < page_count_; page += FAULT_READAHEAD_PAGES)
+                {
+                    send({ base_ + page * page_size, std::min(FAULT_READAHEAD_PAGES, page_count_ - page) });
+                }
+                pages_.end_push(true);
+                return;
+            }
+        }
+    };
+}
+
+TEST_CASE(post_copy, userfaultfd)
+{
+    constexpr std::uint32_t page_count = 64;
+    const auto uffd = open_userfaultfd();
+    if (!uffd)
+    {
+        std::cerr << "userfaultfd isn't available; skipping" << std::endl;
+        return;
+    }
+
+    // The pages the child should end up with; every eighth one is zero.
+    std::vector<std::byte> source(page_count * page_size);
+    for (std::uint32_t page = 0; page < page_count; page++)
+    {
+        if (page % 8 != 5)
+        {
+            std::fill_n(source.begin() + page * page_size, page_size, static_cast<std::byte>(page + 1));
+        }
+    }
+
+    auto* memory = static_cast<std::byte*>(::mmap(
+        nullptr, page_count * page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (!CHECK(memory != MAP_FAILED))
+    {
+        ::close(*uffd);
+        return;
+    }
+
+    const auto base = reinterpret_cast<std::uint64_t>(memory);
+    net::address_space_manifest manifest;
+    manifest.add_region(base, PAGE_READWRITE, 0);
+    manifest.add_subregion(base, page_count * page_size, PAGE_READWRITE);
+
+    lazy_pages pages{ manifest };
+    pages.mark_lazy(0);
+    userfault_region region{ *uffd, pages };
+    if (!CHECK(region.register_lazy_subregions()))
+    {
+        ::munmap(memory, page_count * page_size);
+        return;
+    }
+
+    fake_client client{ pages, source.data(), base, page_count };
+    bool served = false;
+    std::thread client_thread{ [&] { client.run(); } };
+    std::thread fault_thread{ [&]
+    {
+        served = region.serve([&](const page_span& span) { return client.request(span); });
+    } };
+
+    // Nothing is pushed yet, so touching the first half faults every page in on demand.
+    bool first_half_matches = true;
+    for (std::uint32_t page = 0; page < page_count / 2; page++)
+    {
+        first_half_matches &= std::memcmp(memory + page * page_size, source.data() + page * page_size, page_size) == 0;
+    }
+    CHECK(first_half_matches);
+    CHECK(pages.pages_requested() >= page_count / 2);
+
+    // The rest arrives by push or by fault, whichever is first.
+    client.push();
+    bool second_half_matches = true;
+    for (std::uint32_t page = page_count / 2; page < page_count; page++)
+    {
+        second_half_matches &= std::memcmp(memory + page * page_size, source.data() + page * page_size, page_size) == 0;
+    }
+    CHECK(second_half_matches);
+
+    client_thread.join();
+    fault_thread.join();
+    CHECK(served);
+
+    // Unregistered once done: untrapped writes go straight through.
+    memory[0] = std::byte{ 0x7F };
+    CHECK(memory[0] == std::byte{ 0x7F });
+
+    ::munmap(memory, page_count * page_size);
+}
+#endif
@@ -0,0 +1,231 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include "check.hpp"
+
+#include <netfork-lib/dirty_pages.hpp>
+
+#ifdef __linux__
+#	include <sys/mman.h>
+#endif
+
+using namespace netfork;
+using namespace netfork::pre_copy;
+
+namespace
+{
+    constexpr std::size_t page_size = net::MANIFEST_PAGE_SIZE;
+
+    page_hash zero_hash()
+    {
+        const std::vector<std::byte> zeros(page_size);
+        return hash_page(zeros.data());
+    }
+
+    net::page_run all_pages(const std::uint64_t address, const std::uint32_t page_count)
+    {
+        net::page_run run{ .address = address, .page_count = page_count };
+        for (std::uint32_t page = 0; page < page_count; page++)
+        {
+            run.set_present(page);
+        }
+        return run;
+    }
+}
+
+TEST_CASE(pre_copy, diff_run)
+{
+    const auto zero = zero_hash();
+    std::vector<std::byte> pages(4 * page_size);
+    pages[1 * page_size] = std::byte{ 1 };
+    pages[3 * page_size] = std::byte{ 3 };
+
+    // The server starts out with zero pages, except page 2 which it knows nothing about.
+    std::vector<page_hash> hashes(4, zero);
+    hashes[2] = UNKNOWN_HASH;
+
+    // Counting leaves the hashes alone.
+    auto diff = diff_run(all_pages(0x10000, 4), pages, hashes, zero, false);
+    CHECK(diff.dirty.present_count() == 3);
+    CHECK(!diff.dirty.is_present(0) && diff.dirty.is_present(1) && diff.dirty.is_present(2) && diff.dirty.is_present(3));
+    CHECK(diff.resent_pages == 0);
+    CHECK(hashes[1] == zero && hashes[2] == UNKNOWN_HASH);
+
+    diff = diff_run(all_pages(0x10000, 4), pages, hashes, zero, true);
+    CHECK(diff.dirty.present_count() == 3);
+    CHECK(hashes[1] == hash_page(pages.data() + page_size) && hashes[2] == zero);
+
+    // Once sent, only what changes again is dirty, and it's a resend.
+    CHECK(diff_run(all_pages(0x10000, 4), pages, hashes, zero, true).dirty.present_count() == 0);
+    pages[1 * page_size] = std::byte{ 2 };
+    pages[3 * page_size + 7] = std::byte{ 3 };
+    diff = diff_run(all_pages(0x10000, 4), pages, hashes, zero, true);
+    CHECK(diff.dirty.present_count() == 2 && diff.resent_pages == 2);
+
+    // Only candidates are looked at.
+    pages[0] = std::byte{ 9 };
+    net::page_run candidates{ .address = 0x10000, .page_count = 4 };
+    candidates.set_present(2);
+    CHECK(diff_run(candidates, pages, hashes, zero, true).dirty.present_count() == 0);
+}
+
+TEST_CASE(pre_copy, round_schedule)
+{
+    using std::chrono::microseconds;
+    using seconds = std::chrono::duration<double>;
+
+    // 1 GB/s, so a byte takes a nanosecond to send.
+    round_schedule schedule{ microseconds{ 100 }, 8 };
+    schedule.record_round(1'000'000'000, seconds{ 1.0 });
+    CHECK(schedule.rounds() == 1);
+    CHECK(schedule.estimate_pause(1'000'000, seconds{ 0.0 }) == microseconds{ 1000 });
+    CHECK(schedule.estimate_pause(1'000'000, seconds{ 0.001 }) == microseconds{ 2000 });
+
+    // Still too much to send in the pause, and shrinking: go on.
+    CHECK(schedule.another_round(1'000'000, seconds{ 0.0 }));
+    schedule.record_round(1'000'000, seconds{ 0.001 });
+
+    // Growing again; another round won't help.
+    CHECK(!schedule.another_round(2'000'000, seconds{ 0.0 }));
+    // Small enough to send within the pause.
+    CHECK(!schedule.another_round(50'000, seconds{ 0.0 }));
+    // Scanning alone takes longer than the pause, yet the dirty set shrinks.
+    CHECK(schedule.another_round(50'000, seconds{ 0.001 }));
+}
+
+TEST_CASE(pre_copy, round_limit)
+{
+    round_schedule schedule{ std::chrono::microseconds{ 0 }, 2 };
+    schedule.record_round(1'000'000, std::chrono::duration<double>{ 1.0 });
+    CHECK(schedule.another_round(500'000, std::chrono::duration<double>{ 0.0 }));
+    schedule.record_round(500'000, std::chrono::duration<double>{ 1.0 });
+    CHECK(!schedule.another_round(1, std::chrono::duration<double>{ 0.0 }));
+}
+
+#ifdef __linux__
+TEST_CASE(pre_copy, soft_dirty)
+{
+    soft_dirty tracker;
+    if (!tracker.is_supported())
+    {
+        std::cerr << "Soft-dirty bits aren't tracked by this kernel; skipping" << std::endl;
+        return;
+    }
+
+    constexpr std::uint32_t page_count = 8;
+    auto* memory = static_cast<std::byte*>(::mmap(
+        nullptr, page_count * page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (!CHECK(memory != MAP_FAILED))
+    {
+        return;
+    }
+
+    std::memset(memory, 1, page_count * page_size);
+    CHECK(tracker.clear());
+    memory[2 * page_size] = std::byte{ 2 };
+    memory[5 * page_size + 100] = std::byte{ 2 };
+
+    net::page_run written{ .address = reinterpret_cast<std::uint64_t>(memory), .page_count = page_count };
+    CHECK(tracker.written(written));
+    CHECK(written.present_count() == 2 && written.is_present(2) && written.is_present(5));
+
+    ::munmap(memory, page_count * page_size);
+}
+
+// Runs the rounds of a pre-copy against memory that keeps being written between them,
+// finding written pages with soft-dirty bits where the kernel has them and hashing every
+// page where it doesn't. Whatever was sent last has to end up matching.
+TEST_CASE(pre_copy, rounds_converge)
+{
+    constexpr std::uint32_t page_count = 32;
+    auto* memory = static_cast<std::byte*>(::mmap(
+        nullptr, page_count * page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (!CHECK(memory != MAP_FAILED))
+    {
+        return;
+    }
+
+    for (std::uint32_t page = 0; page < page_count; page++)
+    {
+        std::memset(memory + page * page_size, static_cast<int>(page + 1), page_size);
+    }
+
+    soft_dirty tracker;
+    const bool tracked = tracker.is_supported();
+    const auto zero = zero_hash();
+    const auto address = reinterpret_cast<std::uint64_t>(memory);
+    std::vector<page_hash> hashes(page_count, zero);
+    std::vector<std::byte> server(page_count * page_size);
+
+    const auto send_round = [&](const bool everything)
+    {
+        auto candidates = all_pages(address, page_count);
+        if (tracked && !everything)
+        {
+            candidates = { .address = address, .page_count = page_count };
+            tracker.written(candidates);
+        }
+
+        if (tracked)
+        {
+            tracker.clear();
+        }
+
+        const auto diff = diff_run(candidates, { memory, page_count * page_size }, hashes, zero, true);
+        diff.dirty.for_each_present_run([&](const std::uint32_t first, const std::uint32_t count)
+        {
+            std::memcpy(server.data() + first * page_size, memory + first * page_size, count * page_size);
+        });
+        return diff;
+    };
+
+    auto diff = send_round(true);
+    CHECK(diff.dirty.present_count() == page_count && diff.resent_pages == 0);
+
+    // Pages written between rounds, fewer each time.
+    const std::vector<std::vector<std::uint32_t>> writes{ { 1, 4, 9, 30 }, { 4, 17 }, { 0 } };
+    for (const auto& round : writes)
+    {
+        for (const auto page : round)
+        {
+            memory[page * page_size + 11] ^= std::byte{ 0xFF };
+        }
+
+        diff = send_round(false);
+        CHECK(diff.dirty.present_count() == round.size());
+        CHECK(diff.resent_pages == round.size());
+        for (const auto page : round)
+        {
+            CHECK(diff.dirty.is_present(page));
+        }
+    }
+
+    // The final stop-and-copy has nothing left to send.
+    CHECK(send_round(false).dirty.present_count() == 0);
+    CHECK(std::memcmp(server.data(), memory, server.size()) == 0);
+
+    ::munmap(memory, page_count * page_size);
+}
+#endif
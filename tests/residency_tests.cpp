@@ -0,0 +1,156 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include "check.hpp"
+
+#include <netfork-lib/residency.hpp>
+
+#ifdef __linux__
+#	include <sys/mman.h>
+#	include <unistd.h>
+#endif
+
+using namespace netfork::vm;
+
+TEST_CASE(residency, runs)
+{
+    const std::vector<page_residency> residency{
+        page_residency::resident, page_residency::resident,
+        page_residency::demand_zero,
+        page_residency::paged_out, page_residency::paged_out, page_residency::paged_out,
+        page_residency::resident
+    };
+
+    std::vector<residency_run> runs;
+    for (std::size_t page = 0; page < residency.size();)
+    {
+        runs.push_back(residency_run_at(residency, page));
+        page += runs.back().count;
+    }
+
+    CHECK(runs.size() == 4);
+    CHECK(runs[0].state == page_residency::resident && runs[0].first == 0 && runs[0].count == 2);
+    CHECK(runs[1].state == page_residency::demand_zero && runs[1].first == 2 && runs[1].count == 1);
+    CHECK(runs[2].state == page_residency::paged_out && runs[2].first == 3 && runs[2].count == 3);
+    CHECK(runs[3].state == page_residency::resident && runs[3].first == 6 && runs[3].count == 1);
+
+    // A run starting mid-way stops at the same place.
+    const auto tail = residency_run_at(residency, 4);
+    CHECK(tail.first == 4 && tail.count == 2);
+}
+
+#ifdef __linux__
+TEST_CASE(residency, classify_page)
+{
+    // Mapped pages are resident whatever backs them; swapped ones are paged out.
+    CHECK(classify_page(PAGEMAP_PRESENT, true, false) == page_residency::resident);
+    CHECK(classify_page(PAGEMAP_PRESENT, false, false) == page_residency::resident);
+    CHECK(classify_page(PAGEMAP_SWAPPED, true, false) == page_residency::paged_out);
+    CHECK(classify_page(PAGEMAP_SWAPPED, false, true) == page_residency::paged_out);
+
+    // Untouched: anonymous memory is zero, file-backed memory depends on the page cache.
+    CHECK(classify_page(0, true, false) == page_residency::demand_zero);
+    CHECK(classify_page(0, false, true) == page_residency::resident);
+    CHECK(classify_page(0, false, false) == page_residency::paged_out);
+}
+
+TEST_CASE(residency, anonymous_memory)
+{
+    constexpr std::size_t page_size = 4096;
+    constexpr std::size_t page_count = 16;
+    auto* memory = static_cast<std::byte*>(::mmap(
+        nullptr, page_count * page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (!CHECK(memory != MAP_FAILED))
+    {
+        return;
+    }
+
+    // Touch every other page.
+    for (std::size_t page = 0; page < page_count; page += 2)
+    {
+        memory[page * page_size] = std::byte{ 1 };
+    }
+
+    residency_query query;
+    std::vector<page_residency> residency;
+    query.query(reinterpret_cast<std::uint64_t>(memory), page_count, page_size, true, residency);
+
+    CHECK(residency.size() == page_count);
+    for (std::size_t page = 0; page < page_count; page++)
+    {
+        if (page % 2 == 0)
+        {
+            CHECK(residency[page] == page_residency::resident);
+        }
+        else if (query.has_pagemap())
+        {
+            CHECK(residency[page] == page_residency::demand_zero);
+        }
+        else
+        {
+            CHECK(residency[page] == page_residency::paged_out);
+        }
+    }
+
+    // The query itself didn't fault the untouched pages in.
+    std::vector<unsigned char> in_core(page_count * page_size / ::sysconf(_SC_PAGESIZE));
+    CHECK(::mincore(memory, page_count * page_size, in_core.data()) == 0);
+    CHECK((in_core.back() & 1) == 0);
+
+    ::munmap(memory, page_count * page_size);
+}
+
+TEST_CASE(residency, file_backed_memory)
+{
+    constexpr std::size_t page_size = 4096;
+    constexpr std::size_t page_count = 4;
+    std::FILE* file = std::tmpfile();
+    if (!CHECK(file != nullptr))
+    {
+        return;
+    }
+
+    // Written pages are in the page cache; mapping them doesn't map them in yet.
+    const std::vector<std::byte> contents(page_count * page_size, std::byte{ 0x5A });
+    CHECK(std::fwrite(contents.data(), 1, contents.size(), file) == contents.size());
+    std::fflush(file);
+
+    void* memory = ::mmap(nullptr, contents.size(), PROT_READ, MAP_PRIVATE, ::fileno(file), 0);
+    if (CHECK(memory != MAP_FAILED))
+    {
+        residency_query query;
+        std::vector<page_residency> residency;
+        query.query(reinterpret_cast<std::uint64_t>(memory), page_count, page_size, false, residency);
+
+        CHECK(residency.size() == page_count);
+        for (const auto state : residency)
+        {
+            CHECK(state == page_residency::resident);
+        }
+
+        ::munmap(memory, contents.size());
+    }
+
+    std::fclose(file);
+}
+#endif
@@ -0,0 +1,230 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <latch>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include "check.hpp"
+
+#include <netfork-server/admission_scheduler.hpp>
+#include <netfork-server/warm_pool.hpp>
+
+using namespace netfork;
+
+// Many sessions at once against one server's admission scheduler and warm pool, the way
+// `serve_session` uses them: admit the session's committed size, take a warm process of its
+// image or make one cold, hold both while serving, then give them back.
+namespace
+{
+    constexpr std::uint64_t MiB = 1 << 20;
+    constexpr std::uint64_t budget = 100 * MiB;
+    constexpr double bulk_share = 0.75;
+    constexpr int threads = 8;
+    constexpr int sessions_per_thread = 6;
+    constexpr int images = 4;
+
+    // Stands in for a suspended process of an image.
+    struct process
+    {
+        int image;
+        int version;
+    };
+
+    using process_pool = warm_pool<int, int, process>;
+
+    // Raises `peak` to `value` if it's higher.
+    void raise(std::atomic<std::uint64_t>& peak, const std::uint64_t value)
+    {
+        std::uint64_t seen = peak.load();
+        while (value > seen && !peak.compare_exchange_weak(seen, value))
+        {
+        }
+    }
+
+    // One server's scheduler and pool, and what the sessions saw of them.
+    struct load
+    {
+        admission::scheduler scheduler{ admission::options{ .budget = budget, .bulk_share = bulk_share } };
+        process_pool pool;
+        std::atomic<int> processes_made = 0;
+
+        std::atomic<std::uint64_t> in_use = 0;
+        std::atomic<std::uint64_t> bulk_in_use = 0;
+        std::atomic<std::uint64_t> peak = 0;
+        std::atomic<std::uint64_t> bulk_peak = 0;
+        std::atomic<int> queued = 0;
+        std::atomic<int> rejected = 0;
+        std::atomic<int> wrong_process = 0;
+        std::atomic<int> served = 0;
+
+        load()
+            : pool{ { .items_per_key = 2, .max_keys = images }, [this](const int& image, const int& version)
+                {
+                    processes_made++;
+                    return std::optional<process>{ process{ image, version } };
+                } }
+        {
+        }
+
+        // Waits until `size` bytes of `p` are admitted, like `admission::admit` but blocking.
+        // `requested()` runs once the request is in, admitted or queued.
+        template <typename Requested>
+        std::optional<admission::ticket> admit(const std::uint64_t size, const admission::priority p, Requested&& requested)
+        {
+            std::mutex mutex;
+            std::condition_variable admitted_cv;
+            bool admitted = false;
+            const auto decision = scheduler.request(size, p, [&]
+            {
+                std::lock_guard lock{ mutex };
+                admitted = true;
+                admitted_cv.notify_one();
+            });
+            requested();
+
+            if (decision == admission::decision::rejected)
+            {
+                rejected++;
+                return std::nullopt;
+            }
+
+            if (decision == admission::decision::queued)
+            {
+                queued++;
+                std::unique_lock lock{ mutex };
+                admitted_cv.wait(lock, [&] { return admitted; });
+            }
+
+            return std::optional<admission::ticket>{ std::in_place, scheduler, size, p };
+        }
+
+        // Serves one session. `hold` runs while it's admitted and has its process.
+        template <typename Requested, typename Hold>
+        void serve(const int image, const std::uint64_t size, const admission::priority p, Requested&& requested, Hold&& hold)
+        {
+            const auto ticket = admit(size, p, requested);
+            if (!ticket)
+            {
+                return;
+            }
+
+            // Counted after admission and uncounted before release, so this can only ever
+            // be below what the scheduler has handed out.
+            raise(peak, in_use += size);
+            if (p == admission::priority::bulk)
+            {
+                raise(bulk_peak, bulk_in_use += size);
+            }
+
+            auto taken = pool.take(image);
+            if (!taken)
+            {
+                processes_made++;
+                taken = process{ image, 1 };
+            }
+
+            if (taken->image != image || taken->version != 1)
+            {
+                wrong_process++;
+            }
+
+            hold();
+            served++;
+
+            if (p == admission::priority::bulk)
+            {
+                bulk_in_use -= size;
+            }
+            in_use -= size;
+        }
+    };
+}
+
+TEST_CASE(session_load, concurrent_sessions)
+{
+    load server;
+    for (int image = 0; image < images; image++)
+    {
+        server.pool.warm(image, 1);
+    }
+
+    // Every image has its processes ready before the first session turns up.
+    for (int i = 0; i < 1000 && server.pool.size() < 2 * images; i++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds{ 1 });
+    }
+    CHECK(server.pool.size() == 2 * images);
+
+    // The first session of every thread holds on until all of them have asked to be
+    // admitted. They ask for 200 MiB between them, so some have to queue.
+    std::latch all_requested{ threads };
+    std::vector<std::thread> clients;
+    for (int t = 0; t < threads; t++)
+    {
+        clients.emplace_back([&, t]
+        {
+            for (int s = 0; s < sessions_per_thread; s++)
+            {
+                const int session = t * sessions_per_thread + s;
+                const std::uint64_t size = (t % 4 + 1) * 10 * MiB;
+                const auto p = session % 3 == 2 ? admission::priority::bulk : admission::priority::interactive;
+                if (s == 0)
+                {
+                    server.serve(t % images, size, p, [&] { all_requested.count_down(); }, [&] { all_requested.wait(); });
+                }
+                else
+                {
+                    server.serve(session % images, size, p, [] {}, []
+                    {
+                        std::this_thread::sleep_for(std::chrono::microseconds{ 200 });
+                    });
+                }
+            }
+        });
+    }
+
+    for (auto& client : clients)
+    {
+        client.join();
+    }
+
+    const int sessions = threads * sessions_per_thread;
+    CHECK(server.served == sessions);
+    CHECK(server.rejected == 0);
+    CHECK(server.queued > 0);
+    CHECK(server.wrong_process == 0);
+
+    // The budget held throughout, and bulk sessions kept to their share.
+    CHECK(server.peak <= budget);
+    CHECK(server.bulk_peak <= static_cast<std::uint64_t>(budget * bulk_share));
+    CHECK(server.scheduler.in_use() == 0);
+    CHECK(server.scheduler.queued() == 0);
+
+    // Every session took from the pool; at least the processes made ahead were hits.
+    const auto counters = server.pool.counters();
+    CHECK(counters.hits + counters.misses == static_cast<std::uint64_t>(sessions));
+    CHECK(counters.hits >= 2 * images);
+    CHECK(counters.failed == 0);
+}
@@ -0,0 +1,186 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <vector>
+
+#include "check.hpp"
+
+#include <netfork-server/snapshot_format.hpp>
+
+using namespace netfork;
+using namespace netfork::snapshot;
+
+namespace
+{
+    constexpr std::uint64_t PAGE = net::MANIFEST_PAGE_SIZE;
+    constexpr std::uint32_t NO_ACCESS = 0x01;
+    // Deliberately not multiples of each other or of a page.
+    constexpr state_sizes SIZES{ .context = 1232, .peb = 904, .teb = 6216 };
+    constexpr std::uint64_t IMAGE_BASE = 0x140000000;
+    constexpr std::uint64_t IMAGE_SIZE = 5 * PAGE + 123;
+
+    bool has_payload(const std::uint32_t protect)
+    {
+        return protect != 0 && protect != NO_ACCESS;
+    }
+
+    net::address_space_manifest sample_manifest()
+    {
+        net::address_space_manifest manifest;
+        manifest.add_region(0x10000, 0x04, 0x10000);
+        manifest.add_subregion(0x10000, 2 * PAGE, 0x04);
+        manifest.add_subregion(0x12000, 1 * PAGE, NO_ACCESS);
+        manifest.add_subregion(0x13000, 3 * PAGE, 0x02);
+        return manifest;
+    }
+
+    std::vector<std::byte> filled(const std::uint64_t size, const int seed)
+    {
+        std::vector<std::byte> bytes(size);
+        for (std::size_t i = 0; i < bytes.size(); i++)
+        {
+            bytes[i] = static_cast<std::byte>((i * 31 + seed) & 0xFF);
+        }
+
+        return bytes;
+    }
+
+    // A snapshot of `sample_manifest` whose state, image and payload are `filled` with seeds
+    // 1 to 4, written the way `snapshot::write` does.
+    std::vector<std::byte> sample_snapshot(const bool sealed = true)
+    {
+        const auto manifest = sample_manifest();
+        const auto encoded = net::encode_manifest(manifest);
+        const header head = plan(SIZES, encoded.size(), IMAGE_BASE, IMAGE_SIZE, payload_size_of(manifest, has_payload));
+
+        std::vector<std::byte> file(file_size_of(head));
+        write_state(file, head, filled(SIZES.context, 1), filled(SIZES.peb, 2), filled(SIZES.teb, 3), encoded);
+
+        const auto image = filled(IMAGE_SIZE, 4);
+        std::memcpy(file.data() + head.image_offset, image.data(), image.size());
+
+        std::uint64_t offset = head.payload_offset;
+        for (const auto& subregion : manifest.subregions)
+        {
+            if (has_payload(subregion.protect))
+            {
+                const auto payload = filled(subregion.region_size, static_cast<int>(subregion.base_address >> 12));
+                std::memcpy(file.data() + offset, payload.data(), payload.size());
+                offset += subregion.region_size;
+            }
+        }
+
+        if (sealed)
+        {
+            seal(file, head);
+        }
+
+        return file;
+    }
+
+    bool same_bytes(std::span<const std::byte> a, const std::vector<std::byte>& b)
+    {
+        return a.size() == b.size() && std::memcmp(a.data(), b.data(), a.size()) == 0;
+    }
+
+    header header_of(const std::vector<std::byte>& file)
+    {
+        header head;
+        std::memcpy(&head, file.data(), sizeof(header));
+        return head;
+    }
+}
+
+TEST_CASE(snapshot, round_trip)
+{
+    const auto file = sample_snapshot();
+    const auto parsed = parse(file, SIZES, has_payload);
+    CHECK(parsed.has_value());
+    if (!parsed)
+    {
+        return;
+    }
+
+    const header& head = parsed->head;
+    CHECK(head.image_base == IMAGE_BASE);
+    CHECK(same_bytes(std::span{ file }.subspan(head.context_offset, SIZES.context), filled(SIZES.context, 1)));
+    CHECK(same_bytes(std::span{ file }.subspan(head.peb_offset, SIZES.peb), filled(SIZES.peb, 2)));
+    CHECK(same_bytes(std::span{ file }.subspan(head.teb_offset, SIZES.teb), filled(SIZES.teb, 3)));
+    CHECK(same_bytes(std::span{ file }.subspan(head.image_offset, head.image_size), filled(IMAGE_SIZE, 4)));
+    CHECK(parsed->manifest.subregions.size() == 3);
+
+    // Only the subregions which carry a payload are visited, in order, each with its bytes.
+    std::vector<std::uint64_t> visited;
+    for_each_payload(file, parsed.value(), has_payload, [&](const net::manifest_subregion& subregion, std::span<const std::byte> bytes)
+    {
+        visited.push_back(subregion.base_address);
+        CHECK(same_bytes(bytes, filled(subregion.region_size, static_cast<int>(subregion.base_address >> 12))));
+    });
+    CHECK((visited == std::vector<std::uint64_t>{ 0x10000, 0x13000 }));
+}
+
+TEST_CASE(snapshot, image_and_payload_are_page_aligned)
+{
+    const auto file = sample_snapshot();
+    const header head = header_of(file);
+    CHECK(head.image_offset % PAGE == 0);
+    CHECK(head.payload_offset % PAGE == 0);
+    CHECK(head.image_offset >= head.manifest_offset + head.manifest_size);
+    CHECK(head.payload_offset >= head.image_offset + head.image_size);
+    CHECK(head.payload_size == 5 * PAGE);
+    CHECK(file.size() == head.payload_offset + head.payload_size);
+}
+
+TEST_CASE(snapshot, rejects_unsealed_and_truncated)
+{
+    // Everything but the header, as a snapshot cut short while being written would be.
+    CHECK(!parse(sample_snapshot(false), SIZES, has_payload).has_value());
+
+    const auto file = sample_snapshot();
+    for (const std::size_t size : { std::size_t{ 0 }, sizeof(header) - 1, sizeof(header), file.size() / 2, file.size() - 1 })
+    {
+        CHECK(!parse(std::span{ file }.first(size), SIZES, has_payload).has_value());
+    }
+}
+
+TEST_CASE(snapshot, rejects_mismatched_headers)
+{
+    const auto corrupt = [](auto change)
+    {
+        auto file = sample_snapshot();
+        header head = header_of(file);
+        change(head);
+        seal(file, head);
+        return file;
+    };
+
+    CHECK(!parse(corrupt([](header& h) { h.magic[0] = 'X'; }), SIZES, has_payload).has_value());
+    CHECK(!parse(corrupt([](header& h) { h.version++; }), SIZES, has_payload).has_value());
+    CHECK(!parse(corrupt([](header& h) { h.page_size = 0x10000; }), SIZES, has_payload).has_value());
+    CHECK(!parse(corrupt([](header& h) { h.image_offset += 8; }), SIZES, has_payload).has_value());
+    CHECK(!parse(corrupt([](header& h) { h.payload_size -= PAGE; }), SIZES, has_payload).has_value());
+    CHECK(!parse(corrupt([](header& h) { h.manifest_size--; }), SIZES, has_payload).has_value());
+    CHECK(!parse(corrupt([](header& h) { h.image_size = ~std::uint64_t{ 0 }; }), SIZES, has_payload).has_value());
+
+    // Built for state of another size.
+    const auto file = sample_snapshot();
+    CHECK(!parse(file, state_sizes{ .context = SIZES.context, .peb = SIZES.peb, .teb = 1 << 30 }, has_payload).has_value());
+}
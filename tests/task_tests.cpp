@@ -0,0 +1,152 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <thread>
+
+#include "check.hpp"
+
+#include <netfork-shared/net/task.hpp>
+
+using namespace netfork::net;
+
+namespace
+{
+    // Drives `work` to completion on the calling thread, unless it moves itself elsewhere.
+    template <typename T>
+    detail::detached_task run(task<T> work, std::optional<T>& out)
+    {
+        out.emplace(co_await std::move(work));
+    }
+
+    detail::detached_task run(task<> work, bool& done)
+    {
+        co_await std::move(work);
+        done = true;
+    }
+
+    task<int> answer(int& started)
+    {
+        started++;
+        co_return 42;
+    }
+
+    task<int> add(task<int> a, task<int> b)
+    {
+        const int x = co_await std::move(a);
+        co_return x + co_await std::move(b);
+    }
+
+    task<int> count_down(const int depth)
+    {
+        if (depth == 0)
+        {
+            co_return 0;
+        }
+
+        co_return 1 + co_await count_down(depth - 1);
+    }
+
+    struct on_destroy
+    {
+        bool& destroyed;
+
+        ~on_destroy()
+        {
+            destroyed = true;
+        }
+    };
+
+    task<> hold([[maybe_unused]] std::shared_ptr<on_destroy> guard)
+    {
+        co_return;
+    }
+}
+
+TEST_CASE(task, starts_when_awaited)
+{
+    int started = 0;
+    auto work = answer(started);
+    CHECK(started == 0);
+
+    std::optional<int> out;
+    run(std::move(work), out);
+    CHECK(started == 1);
+    CHECK(out == 42);
+}
+
+TEST_CASE(task, chains_results)
+{
+    int started = 0;
+    std::optional<int> out;
+    run(add(answer(started), answer(started)), out);
+    CHECK(out == 84);
+    CHECK(started == 2);
+
+    std::optional<std::unique_ptr<int>> moved;
+    run([]() -> task<std::unique_ptr<int>> { co_return std::make_unique<int>(7); }(), moved);
+    CHECK(moved.has_value() && **moved == 7);
+}
+
+TEST_CASE(task, nested_chains)
+{
+    // Every finished task hands the thread straight back to its awaiter. How deep that can go
+    // depends on the compiler turning the hand-off into a tail call, which unoptimised builds
+    // don't, so this stays shallow.
+    std::optional<int> out;
+    run(count_down(1000), out);
+    CHECK(out == 1000);
+}
+
+TEST_CASE(task, frees_unawaited_frames)
+{
+    bool destroyed = false;
+    {
+        auto work = hold(std::make_shared<on_destroy>(destroyed));
+        CHECK(!destroyed);
+    }
+
+    CHECK(destroyed);
+
+    destroyed = false;
+    bool done = false;
+    run(hold(std::make_shared<on_destroy>(destroyed)), done);
+    CHECK(done && destroyed);
+}
+
+TEST_CASE(task, resumes_on_new_thread)
+{
+    const auto caller = std::this_thread::get_id();
+    std::atomic<bool> moved = false;
+    std::atomic<bool> done = false;
+    [](const std::thread::id caller, std::atomic<bool>& moved, std::atomic<bool>& done) -> detail::detached_task
+    {
+        co_await resume_on_new_thread();
+        moved = std::this_thread::get_id() != caller;
+        done = true;
+    }(caller, moved, done);
+
+    for (int i = 0; i < 1000 && !done; i++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds{ 1 });
+    }
+
+    CHECK(done && moved);
+}
@@ -0,0 +1,165 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <optional>
+#include <thread>
+
+#include "check.hpp"
+
+#include <netfork-server/warm_pool.hpp>
+
+using namespace netfork;
+
+namespace
+{
+    // Stands in for a suspended process: remembers which key and source it was made from.
+    struct stub_item
+    {
+        int key;
+        int source;
+    };
+
+    using stub_pool = warm_pool<int, int, stub_item>;
+
+    // Makes items of any key from any source, failing while `fail` is set.
+    struct stub_factory
+    {
+        std::atomic<int> calls = 0;
+        std::atomic<bool> fail = false;
+
+        stub_pool::factory_type get()
+        {
+            return [this](const int& key, const int& source) -> std::optional<stub_item>
+            {
+                calls++;
+                if (fail)
+                {
+                    return std::nullopt;
+                }
+
+                return stub_item{ key, source };
+            };
+        }
+    };
+
+    // The pool refills on a thread of its own; waits up to a second for `done`.
+    bool eventually(const std::function<bool()>& done)
+    {
+        for (int i = 0; i < 1000; i++)
+        {
+            if (done())
+            {
+                return true;
+            }
+
+            std::this_thread::sleep_for(std::chrono::milliseconds{ 1 });
+        }
+
+        return done();
+    }
+}
+
+TEST_CASE(warm_pool, refills_after_take)
+{
+    stub_factory factory;
+    stub_pool pool{ { .items_per_key = 2, .max_keys = 4 }, factory.get() };
+    pool.warm(1, 100);
+    CHECK(eventually([&] { return pool.size() == 2; }));
+
+    const auto item = pool.take(1);
+    CHECK(item.has_value() && item->key == 1 && item->source == 100);
+    CHECK(eventually([&] { return pool.size() == 2; }));
+    CHECK(eventually([&] { return pool.counters().created == 3; }));
+
+    const auto counters = pool.counters();
+    CHECK(counters.hits == 1);
+    CHECK(counters.misses == 0);
+}
+
+TEST_CASE(warm_pool, unknown_keys_miss)
+{
+    stub_factory factory;
+    stub_pool pool{ { .items_per_key = 2, .max_keys = 4 }, factory.get() };
+    CHECK(!pool.take(7).has_value());
+    CHECK(pool.counters().misses == 1);
+    CHECK(pool.size() == 0);
+    CHECK(factory.calls == 0);
+}
+
+TEST_CASE(warm_pool, evicts_least_recently_used_key)
+{
+    stub_factory factory;
+    stub_pool pool{ { .items_per_key = 1, .max_keys = 2 }, factory.get() };
+    pool.warm(1, 100);
+    pool.warm(2, 200);
+    CHECK(eventually([&] { return pool.size() == 2; }));
+
+    // Using key 1 makes key 2 the one to go.
+    CHECK(pool.take(1).has_value());
+    CHECK(eventually([&] { return pool.size() == 2; }));
+    pool.warm(3, 300);
+    CHECK(eventually([&] { return pool.size() == 2 && pool.counters().evicted == 1; }));
+
+    CHECK(!pool.take(2).has_value());
+    const auto kept = pool.take(3);
+    CHECK(kept.has_value() && kept->source == 300);
+}
+
+TEST_CASE(warm_pool, new_source_replaces_items)
+{
+    stub_factory factory;
+    stub_pool pool{ { .items_per_key = 2, .max_keys = 4 }, factory.get() };
+    pool.warm(1, 100);
+    CHECK(eventually([&] { return pool.size() == 2; }));
+
+    pool.warm(1, 101);
+    CHECK(eventually([&] { return pool.size() == 2; }));
+    for (int i = 0; i < 2; i++)
+    {
+        const auto item = pool.take(1);
+        CHECK(item.has_value() && item->source == 101);
+    }
+}
+
+TEST_CASE(warm_pool, failures_are_counted)
+{
+    stub_factory factory;
+    factory.fail = true;
+    stub_pool pool{ { .items_per_key = 2, .max_keys = 4 }, factory.get() };
+    pool.warm(1, 100);
+    CHECK(eventually([&] { return pool.counters().failed == 1; }));
+    CHECK(pool.size() == 0);
+
+    // A failure gives up until the key is asked for again.
+    factory.fail = false;
+    CHECK(!pool.take(1).has_value());
+    CHECK(eventually([&] { return pool.size() == 2; }));
+}
+
+TEST_CASE(warm_pool, disabled)
+{
+    stub_factory factory;
+    stub_pool pool{ { .items_per_key = 0, .max_keys = 4 }, factory.get() };
+    CHECK(!pool.enabled());
+    pool.warm(1, 100);
+    CHECK(!pool.take(1).has_value());
+    std::this_thread::sleep_for(std::chrono::milliseconds{ 10 });
+    CHECK(factory.calls == 0);
+}
@@ -0,0 +1,231 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <thread>
+#include <vector>
+
+#include "check.hpp"
+
+#include <netfork-server/write_ring.hpp>
+
+using namespace netfork;
+
+namespace
+{
+    constexpr std::uint64_t page_size = net::MANIFEST_PAGE_SIZE;
+    constexpr std::uint64_t base = 0x100000;
+
+    // Stands in for a forked process: its memory from `base` on. Writers can be held up
+    // until `open` is called.
+    struct fake_process
+    {
+        std::vector<std::byte> memory;
+        std::mutex mutex;
+        std::condition_variable opened;
+        bool held = false;
+        std::atomic<int> writes = 0;
+
+        explicit fake_process(const std::size_t page_count)
+            : memory(page_count * page_size)
+        {
+        }
+
+        void hold()
+        {
+            std::lock_guard lock{ mutex };
+            held = true;
+        }
+
+        void open()
+        {
+            {
+                std::lock_guard lock{ mutex };
+                held = false;
+            }
+            opened.notify_all();
+        }
+    };
+
+    using ring = vm::write_ring<fake_process*>;
+
+    bool write_fake(fake_process* const& process, const std::uint64_t address, std::span<const std::byte> bytes)
+    {
+        {
+            std::unique_lock lock{ process->mutex };
+            process->opened.wait(lock, [&] { return !process->held; });
+        }
+
+        std::memcpy(process->memory.data() + (address - base), bytes.data(), bytes.size());
+        process->writes++;
+        return true;
+    }
+
+    // A run of `page_count` pages at page `first`, every one present.
+    net::page_run run_of(const std::uint64_t first, const std::uint32_t page_count)
+    {
+        net::page_run run{ .address = base + first * page_size, .page_count = page_count };
+        for (std::uint32_t page = 0; page < page_count; page++)
+        {
+            run.set_present(page);
+        }
+        return run;
+    }
+
+    // Records that it was made ready, the way a session would be resumed.
+    struct recorded_wait : ring::ring_wait
+    {
+        std::atomic<bool> was_ready = false;
+
+        void ready() override
+        {
+            was_ready = true;
+        }
+    };
+
+    bool eventually(const std::atomic<bool>& flag)
+    {
+        for (int i = 0; i < 100000 && !flag; i++)
+        {
+            std::this_thread::yield();
+        }
+        return flag;
+    }
+}
+
+TEST_CASE(write_ring, writes_every_run)
+{
+    fake_process process{ 256 };
+    std::vector<std::byte> source(process.memory.size());
+    for (std::size_t i = 0; i < source.size(); i++)
+    {
+        source[i] = static_cast<std::byte>(i * 7 + i / page_size);
+    }
+
+    ring writer{ 3, 4, write_fake };
+    {
+        ring::batch writes{ writer, &process };
+        for (std::uint64_t first = 0; first < 256; first += 8)
+        {
+            writes.submit(run_of(first, 8), std::span{ source }.subspan(first * page_size, 8 * page_size));
+        }
+        writes.drain();
+        CHECK(process.memory == source);
+    }
+}
+
+TEST_CASE(write_ring, overlapping_runs_in_order)
+{
+    fake_process process{ 4 };
+    ring writer{ 4, 8, write_fake };
+    ring::batch writes{ writer, &process };
+
+    // The same pages over and over; whatever came last has to be what's left.
+    std::vector<std::byte> pages(4 * page_size);
+    for (int round = 0; round < 64; round++)
+    {
+        std::memset(pages.data(), round, pages.size());
+        writes.submit(run_of(0, 4), pages);
+    }
+
+    writes.drain();
+    CHECK(process.memory == pages);
+}
+
+TEST_CASE(write_ring, waits_for_a_buffer)
+{
+    fake_process process{ 8 };
+    process.hold();
+    ring writer{ 1, 2, write_fake };
+    ring::batch writes{ writer, &process };
+
+    std::vector<std::byte> pages(page_size, std::byte{ 0x5A });
+    recorded_wait first;
+    recorded_wait second;
+    recorded_wait third;
+    CHECK(writes.submit_or_wait(run_of(0, 1), pages, first));
+    CHECK(writes.submit_or_wait(run_of(1, 1), pages, second));
+
+    // Both buffers are in flight; the session queues rather than blocking.
+    CHECK(!writes.submit_or_wait(run_of(2, 1), pages, third));
+    CHECK(!third.was_ready);
+
+    // Not drained either, until the writer gets going.
+    recorded_wait drained;
+    CHECK(!writes.drained_or_wait(drained));
+
+    process.open();
+    if (!CHECK(eventually(third.was_ready)))
+    {
+        return;
+    }
+
+    writes.submit_into(third.buffer, run_of(2, 1), pages);
+    CHECK(eventually(drained.was_ready));
+    writes.drain();
+    CHECK(process.writes == 3);
+    CHECK(std::memcmp(process.memory.data() + 2 * page_size, pages.data(), page_size) == 0);
+
+    recorded_wait idle;
+    CHECK(writes.drained_or_wait(idle));
+}
+
+TEST_CASE(write_ring, leases)
+{
+    fake_process process{ 8 };
+    ring writer{ 1, 4, write_fake };
+    ring::batch writes{ writer, &process };
+
+    // Only half the ring may wait on the network at once.
+    auto first = writes.try_acquire();
+    auto second = writes.try_acquire();
+    CHECK(first.has_value() && second.has_value());
+    CHECK(!writes.try_acquire().has_value());
+
+    std::memset(first->bytes().data(), 0x11, page_size);
+    writes.submit(run_of(3, 1), std::move(first).value(), page_size);
+    first.reset();
+    writes.drain();
+    CHECK(process.memory[3 * page_size] == std::byte{ 0x11 });
+
+    // A lease given back goes to whoever is waiting for a buffer.
+    std::vector<std::byte> pages(page_size, std::byte{ 0x22 });
+    process.hold();
+    recorded_wait a;
+    recorded_wait b;
+    recorded_wait d;
+    CHECK(writes.submit_or_wait(run_of(4, 1), pages, a));
+    CHECK(writes.submit_or_wait(run_of(5, 1), pages, b));
+    CHECK(writes.submit_or_wait(run_of(7, 1), pages, d));
+    recorded_wait c;
+    CHECK(!writes.submit_or_wait(run_of(6, 1), pages, c));
+    second.reset();
+    CHECK(c.was_ready);
+
+    writes.submit_into(c.buffer, run_of(6, 1), pages);
+    process.open();
+    writes.drain();
+    CHECK(process.memory[6 * page_size] == std::byte{ 0x22 });
+}
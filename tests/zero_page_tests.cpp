@@ -0,0 +1,118 @@
+/**
+ * netfork
+ * Copyright (C) 2023 Anthony Calandra
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License along
+ * with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cstddef>
+#include <vector>
+
+#include "check.hpp"
+
+#include <netfork-shared/zero_page.hpp>
+
+using namespace netfork::simd;
+
+namespace
+{
+    // Every kernel this CPU can run.
+    std::vector<zero_page_kernel> kernels()
+    {
+        std::vector<zero_page_kernel> all{ &is_zero_page_scalar };
+#ifdef NETFORK_X64_KERNELS
+        all.push_back(&is_zero_page_sse2);
+        if (cpu_supports_avx2())
+        {
+            all.push_back(&is_zero_page_avx2);
+        }
+#endif
+        return all;
+    }
+
+    // Two pages' worth, so a page can start off any alignment.
+    std::vector<std::byte> buffer()
+    {
+        return std::vector<std::byte>(2 * ZERO_PAGE_SIZE, std::byte{ 0 });
+    }
+}
+
+TEST_CASE(zero_page, zero_pages)
+{
+    auto buf = buffer();
+    for (const auto kernel : kernels())
+    {
+        for (std::size_t misalignment = 0; misalignment < 64; misalignment++)
+        {
+            CHECK(kernel(buf.data() + misalignment));
+        }
+    }
+
+    CHECK(is_zero_page(buf.data()));
+}
+
+TEST_CASE(zero_page, every_byte_and_bit)
+{
+    auto buf = buffer();
+    for (std::size_t offset = 0; offset < ZERO_PAGE_SIZE; offset++)
+    {
+        for (int bit = 0; bit < 8; bit += 7)
+        {
+            buf[offset] = static_cast<std::byte>(1 << bit);
+            for (const auto kernel : kernels())
+            {
+                CHECK(!kernel(buf.data()));
+            }
+
+            CHECK(!is_zero_page(buf.data()));
+        }
+
+        buf[offset] = std::byte{ 0 };
+    }
+}
+
+TEST_CASE(zero_page, kernels_agree_off_alignment)
+{
+    auto buf = buffer();
+    // A stray byte just outside the page is never looked at; one just inside always is.
+    for (const std::size_t misalignment : { 1, 7, 16, 31, 33 })
+    {
+        std::byte* page = buf.data() + misalignment;
+        page[-1] = std::byte{ 0xFF };
+        page[ZERO_PAGE_SIZE] = std::byte{ 0xFF };
+        for (const auto kernel : kernels())
+        {
+            CHECK(kernel(page));
+        }
+
+        page[ZERO_PAGE_SIZE - 1] = std::byte{ 0x80 };
+        for (const auto kernel : kernels())
+        {
+            CHECK(!kernel(page));
+        }
+
+        buf.assign(buf.size(), std::byte{ 0 });
+    }
+}
+
+TEST_CASE(zero_page, selects_a_kernel)
+{
+    const auto selected = select_zero_page_kernel();
+    bool known = false;
+    for (const auto kernel : kernels())
+    {
+        known = known || kernel == selected;
+    }
+
+    CHECK(known);
+}